@@ -33,6 +33,7 @@
 #include "client.h"
 #include "net.h"
 #include "endian_swap.h"
+#include "data.h"
 
 /*
  * The client always maintains a connection to the server.  It reads the
@@ -102,21 +103,24 @@ int scoutfs_client_alloc_inodes(struct super_block *sb, u64 count,
 }
 
 /*
- * Ask the server for an extent of at most @blocks blocks.  It can return
- * smaller extents.
+ * Ask the server for an extent of at most @blocks blocks, preferably
+ * starting at @hint.  It can return smaller extents.
  */
-int scoutfs_client_alloc_extent(struct super_block *sb, u64 blocks, u64 *start,
-				u64 *len)
+int scoutfs_client_alloc_extent(struct super_block *sb, u64 blocks, u64 hint,
+				u64 *start, u64 *len)
 
 {
 	struct client_info *client = SCOUTFS_SB(sb)->client_info;
-	__le64 leblocks = cpu_to_le64(blocks);
+	struct scoutfs_net_extent_alloc nea = {
+		.blocks = cpu_to_le64(blocks),
+		.hint = cpu_to_le64(hint),
+	};
 	struct scoutfs_net_extent nex;
 	int ret;
 
 	ret = scoutfs_net_sync_request(sb, client->conn,
 				       SCOUTFS_NET_CMD_ALLOC_EXTENT,
-				       &leblocks, sizeof(leblocks),
+				       &nea, sizeof(nea),
 				       &nex, sizeof(nex));
 	if (ret == 0) {
 		if (nex.len == 0) {
@@ -410,8 +414,30 @@ out:
 	return ret;
 }
 
+/*
+ * The server is low on free space and asks us to return the free
+ * extents that we aren't using.  We reply immediately and return them
+ * in the background.
+ */
+static int client_return_extents(struct super_block *sb,
+				 struct scoutfs_net_connection *conn,
+				 u8 cmd, u64 id, void *arg, u16 arg_len)
+{
+	int ret;
+
+	if (arg_len != 0) {
+		ret = -EINVAL;
+	} else {
+		scoutfs_data_return_unused(sb);
+		ret = 0;
+	}
+
+	return scoutfs_net_response(sb, conn, cmd, id, ret, NULL, 0);
+}
+
 static scoutfs_net_request_t client_req_funcs[] = {
 	[SCOUTFS_NET_CMD_COMPACT]		= client_compact,
+	[SCOUTFS_NET_CMD_RETURN_EXTENTS]	= client_return_extents,
 };
 
 /*
@@ -94,18 +94,63 @@ static inline void __count_sym_target(struct scoutfs_item_count *cnt,
 	cnt->vals += size;
 }
 
+/*
+ * Inline file data is stored in items like symlink targets.  Writers
+ * can create, update, or delete all of them.
+ */
+static inline void __count_inline_data(struct scoutfs_item_count *cnt)
+{
+	__count_sym_target(cnt, SCOUTFS_INLINE_DATA_MAX_SIZE);
+}
+
+/*
+ * Allocating from a pool that belongs to another file first returns
+ * the pool's remaining blocks to the free extent items.  That can
+ * delete two neighbouring free extents and insert the merged extent,
+ * each mirrored in the blkno and blocks indexes.
+ */
+static inline void __count_drain_pool(struct scoutfs_item_count *cnt)
+{
+	cnt->items += (2 + 1) * 2;
+}
+
 static inline void __count_orphan(struct scoutfs_item_count *cnt)
 {
 
 	cnt->items += 1;
 }
 
+/*
+ * Changing the size of a file with inline data truncates or extends its
+ * inline data items.
+ */
+static inline const struct scoutfs_item_count SIC_SET_SIZE(void)
+{
+	struct scoutfs_item_count cnt = {0,};
+
+	__count_dirty_inode(&cnt);
+	__count_inline_data(&cnt);
+
+	return cnt;
+}
+
+/*
+ * Creates either dirty the dir inode or record their changes to the
+ * dir's attributes in a delta item.
+ */
+static inline void __count_dir_delta(struct scoutfs_item_count *cnt)
+{
+	cnt->items += 1;
+	cnt->vals += sizeof(struct scoutfs_dir_delta);
+}
+
 static inline void __count_mknod(struct scoutfs_item_count *cnt,
 				 unsigned name_len)
 {
 	__count_alloc_inode(cnt);
 	__count_dirents(cnt, name_len);
 	__count_dirty_inode(cnt);
+	__count_dir_delta(cnt);
 }
 
 static inline const struct scoutfs_item_count SIC_MKNOD(unsigned name_len)
@@ -117,6 +162,38 @@ static inline const struct scoutfs_item_count SIC_MKNOD(unsigned name_len)
 	return cnt;
 }
 
+/*
+ * Folding 'nr' dir deltas deletes their items and dirties the dir inode.
+ */
+static inline const struct scoutfs_item_count SIC_FOLD_DIR_DELTAS(unsigned nr)
+{
+	struct scoutfs_item_count cnt = {0,};
+
+	__count_dirty_inode(&cnt);
+	cnt.items += nr;
+
+	return cnt;
+}
+
+static inline void __count_file_delta(struct scoutfs_item_count *cnt)
+{
+	cnt->items += 1;
+	cnt->vals += sizeof(struct scoutfs_file_delta);
+}
+
+/*
+ * Folding 'nr' file deltas deletes their items and dirties the inode.
+ */
+static inline const struct scoutfs_item_count SIC_FOLD_FILE_DELTAS(unsigned nr)
+{
+	struct scoutfs_item_count cnt = {0,};
+
+	__count_dirty_inode(&cnt);
+	cnt.items += nr;
+
+	return cnt;
+}
+
 /*
  * Dropping the inode deletes all its items.  Potentially enormous numbers
  * of items (data mapping, xattrs) are deleted in their own transactions.
@@ -128,6 +205,8 @@ static inline const struct scoutfs_item_count SIC_DROP_INODE(int mode,
 
 	if (S_ISLNK(mode))
 		__count_sym_target(&cnt, size);
+	if (S_ISREG(mode))
+		__count_inline_data(&cnt);
 	__count_dirty_inode(&cnt);
 	__count_orphan(&cnt);
 
@@ -205,18 +284,22 @@ static inline const struct scoutfs_item_count SIC_RENAME(unsigned old_len,
  * item with the header and name.  Any previously existing items are
  * deleted which dirties their key but removes their value.  The two
  * sets of items are indexed by different ids so their items don't
- * overlap.
+ * overlap.  Indexed xattrs can also delete and create an index item.
  */
 static inline const struct scoutfs_item_count SIC_XATTR_SET(unsigned old_parts,
 							    bool creating,
 							    unsigned name_len,
-							    unsigned size)
+							    unsigned size,
+							    bool indexed)
 {
 	struct scoutfs_item_count cnt = {0,};
 	unsigned int new_parts;
 
 	__count_dirty_inode(&cnt);
 
+	if (indexed)
+		cnt.items += 2;
+
 	if (old_parts)
 		cnt.items += old_parts;
 
@@ -237,6 +320,10 @@ static inline const struct scoutfs_item_count SIC_XATTR_SET(unsigned old_parts,
  *  - remove a free extent per block
  *  - remove an offline extent for every other block
  *  - add a file extent per block
+ *  - release shared blocks for every other block
+ *  - write or delete inline data items
+ *  - drain another file's pool for each allocation
+ *  - write a file delta instead of dirtying the inode
  */
 static inline const struct scoutfs_item_count SIC_WRITE_BEGIN(void)
 {
@@ -244,9 +331,36 @@ static inline const struct scoutfs_item_count SIC_WRITE_BEGIN(void)
 	unsigned nr_free = (1 + SCOUTFS_BLOCKS_PER_PAGE) * 3;
 	unsigned nr_file = (DIV_ROUND_UP(SCOUTFS_BLOCKS_PER_PAGE, 2) +
 			    SCOUTFS_BLOCKS_PER_PAGE) * 3;
+	unsigned nr_rel = DIV_ROUND_UP(SCOUTFS_BLOCKS_PER_PAGE, 2);
+	unsigned i;
 
 	__count_dirty_inode(&cnt);
+	__count_file_delta(&cnt);
+	__count_inline_data(&cnt);
+	for (i = 0; i < SCOUTFS_BLOCKS_PER_PAGE; i++)
+		__count_drain_pool(&cnt);
+
+	cnt.items += nr_free + nr_file + nr_rel;
+	cnt.vals += nr_file * sizeof(struct scoutfs_file_extent) +
+		    nr_rel * sizeof(struct scoutfs_shared_release);
+
+	return cnt;
+}
 
+/*
+ * Allocating a run of delayed blocks during writeback can, at most:
+ *  - allocate from the server: delete two free and insert merged
+ *  - remove the free extent: delete one and create two split
+ *  - add the allocated file extent: delete two and insert one merged
+ *  - drain another file's pool
+ */
+static inline const struct scoutfs_item_count SIC_ALLOC_DELAYED(void)
+{
+	struct scoutfs_item_count cnt = {0,};
+	unsigned int nr_free = ((1 + 2) * 2) * 2;
+	unsigned int nr_file = 2 + 1;
+
+	__count_drain_pool(&cnt);
 	cnt.items += nr_free + nr_file;
 	cnt.vals += nr_file * sizeof(struct scoutfs_file_extent);
 
@@ -254,25 +368,102 @@ static inline const struct scoutfs_item_count SIC_WRITE_BEGIN(void)
 }
 
 /*
- * Truncating an extent can:
+ * The commit returns the remaining blocks in each pool to the free
+ * extent items.
+ */
+static inline const struct scoutfs_item_count SIC_DRAIN_POOL(void)
+{
+	struct scoutfs_item_count cnt = {0,};
+
+	__count_drain_pool(&cnt);
+
+	return cnt;
+}
+
+/*
+ * Truncating each of 'nr' extents can:
  *  - delete existing file extent,
  *  - create two surrounding file extents,
  *  - add an offline file extent,
  *  - delete two existing free extents
  *  - create a merged free extent
+ *  - or create a shared block release instead of freeing
  */
 static inline const struct scoutfs_item_count
-SIC_TRUNC_EXTENT(struct inode *inode)
+SIC_TRUNC_EXTENTS(struct inode *inode, unsigned int nr)
 {
 	struct scoutfs_item_count cnt = {0,};
 	unsigned int nr_file = 1 + 2 + 1;
 	unsigned int nr_free = (2 + 1) * 2;
+	unsigned int nr_rel = 1;
 
 	if (inode)
 		__count_dirty_inode(&cnt);
 
-	cnt.items += nr_file + nr_free;
-	cnt.vals += nr_file * sizeof(struct scoutfs_file_extent);
+	cnt.items += (nr_file + nr_free + nr_rel) * nr;
+	cnt.vals += nr_file * nr * sizeof(struct scoutfs_file_extent) +
+		    nr_rel * nr * sizeof(struct scoutfs_shared_release);
+
+	return cnt;
+}
+
+/*
+ * Cloning each of 'nr' extents can:
+ *  - split a reference count item in three
+ *  - set the shared flag on the source extent by removing it, leaving
+ *    two split extents, and adding it, merging with two neighbours
+ *  - add the destination extent, merging with two neighbours
+ */
+static inline const struct scoutfs_item_count
+SIC_CLONE_EXTENTS(unsigned int nr)
+{
+	struct scoutfs_item_count cnt = {0,};
+	unsigned int nr_shared = 3;
+	unsigned int nr_file = (1 + 2) + (2 + 1) + (2 + 1);
+
+	__count_dirty_inode(&cnt);
+
+	cnt.items += (nr_shared + nr_file) * nr;
+	cnt.vals += nr_shared * nr * sizeof(struct scoutfs_shared_extent) +
+		    nr_file * nr * sizeof(struct scoutfs_file_extent);
+
+	return cnt;
+}
+
+/*
+ * Applying each of 'nr' pending shared block releases can:
+ *  - split a reference count item in three
+ *  - add a free extent, merging with two neighbours, mirrored
+ *  - update or delete the pending release
+ */
+static inline const struct scoutfs_item_count
+SIC_SHARED_RELEASE(unsigned int nr)
+{
+	struct scoutfs_item_count cnt = {0,};
+	unsigned int nr_shared = 3;
+	unsigned int nr_free = (2 + 1) * 2;
+	unsigned int nr_rel = 1;
+
+	cnt.items += (nr_shared + nr_free + nr_rel) * nr;
+	cnt.vals += nr_shared * nr * sizeof(struct scoutfs_shared_extent) +
+		    nr_rel * nr * sizeof(struct scoutfs_shared_release);
+
+	return cnt;
+}
+
+/*
+ * Clearing the shared flag on the extents covering 'nr' blocks can, for
+ * each block, remove an extent leaving two split extents and add it
+ * back, merging with two neighbours.
+ */
+static inline const struct scoutfs_item_count
+SIC_CLEAR_SHARED(unsigned int nr)
+{
+	struct scoutfs_item_count cnt = {0,};
+	unsigned int nr_file = (1 + 2) + (2 + 1);
+
+	cnt.items += nr_file * nr;
+	cnt.vals += nr_file * nr * sizeof(struct scoutfs_file_extent);
 
 	return cnt;
 }
@@ -293,13 +484,16 @@ static inline const struct scoutfs_item_count SIC_RETURN_EXTENTS(void)
 }
 
 /*
- * Fallocating an extent can, at most:
+ * Fallocating each extent can, at most:
  *  - allocate from the server: delete two free and insert merged
  *  - free an allocated extent: delete one and create two split
  *  - remove an unallocated file extent: delete one and create two split
  *  - add an fallocated flie extent: delete two and inset one merged
+ *
+ * Reserving blocks for the batch can add one more server extent.
  */
-static inline const struct scoutfs_item_count SIC_FALLOCATE_ONE(void)
+static inline const struct scoutfs_item_count
+SIC_FALLOCATE_EXTENTS(unsigned int nr)
 {
 	struct scoutfs_item_count cnt = {0,};
 	unsigned int nr_free = ((1 + 2) * 2) * 2;
@@ -307,8 +501,8 @@ static inline const struct scoutfs_item_count SIC_FALLOCATE_ONE(void)
 
 	__count_dirty_inode(&cnt);
 
-	cnt.items += nr_free + nr_file;
-	cnt.vals += nr_file * sizeof(struct scoutfs_file_extent);
+	cnt.items += ((nr_free + nr_file) * nr) + (3 * 2);
+	cnt.vals += (nr_file * nr) * sizeof(struct scoutfs_file_extent);
 
 	return cnt;
 }
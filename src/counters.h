@@ -30,22 +30,61 @@
 	EXPAND_COUNTER(corrupt_data_extent_trunc_cleanup)	\
 	EXPAND_COUNTER(corrupt_data_extent_alloc_cleanup)	\
 	EXPAND_COUNTER(corrupt_data_extent_fallocate_cleanup)	\
+	EXPAND_COUNTER(corrupt_data_extent_clone_cleanup)	\
+	EXPAND_COUNTER(corrupt_dir_delta_val_size)		\
 	EXPAND_COUNTER(corrupt_dirent_backref_name_len)		\
 	EXPAND_COUNTER(corrupt_dirent_name_len)			\
 	EXPAND_COUNTER(corrupt_dirent_readdir_name_len)		\
 	EXPAND_COUNTER(corrupt_inode_block_counts)		\
 	EXPAND_COUNTER(corrupt_extent_add_cleanup)		\
 	EXPAND_COUNTER(corrupt_extent_rem_cleanup)		\
+	EXPAND_COUNTER(corrupt_file_delta_val_size)		\
+	EXPAND_COUNTER(corrupt_inline_data_missing_item)	\
 	EXPAND_COUNTER(corrupt_server_extent_cleanup)		\
 	EXPAND_COUNTER(corrupt_symlink_inode_size)		\
 	EXPAND_COUNTER(corrupt_symlink_missing_item)		\
 	EXPAND_COUNTER(corrupt_symlink_not_null_term)		\
+	EXPAND_COUNTER(data_alloc_goal_hit)			\
+	EXPAND_COUNTER(data_alloc_goal_miss)			\
+	EXPAND_COUNTER(data_clone_blocks)			\
+	EXPAND_COUNTER(data_delayed_alloc_extent)		\
+	EXPAND_COUNTER(data_delayed_alloc_partial)		\
+	EXPAND_COUNTER(data_delayed_convert_extent)		\
+	EXPAND_COUNTER(data_delayed_release)			\
+	EXPAND_COUNTER(data_delayed_reserve)			\
+	EXPAND_COUNTER(data_delayed_unwritten)			\
 	EXPAND_COUNTER(data_end_writeback_page)			\
+	EXPAND_COUNTER(data_extent_cache_hit)			\
+	EXPAND_COUNTER(data_extent_cache_miss)			\
+	EXPAND_COUNTER(data_fallocate_reserve)			\
+	EXPAND_COUNTER(data_fault_wait)				\
+	EXPAND_COUNTER(data_inline_convert)			\
+	EXPAND_COUNTER(data_inline_read)			\
+	EXPAND_COUNTER(data_inline_write)			\
 	EXPAND_COUNTER(data_invalidatepage)			\
+	EXPAND_COUNTER(data_page_mkwrite)			\
+	EXPAND_COUNTER(data_pool_fill)				\
+	EXPAND_COUNTER(data_prealloc_offline)			\
+	EXPAND_COUNTER(data_readahead_offline)			\
+	EXPAND_COUNTER(data_readahead_prefetch)			\
+	EXPAND_COUNTER(data_readahead_stride)			\
+	EXPAND_COUNTER(data_readahead_window)			\
 	EXPAND_COUNTER(data_readpage)				\
+	EXPAND_COUNTER(data_return_unused)			\
+	EXPAND_COUNTER(data_server_grant)			\
+	EXPAND_COUNTER(data_shared_free_blocks)			\
+	EXPAND_COUNTER(data_shared_release)			\
+	EXPAND_COUNTER(data_truncate_extent)			\
+	EXPAND_COUNTER(data_truncate_throttled)			\
+	EXPAND_COUNTER(data_unprealloc_offline)			\
+	EXPAND_COUNTER(data_unshare_blocks)			\
+	EXPAND_COUNTER(data_unshared_clear_blocks)		\
+	EXPAND_COUNTER(data_wait)				\
+	EXPAND_COUNTER(data_wait_request)			\
 	EXPAND_COUNTER(data_write_begin)			\
 	EXPAND_COUNTER(data_write_end)				\
 	EXPAND_COUNTER(data_writepage)				\
+	EXPAND_COUNTER(data_writepage_delayed)			\
 	EXPAND_COUNTER(dentry_revalidate_error)			\
 	EXPAND_COUNTER(dentry_revalidate_invalid)		\
 	EXPAND_COUNTER(dentry_revalidate_locked)		\
@@ -54,12 +93,26 @@
 	EXPAND_COUNTER(dentry_revalidate_root)			\
 	EXPAND_COUNTER(dentry_revalidate_valid)			\
 	EXPAND_COUNTER(dir_backref_excessive_retries)		\
+	EXPAND_COUNTER(dir_create_delta)			\
+	EXPAND_COUNTER(dir_delta_fold)				\
+	EXPAND_COUNTER(dir_delta_skip)				\
+	EXPAND_COUNTER(dir_delta_write)				\
+	EXPAND_COUNTER(dir_readdir_plus_ents)			\
+	EXPAND_COUNTER(dir_readdir_pos_reserve)			\
 	EXPAND_COUNTER(extent_add)				\
 	EXPAND_COUNTER(extent_delete)				\
 	EXPAND_COUNTER(extent_insert)				\
 	EXPAND_COUNTER(extent_next)				\
 	EXPAND_COUNTER(extent_prev)				\
 	EXPAND_COUNTER(extent_remove)				\
+	EXPAND_COUNTER(file_delta_fold)				\
+	EXPAND_COUNTER(file_delta_skip)				\
+	EXPAND_COUNTER(file_delta_write)			\
+	EXPAND_COUNTER(inode_delete_background)			\
+	EXPAND_COUNTER(inode_read_attrs)			\
+	EXPAND_COUNTER(inode_read_attrs_group)			\
+	EXPAND_COUNTER(inode_truncate_background)		\
+	EXPAND_COUNTER(inode_writeback_batch)			\
 	EXPAND_COUNTER(item_alloc)				\
 	EXPAND_COUNTER(item_batch_duplicate)			\
 	EXPAND_COUNTER(item_batch_inserted)			\
@@ -93,10 +146,12 @@
 	EXPAND_COUNTER(lock_grace_expired)			\
 	EXPAND_COUNTER(lock_grace_extended)			\
 	EXPAND_COUNTER(lock_invalidate_clean_item)		\
+	EXPAND_COUNTER(lock_invalidate_data_pages)		\
 	EXPAND_COUNTER(lock_lock)				\
 	EXPAND_COUNTER(lock_lock_error)				\
 	EXPAND_COUNTER(lock_nonblock_eagain)			\
 	EXPAND_COUNTER(lock_shrink)				\
+	EXPAND_COUNTER(lock_write_dirty_data)			\
 	EXPAND_COUNTER(lock_write_dirty_item)			\
 	EXPAND_COUNTER(lock_unlock)				\
 	EXPAND_COUNTER(manifest_compact_migrate)		\
@@ -119,10 +174,14 @@
 	EXPAND_COUNTER(server_alloc_segno)			\
 	EXPAND_COUNTER(server_extent_alloc)			\
 	EXPAND_COUNTER(server_extent_alloc_error)		\
+	EXPAND_COUNTER(server_extent_alloc_hinted)		\
+	EXPAND_COUNTER(server_extent_clawback)			\
 	EXPAND_COUNTER(server_free_extent)			\
 	EXPAND_COUNTER(server_free_pending_extent)		\
 	EXPAND_COUNTER(server_free_pending_error)		\
 	EXPAND_COUNTER(server_free_segno)			\
+	EXPAND_COUNTER(symlink_cache_hit)			\
+	EXPAND_COUNTER(symlink_cache_miss)			\
 	EXPAND_COUNTER(trans_commit_fsync)			\
 	EXPAND_COUNTER(trans_commit_full)			\
 	EXPAND_COUNTER(trans_commit_item_flush)			\
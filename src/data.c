@@ -22,6 +22,7 @@
 #include <linux/falloc.h>
 #include <linux/writeback.h>
 #include <linux/workqueue.h>
+#include <linux/delay.h>
 
 #include "format.h"
 #include "super.h"
@@ -40,21 +41,35 @@
 #include "extents.h"
 #include "msg.h"
 #include "count.h"
+#include "bio.h"
 
 /*
  * scoutfs uses extent items to track file data block mappings and free
  * blocks.
  *
- * Typically we'll allocate a single block in get_block if a mapping
- * isn't found.
+ * Buffered writes into sparse regions delay allocation.  write_begin
+ * only reserves a free block and marks the buffer delayed.  Writeback
+ * then finds runs of contiguous delayed blocks in dirty pages and
+ * allocates an extent for each run.  Writes that don't arrive in
+ * order, or which are interleaved with other files, still end up in
+ * large extents.
  *
- * We special case extending contiguous files.  In that case we'll preallocate
- * an unwritten extent at the end of the file.  The size of the preallocation
- * is based on the file size and is capped.
+ * Other paths that need a mapping in get_block allocate a single block.
+ * We special case extending contiguous files.  In that case we'll
+ * preallocate an unwritten extent at the end of the file.  The size of
+ * the preallocation is based on the file size and is capped.
+ *
+ * Block allocations are satisfied from pools of free blocks so that
+ * concurrent writers don't serialize on the node's free extent items.
+ * Each file allocates from the pool of a stream chosen by its inode
+ * number so that interleaved writers don't fragment each other's
+ * files.  Pools are filled from the free extents in bulk, preferring
+ * the blocks after the file's previous extent, and commits return
+ * their remaining blocks.  Each inode's extent_mutex serializes
+ * modification of its file extent items.
  *
  * XXX
  *  - truncate
- *  - mmap
  *  - better io error propagation
  *  - forced unmount with dirty data
  *  - direct IO
@@ -71,13 +86,101 @@
  */
 #define MAX_EXTENT_BLOCKS (8ULL * 1024 * 1024 >> SCOUTFS_BLOCK_SHIFT)
 /*
- * We ask for a fixed size from the server today.
+ * The size of the extents we ask the server for follows the rate that
+ * the node is allocating.  We try to ask for enough to last for a grant
+ * interval, within limits.  The first grant is a reasonable middle
+ * ground.
  */
 #define SERVER_ALLOC_BLOCKS (MAX_EXTENT_BLOCKS * 8)
+#define SERVER_ALLOC_MIN_BLOCKS MAX_EXTENT_BLOCKS
+#define SERVER_ALLOC_MAX_BLOCKS (MAX_EXTENT_BLOCKS * 128)
+#define SERVER_GRANT_INTERVAL (2 * HZ)
+/*
+ * Send free extents back to the server if we have a few grants' worth
+ * locally.  When the server tells us that it's low on space we return
+ * everything that we don't need for delayed allocation for a while.
+ */
+#define NODE_FREE_HIGH_WATER_GRANTS 4
+#define SERVER_PRESSURE_INTERVAL (10 * HZ)
+/*
+ * Each stream's pool of free blocks is filled with an extent of at
+ * least this many blocks.  Pools are filled with free blocks within a
+ * short distance after the file's goal when they're available.  New
+ * files start near the recent allocations of files created in the same
+ * directory.
+ */
+#define POOL_BLOCKS MAX_EXTENT_BLOCKS
+#define ALLOC_STREAM_BITS 6
+#define ALLOC_STREAM_NR (1 << ALLOC_STREAM_BITS)
+#define ALLOC_GOAL_NEAR_BLOCKS SCOUTFS_SEGMENT_BLOCKS
+/*
+ * Delayed buffers are mapped to an impossible block until writeback
+ * allocates them.  Nothing should ever try to write to it.
+ */
+#define DELAYED_BLKNO (~(sector_t)0)
+
+/*
+ * Writes into unwritten extents are delayed like allocations so that
+ * writeback can convert runs of blocks with one extent update.  Their
+ * delayed buffers are also marked unwritten, and offline if the extent
+ * was offline, so that invalidation can restore the inode's counts.
+ */
+enum {
+	BH_ScoutfsOffline = BH_PrivateStart,
+};
+
+BUFFER_FNS(ScoutfsOffline, scoutfs_offline)	/* delayed in offline extent */
+
+/*
+ * Writeback allocates runs of delayed blocks while holding their pages
+ * locked.  Runs are limited to a segment's worth of pages.  Allocations
+ * for the following runs of a large write tend to be contiguous and
+ * merge into the previous extent.
+ */
+#define DELAYED_RUN_PAGES (SCOUTFS_SEGMENT_BLOCKS / SCOUTFS_BLOCKS_PER_PAGE)
+/*
+ * Readers waiting for offline blocks are only woken by local staging
+ * or truncation of their range.  They recheck every so often to notice
+ * staging on other nodes.
+ */
+#define DATA_WAIT_RECHECK_JIFFIES (5 * HZ)
+/*
+ * Truncation removes this many extents in each transaction hold.
+ * Background truncation backs off while other tasks are holding the
+ * transaction so that it doesn't crowd out foreground writers.
+ */
+#define TRUNCATE_CHUNK_EXTENTS 16
+#define TRUNCATE_THROTTLE_MS 10
+/*
+ * Cloning and applying shared block releases process this many extents
+ * in each transaction hold.
+ */
+#define CLONE_CHUNK_EXTENTS 16
+#define SHARED_RELEASE_CHUNK 16
+/*
+ * Writes to shared blocks copy this much of the rest of the shared
+ * extent so that sequential writers don't copy block by block.
+ */
+#define UNSHARE_MAX_BLOCKS 64
+/*
+ * fallocate asks the server for the free blocks it needs for the rest
+ * of its range, within limits, in one request.  Its unwritten extents
+ * aren't limited to MAX_EXTENT_BLOCKS because they don't have dirty
+ * pages that would have to be written to invalidate a lock.  Each
+ * transaction hold adds a batch of extents.
+ */
+#define FALLOCATE_RESERVE_MAX_BLOCKS (SERVER_ALLOC_MAX_BLOCKS * 16)
+#define FALLOCATE_EXTENT_BLOCKS SERVER_ALLOC_MAX_BLOCKS
+#define FALLOCATE_CHUNK_EXTENTS 16
 /*
- * Send free extents back to the server if we have plenty locally.
+ * Readahead windows are sized to cover the rest of the extent being
+ * read, up to the size of the data lock regions that readahead is
+ * batched into.  Reads that repeat the same stride a few times read
+ * ahead the next few strides.
  */
-#define NODE_FREE_HIGH_WATER_BLOCKS (SERVER_ALLOC_BLOCKS * 16)
+#define READAHEAD_MAX_BLOCKS SCOUTFS_LOCK_DATA_REGION_NR
+#define READAHEAD_STRIDE_HITS 2
+#define READAHEAD_STRIDES 4
 
 struct data_info {
 	struct super_block *sb;
@@ -85,15 +188,129 @@ struct data_info {
 	atomic64_t node_free_blocks;
 	struct workqueue_struct *workq;
 	struct work_struct return_work;
+
+	/* free blocks reserved for delayed allocation */
+	atomic64_t delayed_blocks;
+
+	/* free blocks reserved for large fallocate calls */
+	atomic64_t fallocate_blocks;
+
+	/* free blocks removed from the free extent items into pools */
+	struct data_pool *pools;
+	atomic64_t pool_blocks;
+
+	/* where recent files in directories have allocated, by hash */
+	spinlock_t dir_goal_lock;
+	u64 dir_goal_inos[ALLOC_STREAM_NR];
+	u64 dir_goals[ALLOC_STREAM_NR];
+
+	/* sizing and placement of server grants, under alloc_rwsem */
+	atomic64_t alloc_since_grant;
+	unsigned long grant_jiffies;
+	u64 grant_blocks;
+	u64 grant_hint;
+	unsigned long pressure_until;
+
+	/* readers waiting for offline blocks to be staged */
+	spinlock_t wait_lock;
+	struct list_head wait_reqs;
+	struct list_head waiters;
+	wait_queue_head_t waiting_waitq;
+
+	/* dropped references to shared blocks are applied in the background */
+	atomic64_t release_id;
+	struct work_struct release_work;
+};
+
+/*
+ * A request to stage a range of offline blocks.  Readers that wait for
+ * overlapping or adjacent ranges in a file share one request.  The
+ * requests are sorted by inode number and block.
+ */
+struct data_wait_req {
+	struct list_head head;
+	u64 ino;
+	u64 start;
+	u64 last;
+	unsigned int nr_waiters;
+};
+
+/*
+ * A pool holds a free extent that has been removed from the node's free
+ * extent items.  Allocations from a pool only modify the file extent
+ * items.
+ */
+struct data_pool {
+	struct mutex mutex;
+	u64 ino;
+	u64 start;
+	u64 len;
+};
+
+struct delayed_run {
+	u64 start;
+	u64 len;
+	bool unwritten;
+	unsigned int nr_pages;
+	struct page *pages[DELAYED_RUN_PAGES];
 };
 
 #define DECLARE_DATA_INFO(sb, name) \
 	struct data_info *name = SCOUTFS_SB(sb)->data_info
 
+static bool server_pressure(struct data_info *datinf)
+{
+	return time_before(jiffies, ACCESS_ONCE(datinf->pressure_until));
+}
+
+/*
+ * We keep a few grants' worth of free blocks, or none while the server
+ * is low on space.  Free blocks reserved for delayed allocation and
+ * fallocate aren't returned.
+ */
+static u64 free_high_water(struct data_info *datinf)
+{
+	u64 high = 0;
+
+	if (!server_pressure(datinf))
+		high = ACCESS_ONCE(datinf->grant_blocks) *
+		       NODE_FREE_HIGH_WATER_GRANTS;
+
+	return high + atomic64_read(&datinf->delayed_blocks) +
+	       atomic64_read(&datinf->fallocate_blocks);
+}
+
+/*
+ * File extents never cross the boundaries of the data lock regions
+ * whose locks cover their items.
+ */
+static u64 region_last(u64 iblock)
+{
+	return iblock | (SCOUTFS_LOCK_DATA_REGION_NR - 1);
+}
+
+static bool lock_has_block(struct scoutfs_lock *lock, u64 iblock)
+{
+	return le64_to_cpu(lock->name.second) ==
+	       iblock >> SCOUTFS_LOCK_DATA_REGION_SHIFT;
+}
+
+/*
+ * Record that the file might have extents in the region containing the
+ * block.  The caller holds the extent_mutex.  Writers that only hold
+ * the inode lock in PR also record it in their file delta items.
+ */
+static void set_extents_end(struct inode *inode, u64 iblock)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+
+	si->extents_end = max(si->extents_end, region_last(iblock) + 1);
+}
+
 static void init_file_extent_key(struct scoutfs_key *key, u64 ino, u64 last)
 {
 	*key = (struct scoutfs_key) {
-		.sk_zone = SCOUTFS_FS_ZONE,
+		.sk_zone = SCOUTFS_FILE_DATA_ZONE,
 		.skfe_ino = cpu_to_le64(ino),
 		.sk_type = SCOUTFS_FILE_EXTENT_TYPE,
 		.skfe_last = cpu_to_le64(last),
@@ -112,6 +329,26 @@ static void init_free_extent_key(struct scoutfs_key *key, u8 type, u64 node_id,
 	};
 }
 
+static void init_shared_extent_key(struct scoutfs_key *key, u64 last)
+{
+	*key = (struct scoutfs_key) {
+		.sk_zone = SCOUTFS_SHARED_EXTENT_ZONE,
+		.skse_last = cpu_to_le64(last),
+		.sk_type = SCOUTFS_SHARED_EXTENT_TYPE,
+	};
+}
+
+static void init_shared_release_key(struct scoutfs_key *key, u64 node_id,
+				    u64 id)
+{
+	*key = (struct scoutfs_key) {
+		.sk_zone = SCOUTFS_NODE_ZONE,
+		.sksr_node_id = cpu_to_le64(node_id),
+		.sk_type = SCOUTFS_SHARED_RELEASE_TYPE,
+		.sksr_id = cpu_to_le64(id),
+	};
+}
+
 static int init_extent_from_item(struct scoutfs_extent *ext,
 				 struct scoutfs_key *key,
 				 struct scoutfs_file_extent *fex)
@@ -153,7 +390,9 @@ static int init_extent_from_item(struct scoutfs_extent *ext,
  * Read and write file extent and free extent items.
  *
  * File extents and free extents are indexed by the last position in the
- * extent so that we can find intersections with _next.
+ * extent so that we can find intersections with _next.  File extents
+ * are covered by the lock of the data region that contains them and
+ * searches are limited to the locked region.
  *
  * We also index free extents by their length.  We implement that by
  * keeping their _BLOCKS_ item in sync with the primary _BLKNO_ item
@@ -194,10 +433,32 @@ static int data_extent_io(struct super_block *sb, int op,
 	}
 
 	if (ext->type == SCOUTFS_FILE_EXTENT_TYPE) {
+		if (WARN_ON_ONCE(lock->name.scope !=
+				 SCOUTFS_LOCK_SCOPE_FILE_DATA ||
+				 le64_to_cpu(lock->name.second) ==
+				 SCOUTFS_LOCK_DATA_FILE))
+			return -EINVAL;
+		if ((op == SEI_INSERT || op == SEI_DELETE) &&
+		    WARN_ON_ONCE(!lock_has_block(lock, ext->start) ||
+				 !lock_has_block(lock,
+						 ext->start + ext->len - 1)))
+			return -EINVAL;
+
 		init_file_extent_key(&key, ext->owner,
 				     ext->start + ext->len - 1);
-		init_file_extent_key(&first, ext->owner, 0);
-		init_file_extent_key(&last, ext->owner, U64_MAX);
+		first = lock->start;
+		last = lock->end;
+		if (op == SEI_NEXT) {
+			if (scoutfs_key_compare(&key, &last) > 0)
+				return -ENOENT;
+			if (scoutfs_key_compare(&key, &first) < 0)
+				key = first;
+		} else if (op == SEI_PREV) {
+			if (scoutfs_key_compare(&key, &first) < 0)
+				return -ENOENT;
+			if (scoutfs_key_compare(&key, &last) > 0)
+				key = last;
+		}
 		fex.blkno = cpu_to_le64(ext->map);
 		fex.len = cpu_to_le64(ext->len);
 		fex.flags = ext->flags;
@@ -256,6 +517,281 @@ static int data_extent_io(struct super_block *sb, int op,
 	return ret;
 }
 
+/*
+ * Each inode caches the results of its recent file extent searches.  An
+ * entry records that there were no extents from the searched block to
+ * the start of the extent that was found, or none at all if the search
+ * didn't find one.  It can satisfy any later search for a block up to
+ * the end of its extent.  Sequential reads and writes can then map
+ * blocks without searching items.
+ *
+ * Searches only see the extents in the region of the data lock that
+ * covers them so the cache only holds the results of searches in one
+ * region.  It's covered by the region's lock and is dropped when the
+ * lock is invalidated or searches move to another region.  Modifying
+ * the inode's file extents drops the cache after the modification so
+ * that racing searches won't store what they found.
+ */
+static int file_extent_next(struct inode *inode, u64 iblock,
+			    struct scoutfs_extent *ext,
+			    struct scoutfs_lock *lock)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_extent_cache *ec;
+	u64 gen;
+	int ret;
+	int i;
+
+	spin_lock(&si->ext_cache_lock);
+	if (scoutfs_lock_is_covered(sb, &si->ext_cache_cov) &&
+	    si->ext_cache_region == iblock >> SCOUTFS_LOCK_DATA_REGION_SHIFT) {
+		for (i = 0; i < si->ext_cache_nr; i++) {
+			ec = &si->ext_cache[i];
+			if (iblock >= ec->from &&
+			    (ec->ext.len == 0 ||
+			     iblock < ec->ext.start + ec->ext.len)) {
+				*ext = ec->ext;
+				spin_unlock(&si->ext_cache_lock);
+				scoutfs_inc_counter(sb, data_extent_cache_hit);
+				return ext->len ? 0 : -ENOENT;
+			}
+		}
+	}
+	gen = si->ext_cache_gen;
+	spin_unlock(&si->ext_cache_lock);
+
+	scoutfs_inc_counter(sb, data_extent_cache_miss);
+
+	scoutfs_extent_init(ext, SCOUTFS_FILE_EXTENT_TYPE, scoutfs_ino(inode),
+			    iblock, 1, 0, 0);
+	ret = scoutfs_extent_next(sb, data_extent_io, ext, lock);
+	if (ret < 0 && ret != -ENOENT)
+		return ret;
+
+	spin_lock(&si->ext_cache_lock);
+	if (gen == si->ext_cache_gen) {
+		if (!scoutfs_lock_is_covered(sb, &si->ext_cache_cov) ||
+		    si->ext_cache_region != le64_to_cpu(lock->name.second)) {
+			si->ext_cache_nr = 0;
+			si->ext_cache_next = 0;
+			si->ext_cache_region = le64_to_cpu(lock->name.second);
+			scoutfs_lock_add_coverage(sb, lock, &si->ext_cache_cov);
+		}
+
+		i = si->ext_cache_next;
+		si->ext_cache_next = (i + 1) % SCOUTFS_EXTENT_CACHE_NR;
+		if (si->ext_cache_nr < SCOUTFS_EXTENT_CACHE_NR)
+			si->ext_cache_nr++;
+
+		ec = &si->ext_cache[i];
+		ec->from = iblock;
+		if (ret == 0)
+			ec->ext = *ext;
+		else
+			memset(&ec->ext, 0, sizeof(ec->ext));
+	}
+	spin_unlock(&si->ext_cache_lock);
+
+	return ret;
+}
+
+/*
+ * Find the next file extent at or after iblock for callers that walk
+ * the extents in many regions.  Each region before end is searched
+ * under its data lock in PR.  Returns -ENOENT if there are no more
+ * extents before end.  The caller holds the inode lock.
+ */
+static int next_extent_regions(struct inode *inode, u64 iblock, u64 end,
+			       struct scoutfs_extent *ext)
+{
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_lock *lock = NULL;
+	int ret = -ENOENT;
+
+	while (iblock < end) {
+		ret = scoutfs_lock_data_region(sb, DLM_LOCK_PR, 0,
+					       scoutfs_ino(inode), iblock,
+					       &lock);
+		if (ret)
+			break;
+
+		ret = file_extent_next(inode, iblock, ext, lock);
+		scoutfs_unlock(sb, lock, DLM_LOCK_PR);
+		if (ret != -ENOENT)
+			break;
+
+		iblock = region_last(iblock) + 1;
+	}
+
+	return ret;
+}
+
+static void invalidate_extent_cache(struct inode *inode)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+
+	spin_lock(&si->ext_cache_lock);
+	si->ext_cache_gen++;
+	si->ext_cache_nr = 0;
+	spin_unlock(&si->ext_cache_lock);
+}
+
+/*
+ * Find the shared block reference count item that contains or follows
+ * the given block.
+ */
+static int shared_extent_next(struct super_block *sb, u64 blkno, u64 *start,
+			      u64 *len, u64 *refs, struct scoutfs_lock *lock)
+{
+	struct scoutfs_shared_extent sext;
+	struct scoutfs_key last;
+	struct scoutfs_key key;
+	struct kvec val;
+	int ret;
+
+	init_shared_extent_key(&key, blkno);
+	init_shared_extent_key(&last, U64_MAX);
+	kvec_init(&val, &sext, sizeof(sext));
+
+	ret = scoutfs_item_next(sb, &key, &last, &val, lock);
+	if (ret >= 0 && ret != sizeof(sext))
+		ret = -EIO;
+	if (ret < 0)
+		return ret;
+
+	*len = le64_to_cpu(sext.len);
+	*start = le64_to_cpu(key.skse_last) - *len + 1;
+	*refs = le64_to_cpu(sext.refs);
+	return 0;
+}
+
+static int set_shared_extent(struct super_block *sb, u64 start, u64 len,
+			     u64 refs, bool create, struct scoutfs_lock *lock)
+{
+	struct scoutfs_shared_extent sext;
+	struct scoutfs_key key;
+	struct kvec val;
+
+	init_shared_extent_key(&key, start + len - 1);
+	sext.len = cpu_to_le64(len);
+	sext.refs = cpu_to_le64(refs);
+	kvec_init(&val, &sext, sizeof(sext));
+
+	if (create)
+		return scoutfs_item_create(sb, &key, &val, lock);
+	return scoutfs_item_update(sb, &key, &val, lock);
+}
+
+/*
+ * Add or drop a reference to the run of blocks at the start of the
+ * caller's range that all have the same reference count.  Blocks
+ * without a reference count item have a single reference.  Returns the
+ * number of blocks in the run.  If the final reference to the run was
+ * dropped then we set *free and the caller frees the blocks.
+ *
+ * The caller holds the shared extent lock and a transaction.
+ */
+static s64 adjust_shared_refs(struct super_block *sb, u64 blkno, u64 len,
+			      int delta, bool *free,
+			      struct scoutfs_lock *lock)
+{
+	struct scoutfs_key key;
+	u64 start;
+	u64 ilen;
+	u64 refs;
+	u64 last;
+	u64 end;
+	int ret;
+
+	*free = false;
+
+	ret = shared_extent_next(sb, blkno, &start, &ilen, &refs, lock);
+	if (ret < 0 && ret != -ENOENT)
+		return ret;
+
+	/* blocks before the next item only have one reference */
+	if (ret == -ENOENT || start > blkno) {
+		if (ret == 0)
+			len = min(len, start - blkno);
+		if (delta > 0)
+			ret = set_shared_extent(sb, blkno, len, 2, true, lock);
+		else
+			*free = true;
+		return ret ?: len;
+	}
+
+	/* modify the intersection, leaving the rest of the item */
+	end = start + ilen - 1;
+	len = min(len, end - blkno + 1);
+	last = blkno + len - 1;
+
+	if (last < end) {
+		ret = set_shared_extent(sb, last + 1, end - last, refs,
+					false, lock);
+		if (ret == 0 && refs + delta > 1)
+			ret = set_shared_extent(sb, blkno, len, refs + delta,
+						true, lock);
+	} else if (refs + delta > 1) {
+		ret = set_shared_extent(sb, blkno, len, refs + delta, false,
+					lock);
+	} else {
+		init_shared_extent_key(&key, end);
+		ret = scoutfs_item_delete(sb, &key, lock);
+	}
+
+	if (ret == 0 && start < blkno)
+		ret = set_shared_extent(sb, start, blkno - start, refs, true,
+					lock);
+
+	return ret ?: len;
+}
+
+/*
+ * Record that we've dropped our reference to shared blocks.  We can't
+ * acquire the shared extent lock while holding a transaction so the
+ * release is applied later by the release worker.
+ */
+static int add_shared_release(struct super_block *sb, u64 blkno, u64 len,
+			      u64 *id_ret)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	DECLARE_DATA_INFO(sb, datinf);
+	struct scoutfs_shared_release srel;
+	struct scoutfs_key key;
+	struct kvec val;
+	u64 id;
+	int ret;
+
+	srel.blkno = cpu_to_le64(blkno);
+	srel.len = cpu_to_le64(len);
+	kvec_init(&val, &srel, sizeof(srel));
+
+	/* ids restart at each mount, skip past persistent releases */
+	do {
+		id = atomic64_inc_return(&datinf->release_id);
+		init_shared_release_key(&key, sbi->node_id, id);
+		ret = scoutfs_item_create(sb, &key, &val, sbi->node_id_lock);
+	} while (ret == -EEXIST);
+
+	if (ret == 0) {
+		scoutfs_inc_counter(sb, data_shared_release);
+		queue_work(datinf->workq, &datinf->release_work);
+		*id_ret = id;
+	}
+
+	return ret;
+}
+
+static int del_shared_release(struct super_block *sb, u64 id)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	struct scoutfs_key key;
+
+	init_shared_release_key(&key, sbi->node_id, id);
+	return scoutfs_item_delete(sb, &key, sbi->node_id_lock);
+}
+
 /*
  * Find and remove or mark offline the next extent that intersects with
  * the caller's range.  The caller is responsible for transactions and
@@ -282,9 +818,12 @@ static s64 truncate_one_extent(struct super_block *sb, struct inode *inode,
 	struct scoutfs_extent ofl;
 	bool rem_fr = false;
 	bool add_rem = false;
+	bool del_rel = false;
 	s64 offline_delta = 0;
 	s64 online_delta = 0;
+	u64 rel_id;
 	s64 ret;
+	int err;
 
 	scoutfs_extent_init(&next, SCOUTFS_FILE_EXTENT_TYPE, ino,
 			    iblock, 1, 0, 0);
@@ -312,8 +851,13 @@ static s64 truncate_one_extent(struct super_block *sb, struct inode *inode,
 		goto out;
 	}
 
-	/* free an allocated mapping */
-	if (rem.map) {
+	/* drop our reference to shared blocks, or free an allocated mapping */
+	if (rem.map && (rem.flags & SEF_SHARED)) {
+		ret = add_shared_release(sb, rem.map, rem.len, &rel_id);
+		if (ret)
+			goto out;
+		del_rel = true;
+	} else if (rem.map) {
 		scoutfs_extent_init(&fr, SCOUTFS_FREE_EXTENT_BLKNO_TYPE,
 				    sbi->node_id, rem.map, rem.len, 0, 0);
 		ret = scoutfs_extent_add(sb, data_extent_io, &fr,
@@ -349,12 +893,17 @@ static s64 truncate_one_extent(struct super_block *sb, struct inode *inode,
 	scoutfs_inode_add_onoff(inode, online_delta, offline_delta);
 
 	/* start returning free extents to the server after a small delay */
-	if (rem.map && (atomic64_read(&datinf->node_free_blocks) >
-			NODE_FREE_HIGH_WATER_BLOCKS))
+	if (rem_fr && (atomic64_read(&datinf->node_free_blocks) >
+		       free_high_water(datinf)))
 		queue_work(datinf->workq, &datinf->return_work);
 
 	ret = 1;
 out:
+	if (ret < 0 && del_rel && (err = del_shared_release(sb, rel_id)) < 0)
+		scoutfs_corruption(sb, SC_DATA_EXTENT_TRUNC_CLEANUP,
+				   corrupt_data_extent_trunc_cleanup,
+				   "ext "SE_FMT" release %llu ret %d",
+				   SE_ARG(&rem), rel_id, err);
 	scoutfs_extent_cleanup(ret < 0 && add_rem, scoutfs_extent_add, sb,
 			       data_extent_io, &rem, lock,
 			       SC_DATA_EXTENT_TRUNC_CLEANUP,
@@ -380,20 +929,35 @@ out:
  *
  * If the inode is provided then we update its tracking of the online
  * and offline blocks.  If it's not provided then the inode is being
- * destroyed and isn't reachable, we don't need to update it.
+ * destroyed and isn't reachable, we don't need to update it.  The
+ * caller has limited the range to the inode's extents_end.
+ *
+ * The caller is in charge of locking the inode, but we may have to
+ * modify far more items than fit in a transaction so we're in charge
+ * of batching updates into transactions.  We lock each data region in
+ * the range before holding transactions that each remove a bounded
+ * chunk of the region's extents.  If the inode is provided then we're
+ * responsible for updating its item as we go.
  *
- * The caller is in charge of locking the inode and extents, but we may
- * have to modify far more items than fit in a transaction so we're in
- * charge of batching updates into transactions.  If the inode is
- * provided then we're responsible for updating its item as we go.
+ * 'background' callers are freeing on behalf of a task that has already
+ * returned.  They briefly back off before each chunk if other tasks are
+ * holding the transaction.
  */
 int scoutfs_data_truncate_items(struct super_block *sb, struct inode *inode,
 				u64 ino, u64 iblock, u64 last, bool offline,
-				struct scoutfs_lock *lock)
+				bool background, struct scoutfs_lock *lock)
 {
-	struct scoutfs_item_count cnt = SIC_TRUNC_EXTENT(inode);
+	struct scoutfs_item_count cnt = SIC_TRUNC_EXTENTS(inode,
+						TRUNCATE_CHUNK_EXTENTS);
+	struct scoutfs_inode_info *si = inode ? SCOUTFS_I(inode) : NULL;
 	DECLARE_DATA_INFO(sb, datinf);
+	struct scoutfs_lock *region_lock = NULL;
 	LIST_HEAD(ind_locks);
+	bool to_end = false;
+	bool done = false;
+	unsigned int nr;
+	u64 start;
+	u64 rlast;
 	s64 ret = 0;
 
 	WARN_ON_ONCE(inode && !mutex_is_locked(&inode->i_mutex));
@@ -407,7 +971,30 @@ int scoutfs_data_truncate_items(struct super_block *sb, struct inode *inode,
 	if (WARN_ON_ONCE(last < iblock))
 		return -EINVAL;
 
+	/* no extents past the regions the file has used */
+	if (si) {
+		if (iblock >= si->extents_end)
+			return 0;
+		to_end = !offline && last >= si->extents_end - 1;
+		last = min(last, si->extents_end - 1);
+	}
+
+	start = iblock;
 	while (iblock <= last) {
+		if (region_lock == NULL) {
+			ret = scoutfs_lock_data_region(sb, DLM_LOCK_EX, 0, ino,
+						       iblock, &region_lock);
+			if (ret)
+				break;
+			rlast = min(last, region_last(iblock));
+			done = false;
+		}
+
+		if (background && scoutfs_trans_contended(sb)) {
+			scoutfs_inc_counter(sb, data_truncate_throttled);
+			msleep(TRUNCATE_THROTTLE_MS);
+		}
+
 		if (inode)
 			ret = scoutfs_inode_index_lock_hold(inode, &ind_locks,
 							    true, cnt);
@@ -421,11 +1008,31 @@ int scoutfs_data_truncate_items(struct super_block *sb, struct inode *inode,
 		else
 			ret = 0;
 
+		if (inode)
+			mutex_lock(&si->extent_mutex);
 		down_write(&datinf->alloc_rwsem);
-		if (ret == 0)
-			ret = truncate_one_extent(sb, inode, ino, iblock, last,
-						  offline, lock);
+		for (nr = 0; ret == 0 && !done && nr < TRUNCATE_CHUNK_EXTENTS;
+		     nr++) {
+			ret = truncate_one_extent(sb, inode, ino, iblock, rlast,
+						  offline, region_lock);
+			if (ret > 0) {
+				scoutfs_inc_counter(sb, data_truncate_extent);
+				iblock = ret;
+				ret = 0;
+				done = iblock > rlast;
+			} else if (ret == 0) {
+				done = true;
+			}
+		}
 		up_write(&datinf->alloc_rwsem);
+		/* regions past a truncated size no longer have extents */
+		if (ret == 0 && done && to_end && rlast == last)
+			si->extents_end = ALIGN(start,
+						SCOUTFS_LOCK_DATA_REGION_NR);
+		if (inode) {
+			invalidate_extent_cache(inode);
+			mutex_unlock(&si->extent_mutex);
+		}
 
 		if (inode)
 			scoutfs_update_inode_item(inode, lock, &ind_locks);
@@ -433,421 +1040,3115 @@ int scoutfs_data_truncate_items(struct super_block *sb, struct inode *inode,
 		if (inode)
 			scoutfs_inode_index_unlock(sb, &ind_locks);
 
-		if (ret <= 0)
+		if (ret < 0)
 			break;
 
-		iblock = ret;
-		ret = 0;
-	}
-
-	return ret;
-}
+		if (done) {
+			scoutfs_unlock(sb, region_lock, DLM_LOCK_EX);
+			region_lock = NULL;
+			if (rlast == last)
+				break;
+			iblock = rlast + 1;
+		}
 
-static int get_server_extent(struct super_block *sb)
-{
-	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
-	struct scoutfs_extent ext;
-	u64 start;
-	u64 len;
-	int ret;
+		cond_resched();
+	}
 
-	ret = scoutfs_client_alloc_extent(sb, SERVER_ALLOC_BLOCKS,
-					  &start, &len);
-	if (ret)
-		goto out;
+	if (region_lock)
+		scoutfs_unlock(sb, region_lock, DLM_LOCK_EX);
 
-	scoutfs_extent_init(&ext, SCOUTFS_FREE_EXTENT_BLKNO_TYPE,
-			    sbi->node_id, start, len, 0, 0);
-	trace_scoutfs_data_get_server_extent(sb, &ext);
-	ret = scoutfs_extent_add(sb, data_extent_io, &ext, sbi->node_id_lock);
-	/* XXX don't free extent on error, crash recovery with server */
+	if (inode)
+		scoutfs_data_wake_waiters(sb, ino, start, last);
 
-out:
 	return ret;
 }
 
 /*
- * Find a free extent to satisfy an allocation of at most @len blocks.
- *
- * Returns 0 and fills the caller's extent with a _BLKNO_TYPE extent if
- * we found a match.  It's len may be less than desired.  No stored
- * extents have been modified.
+ * Clone the next extent in the source range to the destination.
+ * Allocated blocks are shared by adding a reference and setting the
+ * shared flag on both file extents.  Offline extents are cloned as
+ * offline, without the blocks that staging preallocated in unwritten
+ * offline extents.  Other unwritten extents would read as zeros so
+ * they're left as sparse regions in the destination.
  *
- * Returns -errno on error and -ENOSPC if no free extents were found.
+ * A failure after adding the reference leaves the blocks with an extra
+ * reference.  They'll never be freed but the files are consistent.
  *
- * The caller's extent is always clobbered.
+ * Returns the next source block to clone from, 0 when there are no more
+ * extents in the range, or -errno.
  */
-static int find_free_extent(struct super_block *sb, u64 len,
-			    struct scoutfs_extent *ext)
+static s64 clone_one_extent(struct super_block *sb, struct inode *src,
+			    struct inode *dst, u64 iblock, u64 last,
+			    u64 src_start, u64 dst_start,
+			    struct scoutfs_lock *src_lock,
+			    struct scoutfs_lock *dst_lock,
+			    struct scoutfs_lock *shared_lock)
 {
-	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
-	int ret;
+	struct scoutfs_extent next;
+	struct scoutfs_extent cl;
+	struct scoutfs_extent shr;
+	struct scoutfs_extent add;
+	bool add_cl = false;
+	bool rem_shr = false;
+	bool free;
+	s64 len;
+	s64 ret;
 
-	len = min(len, MAX_EXTENT_BLOCKS);
+	scoutfs_extent_init(&next, SCOUTFS_FILE_EXTENT_TYPE, scoutfs_ino(src),
+			    iblock, 1, 0, 0);
+	ret = scoutfs_extent_next(sb, data_extent_io, &next, src_lock);
+	if (ret < 0) {
+		if (ret == -ENOENT)
+			ret = 0;
+		goto out;
+	}
 
-	for (;;) {
-		/* first try to find the first sufficient extent */
-		scoutfs_extent_init(ext, SCOUTFS_FREE_EXTENT_BLOCKS_TYPE,
-				    sbi->node_id, 0, len, 0, 0);
-		ret = scoutfs_extent_next(sb, data_extent_io, ext,
+	scoutfs_extent_init(&cl, SCOUTFS_FILE_EXTENT_TYPE, scoutfs_ino(src),
+			    iblock, last - iblock + 1, 0, 0);
+	if (!scoutfs_extent_intersection(&cl, &next)) {
+		ret = 0;
+		goto out;
+	}
+
+	if (cl.flags & SEF_UNWRITTEN) {
+		if (!(cl.flags & SEF_OFFLINE))
+			goto done;
+		cl.map = 0;
+		cl.flags = SEF_OFFLINE;
+	}
+
+	if (cl.map) {
+		len = adjust_shared_refs(sb, cl.map, cl.len, 1, &free,
+					 shared_lock);
+		if (len < 0) {
+			ret = len;
+			goto out;
+		}
+		cl.len = len;
+
+		if (!(cl.flags & SEF_SHARED)) {
+			ret = scoutfs_extent_remove(sb, data_extent_io, &cl,
+						    src_lock);
+			if (ret)
+				goto out;
+			add_cl = true;
+
+			shr = cl;
+			shr.flags |= SEF_SHARED;
+			ret = scoutfs_extent_add(sb, data_extent_io, &shr,
+						 src_lock);
+			if (ret)
+				goto out;
+			rem_shr = true;
+		}
+	}
+
+	scoutfs_extent_init(&add, SCOUTFS_FILE_EXTENT_TYPE, scoutfs_ino(dst),
+			    dst_start + (cl.start - src_start), cl.len, cl.map,
+			    cl.flags | (cl.map ? SEF_SHARED : 0));
+	ret = scoutfs_extent_add(sb, data_extent_io, &add, dst_lock);
+	if (ret)
+		goto out;
+
+	set_extents_end(dst, add.start);
+	scoutfs_inode_add_onoff(dst, cl.map ? cl.len : 0,
+				(cl.flags & SEF_OFFLINE) ? cl.len : 0);
+	scoutfs_add_counter(sb, data_clone_blocks, cl.len);
+done:
+	ret = cl.start + cl.len;
+out:
+	scoutfs_extent_cleanup(ret < 0 && rem_shr, scoutfs_extent_remove, sb,
+			       data_extent_io, &shr, src_lock,
+			       SC_DATA_EXTENT_CLONE_CLEANUP,
+			       corrupt_data_extent_clone_cleanup, &cl);
+	scoutfs_extent_cleanup(ret < 0 && add_cl, scoutfs_extent_add, sb,
+			       data_extent_io, &cl, src_lock,
+			       SC_DATA_EXTENT_CLONE_CLEANUP,
+			       corrupt_data_extent_clone_cleanup, &cl);
+
+	return ret;
+}
+
+/*
+ * Clone 'count' blocks of file extents from the source file to the
+ * destination file.  The destination range must not have any extents.
+ *
+ * The caller holds the inode locks and the shared extent lock and is
+ * responsible for writing and invalidating cached pages in both
+ * ranges.  The range is cloned in pieces that don't cross the data
+ * regions of either file.  We lock the regions of each piece, in inode
+ * number order, and batch the modifications into transactions and
+ * update the destination inode item as we go.
+ */
+int scoutfs_data_clone(struct inode *src, struct inode *dst, u64 src_iblock,
+		       u64 dst_iblock, u64 count,
+		       struct scoutfs_lock *src_lock,
+		       struct scoutfs_lock *dst_lock,
+		       struct scoutfs_lock *shared_lock)
+{
+	struct scoutfs_item_count cnt = SIC_CLONE_EXTENTS(CLONE_CHUNK_EXTENTS);
+	struct scoutfs_inode_info *src_si = SCOUTFS_I(src);
+	struct scoutfs_inode_info *dst_si = SCOUTFS_I(dst);
+	struct super_block *sb = src->i_sb;
+	const u64 last = src_iblock + count - 1;
+	struct scoutfs_lock *src_rlock = NULL;
+	struct scoutfs_lock *dst_rlock = NULL;
+	struct scoutfs_lock **first_rlock;
+	struct scoutfs_lock **second_rlock;
+	struct inode *first;
+	struct inode *second;
+	u64 iblock = src_iblock;
+	u64 first_iblock;
+	u64 second_iblock;
+	u64 dst_block;
+	u64 plast;
+	LIST_HEAD(ind_locks);
+	bool done = false;
+	unsigned int nr;
+	s64 ret = 0;
+
+	if (WARN_ON_ONCE(src == dst) || count == 0 ||
+	    last < src_iblock || last > SCOUTFS_BLOCK_MAX ||
+	    dst_iblock + count - 1 < dst_iblock ||
+	    dst_iblock + count - 1 > SCOUTFS_BLOCK_MAX)
+		return -EINVAL;
+
+	if (scoutfs_ino(src) < scoutfs_ino(dst)) {
+		first = src;
+		first_rlock = &src_rlock;
+		second = dst;
+		second_rlock = &dst_rlock;
+	} else {
+		first = dst;
+		first_rlock = &dst_rlock;
+		second = src;
+		second_rlock = &src_rlock;
+	}
+
+	while (iblock <= last) {
+		if (iblock >= src_si->extents_end)
+			break;
+
+		/* the piece can't cross a region in either file */
+		dst_block = dst_iblock + (iblock - src_iblock);
+		plast = min3(last, region_last(iblock),
+			     iblock + (region_last(dst_block) - dst_block));
+
+		first_iblock = first == src ? iblock : dst_block;
+		second_iblock = second == src ? iblock : dst_block;
+		ret = scoutfs_lock_data_region(sb, DLM_LOCK_EX, 0,
+					       scoutfs_ino(first),
+					       first_iblock, first_rlock) ?:
+		      scoutfs_lock_data_region(sb, DLM_LOCK_EX, 0,
+					       scoutfs_ino(second),
+					       second_iblock, second_rlock);
+
+		done = false;
+		while (ret == 0 && !done) {
+			ret = scoutfs_inode_index_lock_hold(dst, &ind_locks,
+							    true, cnt);
+			if (ret)
+				break;
+
+			ret = scoutfs_dirty_inode_item(dst, dst_lock);
+
+			mutex_lock(&src_si->extent_mutex);
+			mutex_lock_nested(&dst_si->extent_mutex,
+					  SINGLE_DEPTH_NESTING);
+			for (nr = 0; ret == 0 && !done &&
+			     nr < CLONE_CHUNK_EXTENTS; nr++) {
+				ret = clone_one_extent(sb, src, dst, iblock,
+						       plast, src_iblock,
+						       dst_iblock, src_rlock,
+						       dst_rlock, shared_lock);
+				if (ret > 0) {
+					iblock = ret;
+					ret = 0;
+					done = iblock > plast;
+				} else if (ret == 0) {
+					done = true;
+				}
+			}
+			invalidate_extent_cache(dst);
+			mutex_unlock(&dst_si->extent_mutex);
+			invalidate_extent_cache(src);
+			mutex_unlock(&src_si->extent_mutex);
+
+			scoutfs_update_inode_item(dst, dst_lock, &ind_locks);
+			scoutfs_release_trans(sb);
+			scoutfs_inode_index_unlock(sb, &ind_locks);
+
+			if (ret < 0)
+				break;
+		}
+
+		scoutfs_unlock(sb, *second_rlock, DLM_LOCK_EX);
+		scoutfs_unlock(sb, *first_rlock, DLM_LOCK_EX);
+		src_rlock = NULL;
+		dst_rlock = NULL;
+
+		if (ret < 0 || plast == last)
+			break;
+		iblock = plast + 1;
+	}
+
+	return ret;
+}
+
+/*
+ * Apply the next of our pending releases of references to shared
+ * blocks, freeing blocks whose last reference is dropped.  Returns 1
+ * if a release was applied and 0 if there are none left.
+ */
+static int apply_shared_release(struct super_block *sb,
+				struct scoutfs_lock *shared_lock)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	DECLARE_DATA_INFO(sb, datinf);
+	struct scoutfs_shared_release srel;
+	struct scoutfs_extent fr;
+	struct scoutfs_key last;
+	struct scoutfs_key key;
+	struct kvec val;
+	bool free;
+	u64 blkno;
+	u64 len;
+	s64 ret;
+
+	init_shared_release_key(&key, sbi->node_id, 0);
+	init_shared_release_key(&last, sbi->node_id, U64_MAX);
+	kvec_init(&val, &srel, sizeof(srel));
+
+	ret = scoutfs_item_next(sb, &key, &last, &val, sbi->node_id_lock);
+	if (ret == -ENOENT)
+		return 0;
+	if (ret >= 0 && ret != sizeof(srel))
+		ret = -EIO;
+	if (ret < 0)
+		return ret;
+
+	blkno = le64_to_cpu(srel.blkno);
+	len = le64_to_cpu(srel.len);
+
+	ret = adjust_shared_refs(sb, blkno, len, -1, &free, shared_lock);
+	if (ret < 0)
+		return ret;
+
+	if (free) {
+		scoutfs_extent_init(&fr, SCOUTFS_FREE_EXTENT_BLKNO_TYPE,
+				    sbi->node_id, blkno, ret, 0, 0);
+		ret = scoutfs_extent_add(sb, data_extent_io, &fr,
+					 sbi->node_id_lock);
+		if (ret < 0)
+			return ret;
+		scoutfs_add_counter(sb, data_shared_free_blocks, fr.len);
+		ret = fr.len;
+	}
+
+	if (ret == len) {
+		ret = scoutfs_item_delete(sb, &key, sbi->node_id_lock);
+	} else {
+		srel.blkno = cpu_to_le64(blkno + ret);
+		srel.len = cpu_to_le64(len - ret);
+		ret = scoutfs_item_update(sb, &key, &val, sbi->node_id_lock);
+	}
+
+	if (free && (atomic64_read(&datinf->node_free_blocks) >
+		     free_high_water(datinf)))
+		queue_work(datinf->workq, &datinf->return_work);
+
+	return ret ?: 1;
+}
+
+/*
+ * Apply all of our pending releases.  The shared extent lock can't be
+ * acquired while holding a transaction so writers and truncation queue
+ * us to do it for them.
+ */
+static void scoutfs_data_shared_release_worker(struct work_struct *work)
+{
+	struct data_info *datinf = container_of(work, struct data_info,
+						release_work);
+	struct super_block *sb = datinf->sb;
+	struct scoutfs_lock *lock = NULL;
+	unsigned int nr;
+	int ret;
+
+	ret = scoutfs_lock_shared_extents(sb, DLM_LOCK_EX, 0, &lock);
+	if (ret)
+		goto out;
+
+	do {
+		ret = scoutfs_hold_trans(sb,
+					 SIC_SHARED_RELEASE(SHARED_RELEASE_CHUNK));
+		if (ret)
+			break;
+
+		down_write(&datinf->alloc_rwsem);
+		for (nr = 0; nr < SHARED_RELEASE_CHUNK; nr++) {
+			ret = apply_shared_release(sb, lock);
+			if (ret <= 0)
+				break;
+		}
+		up_write(&datinf->alloc_rwsem);
+
+		scoutfs_release_trans(sb);
+	} while (ret > 0);
+
+	scoutfs_unlock(sb, lock, DLM_LOCK_EX);
+out:
+	if (ret < 0)
+		scoutfs_err(sb, "error %d applying shared block releases", ret);
+}
+
+/*
+ * Start applying any pending shared block releases left by a previous
+ * mount.
+ */
+void scoutfs_data_apply_shared_releases(struct super_block *sb)
+{
+	DECLARE_DATA_INFO(sb, datinf);
+
+	queue_work(datinf->workq, &datinf->release_work);
+}
+
+/*
+ * Size the next grant so that it would have lasted for a grant interval
+ * at the rate that we've allocated since the previous grant.  The rate
+ * is averaged with the previous grant so that brief bursts or pauses
+ * don't swing the size too far.  We only ask for the minimum while the
+ * server is low on free space.  The caller holds alloc_rwsem.
+ */
+static u64 next_grant_blocks(struct data_info *datinf)
+{
+	unsigned long elapsed;
+	u64 blocks;
+
+	if (server_pressure(datinf))
+		return SERVER_ALLOC_MIN_BLOCKS;
+
+	elapsed = max(jiffies - datinf->grant_jiffies, 1UL);
+	blocks = div64_u64(atomic64_read(&datinf->alloc_since_grant) *
+			   SERVER_GRANT_INTERVAL, elapsed);
+	blocks = (blocks + datinf->grant_blocks) / 2;
+	blocks = ALIGN(blocks, SCOUTFS_SEGMENT_BLOCKS);
+
+	return clamp_t(u64, blocks, SERVER_ALLOC_MIN_BLOCKS,
+		       SERVER_ALLOC_MAX_BLOCKS);
+}
+
+/*
+ * Ask the server for a free extent of at most @blocks and add it to our
+ * free extent items.  We hint that we'd like it to follow our previous
+ * grant so that a node's allocations, and the files it writes, tend to
+ * be contiguous.
+ */
+static int add_server_extent(struct super_block *sb, u64 blocks)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	DECLARE_DATA_INFO(sb, datinf);
+	struct scoutfs_extent ext;
+	u64 start;
+	u64 len;
+	int ret;
+
+	ret = scoutfs_client_alloc_extent(sb, blocks, datinf->grant_hint,
+					  &start, &len);
+	if (ret)
+		return ret;
+
+	datinf->grant_hint = start + len;
+
+	scoutfs_extent_init(&ext, SCOUTFS_FREE_EXTENT_BLKNO_TYPE,
+			    sbi->node_id, start, len, 0, 0);
+	trace_scoutfs_data_get_server_extent(sb, &ext);
+	/* XXX don't free extent on error, crash recovery with server */
+	return scoutfs_extent_add(sb, data_extent_io, &ext, sbi->node_id_lock);
+}
+
+/*
+ * Ask the server for another grant of free blocks sized by our recent
+ * allocation rate.
+ */
+static int get_server_extent(struct super_block *sb)
+{
+	DECLARE_DATA_INFO(sb, datinf);
+	u64 blocks;
+	int ret;
+
+	blocks = next_grant_blocks(datinf);
+
+	ret = add_server_extent(sb, blocks);
+	if (ret == 0) {
+		datinf->grant_blocks = blocks;
+		datinf->grant_jiffies = jiffies;
+		atomic64_set(&datinf->alloc_since_grant, 0);
+		scoutfs_inc_counter(sb, data_server_grant);
+	}
+
+	return ret;
+}
+
+/*
+ * Find the first of our free extents with at least @len blocks, or the
+ * last largest smaller extent.  The caller's extent is set to a
+ * _BLKNO_TYPE extent of at most @len blocks.  No stored extents are
+ * modified.
+ */
+static int next_free_extent(struct super_block *sb, u64 len,
+			    struct scoutfs_extent *ext)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	int ret;
+
+	scoutfs_extent_init(ext, SCOUTFS_FREE_EXTENT_BLOCKS_TYPE,
+			    sbi->node_id, 0, len, 0, 0);
+	ret = scoutfs_extent_next(sb, data_extent_io, ext, sbi->node_id_lock);
+	if (ret == -ENOENT && len > 1)
+		ret = scoutfs_extent_prev(sb, data_extent_io, ext,
 					  sbi->node_id_lock);
+	if (ret == 0)
+		scoutfs_extent_init(ext, SCOUTFS_FREE_EXTENT_BLKNO_TYPE,
+				    sbi->node_id, ext->start,
+				    min(ext->len, len), 0, 0);
+	return ret;
+}
+
+/*
+ * Find a free extent to satisfy an allocation of at most @len blocks.
+ *
+ * Returns 0 and fills the caller's extent with a _BLKNO_TYPE extent if
+ * we found a match.  It's len may be less than desired.  No stored
+ * extents have been modified.
+ *
+ * Returns -errno on error and -ENOSPC if no free extents were found.
+ *
+ * The caller's extent is always clobbered.
+ */
+static int find_free_extent(struct super_block *sb, u64 len,
+			    struct scoutfs_extent *ext)
+{
+	DECLARE_DATA_INFO(sb, datinf);
+	int ret;
+
+	len = min(len, MAX_EXTENT_BLOCKS);
+
+	for (;;) {
+		ret = next_free_extent(sb, len, ext);
+
+		/* ask the server for more if we think it'll help */
+		if (ret == -ENOENT || ext->len < len) {
+			ret = get_server_extent(sb);
+			if (ret == 0)
+				continue;
+		}
+
+		/* use the extent we found or return errors */
+		break;
+	}
+
+	if (ret == 0)
+		atomic64_add(ext->len, &datinf->alloc_since_grant);
+
+	trace_scoutfs_data_find_free_extent(sb, ext);
+	return ret;
+}
+
+/*
+ * Find a free extent that contains the goal or that starts shortly
+ * after it.  The caller's extent is set to a _BLKNO_TYPE extent of at
+ * most @len blocks starting from the goal.  Returns -ENOENT if there's
+ * no free extent near the goal.
+ */
+static int goal_free_extent(struct super_block *sb, u64 len, u64 goal,
+			    struct scoutfs_extent *ext)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	DECLARE_DATA_INFO(sb, datinf);
+	u64 start;
+	int ret;
+
+	len = min(len, MAX_EXTENT_BLOCKS);
+
+	scoutfs_extent_init(ext, SCOUTFS_FREE_EXTENT_BLKNO_TYPE,
+			    sbi->node_id, goal, 1, 0, 0);
+	ret = scoutfs_extent_next(sb, data_extent_io, ext, sbi->node_id_lock);
+	if (ret < 0)
+		return ret;
+
+	start = max(ext->start, goal);
+	if (start - goal > ALLOC_GOAL_NEAR_BLOCKS)
+		return -ENOENT;
+
+	scoutfs_extent_init(ext, SCOUTFS_FREE_EXTENT_BLKNO_TYPE, sbi->node_id,
+			    start, min(len, ext->start + ext->len - start),
+			    0, 0);
+	atomic64_add(ext->len, &datinf->alloc_since_grant);
+	return 0;
+}
+
+static u64 get_dir_goal(struct data_info *datinf, u64 dir_ino)
+{
+	unsigned int h = hash_64(dir_ino, ALLOC_STREAM_BITS);
+	u64 goal = 0;
+
+	spin_lock(&datinf->dir_goal_lock);
+	if (dir_ino && datinf->dir_goal_inos[h] == dir_ino)
+		goal = datinf->dir_goals[h];
+	spin_unlock(&datinf->dir_goal_lock);
+
+	return goal;
+}
+
+static void set_dir_goal(struct data_info *datinf, u64 dir_ino, u64 goal)
+{
+	unsigned int h = hash_64(dir_ino, ALLOC_STREAM_BITS);
+
+	if (dir_ino == 0)
+		return;
+
+	spin_lock(&datinf->dir_goal_lock);
+	datinf->dir_goal_inos[h] = dir_ino;
+	datinf->dir_goals[h] = goal;
+	spin_unlock(&datinf->dir_goal_lock);
+}
+
+/*
+ * Files prefer to allocate the blocks that follow the extent that maps
+ * their previous logical block.  The goal is only a hint so errors
+ * just mean that there's no goal.
+ */
+static u64 file_alloc_goal(struct super_block *sb, struct inode *inode,
+			   u64 iblock, struct scoutfs_lock *lock)
+{
+	struct scoutfs_extent ext;
+
+	if (iblock == 0)
+		return 0;
+
+	scoutfs_extent_init(&ext, SCOUTFS_FILE_EXTENT_TYPE, scoutfs_ino(inode),
+			    iblock - 1, 1, 0, 0);
+	if (scoutfs_extent_next(sb, data_extent_io, &ext, lock) == 0 &&
+	    ext.start < iblock && ext.map)
+		return ext.map + (iblock - ext.start);
+
+	return 0;
+}
+
+/*
+ * Return a pool's remaining blocks to the node's free extent items.
+ * The caller holds the pool's mutex and the transaction.
+ */
+static int drain_pool(struct super_block *sb, struct data_pool *pool)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	DECLARE_DATA_INFO(sb, datinf);
+	struct scoutfs_extent fr;
+	int ret;
+
+	if (pool->len == 0)
+		return 0;
+
+	scoutfs_extent_init(&fr, SCOUTFS_FREE_EXTENT_BLKNO_TYPE,
+			    sbi->node_id, pool->start, pool->len, 0, 0);
+	trace_scoutfs_data_drain_pool(sb, &fr);
+
+	down_write(&datinf->alloc_rwsem);
+	ret = scoutfs_extent_add(sb, data_extent_io, &fr, sbi->node_id_lock);
+	up_write(&datinf->alloc_rwsem);
+	if (ret == 0) {
+		atomic64_sub(pool->len, &datinf->pool_blocks);
+		pool->start = 0;
+		pool->len = 0;
+	}
+
+	return ret;
+}
+
+/*
+ * Fill an empty pool with a free extent large enough for the caller's
+ * allocation, preferring free blocks at the goal.  The commit will
+ * return whatever is left in the pool to the free extent items so we
+ * reserve room for that in the transaction.
+ */
+static int fill_pool(struct super_block *sb, struct data_pool *pool, u64 len,
+		     u64 goal)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	DECLARE_DATA_INFO(sb, datinf);
+	struct scoutfs_extent fr;
+	int ret = -ENOENT;
+
+	down_write(&datinf->alloc_rwsem);
+	if (goal) {
+		ret = goal_free_extent(sb, max(len, POOL_BLOCKS), goal, &fr);
+		if (ret == 0)
+			scoutfs_inc_counter(sb, data_alloc_goal_hit);
+		else if (ret == -ENOENT)
+			scoutfs_inc_counter(sb, data_alloc_goal_miss);
+	}
+	if (ret == -ENOENT)
+		ret = find_free_extent(sb, max(len, POOL_BLOCKS), &fr);
+	if (ret == 0)
+		ret = scoutfs_extent_remove(sb, data_extent_io, &fr,
+					    sbi->node_id_lock);
+	up_write(&datinf->alloc_rwsem);
+	if (ret)
+		return ret;
+
+	trace_scoutfs_data_fill_pool(sb, &fr);
+	scoutfs_inc_counter(sb, data_pool_fill);
+
+	pool->start = fr.start;
+	pool->len = fr.len;
+	atomic64_add(fr.len, &datinf->pool_blocks);
+	scoutfs_trans_add_delayed(sb, SIC_DRAIN_POOL());
+
+	return 0;
+}
+
+/*
+ * Allocate up to len free blocks for the given file blocks from the
+ * pool of the file's stream.  Writers of different files don't contend
+ * on the node's free extent items and don't interleave their
+ * allocations.
+ *
+ * The pool is refilled when it belongs to another file or doesn't
+ * continue the file's previous extent, and allocations that don't fit
+ * in what's left of a pool that isn't at the goal refill it so that
+ * they get a contiguous extent.  Refilling prefers free blocks at the
+ * goal, or near the recent allocations in the directory of a new file.
+ *
+ * The allocated blocks are no longer stored in free extent items.  The
+ * caller has to store them in a file extent or return them with
+ * add_free_extent.
+ */
+static int alloc_pool_blocks(struct super_block *sb, struct inode *inode,
+			     u64 iblock, u64 len, struct scoutfs_extent *ext,
+			     struct scoutfs_lock *lock)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	u64 dir_ino = SCOUTFS_I(inode)->alloc_dir_ino;
+	const u64 ino = scoutfs_ino(inode);
+	DECLARE_DATA_INFO(sb, datinf);
+	struct data_pool *pool;
+	u64 goal;
+	int ret = 0;
+
+	len = min(len, MAX_EXTENT_BLOCKS);
+	pool = &datinf->pools[hash_64(ino, ALLOC_STREAM_BITS)];
+	goal = file_alloc_goal(sb, inode, iblock, lock);
+
+	mutex_lock(&pool->mutex);
+
+	if (pool->ino != ino || pool->len == 0 ||
+	    (goal ? pool->start != goal : pool->len < len)) {
+		if (goal == 0)
+			goal = get_dir_goal(datinf, dir_ino);
+		ret = drain_pool(sb, pool) ?:
+		      fill_pool(sb, pool, len, goal);
+		if (ret)
+			goto out;
+		pool->ino = ino;
+		set_dir_goal(datinf, dir_ino, pool->start + pool->len);
+	}
+
+	scoutfs_extent_init(ext, SCOUTFS_FREE_EXTENT_BLKNO_TYPE, sbi->node_id,
+			    pool->start, min(len, pool->len), 0, 0);
+	pool->start += ext->len;
+	pool->len -= ext->len;
+	atomic64_sub(ext->len, &datinf->pool_blocks);
+out:
+	mutex_unlock(&pool->mutex);
+	return ret;
+}
+
+/* cleanup function that returns pool blocks to the free extent items */
+static int add_free_extent(struct super_block *sb, scoutfs_extent_io_t iof,
+			   struct scoutfs_extent *ext, void *data)
+{
+	DECLARE_DATA_INFO(sb, datinf);
+	int ret;
+
+	down_write(&datinf->alloc_rwsem);
+	ret = scoutfs_extent_add(sb, iof, ext, data);
+	up_write(&datinf->alloc_rwsem);
+
+	return ret;
+}
+
+/*
+ * The commit returns all the blocks remaining in pools to the free
+ * extent items so that each transaction's free extents are consistent
+ * with its file extents.  The pools are refilled by the next
+ * allocations.  This is called from the commit after writeback has
+ * allocated delayed blocks.
+ */
+int scoutfs_data_drain_pools(struct super_block *sb)
+{
+	DECLARE_DATA_INFO(sb, datinf);
+	struct data_pool *pool;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < ALLOC_STREAM_NR; i++) {
+		pool = &datinf->pools[i];
+
+		mutex_lock(&pool->mutex);
+		ret = drain_pool(sb, pool);
+		mutex_unlock(&pool->mutex);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+/*
+ * The caller is writing to a logical block that doesn't have an
+ * allocated extent.
+ *
+ * We always allocate an extent starting at the logical block.  The
+ * caller has considered overlapping and following extents and has given
+ * us a maximum length that we could safely allocate.  Preallocation
+ * heuristics decide to use this length or only a single block.
+ *
+ * If the caller passes in an existing extent then we remove the
+ * allocated region from the existing extent.  We then add a single
+ * block extent for the caller to write into.  Then if we allocated
+ * multiple blocks we add an unwritten extent for the rest of the blocks
+ * in the extent.
+ *
+ * Preallocation is used if we're strictly contiguously extending
+ * writes.  That is, if the logical block offset equals the number of
+ * online blocks.  We try to preallocate the number of blocks existing
+ * so that small files don't waste inordinate amounts of space and large
+ * files will eventually see large extents.  This only works for
+ * contiguous single stream writes or stages of files from the first
+ * block.  It doesn't work for concurrent stages, releasing behind
+ * staging, sparse files, multi-node writes, etc.  fallocate() is always
+ * a better tool to use.
+ *
+ * We can preallocate fewer blocks than we asked for if we don't find a
+ * large enough free extent.
+ *
+ * On success we update the caller's extent to the single block
+ * allocated extent for the logical block for use in block mapping.
+ */
+static int alloc_block(struct super_block *sb, struct inode *inode,
+		       struct scoutfs_extent *ext, u64 iblock, u64 len,
+		       struct scoutfs_lock *lock)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	const u64 ino = scoutfs_ino(inode);
+	struct scoutfs_extent unwr;
+	struct scoutfs_extent old;
+	struct scoutfs_extent blk;
+	struct scoutfs_extent fr;
+	bool add_old = false;
+	bool add_fr = false;
+	bool rem_blk = false;
+	u64 offline;
+	u64 online;
+	int ret;
+
+	scoutfs_inode_get_onoff(inode, &online, &offline);
+
+	/* strictly contiguous extending writes will try to preallocate */ 
+	if (iblock > 1 && iblock == online)
+		len = min3(len, iblock, region_last(iblock) - iblock + 1);
+	else
+		len = 1;
+
+	trace_scoutfs_data_alloc_block(sb, inode, ext, iblock, len,
+				       online, offline);
+
+	ret = alloc_pool_blocks(sb, inode, iblock, len, &fr, lock);
+	if (ret < 0)
+		goto out;
+	add_fr = true;
+
+	trace_scoutfs_data_alloc_block_next(sb, &fr);
+
+	/* we might have found a smaller free extent */
+	len = fr.len;
+
+	/* initialize the new mapped block extent, referenced by cleanup */
+	scoutfs_extent_init(&blk, SCOUTFS_FILE_EXTENT_TYPE, ino,
+			    iblock, 1, fr.start, 0);
+
+	/* remove an existing offline or unwritten block extent */
+	if (ext->flags) {
+		scoutfs_extent_init(&old, SCOUTFS_FILE_EXTENT_TYPE, ino,
+				    iblock, len, 0, ext->flags);
+		ret = scoutfs_extent_remove(sb, data_extent_io, &old, lock);
+		if (ret)
+			goto out;
+		add_old = true;
+	}
+
+	/* add the block that the caller is writing */
+	ret = scoutfs_extent_add(sb, data_extent_io, &blk, lock);
+	if (ret)
+		goto out;
+	rem_blk = true;
+
+	/* and maybe add the remaining unwritten extent */
+	if (len > 1) {
+		scoutfs_extent_init(&unwr, SCOUTFS_FILE_EXTENT_TYPE, ino,
+				    iblock + 1, len - 1, fr.start + 1,
+				    ext->flags | SEF_UNWRITTEN);
+		ret = scoutfs_extent_add(sb, data_extent_io, &unwr, lock);
+		if (ret)
+			goto out;
+	}
+
+	add_write_onoff(inode, 1, (ext->flags & SEF_OFFLINE) ? -1ULL : 0);
+	ret = 0;
+out:
+	scoutfs_extent_cleanup(ret < 0 && rem_blk, scoutfs_extent_remove, sb,
+			       data_extent_io, &blk, lock,
+			       SC_DATA_EXTENT_ALLOC_CLEANUP,
+			       corrupt_data_extent_alloc_cleanup, &blk);
+	scoutfs_extent_cleanup(ret < 0 && add_old, scoutfs_extent_add, sb,
+			       data_extent_io, &old, lock,
+			       SC_DATA_EXTENT_ALLOC_CLEANUP,
+			       corrupt_data_extent_alloc_cleanup, &blk);
+	scoutfs_extent_cleanup(ret < 0 && add_fr, add_free_extent, sb,
+			       data_extent_io, &fr, sbi->node_id_lock,
+			       SC_DATA_EXTENT_ALLOC_CLEANUP,
+			       corrupt_data_extent_alloc_cleanup, &blk);
+
+	invalidate_extent_cache(inode);
+
+	trace_scoutfs_data_alloc_block_ret(sb, ext, ret);
+	if (ret == 0)
+		*ext = blk;
+	return ret;
+}
+
+/*
+ * A caller is writing into unwritten allocated space.  This can also be
+ * called for staging writes so we clear both the unwritten and offline
+ * flags.  The caller records the blocks as online when they're written
+ * so that writeback's conversion doesn't change the inode's counts.
+ *
+ * We don't have to wait for dirty block IO to complete before clearing
+ * the unwritten flag in metadata because we have strict synchronization
+ * between data and metadata.  All dirty data in the current transaction
+ * is written before the metadata in the transaction that references it
+ * is committed.
+ */
+static int convert_unwritten(struct super_block *sb, struct inode *inode,
+			     struct scoutfs_extent *ext, u64 start, u64 len,
+			     struct scoutfs_lock *lock)
+{
+	struct scoutfs_extent conv;
+	int err;
+	int ret;
+
+	if (WARN_ON_ONCE(!ext->map) ||
+	    WARN_ON_ONCE(!(ext->flags & SEF_UNWRITTEN)))
+		return -EINVAL;
+
+	scoutfs_extent_init(&conv, ext->type, ext->owner, start, len,
+			    ext->map + (start - ext->start), ext->flags);
+	ret = scoutfs_extent_remove(sb, data_extent_io, &conv, lock);
+	if (ret)
+		goto out;
+
+	conv.flags &= ~(SEF_UNWRITTEN | SEF_OFFLINE);
+	ret = scoutfs_extent_add(sb, data_extent_io, &conv, lock);
+	if (ret) {
+		conv.flags = ext->flags;
+		err = scoutfs_extent_add(sb, data_extent_io, &conv, lock);
+		BUG_ON(err);
+		goto out;
+	}
+
+	*ext = conv;
+	ret = 0;
+out:
+	invalidate_extent_cache(inode);
+	return ret;
+}
+
+/*
+ * Copy file data between blocks on the device.  All the blocks are
+ * read and then written with one multi-block io each.
+ */
+static int copy_blocks(struct super_block *sb, u64 from, u64 to, u64 len)
+{
+	unsigned int nr_pages = DIV_ROUND_UP(len, SCOUTFS_BLOCKS_PER_PAGE);
+	struct page **pages;
+	unsigned int i;
+	int ret;
+
+	pages = kcalloc(nr_pages, sizeof(pages[0]), GFP_NOFS);
+	if (!pages)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_pages; i++) {
+		pages[i] = alloc_page(GFP_NOFS);
+		if (!pages[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	ret = scoutfs_bio_read(sb, pages, from, len) ?:
+	      scoutfs_bio_write(sb, pages, to, len);
+out:
+	for (i = 0; i < nr_pages && pages[i]; i++)
+		__free_page(pages[i]);
+	kfree(pages);
+	return ret;
+}
+
+/*
+ * The caller is writing to blocks that are shared with other files.  We
+ * copy the blocks to a new allocation, remap our file extent to the
+ * copy, and drop our reference to the shared blocks.  The copy is
+ * synchronous so that the caller can read partially written blocks
+ * from the new mapping.
+ *
+ * We copy up to UNSHARE_MAX_BLOCKS of the rest of the shared extent,
+ * not just the caller's block.  Cached pages of the following blocks
+ * can be left with buffers mapped to the old shared blocks.  They have
+ * the same contents and writers unmap them before they're dirtied.
+ *
+ * We can copy fewer blocks if we don't find a large enough free extent.
+ */
+static int unshare_blocks(struct super_block *sb, struct inode *inode,
+			  struct scoutfs_extent *ext, u64 iblock,
+			  struct scoutfs_lock *lock)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	const u64 ino = scoutfs_ino(inode);
+	struct scoutfs_extent old;
+	struct scoutfs_extent new;
+	struct scoutfs_extent fr;
+	bool add_fr = false;
+	bool add_old = false;
+	bool rem_new = false;
+	u64 rel_id;
+	u64 off;
+	u64 nr;
+	int ret;
+
+	off = iblock - ext->start;
+	nr = min_t(u64, UNSHARE_MAX_BLOCKS, ext->len - off);
+
+	ret = alloc_pool_blocks(sb, inode, iblock, nr, &fr, lock);
+	if (ret < 0)
+		goto out;
+	add_fr = true;
+	nr = fr.len;
+
+	scoutfs_extent_init(&old, SCOUTFS_FILE_EXTENT_TYPE, ino, iblock, nr,
+			    ext->map + off, ext->flags);
+	scoutfs_extent_init(&new, SCOUTFS_FILE_EXTENT_TYPE, ino, iblock, nr,
+			    fr.start, ext->flags & ~SEF_SHARED);
+
+	ret = copy_blocks(sb, old.map, new.map, nr);
+	if (ret)
+		goto out;
+
+	ret = scoutfs_extent_remove(sb, data_extent_io, &old, lock);
+	if (ret)
+		goto out;
+	add_old = true;
+
+	ret = scoutfs_extent_add(sb, data_extent_io, &new, lock);
+	if (ret)
+		goto out;
+	rem_new = true;
+
+	ret = add_shared_release(sb, old.map, nr, &rel_id);
+	if (ret)
+		goto out;
+
+	scoutfs_add_counter(sb, data_unshare_blocks, nr);
+out:
+	scoutfs_extent_cleanup(ret < 0 && rem_new, scoutfs_extent_remove, sb,
+			       data_extent_io, &new, lock,
+			       SC_DATA_EXTENT_ALLOC_CLEANUP,
+			       corrupt_data_extent_alloc_cleanup, &new);
+	scoutfs_extent_cleanup(ret < 0 && add_old, scoutfs_extent_add, sb,
+			       data_extent_io, &old, lock,
+			       SC_DATA_EXTENT_ALLOC_CLEANUP,
+			       corrupt_data_extent_alloc_cleanup, &new);
+	scoutfs_extent_cleanup(ret < 0 && add_fr, add_free_extent, sb,
+			       data_extent_io, &fr, sbi->node_id_lock,
+			       SC_DATA_EXTENT_ALLOC_CLEANUP,
+			       corrupt_data_extent_alloc_cleanup, &new);
+
+	invalidate_extent_cache(inode);
+
+	if (ret == 0)
+		*ext = new;
+	return ret;
+}
+
+/*
+ * Clear the shared flag on the file extents in the caller's range
+ * whose blocks no longer have a reference count item.  The other
+ * references to the blocks have been released so the blocks can be
+ * written in place instead of being copied.
+ *
+ * There's no mapping from blocks to the file extents that reference
+ * them so releasing can't find the surviving extent when it deletes
+ * the reference count item.  Instead writers check the shared extents
+ * they're about to write.  This is called before the writer's
+ * transaction because the shared extent lock is acquired before
+ * holding transactions.  Files without shared extents only pay for
+ * the extent search.
+ */
+static int clear_unshared_extents(struct inode *inode, u64 iblock,
+				  u64 last, struct scoutfs_lock *lock)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_lock *shared_lock = NULL;
+	struct scoutfs_extent ext;
+	struct scoutfs_extent clr;
+	bool shared = false;
+	u64 start;
+	u64 len;
+	u64 refs;
+	u64 pos;
+	int err;
+	int ret;
+
+	for (pos = iblock; pos <= last && !shared; pos = ext.start + ext.len) {
+		ret = file_extent_next(inode, pos, &ext, lock);
+		if (ret == -ENOENT || (ret == 0 && ext.start > last))
+			break;
+		if (ret < 0)
+			return ret;
+		shared = ext.map && (ext.flags & SEF_SHARED);
+	}
+	if (!shared)
+		return 0;
+
+	ret = scoutfs_lock_shared_extents(sb, DLM_LOCK_PR, 0, &shared_lock);
+	if (ret)
+		return ret;
+
+	ret = scoutfs_hold_trans(sb, SIC_CLEAR_SHARED(last - iblock + 1));
+	if (ret)
+		goto unlock;
+
+	mutex_lock(&si->extent_mutex);
+	for (pos = iblock; pos <= last; pos = clr.start + clr.len) {
+		ret = file_extent_next(inode, pos, &ext, lock);
+		if (ret == -ENOENT) {
+			ret = 0;
+			break;
+		}
+		if (ret < 0)
+			break;
+
+		scoutfs_extent_init(&clr, SCOUTFS_FILE_EXTENT_TYPE,
+				    scoutfs_ino(inode), pos, last - pos + 1,
+				    0, 0);
+		if (!scoutfs_extent_intersection(&clr, &ext))
+			break;
+		if (!clr.map || !(clr.flags & SEF_SHARED))
+			continue;
+
+		ret = shared_extent_next(sb, clr.map, &start, &len, &refs,
+					 shared_lock);
+		if (ret < 0 && ret != -ENOENT)
+			break;
+
+		/* skip blocks that are still shared */
+		if (ret == 0 && start <= clr.map) {
+			clr.len = min(clr.len, start + len - clr.map);
+			continue;
+		}
+		if (ret == 0)
+			clr.len = min(clr.len, start - clr.map);
+
+		ret = scoutfs_extent_remove(sb, data_extent_io, &clr, lock);
+		if (ret)
+			break;
+
+		clr.flags &= ~SEF_SHARED;
+		ret = scoutfs_extent_add(sb, data_extent_io, &clr, lock);
+		if (ret) {
+			clr.flags |= SEF_SHARED;
+			err = scoutfs_extent_add(sb, data_extent_io, &clr,
+						 lock);
+			BUG_ON(err);
+			break;
+		}
+
+		scoutfs_add_counter(sb, data_unshared_clear_blocks, clr.len);
+		invalidate_extent_cache(inode);
+	}
+	invalidate_extent_cache(inode);
+	mutex_unlock(&si->extent_mutex);
+
+	scoutfs_release_trans(sb);
+unlock:
+	scoutfs_unlock(sb, shared_lock, DLM_LOCK_PR);
+	return ret;
+}
+
+/*
+ * Reserve a free block for a delayed allocation.  We make sure that
+ * there are enough local free blocks to satisfy all the reservations so
+ * that writeback rarely has to go to the server.  Other allocations can
+ * still consume the free blocks so writeback is prepared to get more.
+ */
+static int reserve_delayed_block(struct super_block *sb)
+{
+	DECLARE_DATA_INFO(sb, datinf);
+	int ret = 0;
+
+	down_write(&datinf->alloc_rwsem);
+
+	if (atomic64_read(&datinf->node_free_blocks) +
+	    atomic64_read(&datinf->pool_blocks) <=
+	    atomic64_read(&datinf->delayed_blocks))
+		ret = get_server_extent(sb);
+	if (ret == 0)
+		atomic64_inc(&datinf->delayed_blocks);
+
+	up_write(&datinf->alloc_rwsem);
+
+	if (ret == 0)
+		scoutfs_inc_counter(sb, data_delayed_reserve);
+	return ret;
+}
+
+static void release_delayed_blocks(struct super_block *sb, u64 nr)
+{
+	DECLARE_DATA_INFO(sb, datinf);
+
+	atomic64_sub(nr, &datinf->delayed_blocks);
+	scoutfs_add_counter(sb, data_delayed_release, nr);
+}
+
+/*
+ * Delayed blocks pin the lock of their region with an added EX user so
+ * that the lock can't be invalidated until writeback has allocated all
+ * the region's blocks.  Each region with delayed blocks has a pin in
+ * the inode.
+ */
+struct delayed_pin {
+	struct list_head head;
+	struct scoutfs_lock *lock;
+	u64 blocks;
+};
+
+static struct delayed_pin *find_delayed_pin(struct scoutfs_inode_info *si,
+					    u64 iblock)
+{
+	struct delayed_pin *pin;
+
+	assert_spin_locked(&si->delayed_blocks_lock);
+
+	list_for_each_entry(pin, &si->delayed_pins, head) {
+		if (lock_has_block(pin->lock, iblock))
+			return pin;
+	}
+
+	return NULL;
+}
+
+/*
+ * Track a new delayed block in the inode.  The first delayed block in
+ * a region pins the region's lock.  Sets new_run if the block starts a
+ * new run that writeback will allocate as a separate extent.
+ */
+static int add_inode_delayed(struct inode *inode, struct scoutfs_lock *lock,
+			     u64 iblock, bool *new_run)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct delayed_pin *alloc = NULL;
+	struct delayed_pin *pin;
+
+retry:
+	spin_lock(&si->delayed_blocks_lock);
+	pin = find_delayed_pin(si, iblock);
+	if (!pin) {
+		if (!alloc) {
+			spin_unlock(&si->delayed_blocks_lock);
+			alloc = kmalloc(sizeof(struct delayed_pin), GFP_NOFS);
+			if (!alloc)
+				return -ENOMEM;
+			goto retry;
+		}
+		pin = alloc;
+		alloc = NULL;
+		pin->lock = lock;
+		pin->blocks = 0;
+		list_add_tail(&pin->head, &si->delayed_pins);
+		scoutfs_lock_add_user(inode->i_sb, lock, DLM_LOCK_EX);
+		atomic_inc(&lock->delayed_pins);
+	}
+	pin->blocks++;
+	si->delayed_blocks++;
+	*new_run = iblock != si->delayed_next ||
+		   (iblock & (SCOUTFS_SEGMENT_BLOCKS - 1)) == 0;
+	si->delayed_next = iblock + 1;
+	spin_unlock(&si->delayed_blocks_lock);
+
+	kfree(alloc);
+	return 0;
+}
+
+/*
+ * Delayed blocks in the region that contains iblock were allocated or
+ * invalidated.  The last one in the region drops the lock user that
+ * was added by the first.  The inode's last delayed block also forgets
+ * the end of the previous run.  The commit that allocated the blocks
+ * cleared the transaction's delayed item estimate so the next delayed
+ * block has to start a new run that adds to the estimate again.
+ */
+static void sub_inode_delayed(struct inode *inode, u64 iblock, u64 nr)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct scoutfs_lock *lock = NULL;
+	struct delayed_pin *pin;
+
+	spin_lock(&si->delayed_blocks_lock);
+	pin = find_delayed_pin(si, iblock);
+	if (!WARN_ON_ONCE(!pin || nr > pin->blocks)) {
+		pin->blocks -= nr;
+		si->delayed_blocks -= nr;
+		if (pin->blocks == 0) {
+			list_del(&pin->head);
+			lock = pin->lock;
+		}
+		if (si->delayed_blocks == 0)
+			si->delayed_next = 0;
+	}
+	spin_unlock(&si->delayed_blocks_lock);
+
+	if (lock) {
+		kfree(pin);
+		atomic_dec(&lock->delayed_pins);
+		scoutfs_unlock(inode->i_sb, lock, DLM_LOCK_EX);
+	}
+}
+
+/*
+ * Return the lock pinned by delayed blocks in the region that contains
+ * iblock with an added user, or NULL if the region doesn't have delayed
+ * blocks.  The caller unlocks it.
+ */
+static struct scoutfs_lock *get_inode_delayed_lock(struct inode *inode,
+						   u64 iblock)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct scoutfs_lock *lock = NULL;
+	struct delayed_pin *pin;
+
+	spin_lock(&si->delayed_blocks_lock);
+	pin = find_delayed_pin(si, iblock);
+	if (pin) {
+		lock = pin->lock;
+		scoutfs_lock_add_user(inode->i_sb, lock, DLM_LOCK_EX);
+	}
+	spin_unlock(&si->delayed_blocks_lock);
+
+	return lock;
+}
+
+/*
+ * Writers that hold the inode lock in PR can't update the inode's
+ * block counts.  The blocks they bring online are added to the file
+ * delta that write_end records.  They never write into offline
+ * extents, only staging does that and it holds the inode lock in EX.
+ */
+static void add_write_onoff(struct inode *inode, s64 on, s64 off)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct scoutfs_data_locks *dl;
+
+	dl = scoutfs_per_task_get(&si->pt_write_locks);
+	if (dl && dl->deltas) {
+		WARN_ON_ONCE(off);
+		dl->online += on;
+	} else {
+		scoutfs_inode_add_onoff(inode, on, off);
+	}
+}
+
+/*
+ * Writes into sparse regions can delay allocation.  We reserve a free
+ * block and map the buffer to the delayed block.  Writeback will
+ * allocate the block.  The block is accounted as online as soon as it's
+ * written so that the inode's counts don't change at writeback.
+ */
+static int delay_block(struct inode *inode, u64 iblock,
+		       struct buffer_head *bh, struct scoutfs_lock *lock)
+{
+	struct super_block *sb = inode->i_sb;
+	bool new_run;
+	int ret;
+
+	ret = reserve_delayed_block(sb);
+	if (ret)
+		return ret;
+
+	ret = add_inode_delayed(inode, lock, iblock, &new_run);
+	if (ret) {
+		release_delayed_blocks(sb, 1);
+		return ret;
+	}
+	if (new_run)
+		scoutfs_trans_add_delayed(sb, SIC_ALLOC_DELAYED());
+
+	add_write_onoff(inode, 1, 0);
+	map_bh(bh, sb, DELAYED_BLKNO);
+	bh->b_size = SCOUTFS_BLOCK_SIZE;
+	set_buffer_new(bh);
+	set_buffer_delay(bh);
+
+	return 0;
+}
+
+/*
+ * Writes into unwritten extents delay their conversion.  The block is
+ * already allocated so there's nothing to reserve.  Writeback converts
+ * the run of delayed unwritten blocks and maps their buffers.
+ */
+static int delay_unwritten_block(struct inode *inode,
+				 struct scoutfs_extent *ext, u64 iblock,
+				 struct buffer_head *bh,
+				 struct scoutfs_lock *lock)
+{
+	struct super_block *sb = inode->i_sb;
+	bool offline = !!(ext->flags & SEF_OFFLINE);
+	bool new_run;
+	int ret;
+
+	ret = add_inode_delayed(inode, lock, iblock, &new_run);
+	if (ret)
+		return ret;
+	if (new_run)
+		scoutfs_trans_add_delayed(sb, SIC_ALLOC_DELAYED());
+
+	add_write_onoff(inode, 1, offline ? -1 : 0);
+	map_bh(bh, sb, DELAYED_BLKNO);
+	bh->b_size = SCOUTFS_BLOCK_SIZE;
+	set_buffer_new(bh);
+	set_buffer_delay(bh);
+	set_buffer_unwritten(bh);
+	if (offline)
+		set_buffer_scoutfs_offline(bh);
+
+	scoutfs_inc_counter(sb, data_delayed_unwritten);
+	return 0;
+}
+
+static int get_block(struct inode *inode, sector_t iblock,
+		     struct buffer_head *bh, int create, bool delay)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_lock *lock = NULL;
+	struct scoutfs_extent ext;
+	u64 next_iblock = 0;
+	bool offline;
+	u64 offset;
+	u64 len;
+	int ret;
+
+	/* make sure caller holds the lock of the block's region */
+	lock = scoutfs_per_task_get(&si->pt_data_lock);
+	if (WARN_ON_ONCE(!lock) ||
+	    WARN_ON_ONCE(!lock_has_block(lock, iblock)) ||
+	    WARN_ON_ONCE(!create && si->staging)) {
+		ret = -EINVAL;
+		goto trace;
+	}
+
+	/*
+	 * page_mkwrite doesn't hold i_mutex so writers serialize the
+	 * search and modification of extents.
+	 */
+	if (create) {
+		mutex_lock(&si->extent_mutex);
+		set_extents_end(inode, iblock);
+	}
+
+	/* look for the extent that overlaps our iblock */
+	ret = file_extent_next(inode, iblock, &ext, lock);
+	if (ret && ret != -ENOENT)
+		goto out;
+
+	if (ret == 0) {
+		trace_scoutfs_data_get_block_next(sb, &ext);
+		/* remember start of next to limit preallocation */
+		if (ext.start > iblock)
+			next_iblock = ext.start;
+	}
+
+	/* didn't find an extent or it's past our iblock */
+	if (ret == -ENOENT || ext.start > iblock)
+		memset(&ext, 0, sizeof(ext));
+
+	if (ext.len)
+		trace_scoutfs_data_get_block_intersection(sb, &ext);
+
+	/* fail read and write if it's offline and we're not staging */
+	if ((ext.flags & SEF_OFFLINE) && !si->staging) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* writes to shared blocks copy them to a new allocation */
+	if (create && ext.map && (ext.flags & SEF_SHARED)) {
+		ret = unshare_blocks(sb, inode, &ext, iblock, lock);
+		goto out;
+	}
+
+	/* writeback converts runs of delayed unwritten blocks */
+	if (create && delay && (ext.flags & SEF_UNWRITTEN)) {
+		ret = delay_unwritten_block(inode, &ext, iblock, bh, lock);
+		goto unlock;
+	}
+
+	/* convert unwritten to written */
+	if (create && (ext.flags & SEF_UNWRITTEN)) {
+		offline = !!(ext.flags & SEF_OFFLINE);
+		ret = convert_unwritten(sb, inode, &ext, iblock, 1, lock);
+		if (ret == 0) {
+			add_write_onoff(inode, 1, offline ? -1 : 0);
+			set_buffer_new(bh);
+		}
+		goto out;
+	}
+
+	/* delay allocating blocks in sparse regions */
+	if (create && delay && !ext.len) {
+		ret = delay_block(inode, iblock, bh, lock);
+		goto unlock;
+	}
+
+	/* allocate an extent from our logical block */
+	if (create && !ext.map) {
+		/* limit possible alloc to this extent, next, or region end */
+		if (ext.len > 0)
+			len = ext.len - (iblock - ext.start);
+		else if (next_iblock > iblock)
+			len = next_iblock - iblock;
+		else
+			len = region_last(iblock) - iblock + 1;
+
+		ret = alloc_block(sb, inode, &ext, iblock, len, lock);
+		if (ret == 0)
+			set_buffer_new(bh);
+	} else {
+		ret = 0;
+	}
+
+out:
+	/* map usable extent, else leave bh unmapped for sparse reads */
+	if (ret == 0 && ext.map && !(ext.flags & SEF_UNWRITTEN)) {
+		offset = iblock - ext.start;
+		map_bh(bh, inode->i_sb, ext.map + offset);
+		bh->b_size = min_t(u64, bh->b_size,
+				   (ext.len - offset) << SCOUTFS_BLOCK_SHIFT);
+	}
+
+unlock:
+	if (create)
+		mutex_unlock(&si->extent_mutex);
+trace:
+	trace_scoutfs_get_block(sb, scoutfs_ino(inode), iblock, create,
+				ret, bh->b_blocknr, bh->b_size);
+	return ret;
+}
+
+static int scoutfs_get_block(struct inode *inode, sector_t iblock,
+			     struct buffer_head *bh, int create)
+{
+	return get_block(inode, iblock, bh, create, false);
+}
+
+static int scoutfs_get_block_delay(struct inode *inode, sector_t iblock,
+				   struct buffer_head *bh, int create)
+{
+	return get_block(inode, iblock, bh, create, true);
+}
+
+/*
+ * Page cache users hold the whole file data lock in PR and the data
+ * lock for the region of the file that contains their block.  Nodes
+ * can cache pages of regions that other nodes aren't writing.
+ */
+static int lock_data_block(struct super_block *sb, int mode, int flags,
+			   struct inode *inode, u64 iblock,
+			   struct scoutfs_data_locks *dl)
+{
+	int ret;
+
+	dl->region = NULL;
+	dl->region_nr = iblock >> SCOUTFS_LOCK_DATA_REGION_SHIFT;
+	dl->mode = mode;
+
+	ret = scoutfs_lock_data_file(sb, DLM_LOCK_PR, flags, inode, &dl->file);
+	if (ret == 0) {
+		ret = scoutfs_lock_data_region(sb, mode, flags,
+					       scoutfs_ino(inode), iblock,
+					       &dl->region);
+		if (ret < 0) {
+			scoutfs_unlock(sb, dl->file, DLM_LOCK_PR);
+			dl->file = NULL;
+		}
+	}
+
+	return ret;
+}
+
+static void unlock_data_block(struct super_block *sb,
+			      struct scoutfs_data_locks *dl)
+{
+	scoutfs_unlock(sb, dl->region, dl->mode);
+	scoutfs_unlock(sb, dl->file, DLM_LOCK_PR);
+	dl->region = NULL;
+	dl->file = NULL;
+}
+
+/*
+ * Buffered writers hold their data locks across all the pages of a
+ * write instead of acquiring and releasing them for each page.  They
+ * only lock another region when the write crosses into it.  Writers
+ * hold the inode lock for the whole write, in PR if only their regions
+ * are locked in EX, so writers on other mounts only wait for the
+ * regions that they share.
+ */
+static int lock_write_block(struct super_block *sb, struct inode *inode,
+			    u64 iblock, struct scoutfs_data_locks *dl)
+{
+	if (dl->file && dl->region &&
+	    dl->region_nr == iblock >> SCOUTFS_LOCK_DATA_REGION_SHIFT)
+		return 0;
+
+	unlock_data_block(sb, dl);
+	return lock_data_block(sb, DLM_LOCK_EX, 0, inode, iblock, dl);
+}
+
+void scoutfs_data_unlock_write(struct super_block *sb,
+			       struct scoutfs_data_locks *dl)
+{
+	unlock_data_block(sb, dl);
+}
+
+/*
+ * New regular files store their data in items instead of allocating
+ * blocks until they're written past SCOUTFS_INLINE_DATA_MAX_SIZE.  A
+ * file with the inline flag has no extents.  Its items store the bytes
+ * up to i_size, or the max, and the rest of the file is sparse.  The
+ * lock on the first page serializes writing the items with moving the
+ * data into a block.
+ */
+static bool inode_inline(struct inode *inode)
+{
+	return !!(SCOUTFS_I(inode)->flags & SCOUTFS_INO_FLAG_INLINE_DATA);
+}
+
+static u64 inline_len(u64 size)
+{
+	return min_t(u64, size, SCOUTFS_INLINE_DATA_MAX_SIZE);
+}
+
+static void init_inline_key(struct scoutfs_key *key, u64 ino, u64 nr)
+{
+	*key = (struct scoutfs_key) {
+		.sk_zone = SCOUTFS_FS_ZONE,
+		.skid_ino = cpu_to_le64(ino),
+		.sk_type = SCOUTFS_INLINE_DATA_TYPE,
+		.skid_nr = cpu_to_le64(nr),
+	};
+}
+
+static int read_inline_items(struct super_block *sb, u64 ino, void *buf,
+			     u64 len, struct scoutfs_lock *lock)
+{
+	struct scoutfs_key key;
+	struct kvec val;
+	unsigned bytes;
+	u64 nr;
+	int ret = 0;
+
+	for (nr = 0; len > 0; nr++) {
+		init_inline_key(&key, ino, nr);
+		bytes = min_t(u64, len, SCOUTFS_MAX_VAL_SIZE);
+		kvec_init(&val, buf, bytes);
+
+		ret = scoutfs_item_lookup_exact(sb, &key, &val, lock);
+		if (ret == -ENOENT) {
+			scoutfs_corruption(sb, SC_INLINE_DATA_MISSING_ITEM,
+					   corrupt_inline_data_missing_item,
+					   "ino %llu nr %llu", ino, nr);
+			ret = -EIO;
+		}
+		if (ret)
+			break;
+
+		buf += bytes;
+		len -= bytes;
+	}
+
+	return ret;
+}
+
+/*
+ * Store new_len bytes of inline data in items that currently store
+ * old_len bytes.  Existing items are updated, items past the old length
+ * are created, and items past the new length are deleted.  The buffer
+ * isn't used when the new length is 0.
+ */
+static int write_inline_items(struct super_block *sb, u64 ino, void *buf,
+			      u64 old_len, u64 new_len,
+			      struct scoutfs_lock *lock)
+{
+	u64 old_nr = DIV_ROUND_UP(old_len, SCOUTFS_MAX_VAL_SIZE);
+	u64 new_nr = DIV_ROUND_UP(new_len, SCOUTFS_MAX_VAL_SIZE);
+	struct scoutfs_key key;
+	struct kvec val;
+	unsigned bytes;
+	u64 nr;
+	int ret = 0;
+
+	for (nr = 0; nr < max(old_nr, new_nr); nr++) {
+		init_inline_key(&key, ino, nr);
+
+		if (nr >= new_nr) {
+			ret = scoutfs_item_delete(sb, &key, lock);
+		} else {
+			bytes = min_t(u64, new_len, SCOUTFS_MAX_VAL_SIZE);
+			kvec_init(&val, buf, bytes);
+			if (nr < old_nr)
+				ret = scoutfs_item_update(sb, &key, &val, lock);
+			else
+				ret = scoutfs_item_create(sb, &key, &val, lock);
+			buf += bytes;
+			new_len -= bytes;
+		}
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+/*
+ * Fill a locked page of an inline file.  The first page gets the inline
+ * data and all the rest of the file is zero.
+ */
+static int read_inline_page(struct inode *inode, struct page *page,
+			    struct scoutfs_lock *lock)
+{
+	struct super_block *sb = inode->i_sb;
+	u64 len = page->index ? 0 : inline_len(i_size_read(inode));
+	void *addr;
+	int ret;
+
+	addr = kmap(page);
+	ret = read_inline_items(sb, scoutfs_ino(inode), addr, len, lock);
+	memset(addr + len, 0, PAGE_CACHE_SIZE - len);
+	kunmap(page);
+
+	if (ret == 0) {
+		flush_dcache_page(page);
+		SetPageUptodate(page);
+		scoutfs_inc_counter(sb, data_inline_read);
+	}
+
+	return ret;
+}
+
+/*
+ * Move a file's inline data into a block and stop storing its data
+ * inline.  The caller holds i_mutex or an EX inode lock and can't hold
+ * a transaction.  The block is allocated as the page is dirtied, like
+ * page_mkwrite, so that writeback never finds delayed blocks from
+ * callers that don't hold i_mutex.  Data versions don't change because
+ * the file's contents don't.
+ *
+ * Page 0 is only consistent with other nodes' writes while we hold its
+ * data lock so we lock its region in EX, which adds a user if the
+ * caller already holds it.
+ */
+int scoutfs_data_convert_inline(struct inode *inode, struct scoutfs_lock *lock)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	SCOUTFS_DECLARE_PER_TASK_ENTRY(pt_ent);
+	struct scoutfs_data_locks dl;
+	LIST_HEAD(ind_locks);
+	struct page *page;
+	u64 len;
+	int ret;
+
+	if (!inode_inline(inode))
+		return 0;
+
+	ret = lock_data_block(sb, DLM_LOCK_EX, 0, inode, 0, &dl);
+	if (ret)
+		return ret;
+
+	ret = scoutfs_inode_index_lock_hold(inode, &ind_locks, false,
+					    SIC_WRITE_BEGIN());
+	if (ret)
+		goto out_dl;
+
+	page = find_or_create_page(inode->i_mapping, 0, GFP_NOFS);
+	if (!page) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* raced with another converter */
+	if (!inode_inline(inode))
+		goto unlock;
+
+	len = inline_len(i_size_read(inode));
+	if (len) {
+		if (!PageUptodate(page)) {
+			ret = read_inline_page(inode, page, lock);
+			if (ret)
+				goto unlock;
+		}
+
+		scoutfs_per_task_add(&si->pt_data_lock, &pt_ent, dl.region);
+		ret = __block_write_begin(page, 0, len, scoutfs_get_block);
+		scoutfs_per_task_del(&si->pt_data_lock, &pt_ent);
+		if (ret)
+			goto unlock;
+
+		block_commit_write(page, 0, len);
+
+		ret = write_inline_items(sb, scoutfs_ino(inode), NULL, len, 0,
+					 lock);
+		if (ret)
+			goto unlock;
+
+		scoutfs_inode_queue_writeback(inode);
+	}
+
+	si->flags &= ~SCOUTFS_INO_FLAG_INLINE_DATA;
+	scoutfs_update_inode_item(inode, lock, &ind_locks);
+	scoutfs_inc_counter(sb, data_inline_convert);
+
+unlock:
+	unlock_page(page);
+	page_cache_release(page);
+out:
+	scoutfs_release_trans(sb);
+	scoutfs_inode_index_unlock(sb, &ind_locks);
+out_dl:
+	unlock_data_block(sb, &dl);
+
+	return ret;
+}
+
+/*
+ * set_inode_size has changed the size of a file with inline data.  Its
+ * items are truncated or extended with zeros to match the new size.
+ * The caller holds a transaction.
+ */
+int scoutfs_data_truncate_inline(struct inode *inode, u64 old_size,
+				 struct scoutfs_lock *lock)
+{
+	struct super_block *sb = inode->i_sb;
+	struct page *page;
+	u64 old_len;
+	u64 new_len;
+	void *buf = NULL;
+	int ret = 0;
+
+	if (!inode_inline(inode))
+		return 0;
+
+	page = find_or_create_page(inode->i_mapping, 0, GFP_NOFS);
+	if (!page)
+		return -ENOMEM;
+
+	old_len = inline_len(old_size);
+	new_len = inline_len(i_size_read(inode));
+	if (!inode_inline(inode) || old_len == new_len)
+		goto out;
+
+	if (new_len) {
+		buf = kzalloc(SCOUTFS_INLINE_DATA_MAX_SIZE, GFP_NOFS);
+		if (!buf) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		ret = read_inline_items(sb, scoutfs_ino(inode), buf,
+					min(old_len, new_len), lock);
+		if (ret)
+			goto out;
+	}
+
+	ret = write_inline_items(sb, scoutfs_ino(inode), buf, old_len,
+				 new_len, lock);
+out:
+	kfree(buf);
+	unlock_page(page);
+	page_cache_release(page);
+	return ret;
+}
+
+/*
+ * Delete the inline data items of an inode that's being deleted.  The
+ * caller holds a transaction.
+ */
+int scoutfs_data_drop_inline(struct super_block *sb, u64 ino, u64 size,
+			     struct scoutfs_lock *lock)
+{
+	return write_inline_items(sb, ino, NULL, inline_len(size), 0, lock);
+}
+
+/*
+ * This is almost never used.  We can't block on a cluster lock while
+ * holding the page lock because lock invalidation gets the page lock
+ * while blocking locks.  That's true of the inode lock and the data
+ * locks.  If we can't use existing locks then we drop the page lock and
+ * try again.
+ */
+static int scoutfs_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = file->f_inode;
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_lock *inode_lock = NULL;
+	SCOUTFS_DECLARE_PER_TASK_ENTRY(pt_ent);
+	struct scoutfs_data_locks dl;
+	u64 iblock;
+	int flags;
+	int ret;
+
+	iblock = (u64)page->index << (PAGE_CACHE_SHIFT - SCOUTFS_BLOCK_SHIFT);
+
+	flags = SCOUTFS_LKF_REFRESH_INODE | SCOUTFS_LKF_NONBLOCK;
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, flags, inode, &inode_lock);
+	if (ret == 0) {
+		ret = lock_data_block(sb, DLM_LOCK_PR, SCOUTFS_LKF_NONBLOCK,
+				      inode, iblock, &dl);
+		if (ret < 0)
+			scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
+	}
+	if (ret < 0) {
+		unlock_page(page);
+		if (ret == -EAGAIN) {
+			flags &= ~SCOUTFS_LKF_NONBLOCK;
+			ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, flags, inode,
+					   &inode_lock);
+			if (ret == 0) {
+				ret = lock_data_block(sb, DLM_LOCK_PR, 0, inode,
+						      iblock, &dl);
+				if (ret == 0) {
+					unlock_data_block(sb, &dl);
+					ret = AOP_TRUNCATED_PAGE;
+				}
+				scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
+			}
+		}
+		return ret;
+	}
+
+	if (inode_inline(inode)) {
+		ret = read_inline_page(inode, page, inode_lock);
+		unlock_page(page);
+	} else {
+		/* faults in mappings don't have a per-task lock */
+		scoutfs_per_task_add(&si->pt_data_lock, &pt_ent, dl.region);
+		ret = mpage_readpage(page, scoutfs_get_block);
+		scoutfs_per_task_del(&si->pt_data_lock, &pt_ent);
+	}
+	unlock_data_block(sb, &dl);
+	scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
+	return ret;
+}
+
+/*
+ * Grow the file's readahead window to cover the rest of the allocated
+ * extent that contains the block being read.  We never shrink the
+ * window so that larger windows from sequential access advice are
+ * kept, and we leave it alone when random access advice or a zero
+ * window has disabled readahead.
+ */
+static void size_readahead_window(struct file *file, struct inode *inode,
+				  u64 iblock, struct scoutfs_lock *lock)
+{
+	struct file_ra_state *ra = &file->f_ra;
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_extent ext;
+	unsigned long pages;
+
+	if (ra->ra_pages == 0 || (file->f_mode & FMODE_RANDOM))
+		return;
+
+	if (file_extent_next(inode, iblock, &ext, lock) != 0 ||
+	    ext.start > iblock || !ext.map ||
+	    (ext.flags & (SEF_OFFLINE | SEF_UNWRITTEN)))
+		return;
+
+	pages = min(ext.start + ext.len - iblock, READAHEAD_MAX_BLOCKS) /
+		SCOUTFS_BLOCKS_PER_PAGE;
+
+	if (pages > ra->ra_pages) {
+		ra->ra_pages = pages;
+		scoutfs_inc_counter(sb, data_readahead_window);
+	}
+}
+
+/*
+ * Search for the extent items that map the block after a readahead
+ * window once the window's reads have been submitted.  Reading the
+ * items overlaps with the data reads and the next window then finds
+ * its mapping in the extent cache.  The caller holds the lock of the
+ * block's region.
+ */
+static void prefetch_extents(struct inode *inode, u64 iblock,
+			     struct scoutfs_lock *lock)
+{
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_extent ext;
+	u64 size = i_size_read(inode);
+
+	if (iblock >= DIV_ROUND_UP(size, SCOUTFS_BLOCK_SIZE))
+		return;
+
+	if (file_extent_next(inode, iblock, &ext, lock) == 0)
+		scoutfs_inc_counter(sb, data_readahead_prefetch);
+}
+
+/*
+ * Readahead doesn't wait for offline blocks to be staged.  Reads and
+ * faults wait for staging before reading so we drop readahead pages
+ * that start in offline extents rather than failing them in get_block.
+ */
+static bool page_offline(struct inode *inode, struct page *page,
+			 struct scoutfs_lock *lock)
+{
+	struct scoutfs_extent ext;
+	u64 iblock;
+
+	iblock = (u64)page->index << (PAGE_CACHE_SHIFT - SCOUTFS_BLOCK_SHIFT);
+
+	return file_extent_next(inode, iblock, &ext, lock) == 0 &&
+	       ext.start <= iblock && (ext.flags & SEF_OFFLINE);
+}
+
+static int scoutfs_readpages(struct file *file, struct address_space *mapping,
+			     struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = file->f_inode;
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_lock *inode_lock = NULL;
+	SCOUTFS_DECLARE_PER_TASK_ENTRY(pt_ent);
+	LIST_HEAD(region_pages);
+	struct scoutfs_data_locks dl;
+	struct page *page;
+	bool first = true;
+	unsigned nr;
+	u64 region;
+	u64 iblock;
+	u64 next;
+	int ret;
+
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, SCOUTFS_LKF_REFRESH_INODE,
+				 inode, &inode_lock);
+	if (ret)
+		return ret;
+
+	/* the caller drops the pages and falls back to readpage */
+	if (inode_inline(inode)) {
+		scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
+		return 0;
+	}
+
+	/* pages are sorted with the lowest index at the tail */
+	page = list_entry(pages->next, struct page, lru);
+	next = ((u64)page->index + 1) <<
+	       (PAGE_CACHE_SHIFT - SCOUTFS_BLOCK_SHIFT);
+
+	while (!list_empty(pages)) {
+		page = list_entry(pages->prev, struct page, lru);
+		iblock = (u64)page->index <<
+			 (PAGE_CACHE_SHIFT - SCOUTFS_BLOCK_SHIFT);
+		region = iblock >> SCOUTFS_LOCK_DATA_REGION_SHIFT;
+
+		/* the region's lock covers its pages and extent items */
+		ret = lock_data_block(sb, DLM_LOCK_PR, 0, inode, iblock, &dl);
+		if (ret < 0)
+			break;
+		scoutfs_per_task_add(&si->pt_data_lock, &pt_ent, dl.region);
+
+		if (first) {
+			size_readahead_window(file, inode, iblock, dl.region);
+			first = false;
+		}
+
+		nr = 0;
+		while (!list_empty(pages)) {
+			page = list_entry(pages->prev, struct page, lru);
+			iblock = (u64)page->index <<
+				 (PAGE_CACHE_SHIFT - SCOUTFS_BLOCK_SHIFT);
+			if ((iblock >> SCOUTFS_LOCK_DATA_REGION_SHIFT) != region)
+				break;
+			if (page_offline(inode, page, dl.region)) {
+				list_del(&page->lru);
+				page_cache_release(page);
+				scoutfs_inc_counter(sb, data_readahead_offline);
+				continue;
+			}
+			list_move(&page->lru, &region_pages);
+			nr++;
+		}
+
+		if (nr)
+			ret = mpage_readpages(mapping, &region_pages, nr,
+					      scoutfs_get_block);
+
+		/* next window's extents can only be found in our region */
+		if (ret == 0 && list_empty(pages) &&
+		    lock_has_block(dl.region, next))
+			prefetch_extents(inode, next, dl.region);
+
+		scoutfs_per_task_del(&si->pt_data_lock, &pt_ent);
+		unlock_data_block(sb, &dl);
+		if (ret < 0)
+			break;
+	}
+
+	scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
+	return ret;
+}
+
+static bool page_has_delayed(struct page *page)
+{
+	struct buffer_head *head;
+	struct buffer_head *bh;
+
+	if (!page_has_buffers(page))
+		return false;
+
+	bh = head = page_buffers(page);
+	do {
+		if (buffer_delay(bh))
+			return true;
+	} while ((bh = bh->b_this_page) != head);
+
+	return false;
+}
+
+/*
+ * Delayed blocks are only allocated by writepages.  Pages with delayed
+ * blocks are left dirty for it to find.
+ */
+static int scoutfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct super_block *sb = page->mapping->host->i_sb;
+
+	scoutfs_inc_counter(sb, data_writepage);
+
+	if (page_has_delayed(page)) {
+		scoutfs_inc_counter(sb, data_writepage_delayed);
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return 0;
+	}
+
+	return block_write_full_page(page, scoutfs_get_block, wbc);
+}
+
+/*
+ * Add the page's delayed blocks to the run.  Returns true if the page
+ * had delayed blocks that continued the run.  more is set if the page
+ * has delayed blocks past the end of the run.  Runs don't cross data
+ * lock regions because extents can't.
+ */
+static bool add_page_delayed(struct page *page, struct delayed_run *run,
+			     bool *more)
+{
+	struct buffer_head *head;
+	struct buffer_head *bh;
+	bool added = false;
+	u64 iblock;
+
+	*more = false;
+
+	if (!page_has_buffers(page))
+		return false;
+
+	iblock = (u64)page->index << (PAGE_CACHE_SHIFT - SCOUTFS_BLOCK_SHIFT);
+	bh = head = page_buffers(page);
+	do {
+		if (buffer_delay(bh)) {
+			if (run->len == 0) {
+				run->start = iblock;
+				run->unwritten = !!buffer_unwritten(bh);
+			}
+			if (iblock != run->start + run->len ||
+			    iblock > region_last(run->start) ||
+			    !!buffer_unwritten(bh) != run->unwritten) {
+				*more = true;
+				break;
+			}
+			run->len++;
+			added = true;
+		}
+		iblock++;
+	} while ((bh = bh->b_this_page) != head);
+
+	return added;
+}
+
+/*
+ * Find the next run of logically contiguous delayed blocks in dirty
+ * pages between *index and end.  The run's pages are returned locked
+ * with references held.  *index is set to the page to search from next.
+ * Returns false if there are no more delayed blocks in the range.
+ */
+static bool find_delayed_run(struct address_space *mapping, pgoff_t *index,
+			     pgoff_t end, struct delayed_run *run)
+{
+	struct page *page;
+	pgoff_t next;
+	pgoff_t idx;
+	bool more;
+
+	run->start = 0;
+	run->len = 0;
+	run->unwritten = false;
+	run->nr_pages = 0;
+
+	while (*index <= end && run->nr_pages < DELAYED_RUN_PAGES) {
+		next = *index;
+		if (!find_get_pages_tag(mapping, &next, PAGECACHE_TAG_DIRTY,
+					1, &page))
+			break;
+
+		/* runs are made of contiguous pages */
+		idx = page->index;
+		if (idx > end || (run->nr_pages && idx != *index)) {
+			page_cache_release(page);
+			break;
+		}
+
+		lock_page(page);
+		if (page->mapping == mapping && PageDirty(page) &&
+		    add_page_delayed(page, run, &more)) {
+			run->pages[run->nr_pages++] = page;
+			*index = more ? idx : idx + 1;
+			if (more)
+				break;
+			continue;
+		}
+		unlock_page(page);
+		page_cache_release(page);
+
+		/* search again from a page that didn't continue the run */
+		if (run->nr_pages) {
+			*index = idx;
+			break;
+		}
+		*index = idx + 1;
+	}
+
+	return run->nr_pages > 0;
+}
+
+/*
+ * Allocate an extent for a run of delayed blocks and map their buffers.
+ * We might not find a free extent large enough for the whole run.  The
+ * remaining blocks stay delayed and *index is moved back to the page
+ * that contains the first of them so that the next search finds them.
+ * The run's pages are unlocked and released.
+ *
+ * Runs of delayed blocks in unwritten extents are converted instead.
+ * The conversion is limited to the unwritten extent that contains the
+ * start of the run.  Readers waiting for staging see offline extents
+ * until they're converted so they're woken once their blocks are
+ * online.
+ *
+ * The lock of the run's region that's pinned by its delayed blocks
+ * covers the extent items.
+ */
+static int alloc_delayed_run(struct super_block *sb, struct inode *inode,
+			     struct delayed_run *run, pgoff_t *index)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct scoutfs_extent ext;
+	struct scoutfs_extent fr;
+	struct buffer_head *head;
+	struct buffer_head *bh;
+	struct page *page;
+	struct scoutfs_lock *lock;
+	bool add_fr = false;
+	bool wake = false;
+	u64 iblock;
+	u64 nr = 0;
+	int ret;
+	int i;
+
+	lock = get_inode_delayed_lock(inode, run->start);
+	if (WARN_ON_ONCE(!lock)) {
+		ret = -EIO;
+		goto release;
+	}
+
+	mutex_lock(&si->extent_mutex);
+
+	if (run->unwritten) {
+		ret = file_extent_next(inode, run->start, &ext, lock);
+		if (ret == -ENOENT ||
+		    (ret == 0 && (ext.start > run->start || !ext.map ||
+				  !(ext.flags & SEF_UNWRITTEN)))) {
+			/* only writers convert unwritten extents */
+			WARN_ON_ONCE(1);
+			ret = -EIO;
+		}
+		if (ret == 0) {
+			wake = !!(ext.flags & SEF_OFFLINE);
+			ret = convert_unwritten(sb, inode, &ext, run->start,
+					min(run->len,
+					    ext.start + ext.len - run->start),
+					lock);
+		}
+		goto out;
+	}
+
+	ret = alloc_pool_blocks(sb, inode, run->start, run->len, &fr, lock);
+	if (ret < 0)
+		goto out;
+	add_fr = true;
+
+	scoutfs_extent_init(&ext, SCOUTFS_FILE_EXTENT_TYPE, scoutfs_ino(inode),
+			    run->start, fr.len, fr.start, 0);
+	trace_scoutfs_data_alloc_delayed_extent(sb, &ext);
+
+	ret = scoutfs_extent_add(sb, data_extent_io, &ext, lock);
+out:
+	scoutfs_extent_cleanup(ret < 0 && add_fr, add_free_extent, sb,
+			       data_extent_io, &fr, sbi->node_id_lock,
+			       SC_DATA_EXTENT_ALLOC_CLEANUP,
+			       corrupt_data_extent_alloc_cleanup, &ext);
+	invalidate_extent_cache(inode);
+	mutex_unlock(&si->extent_mutex);
+
+release:
+	for (i = 0; i < run->nr_pages; i++) {
+		page = run->pages[i];
+
+		if (ret == 0) {
+			iblock = (u64)page->index <<
+				 (PAGE_CACHE_SHIFT - SCOUTFS_BLOCK_SHIFT);
+			bh = head = page_buffers(page);
+			do {
+				if (buffer_delay(bh) &&
+				    !!buffer_unwritten(bh) == run->unwritten &&
+				    iblock >= ext.start &&
+				    iblock < ext.start + ext.len) {
+					bh->b_blocknr = ext.map +
+							(iblock - ext.start);
+					clear_buffer_delay(bh);
+					clear_buffer_unwritten(bh);
+					clear_buffer_scoutfs_offline(bh);
+					nr++;
+				}
+				iblock++;
+			} while ((bh = bh->b_this_page) != head);
+		}
+
+		unlock_page(page);
+		page_cache_release(page);
+	}
+
+	if (nr && run->unwritten) {
+		scoutfs_inc_counter(sb, data_delayed_convert_extent);
+		sub_inode_delayed(inode, run->start, nr);
+		if (wake)
+			scoutfs_data_wake_waiters(sb, scoutfs_ino(inode),
+						  ext.start,
+						  ext.start + ext.len - 1);
+	} else if (nr) {
+		scoutfs_inc_counter(sb, data_delayed_alloc_extent);
+		sub_inode_delayed(inode, run->start, nr);
+		release_delayed_blocks(sb, nr);
+	}
+
+	if (ret == 0 && nr != ext.len) {
+		/* mpage would write unmapped delayed blocks to DELAYED_BLKNO */
+		WARN_ON_ONCE(1);
+		ret = -EIO;
+	}
+
+	if (ret == 0 && ext.len < run->len) {
+		scoutfs_inc_counter(sb, data_delayed_alloc_partial);
+		*index = (ext.start + ext.len) >>
+			 (PAGE_CACHE_SHIFT - SCOUTFS_BLOCK_SHIFT);
+	}
+
+	scoutfs_unlock(sb, lock, DLM_LOCK_EX);
+	return ret;
+}
+
+/*
+ * Allocate extents for the delayed blocks in the writeback range.  The
+ * commit calls this with the transaction implicitly held.  Otherwise we
+ * hold the transaction around each allocation.
+ */
+static int alloc_delayed_blocks(struct address_space *mapping,
+				struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct delayed_run *run = NULL;
+	pgoff_t index;
+	pgoff_t end;
+	u64 delayed;
+	bool found;
+	int ret;
+
+	spin_lock(&si->delayed_blocks_lock);
+	delayed = si->delayed_blocks;
+	spin_unlock(&si->delayed_blocks_lock);
+	if (delayed == 0)
+		return 0;
+
+	run = kmalloc(sizeof(struct delayed_run), GFP_NOFS);
+	if (!run)
+		return -ENOMEM;
+
+	if (wbc->range_cyclic) {
+		index = 0;
+		end = -1;
+	} else {
+		index = wbc->range_start >> PAGE_CACHE_SHIFT;
+		end = wbc->range_end >> PAGE_CACHE_SHIFT;
+	}
+
+	do {
+		ret = scoutfs_hold_trans(sb, SIC_ALLOC_DELAYED());
+		if (ret)
+			break;
+
+		found = find_delayed_run(mapping, &index, end, run);
+		if (found)
+			ret = alloc_delayed_run(sb, inode, run, &index);
+
+		scoutfs_release_trans(sb);
+	} while (ret == 0 && found);
+
+	kfree(run);
+	return ret;
+}
+
+static int scoutfs_writepages(struct address_space *mapping,
+			      struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	u64 delayed;
+	int ret;
+
+	ret = alloc_delayed_blocks(mapping, wbc);
+	if (ret)
+		return ret;
+
+	/*
+	 * mpage would write delayed blocks to their placeholder mapping.
+	 * We can only use it if writers are excluded and couldn't have
+	 * delayed more blocks since we allocated.  Otherwise writepage
+	 * skips pages with delayed blocks.  Writing back the whole file
+	 * must have allocated all its delayed blocks.
+	 */
+	if (scoutfs_trans_committing(inode->i_sb) ||
+	    scoutfs_per_task_get(&si->pt_write_locks)) {
+		if (wbc->range_cyclic ||
+		    (wbc->range_start == 0 && wbc->range_end == LLONG_MAX)) {
+			spin_lock(&si->delayed_blocks_lock);
+			delayed = si->delayed_blocks;
+			spin_unlock(&si->delayed_blocks_lock);
+			if (WARN_ON_ONCE(delayed))
+				return -EIO;
+		}
+		return mpage_writepages(mapping, wbc, scoutfs_get_block);
+	}
+
+	return generic_writepages(mapping, wbc);
+}
+
+/*
+ * Archive readers often read records at a fixed stride which generic
+ * readahead sees as random reads.  Once a few reads have repeated the
+ * same stride we read ahead the records at the next few strides.  The
+ * state is per-inode so racing readers only confuse the detection, the
+ * lock just keeps each update consistent.
+ */
+void scoutfs_data_stride_readahead(struct file *file, loff_t pos, size_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct address_space *mapping = inode->i_mapping;
+	struct super_block *sb = inode->i_sb;
+	struct file_ra_state ra;
+	unsigned long nr;
+	loff_t size;
+	loff_t off;
+	u64 stride;
+	bool hit;
+	int i;
+
+	spin_lock(&si->read_stride_lock);
+	stride = pos - si->read_stride_pos;
+	if (pos > si->read_stride_pos && stride > len &&
+	    stride == si->read_stride) {
+		if (si->read_stride_hits < READAHEAD_STRIDE_HITS)
+			si->read_stride_hits++;
+	} else {
+		si->read_stride_hits = 0;
+	}
+	si->read_stride_pos = pos;
+	si->read_stride = stride;
+	hit = si->read_stride_hits >= READAHEAD_STRIDE_HITS;
+	spin_unlock(&si->read_stride_lock);
+
+	if (!hit || file->f_ra.ra_pages == 0 ||
+	    (file->f_mode & FMODE_RANDOM) || len == 0)
+		return;
+
+	nr = DIV_ROUND_UP((pos & ~PAGE_CACHE_MASK) + len, PAGE_CACHE_SIZE);
+	nr = min_t(unsigned long, nr,
+		   READAHEAD_MAX_BLOCKS / SCOUTFS_BLOCKS_PER_PAGE);
+
+	file_ra_state_init(&ra, mapping);
+	ra.ra_pages = max_t(unsigned long, ra.ra_pages, nr);
+	size = i_size_read(inode);
+
+	for (i = 1, off = pos + stride; i <= READAHEAD_STRIDES && off < size;
+	     i++, off += stride)
+		page_cache_sync_readahead(mapping, &ra, file,
+					  off >> PAGE_CACHE_SHIFT, nr);
+
+	scoutfs_inc_counter(sb, data_readahead_stride);
+}
+
+static void scoutfs_invalidatepage(struct page *page, unsigned long offset)
+{
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *head;
+	struct buffer_head *bh;
+	unsigned long pos = 0;
+	u64 offline = 0;
+	u64 unwr = 0;
+	u64 nr = 0;
+
+	scoutfs_inc_counter(sb, data_invalidatepage);
+
+	if (page_has_buffers(page)) {
+		bh = head = page_buffers(page);
+		do {
+			if (pos >= offset && buffer_delay(bh)) {
+				if (buffer_unwritten(bh))
+					unwr++;
+				if (buffer_scoutfs_offline(bh))
+					offline++;
+				clear_buffer_delay(bh);
+				clear_buffer_unwritten(bh);
+				clear_buffer_scoutfs_offline(bh);
+				nr++;
+			}
+			pos += bh->b_size;
+		} while ((bh = bh->b_this_page) != head);
+	}
+
+	/* unwritten blocks go back to their unconverted extent */
+	if (nr) {
+		add_write_onoff(inode, -nr, offline);
+		sub_inode_delayed(inode, (u64)page->index <<
+				  (PAGE_CACHE_SHIFT - SCOUTFS_BLOCK_SHIFT), nr);
+		if (nr > unwr)
+			release_delayed_blocks(sb, nr - unwr);
+	}
+
+	block_invalidatepage(page, offset);
+}
+
+/*
+ * Delayed blocks keep their reservation and the lock they pin until
+ * writeback allocates them or their page is invalidated.  Freeing their
+ * buffers would lose both so we refuse to release pages with delayed
+ * blocks.
+ */
+static int scoutfs_releasepage(struct page *page, gfp_t gfp)
+{
+	if (page_has_delayed(page))
+		return 0;
+
+	return try_to_free_buffers(page);
+}
+
+/* the sum of a file's delta items */
+struct file_deltas {
+	u64 size;
+	u64 extents_end;
+	u64 data_version;
+	s64 online;
+	struct timespec mtime;
+};
+
+static void init_file_delta_key(struct scoutfs_key *key, u64 ino, u64 seq,
+				u64 node_id)
+{
+	*key = (struct scoutfs_key) {
+		.sk_zone = SCOUTFS_FILE_DATA_ZONE,
+		.skfd_ino = cpu_to_le64(ino),
+		.sk_type = SCOUTFS_FILE_DELTA_TYPE,
+		.skfd_seq = cpu_to_le64(seq),
+		.skfd_node_id = cpu_to_le64(node_id),
+	};
+}
 
-		/* if none big enough, look for last largest smaller */
-		if (ret == -ENOENT && len > 1)
-			ret = scoutfs_extent_prev(sb, data_extent_io, ext,
-						  sbi->node_id_lock);
+/*
+ * Add up to nr of a file's delta items to the caller's sums, deleting
+ * each item as it's added if asked.  Returns the number of items that
+ * were added or -errno.  The sums include the items that were deleted
+ * before an error was returned.
+ */
+static int read_file_deltas(struct super_block *sb, u64 ino,
+			    unsigned int nr, bool delete,
+			    struct file_deltas *fd, struct scoutfs_lock *lock)
+{
+	struct scoutfs_file_delta delta;
+	struct scoutfs_key last_key;
+	struct scoutfs_key key;
+	struct timespec ts;
+	struct kvec val;
+	unsigned int i;
+	int ret = 0;
 
-		/* ask the server for more if we think it'll help */
-		if (ret == -ENOENT || ext->len < len) {
-			ret = get_server_extent(sb);
-			if (ret == 0)
-				continue;
+	init_file_delta_key(&key, ino, 0, 0);
+	init_file_delta_key(&last_key, ino, U64_MAX, U64_MAX);
+	kvec_init(&val, &delta, sizeof(delta));
+
+	for (i = 0; i < nr; i++) {
+		ret = scoutfs_item_next(sb, &key, &last_key, &val, lock);
+		if (ret < 0) {
+			if (ret == -ENOENT)
+				ret = 0;
+			break;
 		}
 
-		/* use the extent we found or return errors */
-		break;
-	}
+		if (ret != sizeof(delta)) {
+			scoutfs_corruption(sb, SC_FILE_DELTA_VAL_SIZE,
+					   corrupt_file_delta_val_size,
+					   "ino %llu key "SK_FMT" len %d",
+					   ino, SK_ARG(&key), ret);
+			ret = -EIO;
+			break;
+		}
 
-	if (ret == 0)
-		scoutfs_extent_init(ext, SCOUTFS_FREE_EXTENT_BLKNO_TYPE,
-				    sbi->node_id, ext->start,
-				    min(ext->len, len), 0, 0);
+		if (delete) {
+			ret = scoutfs_item_delete(sb, &key, lock);
+			if (ret)
+				break;
+		}
 
-	trace_scoutfs_data_find_free_extent(sb, ext);
-	return ret;
+		fd->size = max(fd->size, le64_to_cpu(delta.size));
+		fd->extents_end = max(fd->extents_end,
+				      le64_to_cpu(delta.extents_end));
+		fd->data_version += le64_to_cpu(delta.data_version);
+		fd->online += (s64)le64_to_cpu(delta.online_blocks);
+		ts.tv_sec = le64_to_cpu(delta.mtime_sec);
+		ts.tv_nsec = le32_to_cpu(delta.mtime_nsec);
+		if (timespec_compare(&ts, &fd->mtime) > 0)
+			fd->mtime = ts;
+
+		scoutfs_key_inc(&key);
+	}
+
+	return ret < 0 ? ret : i;
 }
 
 /*
- * The caller is writing to a logical block that doesn't have an
- * allocated extent.
- *
- * We always allocate an extent starting at the logical block.  The
- * caller has considered overlapping and following extents and has given
- * us a maximum length that we could safely allocate.  Preallocation
- * heuristics decide to use this length or only a single block.
- *
- * If the caller passes in an existing extent then we remove the
- * allocated region from the existing extent.  We then add a single
- * block extent for the caller to write into.  Then if we allocated
- * multiple blocks we add an unwritten extent for the rest of the blocks
- * in the extent.
- *
- * Preallocation is used if we're strictly contiguously extending
- * writes.  That is, if the logical block offset equals the number of
- * online blocks.  We try to preallocate the number of blocks existing
- * so that small files don't waste inordinate amounts of space and large
- * files will eventually see large extents.  This only works for
- * contiguous single stream writes or stages of files from the first
- * block.  It doesn't work for concurrent stages, releasing behind
- * staging, sparse files, multi-node writes, etc.  fallocate() is always
- * a better tool to use.
+ * Writers that hold the inode lock in PR record their changes to the
+ * file's attributes in an item for the mount and transaction instead
+ * of updating the inode item.  The item is written blindly under the
+ * CW file deltas lock so writers on different mounts don't contend.
+ * We keep our totals for the current transaction in the inode.  The
+ * writer's i_size and extents_end are already set in our inode, its
+ * blocks brought online were gathered in the write locks.
  *
- * On success we update the caller's extent to the single block
- * allocated extent for the logical block for use in block mapping.
+ * The caller holds i_mutex and a transaction.
  */
-static int alloc_block(struct super_block *sb, struct inode *inode,
-		       struct scoutfs_extent *ext, u64 iblock, u64 len,
-		       struct scoutfs_lock *lock)
+static int add_file_delta(struct inode *inode, u64 versions,
+			  struct scoutfs_data_locks *dl)
 {
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
 	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
-	DECLARE_DATA_INFO(sb, datinf);
-	const u64 ino = scoutfs_ino(inode);
-	struct scoutfs_extent unwr;
-	struct scoutfs_extent old;
-	struct scoutfs_extent blk;
-	struct scoutfs_extent fr;
-	bool add_old = false;
-	bool add_fr = false;
-	bool rem_blk = false;
-	u64 offline;
-	u64 online;
+	struct scoutfs_file_delta delta;
+	struct scoutfs_key key;
+	struct kvec val;
+	u64 extents_end;
+	u64 size;
 	int ret;
 
-	down_write(&datinf->alloc_rwsem);
+	si->file_deltas_none_gen = 0;
 
-	scoutfs_inode_get_onoff(inode, &online, &offline);
+	if (si->file_delta_seq != sbi->trans_seq) {
+		si->file_delta_seq = sbi->trans_seq;
+		si->file_delta_size = 0;
+		si->file_delta_extents_end = 0;
+		si->file_delta_data_version = 0;
+		si->file_delta_online = 0;
+	}
 
-	/* strictly contiguous extending writes will try to preallocate */ 
-	if (iblock > 1 && iblock == online)
-		len = min3(len, iblock, MAX_EXTENT_BLOCKS);
-	else
-		len = 1;
+	size = max_t(u64, si->file_delta_size, i_size_read(inode));
+	mutex_lock(&si->extent_mutex);
+	extents_end = max(si->file_delta_extents_end, si->extents_end);
+	mutex_unlock(&si->extent_mutex);
 
-	trace_scoutfs_data_alloc_block(sb, inode, ext, iblock, len,
-				       online, offline);
+	delta.size = cpu_to_le64(size);
+	delta.extents_end = cpu_to_le64(extents_end);
+	delta.data_version = cpu_to_le64(si->file_delta_data_version +
+					 versions);
+	delta.online_blocks = cpu_to_le64(si->file_delta_online + dl->online);
+	delta.mtime_sec = cpu_to_le64(inode->i_mtime.tv_sec);
+	delta.mtime_nsec = cpu_to_le32(inode->i_mtime.tv_nsec);
 
-	ret = find_free_extent(sb, len, &fr);
-	if (ret < 0)
-		goto out;
+	init_file_delta_key(&key, scoutfs_ino(inode), sbi->trans_seq,
+			    sbi->node_id);
+	kvec_init(&val, &delta, sizeof(delta));
 
-	trace_scoutfs_data_alloc_block_next(sb, &fr);
+	ret = scoutfs_item_create_force(sb, &key, &val, dl->deltas);
+	if (ret == 0) {
+		si->file_delta_size = size;
+		si->file_delta_extents_end = extents_end;
+		si->file_delta_data_version += versions;
+		si->file_delta_online += dl->online;
+		si->file_delta_isize = max(si->file_delta_isize, size);
+		si->file_deltas_written = true;
+		dl->online = 0;
+		scoutfs_inc_counter(sb, file_delta_write);
+	}
 
-	/* initialize the new mapped block extent, referenced by cleanup */
-	scoutfs_extent_init(&blk, SCOUTFS_FILE_EXTENT_TYPE, ino,
-			    iblock, 1, fr.start, 0);
+	return ret;
+}
 
-	/* remove the free extent that we're allocating */
-	ret = scoutfs_extent_remove(sb, data_extent_io, &fr, sbi->node_id_lock);
-	if (ret)
-		goto out;
-	add_fr = true;
+static void apply_file_deltas(struct inode *inode, struct file_deltas *fd)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
 
-	/* remove an existing offline or unwritten block extent */
-	if (ext->flags) {
-		scoutfs_extent_init(&old, SCOUTFS_FILE_EXTENT_TYPE, ino,
-				    iblock, len, 0, ext->flags);
-		ret = scoutfs_extent_remove(sb, data_extent_io, &old, lock);
-		if (ret)
-			goto out;
-		add_old = true;
+	if (fd->size > i_size_read(inode))
+		i_size_write(inode, fd->size);
+
+	mutex_lock(&si->extent_mutex);
+	si->extents_end = max(si->extents_end, fd->extents_end);
+	mutex_unlock(&si->extent_mutex);
+
+	if (fd->data_version) {
+		scoutfs_inode_add_data_version(inode, fd->data_version);
+		scoutfs_inode_set_data_seq(inode);
 	}
+	if (fd->online)
+		scoutfs_inode_add_onoff(inode, fd->online, 0);
 
-	/* add the block that the caller is writing */
-	ret = scoutfs_extent_add(sb, data_extent_io, &blk, lock);
+	if (timespec_compare(&fd->mtime, &inode->i_mtime) > 0)
+		inode->i_mtime = fd->mtime;
+	if (timespec_compare(&fd->mtime, &inode->i_ctime) > 0)
+		inode->i_ctime = fd->mtime;
+}
+
+#define FOLD_FILE_DELTAS_BATCH 64
+
+/*
+ * Merge all of a file's delta items into its inode.  This has to be
+ * done before anything that depends on the file's attributes, like
+ * truncating, releasing, staging, or cloning.  The caller holds the
+ * inode lock in EX so writers can't add deltas while we're working.
+ * Each batch of items is deleted and applied to the inode in its own
+ * transaction.  Once they're all folded we can skip reading deltas
+ * until our EX lock is lost.
+ */
+int scoutfs_data_fold_file_deltas(struct inode *inode,
+				  struct scoutfs_lock *lock)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_lock *delta_lock = NULL;
+	struct file_deltas fd = {0,};
+	LIST_HEAD(ind_locks);
+	int ret;
+
+	if (!S_ISREG(inode->i_mode) ||
+	    si->file_deltas_none_gen == lock->write_gen)
+		return 0;
+
+	ret = scoutfs_lock_file_deltas(sb, DLM_LOCK_EX, 0, scoutfs_ino(inode),
+				       &delta_lock);
 	if (ret)
-		goto out;
-	rem_blk = true;
+		return ret;
 
-	/* and maybe add the remaining unwritten extent */
-	if (len > 1) {
-		scoutfs_extent_init(&unwr, SCOUTFS_FILE_EXTENT_TYPE, ino,
-				    iblock + 1, len - 1, fr.start + 1,
-				    ext->flags | SEF_UNWRITTEN);
-		ret = scoutfs_extent_add(sb, data_extent_io, &unwr, lock);
-		if (ret)
-			goto out;
+	/* our pending delta was written as our CW lock was converted */
+	si->file_delta_seq = 0;
+
+	/* most of the time there's nothing to do */
+	ret = read_file_deltas(sb, scoutfs_ino(inode), 1, false, &fd,
+			       delta_lock);
+
+	while (ret > 0) {
+		memset(&fd, 0, sizeof(fd));
+
+		ret = scoutfs_inode_index_lock_hold(inode, &ind_locks, true,
+				SIC_FOLD_FILE_DELTAS(FOLD_FILE_DELTAS_BATCH));
+		if (ret == 0) {
+			ret = scoutfs_dirty_inode_item(inode, lock);
+			if (ret == 0) {
+				ret = read_file_deltas(sb, scoutfs_ino(inode),
+						       FOLD_FILE_DELTAS_BATCH,
+						       true, &fd, delta_lock);
+				apply_file_deltas(inode, &fd);
+				scoutfs_update_inode_item(inode, lock,
+							  &ind_locks);
+			}
+			scoutfs_release_trans(sb);
+		}
+		scoutfs_inode_index_unlock(sb, &ind_locks);
+
+		if (ret > 0)
+			scoutfs_add_counter(sb, file_delta_fold, ret);
+		if (ret < FOLD_FILE_DELTAS_BATCH)
+			break;
 	}
 
-	scoutfs_inode_add_onoff(inode, 1,
-				(ext->flags & SEF_OFFLINE) ? -1ULL : 0);
-	ret = 0;
-out:
-	scoutfs_extent_cleanup(ret < 0 && rem_blk, scoutfs_extent_remove, sb,
-			       data_extent_io, &blk, lock,
-			       SC_DATA_EXTENT_ALLOC_CLEANUP,
-			       corrupt_data_extent_alloc_cleanup, &blk);
-	scoutfs_extent_cleanup(ret < 0 && add_old, scoutfs_extent_add, sb,
-			       data_extent_io, &old, lock,
-			       SC_DATA_EXTENT_ALLOC_CLEANUP,
-			       corrupt_data_extent_alloc_cleanup, &blk);
-	scoutfs_extent_cleanup(ret < 0 && add_fr, scoutfs_extent_add, sb,
-			       data_extent_io, &fr, sbi->node_id_lock,
-			       SC_DATA_EXTENT_ALLOC_CLEANUP,
-			       corrupt_data_extent_alloc_cleanup, &blk);
+	scoutfs_unlock(sb, delta_lock, DLM_LOCK_EX);
 
-	up_write(&datinf->alloc_rwsem);
+	if (ret >= 0) {
+		si->file_deltas_none_gen = lock->write_gen;
+		si->file_deltas_written = false;
+		si->file_delta_isize = 0;
+	}
 
-	trace_scoutfs_data_alloc_block_ret(sb, ext, ret);
-	if (ret == 0)
-		*ext = blk;
-	return ret;
+	return ret < 0 ? ret : 0;
 }
 
 /*
- * A caller is writing into unwritten allocated space.  This can also be
- * called for staging writes so we clear both the unwritten and offline
- * flags.  We record the extent as online as allocating writes would.
- *
- * We don't have to wait for dirty block IO to complete before clearing
- * the unwritten flag in metadata because we have strict synchronization
- * between data and metadata.  All dirty data in the current transaction
- * is written before the metadata in the transaction that references it
- * is committed.
+ * Sum all of a file's pending delta items, returning the number of
+ * items.  The caller holds the inode lock.
  */
-static int convert_unwritten(struct super_block *sb, struct inode *inode,
-			     struct scoutfs_extent *ext, u64 start, u64 len,
-			     struct scoutfs_lock *lock)
+static int sum_file_deltas(struct super_block *sb, u64 ino,
+			   struct file_deltas *fd)
 {
-	struct scoutfs_extent conv;
-	int err;
+	struct scoutfs_lock *delta_lock = NULL;
 	int ret;
 
-	if (WARN_ON_ONCE(!ext->map) ||
-	    WARN_ON_ONCE(!(ext->flags & SEF_UNWRITTEN)))
-		return -EINVAL;
-
-	scoutfs_extent_init(&conv, ext->type, ext->owner, start, len,
-			    ext->map + (start - ext->start), ext->flags);
-	ret = scoutfs_extent_remove(sb, data_extent_io, &conv, lock);
+	ret = scoutfs_lock_file_deltas(sb, DLM_LOCK_PR, 0, ino, &delta_lock);
 	if (ret)
-		goto out;
+		return ret;
 
-	conv.flags &= ~(SEF_UNWRITTEN | SEF_OFFLINE);
-	ret = scoutfs_extent_add(sb, data_extent_io, &conv, lock);
-	if (ret) {
-		conv.flags = ext->flags;
-		err = scoutfs_extent_add(sb, data_extent_io, &conv, lock);
-		BUG_ON(err);
-		goto out;
-	}
+	ret = read_file_deltas(sb, ino, UINT_MAX, false, fd, delta_lock);
+
+	scoutfs_unlock(sb, delta_lock, DLM_LOCK_PR);
 
-	scoutfs_inode_add_onoff(inode, len,
-				(ext->flags & SEF_OFFLINE) ? -len : 0);
-	*ext = conv;
-	ret = 0;
-out:
 	return ret;
 }
 
-static int scoutfs_get_block(struct inode *inode, sector_t iblock,
-			     struct buffer_head *bh, int create)
+/*
+ * Sum a file's pending deltas for callers that hold its inode lock.
+ * Like dir deltas, we skip the delta lock while we hold the inode lock
+ * in EX and have already seen that there are no deltas.  Returns the
+ * number of items that were summed.
+ */
+static int get_file_deltas(struct inode *inode, struct scoutfs_lock *lock,
+			   struct file_deltas *fd)
 {
 	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
 	struct super_block *sb = inode->i_sb;
-	struct scoutfs_lock *lock = NULL;
-	struct scoutfs_extent ext;
-	u64 next_iblock = 0;
-	u64 offset;
-	u64 len;
+	bool ex;
 	int ret;
 
-	WARN_ON_ONCE(create && !mutex_is_locked(&inode->i_mutex));
-
-	/* make sure caller holds a cluster lock */
-	lock = scoutfs_per_task_get(&si->pt_data_lock);
-	if (WARN_ON_ONCE(!lock) ||
-	    WARN_ON_ONCE(!create && si->staging)) {
-		ret = -EINVAL;
+	ex = scoutfs_lock_try_add_user(sb, lock, DLM_LOCK_EX);
+	if (ex && si->file_deltas_none_gen == lock->write_gen) {
+		scoutfs_inc_counter(sb, file_delta_skip);
+		ret = 0;
 		goto out;
 	}
 
-	/* look for the extent that overlaps our iblock */
-	scoutfs_extent_init(&ext, SCOUTFS_FILE_EXTENT_TYPE,
-			    scoutfs_ino(inode), iblock, 1, 0, 0);
-	ret = scoutfs_extent_next(sb, data_extent_io, &ext, lock);
-	if (ret && ret != -ENOENT)
-		goto out;
+	ret = sum_file_deltas(sb, scoutfs_ino(inode), fd);
+	if (ret == 0 && ex)
+		si->file_deltas_none_gen = lock->write_gen;
+out:
+	if (ex)
+		scoutfs_unlock(sb, lock, DLM_LOCK_EX);
+	return ret;
+}
 
-	if (ret == 0) {
-		trace_scoutfs_data_get_block_next(sb, &ext);
-		/* remember start of next to limit preallocation */
-		if (ext.start > iblock)
-			next_iblock = ext.start;
-	}
+/*
+ * Add a file's pending deltas to its attributes for getattr.  Our own
+ * writers have already grown i_size, sizes are only ever the greatest
+ * so it's fine to see them again in the deltas.
+ */
+int scoutfs_data_add_file_deltas(struct inode *inode,
+				 struct scoutfs_lock *lock, struct kstat *stat)
+{
+	struct file_deltas fd = {0,};
+	int ret;
 
-	/* didn't find an extent or it's past our iblock */
-	if (ret == -ENOENT || ext.start > iblock)
-		memset(&ext, 0, sizeof(ext));
+	ret = get_file_deltas(inode, lock, &fd);
+	if (ret <= 0)
+		return ret;
 
-	if (ext.len)
-		trace_scoutfs_data_get_block_intersection(sb, &ext);
+	stat->size = max_t(loff_t, stat->size, fd.size);
+	stat->blocks += fd.online << SCOUTFS_BLOCK_SECTOR_SHIFT;
+	if (timespec_compare(&fd.mtime, &stat->mtime) > 0)
+		stat->mtime = fd.mtime;
+	if (timespec_compare(&fd.mtime, &stat->ctime) > 0)
+		stat->ctime = fd.mtime;
 
-	/* fail read and write if it's offline and we're not staging */
-	if ((ext.flags & SEF_OFFLINE) && !si->staging) {
-		ret = -EINVAL;
-		goto out;
-	}
+	return 0;
+}
 
-	/* convert unwritten to written */
-	if (create && (ext.flags & SEF_UNWRITTEN)) {
-		ret = convert_unwritten(sb, inode, &ext, iblock, 1, lock);
-		if (ret == 0)
-			set_buffer_new(bh);
-		goto out;
-	}
+/*
+ * Add a file's pending deltas to the attributes returned by the bulk
+ * ioctls.  The caller holds the inode lock.
+ */
+int scoutfs_data_add_attrs_file_deltas(struct super_block *sb, u64 ino,
+				       struct scoutfs_ioctl_inode_attrs *attrs)
+{
+	struct file_deltas fd = {0,};
+	struct timespec ts;
+	int ret;
 
-	/* allocate an extent from our logical block */
-	if (create && !ext.map) {
-		/* limit possible alloc to this extent, next, or logical max */
-		if (ext.len > 0)
-			len = ext.len - (iblock - ext.start);
-		else if (next_iblock > iblock)
-			len = ext.start - iblock;
-		else
-			len = SCOUTFS_BLOCK_MAX - iblock;
+	ret = sum_file_deltas(sb, ino, &fd);
+	if (ret <= 0)
+		return ret;
 
-		ret = alloc_block(sb, inode, &ext, iblock, len, lock);
-		if (ret == 0)
-			set_buffer_new(bh);
-	} else {
-		ret = 0;
+	attrs->size = max(attrs->size, fd.size);
+	attrs->data_version += fd.data_version;
+	attrs->online_blocks += fd.online;
+
+	ts.tv_sec = attrs->mtime_sec;
+	ts.tv_nsec = attrs->mtime_nsec;
+	if (timespec_compare(&fd.mtime, &ts) > 0) {
+		attrs->mtime_sec = fd.mtime.tv_sec;
+		attrs->mtime_nsec = fd.mtime.tv_nsec;
 	}
 
-out:
-	/* map usable extent, else leave bh unmapped for sparse reads */
-	if (ret == 0 && ext.map && !(ext.flags & SEF_UNWRITTEN)) {
-		offset = iblock - ext.start;
-		map_bh(bh, inode->i_sb, ext.map + offset);
-		bh->b_size = min_t(u64, bh->b_size,
-				   (ext.len - offset) << SCOUTFS_BLOCK_SHIFT);
+	ts.tv_sec = attrs->ctime_sec;
+	ts.tv_nsec = attrs->ctime_nsec;
+	if (timespec_compare(&fd.mtime, &ts) > 0) {
+		attrs->ctime_sec = fd.mtime.tv_sec;
+		attrs->ctime_nsec = fd.mtime.tv_nsec;
 	}
 
-	trace_scoutfs_get_block(sb, scoutfs_ino(inode), iblock, create,
-				ret, bh->b_blocknr, bh->b_size);
-	return ret;
+	return 0;
 }
 
 /*
- * This is almost never used.  We can't block on a cluster lock while
- * holding the page lock because lock invalidation gets the page lock
- * while blocking locks.  If we can't use an existing lock then we drop
- * the page lock and try again.
+ * Grow our i_size to include the deltas of writers on other mounts for
+ * reads past our size and SEEK_END, which use i_size directly.  The
+ * caller holds i_mutex so our writers can't be changing the size.
  */
-static int scoutfs_readpage(struct file *file, struct page *page)
+int scoutfs_data_grow_size_deltas(struct inode *inode,
+				  struct scoutfs_lock *lock)
 {
-	struct inode *inode = file->f_inode;
-	struct super_block *sb = inode->i_sb;
-	struct scoutfs_lock *inode_lock = NULL;
-	int flags;
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct file_deltas fd = {0,};
 	int ret;
 
-	flags = SCOUTFS_LKF_REFRESH_INODE | SCOUTFS_LKF_NONBLOCK;
-	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, flags, inode, &inode_lock);
-	if (ret < 0) {
-		unlock_page(page);
-		if (ret == -EAGAIN) {
-			flags &= ~SCOUTFS_LKF_NONBLOCK;
-			ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, flags, inode,
-					   &inode_lock);
-			if (ret == 0) {
-				scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
-				ret = AOP_TRUNCATED_PAGE;
-			}
-		}
+	ret = get_file_deltas(inode, lock, &fd);
+	if (ret <= 0)
 		return ret;
+
+	if (fd.size > i_size_read(inode)) {
+		i_size_write(inode, fd.size);
+		si->file_delta_isize = max(si->file_delta_isize, fd.size);
 	}
 
-	ret = mpage_readpage(page, scoutfs_get_block);
-	scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
-	return ret;
+	return 0;
 }
 
-static int scoutfs_readpages(struct file *file, struct address_space *mapping,
-			     struct list_head *pages, unsigned nr_pages)
+/*
+ * Return the block past the last region that could contain extents,
+ * including regions that writers on other mounts have recorded in
+ * their deltas.  Callers that walk all of a file's extents stop here.
+ */
+static int get_extents_end(struct inode *inode, struct scoutfs_lock *lock,
+			   u64 *end)
 {
-	struct inode *inode = file->f_inode;
-	struct super_block *sb = inode->i_sb;
-	struct scoutfs_lock *inode_lock = NULL;
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct file_deltas fd = {0,};
 	int ret;
 
-	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, SCOUTFS_LKF_REFRESH_INODE,
-				 inode, &inode_lock);
-	if (ret)
+	ret = get_file_deltas(inode, lock, &fd);
+	if (ret < 0)
 		return ret;
 
-	ret = mpage_readpages(mapping, pages, nr_pages, scoutfs_get_block);
+	mutex_lock(&si->extent_mutex);
+	*end = max(si->extents_end, fd.extents_end);
+	mutex_unlock(&si->extent_mutex);
 
-	scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
-	return ret;
+	return 0;
 }
 
-static int scoutfs_writepage(struct page *page, struct writeback_control *wbc)
+/*
+ * Delete all of a deleted inode's delta items and return the greatest
+ * extents_end that they recorded so the caller can delete their
+ * extents.  Nothing can be writing to the inode.
+ */
+int scoutfs_data_delete_file_deltas(struct super_block *sb, u64 ino,
+				    u64 *extents_end)
 {
-	return block_write_full_page(page, scoutfs_get_block, wbc);
-}
+	struct scoutfs_lock *delta_lock = NULL;
+	struct file_deltas fd;
+	int ret;
 
-static int scoutfs_writepages(struct address_space *mapping,
-			      struct writeback_control *wbc)
-{
-	return mpage_writepages(mapping, wbc, scoutfs_get_block);
+	*extents_end = 0;
+
+	ret = scoutfs_lock_file_deltas(sb, DLM_LOCK_EX, 0, ino, &delta_lock);
+	if (ret)
+		return ret;
+
+	do {
+		memset(&fd, 0, sizeof(fd));
+		ret = scoutfs_hold_trans(sb,
+				SIC_FOLD_FILE_DELTAS(FOLD_FILE_DELTAS_BATCH));
+		if (ret == 0) {
+			ret = read_file_deltas(sb, ino, FOLD_FILE_DELTAS_BATCH,
+					       true, &fd, delta_lock);
+			scoutfs_release_trans(sb);
+		}
+		*extents_end = max(*extents_end, fd.extents_end);
+	} while (ret == FOLD_FILE_DELTAS_BATCH);
+
+	scoutfs_unlock(sb, delta_lock, DLM_LOCK_EX);
+
+	return ret < 0 ? ret : 0;
 }
 
 /* fsdata allocated in write_begin and freed in write_end */
 struct write_begin_data {
 	struct list_head ind_locks;
 	struct scoutfs_lock *lock;
+	struct scoutfs_data_locks *dl;
+	bool inline_page;
 };
 
+/*
+ * Cached pages can have buffers that were mapped to shared blocks by
+ * reads.  Writers unmap them so that get_block is called to copy the
+ * shared blocks before they're written.  Buffers can also still be
+ * mapped to the old shared blocks after unsharing copied them to a new
+ * allocation.  Those old blocks can be freed so they're unmapped too.
+ */
+static int unmap_shared_buffers(struct inode *inode, struct page *page,
+				struct scoutfs_lock *lock)
+{
+	struct buffer_head *head;
+	struct buffer_head *bh;
+	struct scoutfs_extent ext;
+	u64 iblock;
+	int ret;
+
+	if (!page_has_buffers(page))
+		return 0;
+
+	iblock = (u64)page->index << (PAGE_CACHE_SHIFT - SCOUTFS_BLOCK_SHIFT);
+	bh = head = page_buffers(page);
+	do {
+		if (buffer_mapped(bh) && !buffer_delay(bh)) {
+			ret = file_extent_next(inode, iblock, &ext, lock);
+			if (ret < 0 && ret != -ENOENT)
+				return ret;
+			if (ret == 0 && ext.start <= iblock &&
+			    ((ext.flags & SEF_SHARED) ||
+			     bh->b_blocknr != ext.map + (iblock - ext.start)))
+				clear_buffer_mapped(bh);
+		}
+		iblock++;
+	} while ((bh = bh->b_this_page) != head);
+
+	return 0;
+}
+
+/* block_write_begin() that unmaps shared buffers before mapping */
+static int write_begin_page(struct address_space *mapping, loff_t pos,
+			    unsigned len, unsigned flags, struct page **pagep,
+			    struct scoutfs_lock *lock)
+{
+	struct page *page;
+	int ret;
+
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_CACHE_SHIFT,
+					   flags);
+	if (!page)
+		return -ENOMEM;
+
+	ret = unmap_shared_buffers(mapping->host, page, lock) ?:
+	      __block_write_begin(page, pos, len, scoutfs_get_block_delay);
+	if (ret) {
+		unlock_page(page);
+		page_cache_release(page);
+		page = NULL;
+	}
+
+	*pagep = page;
+	return ret;
+}
+
+/*
+ * Lock and fill the first page for a write that fits in inline data.
+ * Returns 1 if the file is still inline and the page is locked, 0 if
+ * the write has to use blocks, or -errno.
+ */
+static int write_begin_inline(struct address_space *mapping, unsigned flags,
+			      struct page **pagep, struct scoutfs_lock *lock)
+{
+	struct inode *inode = mapping->host;
+	struct page *page;
+	int ret;
+
+	if (!inode_inline(inode))
+		return 0;
+
+	page = grab_cache_page_write_begin(mapping, 0, flags);
+	if (!page)
+		return -ENOMEM;
+
+	if (!inode_inline(inode)) {
+		ret = 0;
+	} else if (!PageUptodate(page)) {
+		ret = read_inline_page(inode, page, lock) ?: 1;
+	} else {
+		ret = 1;
+	}
+
+	if (ret <= 0) {
+		unlock_page(page);
+		page_cache_release(page);
+	} else {
+		*pagep = page;
+	}
+
+	return ret;
+}
+
+/*
+ * Writers hold the inode lock in EX, or in PR with the file deltas lock
+ * in CW when they only write blocks.  PR writers record the changes to
+ * the inode's attributes in their file delta instead of dirtying the
+ * inode item.
+ */
 static int scoutfs_write_begin(struct file *file,
 			       struct address_space *mapping, loff_t pos,
 			       unsigned len, unsigned flags,
@@ -856,6 +4157,8 @@ static int scoutfs_write_begin(struct file *file,
 	struct inode *inode = mapping->host;
 	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
 	struct super_block *sb = inode->i_sb;
+	SCOUTFS_DECLARE_PER_TASK_ENTRY(pt_ent);
+	struct scoutfs_data_locks *dl;
 	struct write_begin_data *wbd;
 	u64 ind_seq;
 	int ret;
@@ -869,20 +4172,47 @@ static int scoutfs_write_begin(struct file *file,
 	INIT_LIST_HEAD(&wbd->ind_locks);
 	*fsdata = wbd;
 
-	wbd->lock = scoutfs_per_task_get(&si->pt_data_lock);
-	if (WARN_ON_ONCE(!wbd->lock)) {
+	wbd->inline_page = false;
+
+	/* writers hold their locks across all the pages of the write */
+	dl = scoutfs_per_task_get(&si->pt_write_locks);
+	if (WARN_ON_ONCE(!dl || !dl->inode)) {
 		ret = -EINVAL;
 		goto out;
 	}
+	wbd->dl = dl;
+	wbd->lock = dl->inode;
 
-	do {
-		ret = scoutfs_inode_index_start(sb, &ind_seq) ?:
-		      scoutfs_inode_index_prepare(sb, &wbd->ind_locks, inode,
-						  true) ?:
-		      scoutfs_inode_index_try_lock_hold(sb, &wbd->ind_locks,
+	ret = lock_write_block(sb, inode, pos >> SCOUTFS_BLOCK_SHIFT, dl);
+	if (ret < 0)
+		goto out;
+
+	/* writes past the inline size first move the data to a block */
+	if (pos + len > SCOUTFS_INLINE_DATA_MAX_SIZE) {
+		ret = scoutfs_data_convert_inline(inode, wbd->lock);
+		if (ret < 0)
+			goto out;
+	}
+
+	ret = clear_unshared_extents(inode, pos >> SCOUTFS_BLOCK_SHIFT,
+				     (pos + len - 1) >> SCOUTFS_BLOCK_SHIFT,
+				     dl->region);
+	if (ret < 0)
+		goto out;
+
+	if (dl->deltas) {
+		ret = scoutfs_hold_trans(sb, SIC_WRITE_BEGIN());
+	} else {
+		do {
+			ret = scoutfs_inode_index_start(sb, &ind_seq) ?:
+			      scoutfs_inode_index_prepare(sb, &wbd->ind_locks,
+							  inode, true) ?:
+			      scoutfs_inode_index_try_lock_hold(sb,
+							&wbd->ind_locks,
 							ind_seq,
 							SIC_WRITE_BEGIN());
-	} while (ret > 0);
+		} while (ret > 0);
+	}
 	if (ret < 0)
 		goto out;
 
@@ -890,12 +4220,27 @@ static int scoutfs_write_begin(struct file *file,
 	flags |= AOP_FLAG_NOFS;
 
 	/* generic write_end updates i_size and calls dirty_inode */
-	ret = scoutfs_dirty_inode_item(inode, wbd->lock);
-	if (ret == 0)
-		ret = block_write_begin(mapping, pos, len, flags, pagep,
-					scoutfs_get_block);
-	if (ret)
+	if (!dl->deltas)
+		ret = scoutfs_dirty_inode_item(inode, wbd->lock);
+	if (ret == 0) {
+		ret = write_begin_inline(mapping, flags, pagep, wbd->lock);
+		if (ret > 0) {
+			wbd->inline_page = true;
+			ret = 0;
+		} else if (ret == 0) {
+			scoutfs_per_task_add(&si->pt_data_lock, &pt_ent,
+					     dl->region);
+			ret = write_begin_page(mapping, pos, len, flags, pagep,
+					       dl->region);
+			scoutfs_per_task_del(&si->pt_data_lock, &pt_ent);
+		}
+	}
+	if (ret) {
+		/* record blocks that get_block brought online */
+		if (dl->deltas && dl->online)
+			add_file_delta(inode, 0, dl);
 		scoutfs_release_trans(sb);
+	}
 out:
 	if (ret) {
 		scoutfs_inode_index_unlock(sb, &wbd->ind_locks);
@@ -918,6 +4263,43 @@ static int writepages_sync_none(struct address_space *mapping, loff_t start,
 	return mapping->a_ops->writepages(mapping, &wbc);
 }
 
+/*
+ * Store the first page's inline data in items once it's been written.
+ * The page is never dirtied so writeback never sees it.
+ */
+static int write_end_inline(struct inode *inode, loff_t pos, unsigned copied,
+			    struct page *page, struct scoutfs_lock *lock)
+{
+	struct super_block *sb = inode->i_sb;
+	loff_t old_size = i_size_read(inode);
+	void *addr;
+	int ret;
+
+	if (pos + copied > old_size)
+		i_size_write(inode, pos + copied);
+
+	addr = kmap(page);
+	ret = write_inline_items(sb, scoutfs_ino(inode), addr,
+				 inline_len(old_size),
+				 inline_len(i_size_read(inode)), lock);
+	kunmap(page);
+
+	/* the page has bytes that weren't stored, read it again */
+	if (ret < 0)
+		ClearPageUptodate(page);
+
+	unlock_page(page);
+	page_cache_release(page);
+
+	if (ret < 0) {
+		i_size_write(inode, old_size);
+		return ret;
+	}
+
+	scoutfs_inc_counter(sb, data_inline_write);
+	return copied;
+}
+
 static int scoutfs_write_end(struct file *file, struct address_space *mapping,
 			     loff_t pos, unsigned len, unsigned copied,
 			     struct page *page, void *fsdata)
@@ -926,46 +4308,198 @@ static int scoutfs_write_end(struct file *file, struct address_space *mapping,
 	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
 	struct super_block *sb = inode->i_sb;
 	struct write_begin_data *wbd = fsdata;
+	int err;
 	int ret;
 
 	trace_scoutfs_write_end(sb, scoutfs_ino(inode), page->index, (u64)pos,
 				len, copied);
 
-	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
-	if (ret > 0) {
+	if (wbd->inline_page)
+		ret = write_end_inline(inode, pos, copied, page, wbd->lock);
+	else
+		ret = generic_write_end(file, mapping, pos, len, copied, page,
+					fsdata);
+	if (wbd->dl->deltas && (ret > 0 || wbd->dl->online)) {
+		err = add_file_delta(inode, ret > 0 ? 1 : 0, wbd->dl);
+		if (err < 0 && ret >= 0)
+			ret = err;
+	} else if (ret > 0) {
 		if (!si->staging) {
 			scoutfs_inode_set_data_seq(inode);
 			scoutfs_inode_inc_data_version(inode);
 		}
 
 		scoutfs_update_inode_item(inode, wbd->lock, &wbd->ind_locks);
-		scoutfs_inode_queue_writeback(inode);
 	}
+	if (ret > 0)
+		scoutfs_inode_queue_writeback(inode);
 	scoutfs_release_trans(sb);
 	scoutfs_inode_index_unlock(sb, &wbd->ind_locks);
 	kfree(wbd);
 
-	/*
-	 * Currently transactions are kept very simple.  Only one is
-	 * open at a time and commit excludes concurrent dirtying.  It
-	 * writes out all dirty file data during commit.  This can lead
-	 * to very long commit latencies with lots of dirty file data.
-	 *
-	 * This hack tries to minimize these writeback latencies while
-	 * keeping concurrent large file strreaming writes from
-	 * suffering too terribly.  Every N bytes we kick off background
-	 * writbeack on the previous N bytes.  By the time transaction
-	 * commit comes along it will find that dirty file blocks have
-	 * already been written.
-	 */
-#define BACKGROUND_WRITEBACK_BYTES (16 * 1024 * 1024)
-#define BACKGROUND_WRITEBACK_MASK (BACKGROUND_WRITEBACK_BYTES - 1)
-	if (ret > 0 && ((pos + ret) & BACKGROUND_WRITEBACK_MASK) == 0)
-		writepages_sync_none(mapping,
-				     pos + ret - BACKGROUND_WRITEBACK_BYTES,
-				     pos + ret - 1);
+	/*
+	 * Currently transactions are kept very simple.  Only one is
+	 * open at a time and commit excludes concurrent dirtying.  It
+	 * writes out all dirty file data during commit.  This can lead
+	 * to very long commit latencies with lots of dirty file data.
+	 *
+	 * This hack tries to minimize these writeback latencies while
+	 * keeping concurrent large file strreaming writes from
+	 * suffering too terribly.  Every N bytes we kick off background
+	 * writbeack on the previous N bytes.  By the time transaction
+	 * commit comes along it will find that dirty file blocks have
+	 * already been written.
+	 */
+#define BACKGROUND_WRITEBACK_BYTES (16 * 1024 * 1024)
+#define BACKGROUND_WRITEBACK_MASK (BACKGROUND_WRITEBACK_BYTES - 1)
+	if (ret > 0 && ((pos + ret) & BACKGROUND_WRITEBACK_MASK) == 0)
+		writepages_sync_none(mapping,
+				     pos + ret - BACKGROUND_WRITEBACK_BYTES,
+				     pos + ret - 1);
+
+	return ret;
+}
+
+/*
+ * A shared writable mapping is about to dirty a page.  We get the
+ * cluster lock and a transaction and allocate or convert the page's
+ * blocks like write_begin, then update the inode as write_end would.
+ *
+ * We can't get i_mutex here so blocks aren't delayed.  Writeback could
+ * otherwise find delayed blocks that it didn't allocate while it
+ * thinks that writers are excluded.  get_block serializes modifying
+ * extents with other writers.
+ *
+ * Without i_mutex we also can't record a file delta, whose totals are
+ * serialized by i_mutex, so we update the inode under an EX lock.
+ *
+ * The page stays writable in the mapping until writeback cleans it.
+ * The commit that writes the page's dirty inode item writes the page,
+ * so downconverting the lock always writes and write protects pages
+ * dirtied under it.
+ */
+static int scoutfs_page_mkwrite(struct vm_area_struct *vma,
+				struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vma->vm_file);
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	SCOUTFS_DECLARE_PER_TASK_ENTRY(pt_ent);
+	struct scoutfs_lock *lock = NULL;
+	LIST_HEAD(ind_locks);
+	struct scoutfs_data_locks dl;
+	u64 ind_seq;
+	u64 iblock;
+	int ret;
+
+	sb_start_pagefault(sb);
+
+	dl.file = NULL;
+	dl.region = NULL;
+
+	iblock = (u64)vmf->page->index <<
+		 (PAGE_CACHE_SHIFT - SCOUTFS_BLOCK_SHIFT);
+
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_EX, SCOUTFS_LKF_REFRESH_INODE,
+				 inode, &lock) ?:
+	      lock_data_block(sb, DLM_LOCK_EX, 0, inode, iblock, &dl) ?:
+	      scoutfs_data_convert_inline(inode, lock) ?:
+	      clear_unshared_extents(inode, iblock,
+				     iblock + SCOUTFS_BLOCKS_PER_PAGE - 1,
+				     dl.region);
+	if (ret)
+		goto out;
+
+	do {
+		ret = scoutfs_inode_index_start(sb, &ind_seq) ?:
+		      scoutfs_inode_index_prepare(sb, &ind_locks, inode,
+						  true) ?:
+		      scoutfs_inode_index_try_lock_hold(sb, &ind_locks,
+							ind_seq,
+							SIC_WRITE_BEGIN());
+	} while (ret > 0);
+	if (ret < 0)
+		goto unlock;
+
+	ret = scoutfs_dirty_inode_item(inode, lock);
+	if (ret == 0) {
+		lock_page(vmf->page);
+		ret = unmap_shared_buffers(inode, vmf->page, dl.region);
+		unlock_page(vmf->page);
+	}
+	if (ret == 0) {
+		scoutfs_per_task_add(&si->pt_data_lock, &pt_ent, dl.region);
+		ret = __block_page_mkwrite(vma, vmf, scoutfs_get_block);
+		scoutfs_per_task_del(&si->pt_data_lock, &pt_ent);
+	}
+	if (ret == 0) {
+		scoutfs_inc_counter(sb, data_page_mkwrite);
+		inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+		scoutfs_inode_set_data_seq(inode);
+		scoutfs_inode_inc_data_version(inode);
+		scoutfs_update_inode_item(inode, lock, &ind_locks);
+		scoutfs_inode_queue_writeback(inode);
+	}
+
+	scoutfs_release_trans(sb);
+unlock:
+	scoutfs_inode_index_unlock(sb, &ind_locks);
+out:
+	unlock_data_block(sb, &dl);
+	scoutfs_unlock(sb, lock, DLM_LOCK_EX);
+	sb_end_pagefault(sb);
+
+	return block_page_mkwrite_return(ret);
+}
+
+/*
+ * Make sure that we have free blocks for the rest of a large fallocate
+ * by asking the server for them in one request, rather than growing
+ * our grants as fallocate consumes them.  The reserved blocks aren't
+ * returned to the server until fallocate has used them or finished.
+ * The reservation can be larger than what the server gives us or what
+ * fallocate uses, that only delays returning free blocks.
+ *
+ * The caller holds the transaction and alloc_rwsem.
+ */
+static int reserve_fallocate_blocks(struct super_block *sb, u64 blocks,
+				    u64 *reserved)
+{
+	DECLARE_DATA_INFO(sb, datinf);
+	s64 avail;
+	int ret;
+
+	if (*reserved > 0)
+		return 0;
+
+	blocks = min(blocks, FALLOCATE_RESERVE_MAX_BLOCKS);
+	avail = atomic64_read(&datinf->node_free_blocks) -
+		atomic64_read(&datinf->delayed_blocks) -
+		atomic64_read(&datinf->fallocate_blocks);
+
+	if (avail < (s64)blocks) {
+		ret = add_server_extent(sb, ALIGN(blocks - max(avail, 0LL),
+						  SCOUTFS_SEGMENT_BLOCKS));
+		/* allocation will find whatever free blocks remain */
+		if (ret < 0 && ret != -ENOSPC)
+			return ret;
+		if (ret == 0)
+			scoutfs_inc_counter(sb, data_fallocate_reserve);
+	}
+
+	atomic64_add(blocks, &datinf->fallocate_blocks);
+	*reserved = blocks;
+	return 0;
+}
 
-	return ret;
+static void use_fallocate_blocks(struct super_block *sb, u64 blocks,
+				 u64 *reserved)
+{
+	DECLARE_DATA_INFO(sb, datinf);
+
+	blocks = min(blocks, *reserved);
+	atomic64_sub(blocks, &datinf->fallocate_blocks);
+	*reserved -= blocks;
 }
 
 /*
@@ -974,7 +4508,8 @@ static int scoutfs_write_end(struct file *file, struct address_space *mapping,
  * existing overlapping extent to remove.
  *
  * We allocate the largest extent that we can and return its length or
- * -errno.
+ * -errno.  We first use the free extents that fallocate reserved before
+ * asking the server for more.
  */
 static s64 fallocate_one_extent(struct super_block *sb, u64 ino, u64 start,
 				u64 len, u8 flags, u8 rem_flags,
@@ -994,7 +4529,9 @@ static s64 fallocate_one_extent(struct super_block *sb, u64 ino, u64 start,
 		goto out;
 	}
 
-	ret = find_free_extent(sb, len, &fr);
+	ret = next_free_extent(sb, min(len, FALLOCATE_EXTENT_BLOCKS), &fr);
+	if (ret == -ENOENT)
+		ret = find_free_extent(sb, len, &fr);
 	if (ret < 0)
 		goto out;
 
@@ -1034,143 +4571,636 @@ out:
 }
 
 /*
- * Modify the extents that map the blocks that store the len byte region
- * starting at offset.
- *
- * The caller has only prevented freezing by entering a fs write
- * context.  We're responsible for all other locking and consistency.
+ * Allocate unwritten extents for the sparse and unallocated blocks at
+ * the start of the given range.  Allocated extents are skipped.  Returns
+ * the number of blocks that were allocated or skipped, and sets
+ * *allocated, or -errno.
+ */
+static s64 fallocate_next(struct super_block *sb, u64 ino, u64 iblock,
+			  u64 last_block, u64 *allocated,
+			  struct scoutfs_lock *lock)
+{
+	struct scoutfs_extent ext;
+	u8 rem_flags;
+	u8 flags;
+	s64 blocks;
+	int ret;
+
+	*allocated = 0;
+
+	scoutfs_extent_init(&ext, SCOUTFS_FILE_EXTENT_TYPE,
+			    ino, iblock, 1, 0, 0);
+	ret = scoutfs_extent_next(sb, data_extent_io, &ext, lock);
+	if (ret < 0 && ret != -ENOENT)
+		return ret;
+
+	blocks = last_block - iblock + 1;
+	flags = SEF_UNWRITTEN;
+	rem_flags = 0;
+
+	if (ret == -ENOENT || ext.start > last_block) {
+		/* no next extent or past us, all remaining blocks */
+
+	} else if (iblock < ext.start) {
+		/* sparse region until next extent */
+		blocks = min_t(u64, blocks, ext.start - iblock);
+
+	} else if (ext.map > 0) {
+		/* skip past an allocated extent */
+		return min_t(u64, blocks, (ext.start + ext.len) - iblock);
+
+	} else {
+		/* allocating a portion of an unallocated extent */
+		blocks = min_t(u64, blocks, (ext.start + ext.len) - iblock);
+		flags |= ext.flags;
+		rem_flags = ext.flags;
+		/* XXX corruption; why'd we store map == flags == 0? */
+		if (rem_flags == 0)
+			return -EIO;
+	}
+
+	blocks = fallocate_one_extent(sb, ino, iblock, blocks, flags,
+				      rem_flags, lock);
+	if (blocks > 0)
+		*allocated = blocks;
+	return blocks;
+}
+
+/*
+ * Modify the extents that map the blocks that store the len byte region
+ * starting at offset.
+ *
+ * Free blocks for the range are reserved from the server in large
+ * requests and each transaction hold adds a batch of extents so that
+ * large preallocations only take a few transactions.  Extents are
+ * added a data region at a time under the region's EX lock.
+ *
+ * The caller has only prevented freezing by entering a fs write
+ * context.  We're responsible for all other locking and consistency.
+ */
+long scoutfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	const u64 ino = scoutfs_ino(inode);
+	struct scoutfs_lock *region_lock = NULL;
+	struct scoutfs_lock *lock = NULL;
+	DECLARE_DATA_INFO(sb, datinf);
+	LIST_HEAD(ind_locks);
+	unsigned int nr;
+	u64 reserved = 0;
+	u64 allocated;
+	u64 last_block;
+	u64 iblock;
+	u64 rlast;
+	s64 blocks;
+	loff_t end;
+	int ret;
+
+	mutex_lock(&inode->i_mutex);
+
+	/* XXX support more flags */
+        if (mode & ~(FALLOC_FL_KEEP_SIZE)) {
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+
+	/* catch wrapping */
+	if (offset + len < offset) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (len == 0) {
+		ret = 0;
+		goto out;
+	}
+
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_EX, SCOUTFS_LKF_REFRESH_INODE,
+				 inode, &lock);
+	if (ret)
+		goto out;
+
+	/* don't allocate around extents left by a background truncate */
+	ret = scoutfs_data_fold_file_deltas(inode, lock) ?:
+	      scoutfs_complete_truncate(inode, lock) ?:
+	      scoutfs_data_convert_inline(inode, lock);
+	if (ret)
+		goto out;
+
+	inode_dio_wait(inode);
+
+	/* allocate delayed blocks before we add extents in their holes */
+	ret = filemap_write_and_wait_range(inode->i_mapping, offset,
+					   offset + len - 1);
+	if (ret)
+		goto out;
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) &&
+	    (offset + len > i_size_read(inode))) {
+                ret = inode_newsize_ok(inode, offset + len);
+                if (ret)
+                        goto out;
+        }
+
+	iblock = offset >> SCOUTFS_BLOCK_SHIFT;
+	last_block = (offset + len - 1) >> SCOUTFS_BLOCK_SHIFT;
+
+	while (iblock <= last_block) {
+		if (region_lock == NULL) {
+			ret = scoutfs_lock_data_region(sb, DLM_LOCK_EX, 0, ino,
+						       iblock, &region_lock);
+			if (ret)
+				goto out;
+			rlast = min(last_block, region_last(iblock));
+		}
+
+		ret = scoutfs_inode_index_lock_hold(inode, &ind_locks, false,
+				SIC_FALLOCATE_EXTENTS(FALLOCATE_CHUNK_EXTENTS));
+		if (ret)
+			goto out;
+
+		mutex_lock(&si->extent_mutex);
+		down_write(&datinf->alloc_rwsem);
+		set_extents_end(inode, iblock);
+		ret = reserve_fallocate_blocks(sb, last_block - iblock + 1,
+					       &reserved);
+		for (nr = 0; ret == 0 && iblock <= rlast &&
+			     nr < FALLOCATE_CHUNK_EXTENTS; nr++) {
+			blocks = fallocate_next(sb, ino, iblock, rlast,
+						&allocated, region_lock);
+			if (blocks < 0) {
+				ret = blocks;
+			} else {
+				use_fallocate_blocks(sb, allocated, &reserved);
+				iblock += blocks;
+			}
+		}
+		up_write(&datinf->alloc_rwsem);
+		invalidate_extent_cache(inode);
+		mutex_unlock(&si->extent_mutex);
+
+		if (ret == 0 && !(mode & FALLOC_FL_KEEP_SIZE)) {
+			end = iblock << SCOUTFS_BLOCK_SHIFT;
+			if (end == 0 || end > offset + len)
+				end = offset + len;
+			if (end > i_size_read(inode))
+				i_size_write(inode, end);
+			scoutfs_update_inode_item(inode, lock, &ind_locks);
+		}
+		scoutfs_release_trans(sb);
+		scoutfs_inode_index_unlock(sb, &ind_locks);
+
+		if (ret)
+			goto out;
+
+		if (iblock > rlast) {
+			scoutfs_unlock(sb, region_lock, DLM_LOCK_EX);
+			region_lock = NULL;
+		}
+	}
+
+out:
+	/* return unused reserved blocks */
+	if (reserved) {
+		use_fallocate_blocks(sb, reserved, &reserved);
+		if (atomic64_read(&datinf->node_free_blocks) >
+		    free_high_water(datinf))
+			queue_work(datinf->workq, &datinf->return_work);
+	}
+	scoutfs_unlock(sb, region_lock, DLM_LOCK_EX);
+	scoutfs_unlock(sb, lock, DLM_LOCK_EX);
+	mutex_unlock(&inode->i_mutex);
+
+	trace_scoutfs_data_fallocate(sb, ino, mode, offset, len, ret);
+	return ret;
+}
+
+/*
+ * Allocate unwritten extents for the offline regions in the given
+ * blocks so that a following stage writes into large extents instead
+ * of allocating as it writes each page.  Sparse and allocated regions
+ * are skipped.  The extents stay offline until they're written so the
+ * inode's counts don't change.  Each data region's extents are
+ * searched and modified under its EX lock.
+ *
+ * The caller holds i_mutex and the EX inode lock and has folded the
+ * file's deltas.
+ */
+int scoutfs_data_prealloc_offline(struct inode *inode, u64 iblock, u64 last,
+				  struct scoutfs_lock *lock)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	const u64 ino = scoutfs_ino(inode);
+	DECLARE_DATA_INFO(sb, datinf);
+	struct scoutfs_lock *region_lock = NULL;
+	struct scoutfs_extent ext;
+	u64 start;
+	u64 rlast;
+	s64 blocks;
+	int ret = 0;
+
+	/* offline extents are only in the regions the file has used */
+	if (iblock >= si->extents_end)
+		return 0;
+	last = min(last, si->extents_end - 1);
+
+	while (iblock <= last) {
+		if (region_lock == NULL) {
+			ret = scoutfs_lock_data_region(sb, DLM_LOCK_EX, 0, ino,
+						       iblock, &region_lock);
+			if (ret)
+				break;
+			rlast = min(last, region_last(iblock));
+		}
+
+		scoutfs_extent_init(&ext, SCOUTFS_FILE_EXTENT_TYPE,
+				    ino, iblock, 1, 0, 0);
+		ret = scoutfs_extent_next(sb, data_extent_io, &ext,
+					  region_lock);
+		if (ret < 0 && ret != -ENOENT)
+			break;
+		if (ret == -ENOENT || ext.start > rlast) {
+			ret = 0;
+			scoutfs_unlock(sb, region_lock, DLM_LOCK_EX);
+			region_lock = NULL;
+			if (rlast == last)
+				break;
+			iblock = rlast + 1;
+			continue;
+		}
+
+		start = max(iblock, ext.start);
+		blocks = min(rlast, ext.start + ext.len - 1) - start + 1;
+
+		if (ext.map || !(ext.flags & SEF_OFFLINE)) {
+			iblock = start + blocks;
+			continue;
+		}
+
+		ret = scoutfs_hold_trans(sb, SIC_FALLOCATE_EXTENTS(1));
+		if (ret)
+			break;
+
+		mutex_lock(&si->extent_mutex);
+		down_write(&datinf->alloc_rwsem);
+		blocks = fallocate_one_extent(sb, ino, start, blocks,
+					      ext.flags | SEF_UNWRITTEN,
+					      ext.flags, region_lock);
+		up_write(&datinf->alloc_rwsem);
+		invalidate_extent_cache(inode);
+		mutex_unlock(&si->extent_mutex);
+
+		scoutfs_release_trans(sb);
+
+		if (blocks < 0) {
+			ret = blocks;
+			break;
+		}
+
+		scoutfs_add_counter(sb, data_prealloc_offline, blocks);
+		iblock = start + blocks;
+	}
+
+	scoutfs_unlock(sb, region_lock, DLM_LOCK_EX);
+
+	return ret;
+}
+
+/*
+ * Free the unwritten blocks that prealloc_offline allocated in the
+ * given blocks that staging didn't write.  The extents are left offline
+ * without blocks, as they were before they were preallocated.  Other
+ * extents are skipped.  Failed writes can leave delayed buffers in the
+ * blocks' cached pages which would convert the freed extents so the
+ * pages are truncated first.  Extents are found in each region under
+ * its lock and truncate_items locks the region again to free them.
+ *
+ * The caller holds i_mutex and the EX inode lock and has folded the
+ * file's deltas.
+ */
+int scoutfs_data_unprealloc_offline(struct inode *inode, u64 iblock,
+				    u64 last, struct scoutfs_lock *lock)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	const u64 ino = scoutfs_ino(inode);
+	struct scoutfs_lock *region_lock = NULL;
+	struct scoutfs_extent ext;
+	u64 start;
+	u64 end;
+	int ret = 0;
+
+	truncate_inode_pages_range(inode->i_mapping,
+				   iblock << SCOUTFS_BLOCK_SHIFT,
+				   ((last + 1) << SCOUTFS_BLOCK_SHIFT) - 1);
+
+	if (iblock >= si->extents_end)
+		return 0;
+	last = min(last, si->extents_end - 1);
+
+	while (iblock <= last) {
+		ret = scoutfs_lock_data_region(sb, DLM_LOCK_EX, 0, ino, iblock,
+					       &region_lock);
+		if (ret)
+			break;
+
+		scoutfs_extent_init(&ext, SCOUTFS_FILE_EXTENT_TYPE,
+				    ino, iblock, 1, 0, 0);
+		ret = scoutfs_extent_next(sb, data_extent_io, &ext,
+					  region_lock);
+		scoutfs_unlock(sb, region_lock, DLM_LOCK_EX);
+		if (ret < 0 && ret != -ENOENT)
+			break;
+		if (ret == -ENOENT) {
+			ret = 0;
+			if (region_last(iblock) >= last)
+				break;
+			iblock = region_last(iblock) + 1;
+			continue;
+		}
+		if (ext.start > last)
+			break;
+
+		start = max(iblock, ext.start);
+		end = min(last, ext.start + ext.len - 1);
+
+		if (ext.map && (ext.flags & SEF_OFFLINE) &&
+		    (ext.flags & SEF_UNWRITTEN)) {
+			ret = scoutfs_data_truncate_items(sb, inode, ino,
+							  start, end, true,
+							  false, lock);
+			if (ret)
+				break;
+			scoutfs_add_counter(sb, data_unprealloc_offline,
+					    end - start + 1);
+		}
+
+		iblock = end + 1;
+	}
+
+	return ret;
+}
+
+/*
+ * Start writeback of a range of dirty pages without waiting for it.
+ */
+int scoutfs_data_start_writeback(struct inode *inode, loff_t start,
+				 loff_t end)
+{
+	return writepages_sync_none(inode->i_mapping, start, end);
+}
+
+/*
+ * Add a reader's wait to the request that covers its blocks, merging
+ * with any requests that overlap or are adjacent.  Merged requests
+ * cover all the ranges of their waiters so a waiter can always find the
+ * request that contains its range.
+ */
+static void add_wait_req(struct super_block *sb, struct scoutfs_data_wait *dw,
+			 struct data_wait_req *new)
+{
+	u64 ino = dw->ino;
+	u64 start = dw->start;
+	u64 last = dw->last;
+	DECLARE_DATA_INFO(sb, datinf);
+	struct data_wait_req *req = NULL;
+	struct data_wait_req *pos;
+	struct data_wait_req *tmp;
+	bool created = false;
+
+	spin_lock(&datinf->wait_lock);
+
+	list_for_each_entry(pos, &datinf->wait_reqs, head) {
+		if (pos->ino > ino || (pos->ino == ino && pos->start > last + 1))
+			break;
+		if (pos->ino == ino && pos->last + 1 >= start) {
+			req = pos;
+			break;
+		}
+	}
+
+	if (req) {
+		req->start = min(req->start, start);
+		req->last = max(req->last, last);
+		req->nr_waiters++;
+
+		/* absorb following requests that now overlap */
+		pos = req;
+		list_for_each_entry_safe_continue(pos, tmp, &datinf->wait_reqs,
+						  head) {
+			if (pos->ino != ino || pos->start > req->last + 1)
+				break;
+			req->last = max(req->last, pos->last);
+			req->nr_waiters += pos->nr_waiters;
+			list_del(&pos->head);
+			kfree(pos);
+		}
+	} else {
+		new->ino = ino;
+		new->start = start;
+		new->last = last;
+		new->nr_waiters = 1;
+		list_add_tail(&new->head, &pos->head);
+		created = true;
+	}
+
+	init_waitqueue_head(&dw->waitq);
+	dw->woken = false;
+	list_add_tail(&dw->head, &datinf->waiters);
+
+	spin_unlock(&datinf->wait_lock);
+
+	if (created) {
+		scoutfs_inc_counter(sb, data_wait_request);
+		wake_up(&datinf->waiting_waitq);
+	} else {
+		kfree(new);
+	}
+}
+
+static void del_wait_req(struct super_block *sb, struct scoutfs_data_wait *dw)
+{
+	DECLARE_DATA_INFO(sb, datinf);
+	struct data_wait_req *req;
+
+	spin_lock(&datinf->wait_lock);
+	list_del_init(&dw->head);
+	list_for_each_entry(req, &datinf->wait_reqs, head) {
+		if (req->ino == dw->ino && req->start <= dw->start &&
+		    req->last >= dw->last) {
+			if (--req->nr_waiters == 0) {
+				list_del(&req->head);
+				kfree(req);
+			}
+			break;
+		}
+	}
+	spin_unlock(&datinf->wait_lock);
+}
+
+/*
+ * Readers call this before reading the page cache.  If there are
+ * offline blocks in the read then we record the reader's wait for the
+ * first offline region and return 1.  The caller must then unlock and
+ * call _data_wait before retrying.  Returns 0 if the read can proceed.
  */
-long scoutfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+int scoutfs_data_wait_check(struct inode *inode, loff_t pos, size_t len,
+			    struct scoutfs_lock *lock,
+			    struct scoutfs_data_wait *dw)
 {
-	struct inode *inode = file_inode(file);
 	struct super_block *sb = inode->i_sb;
-	const u64 ino = scoutfs_ino(inode);
-	struct scoutfs_lock *lock = NULL;
-	DECLARE_DATA_INFO(sb, datinf);
+	struct data_wait_req *new;
 	struct scoutfs_extent ext;
-	LIST_HEAD(ind_locks);
-	u64 last_block;
+	loff_t isize = i_size_read(inode);
 	u64 iblock;
-	s64 blocks;
-	loff_t end;
-	u8 rem_flags;
-	u8 flags;
+	u64 last;
+	s64 on;
+	s64 off;
 	int ret;
 
-	mutex_lock(&inode->i_mutex);
+	if (len == 0 || pos >= isize)
+		return 0;
 
-	/* XXX support more flags */
-        if (mode & ~(FALLOC_FL_KEEP_SIZE)) {
-		ret = -EOPNOTSUPP;
-		goto out;
-	}
+	/* only staging, under an EX lock, brings offline blocks online */
+	scoutfs_inode_get_onoff(inode, &on, &off);
+	if (off == 0)
+		return 0;
 
-	/* catch wrapping */
-	if (offset + len < offset) {
-		ret = -EINVAL;
-		goto out;
-	}
+	len = min_t(loff_t, len, isize - pos);
+	iblock = pos >> SCOUTFS_BLOCK_SHIFT;
+	last = (pos + len - 1) >> SCOUTFS_BLOCK_SHIFT;
 
-	if (len == 0) {
-		ret = 0;
-		goto out;
-	}
+	/* staging needs an EX lock so it can't race with our PR search */
+	while (iblock <= last) {
+		ret = next_extent_regions(inode, iblock, last + 1, &ext);
+		if (ret < 0) {
+			if (ret == -ENOENT)
+				ret = 0;
+			return ret;
+		}
+		if (ext.start > last)
+			break;
 
-	ret = scoutfs_lock_inode(sb, DLM_LOCK_EX, SCOUTFS_LKF_REFRESH_INODE,
-				 inode, &lock);
-	if (ret)
-		goto out;
+		if (ext.flags & SEF_OFFLINE) {
+			new = kmalloc(sizeof(struct data_wait_req), GFP_NOFS);
+			if (!new)
+				return -ENOMEM;
 
-	inode_dio_wait(inode);
+			dw->ino = scoutfs_ino(inode);
+			dw->start = max(iblock, ext.start);
+			dw->last = min(last, ext.start + ext.len - 1);
+			add_wait_req(sb, dw, new);
+			return 1;
+		}
 
-	if (!(mode & FALLOC_FL_KEEP_SIZE) &&
-	    (offset + len > i_size_read(inode))) {
-                ret = inode_newsize_ok(inode, offset + len);
-                if (ret)
-                        goto out;
-        }
+		iblock = ext.start + ext.len;
+	}
 
-	iblock = offset >> SCOUTFS_BLOCK_SHIFT;
-	last_block = (offset + len - 1) >> SCOUTFS_BLOCK_SHIFT;
+	return 0;
+}
 
-	while(iblock <= last_block) {
+/*
+ * Wait for the range of offline blocks that a reader found to be
+ * staged.  Local staging of an overlapping range wakes us.  Staging on
+ * other nodes invalidates our lock without waking so we also wake up
+ * periodically to check.  Returns 0 when the caller should retry the
+ * read.
+ */
+static int data_wait(struct super_block *sb, struct scoutfs_data_wait *dw,
+		     int state)
+{
+	DEFINE_WAIT(wait);
+	int ret = 0;
 
-		scoutfs_extent_init(&ext, SCOUTFS_FILE_EXTENT_TYPE,
-				    ino, iblock, 1, 0, 0);
-		ret = scoutfs_extent_next(sb, data_extent_io, &ext, lock);
-		if (ret < 0 && ret != -ENOENT)
-			goto out;
+	scoutfs_inc_counter(sb, data_wait);
 
-		blocks = last_block - iblock + 1;
-		flags = SEF_UNWRITTEN;
-		rem_flags = 0;
+	prepare_to_wait(&dw->waitq, &wait, state);
+	if (!dw->woken) {
+		if (signal_pending_state(state, current))
+			ret = -ERESTARTSYS;
+		else
+			schedule_timeout(DATA_WAIT_RECHECK_JIFFIES);
+	}
+	finish_wait(&dw->waitq, &wait);
+	del_wait_req(sb, dw);
 
-		if (ret == -ENOENT || ext.start > last_block) {
-			/* no next extent or past us, all remaining blocks */
+	return ret;
+}
 
-		} else if (iblock < ext.start) {
-			/* sparse region until next extent */
-			blocks = min_t(u64, blocks, ext.start - iblock);
+int scoutfs_data_wait(struct inode *inode, struct scoutfs_data_wait *dw)
+{
+	return data_wait(inode->i_sb, dw, TASK_INTERRUPTIBLE);
+}
 
-		} else if (ext.map > 0) {
-			/* skip past an allocated extent */
-			blocks = min_t(u64, blocks,
-				      (ext.start + ext.len) - iblock);
-			iblock += blocks;
-			blocks = 0;
+/*
+ * Wake the readers that are waiting for offline blocks that intersect
+ * with a range of a file whose extents have been staged or truncated.
+ */
+void scoutfs_data_wake_waiters(struct super_block *sb, u64 ino, u64 start,
+			       u64 last)
+{
+	DECLARE_DATA_INFO(sb, datinf);
+	struct scoutfs_data_wait *dw;
 
-		} else {
-			/* allocating a portion of an unallocated extent */
-			blocks = min_t(u64, blocks,
-				       (ext.start + ext.len) - iblock);
-			flags |= ext.flags;
-			rem_flags = ext.flags;
-			/* XXX corruption; why'd we store map == flags == 0? */
-			if (rem_flags == 0) {
-				ret = -EIO;
-				goto out;
-			}
+	spin_lock(&datinf->wait_lock);
+	list_for_each_entry(dw, &datinf->waiters, head) {
+		if (dw->ino == ino && dw->start <= last && dw->last >= start) {
+			dw->woken = true;
+			wake_up(&dw->waitq);
 		}
+	}
+	spin_unlock(&datinf->wait_lock);
+}
 
-		ret = scoutfs_inode_index_lock_hold(inode, &ind_locks, false,
-						    SIC_FALLOCATE_ONE());
-		if (ret)
-			goto out;
+static unsigned int fill_waiting(struct data_info *datinf, u64 ino,
+				 u64 iblock,
+				 struct scoutfs_ioctl_data_waiting_entry *dwe,
+				 unsigned int nr)
+{
+	struct data_wait_req *req;
+	unsigned int i = 0;
 
-		if (blocks > 0) {
-			down_write(&datinf->alloc_rwsem);
-			blocks = fallocate_one_extent(sb, ino, iblock, blocks,
-						      flags, rem_flags, lock);
-			up_write(&datinf->alloc_rwsem);
-			if (blocks < 0)
-				ret = blocks;
-			else
-				ret = 0;
-		}
+	spin_lock(&datinf->wait_lock);
+	list_for_each_entry(req, &datinf->wait_reqs, head) {
+		if (i == nr)
+			break;
+		if (req->ino < ino || (req->ino == ino && req->start < iblock))
+			continue;
+
+		dwe[i].ino = req->ino;
+		dwe[i].iblock = req->start;
+		dwe[i].count = req->last - req->start + 1;
+		dwe[i].nr_waiters = req->nr_waiters;
+		i++;
+	}
+	spin_unlock(&datinf->wait_lock);
 
-		if (ret == 0 && !(mode & FALLOC_FL_KEEP_SIZE)) {
-			end = (iblock + blocks) << SCOUTFS_BLOCK_SHIFT;
-			if (end == 0 || end > offset + len)
-				end = offset + len;
-			if (end > i_size_read(inode))
-				i_size_write(inode, end);
-			scoutfs_update_inode_item(inode, lock, &ind_locks);
-		}
-		scoutfs_release_trans(sb);
-		scoutfs_inode_index_unlock(sb, &ind_locks);
+	return i;
+}
 
-		if (ret)
-			goto out;
+/*
+ * Fill the caller's entries with the staging requests at or after the
+ * given inode and block.  If @block is set we wait for a request to
+ * arrive if there aren't any.  Returns the number of entries filled.
+ */
+int scoutfs_data_waiting(struct super_block *sb, u64 ino, u64 iblock,
+			 struct scoutfs_ioctl_data_waiting_entry *dwe,
+			 unsigned int nr, bool block)
+{
+	DECLARE_DATA_INFO(sb, datinf);
+	unsigned int filled = 0;
+	int ret;
 
-		iblock += blocks;
-	}
+	if (!block)
+		return fill_waiting(datinf, ino, iblock, dwe, nr);
 
-out:
-	scoutfs_unlock(sb, lock, DLM_LOCK_EX);
-	mutex_unlock(&inode->i_mutex);
+	ret = wait_event_interruptible(datinf->waiting_waitq,
+			(filled = fill_waiting(datinf, ino, iblock, dwe, nr)));
 
-	trace_scoutfs_data_fallocate(sb, ino, mode, offset, len, ret);
-	return ret;
+	return ret ?: filled;
 }
 
 
@@ -1186,6 +5216,7 @@ int scoutfs_data_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 	struct scoutfs_lock *inode_lock = NULL;
 	struct scoutfs_extent ext;
 	u64 blk_off;
+	u64 end;
 	u64 logical = 0;
 	u64 phys = 0;
 	u64 size = 0;
@@ -1196,19 +5227,30 @@ int scoutfs_data_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 	if (ret)
 		return ret;
 
-	/* XXX overkill? */
-	mutex_lock(&inode->i_mutex);
-
 	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, 0, inode, &inode_lock);
 	if (ret)
 		goto out;
 
+	if (inode_inline(inode)) {
+		size = inline_len(i_size_read(inode));
+		if (start < size)
+			ret = fiemap_fill_next_extent(fieinfo, 0, 0, size,
+						FIEMAP_EXTENT_DATA_INLINE |
+						FIEMAP_EXTENT_NOT_ALIGNED |
+						FIEMAP_EXTENT_LAST);
+		if (ret == 1)
+			ret = 0;
+		goto unlock;
+	}
+
+	ret = get_extents_end(inode, inode_lock, &end);
+	if (ret)
+		goto unlock;
+
 	blk_off = start >> SCOUTFS_BLOCK_SHIFT;
 
 	for (;;) {
-		scoutfs_extent_init(&ext, SCOUTFS_FILE_EXTENT_TYPE,
-				    scoutfs_ino(inode), blk_off, 1, 0, 0);
-		ret = scoutfs_extent_next(sb, data_extent_io, &ext, inode_lock);
+		ret = next_extent_regions(inode, blk_off, end, &ext);
 		/* fiemap will return last and stop when we see enoent */
 		if (ret < 0 && ret != -ENOENT)
 			break;
@@ -1236,17 +5278,244 @@ int scoutfs_data_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 			flags |= FIEMAP_EXTENT_UNKNOWN;
 		if (ext.flags & SEF_UNWRITTEN)
 			flags |= FIEMAP_EXTENT_UNWRITTEN;
+		if (ext.flags & SEF_SHARED)
+			flags |= FIEMAP_EXTENT_SHARED;
 
 		blk_off = ext.start + ext.len;
 	}
 
+unlock:
 	scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
 out:
-	mutex_unlock(&inode->i_mutex);
+	return ret;
+}
+
+/*
+ * Offline extents are reported as data because their contents exist
+ * and reading them will wait for staging.  Unwritten extents read as
+ * zeros and are reported as holes.
+ */
+static bool extent_is_data(struct scoutfs_extent *ext)
+{
+	return (ext->flags & SEF_OFFLINE) ||
+	       (ext->map && !(ext->flags & SEF_UNWRITTEN));
+}
+
+/*
+ * Find the next data or hole at or after the offset for SEEK_DATA and
+ * SEEK_HOLE by searching the file extent items.  The caller has written
+ * dirty pages so that delayed blocks are allocated and holds a lock
+ * that covers the inode.  There's always a virtual hole at i_size.
+ */
+loff_t scoutfs_data_seek(struct inode *inode, loff_t offset, int whence,
+			 struct scoutfs_lock *lock)
+{
+	loff_t isize = i_size_read(inode);
+	struct scoutfs_extent ext;
+	loff_t found = -ENXIO;
+	u64 iblock;
+	u64 end;
+	int ret;
+
+	if (offset < 0 || offset >= isize)
+		return -ENXIO;
+
+	iblock = offset >> SCOUTFS_BLOCK_SHIFT;
+
+	/* inline data is in the first block and the rest is sparse */
+	if (inode_inline(inode)) {
+		if ((iblock == 0) == (whence == SEEK_DATA))
+			found = offset;
+		else if (whence == SEEK_HOLE)
+			found = SCOUTFS_BLOCK_SIZE;
+		goto out;
+	}
+
+	ret = get_extents_end(inode, lock, &end);
+	if (ret)
+		return ret;
+
+	for (;;) {
+		ret = next_extent_regions(inode, iblock, end, &ext);
+		if (ret < 0 && ret != -ENOENT)
+			return ret;
+
+		/* sparse region before the next extent */
+		if (ret == -ENOENT || ext.start > iblock) {
+			if (whence == SEEK_HOLE) {
+				found = iblock << SCOUTFS_BLOCK_SHIFT;
+				break;
+			}
+			if (ret == -ENOENT)
+				break;
+			iblock = ext.start;
+		}
+
+		if ((whence == SEEK_DATA) == extent_is_data(&ext)) {
+			found = iblock << SCOUTFS_BLOCK_SHIFT;
+			break;
+		}
+
+		iblock = ext.start + ext.len;
+		if ((iblock << SCOUTFS_BLOCK_SHIFT) >= isize)
+			break;
+	}
+
+out:
+	if (found >= 0)
+		found = max(found, offset);
+	if (found < 0 || found >= isize)
+		found = whence == SEEK_HOLE ? isize : -ENXIO;
+
+	return found;
+}
+
+/*
+ * Fill the caller's array with the file's extents that end after the
+ * given block.  Returns the number of extents filled or -errno.  The
+ * caller holds a lock that covers the inode.
+ */
+int scoutfs_data_get_extents(struct inode *inode, u64 iblock,
+			     struct scoutfs_ioctl_extent *exts,
+			     unsigned int nr, struct scoutfs_lock *lock)
+{
+	struct scoutfs_extent ext;
+	unsigned int i;
+	u64 end;
+	int ret;
+
+	ret = get_extents_end(inode, lock, &end);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < nr; i++) {
+		ret = next_extent_regions(inode, iblock, end, &ext);
+		if (ret < 0) {
+			if (ret == -ENOENT)
+				ret = 0;
+			break;
+		}
+
+		exts[i].logical = ext.start;
+		exts[i].physical = ext.map;
+		exts[i].blocks = ext.len;
+		exts[i].flags = 0;
+		if (ext.flags & SEF_OFFLINE)
+			exts[i].flags |= SCOUTFS_IOC_EXTENT_OFFLINE;
+		if (ext.flags & SEF_UNWRITTEN)
+			exts[i].flags |= SCOUTFS_IOC_EXTENT_UNWRITTEN;
+		if (ext.flags & SEF_SHARED)
+			exts[i].flags |= SCOUTFS_IOC_EXTENT_SHARED;
+
+		iblock = ext.start + ext.len;
+	}
+
+	return ret ?: i;
+}
+
+/*
+ * Count the physically contiguous runs of blocks that store the file's
+ * data as a measure of its fragmentation.  Neighbouring file extents
+ * that only differ in their flags are counted once.  Unallocated
+ * extents aren't counted.  The caller holds a lock that covers the
+ * inode.
+ */
+int scoutfs_data_count_extents(struct inode *inode, u64 *nr_ret,
+			       struct scoutfs_lock *lock)
+{
+	struct scoutfs_extent ext;
+	u64 next_iblock = 0;
+	u64 next_map = 0;
+	u64 iblock = 0;
+	u64 nr = 0;
+	u64 end;
+	int ret;
+
+	ret = get_extents_end(inode, lock, &end);
+	if (ret)
+		return ret;
+
+	for (;;) {
+		ret = next_extent_regions(inode, iblock, end, &ext);
+		if (ret < 0) {
+			if (ret == -ENOENT)
+				ret = 0;
+			break;
+		}
+
+		if (ext.map && (ext.start != next_iblock ||
+				ext.map != next_map))
+			nr++;
+
+		next_iblock = ext.start + ext.len;
+		next_map = ext.map ? ext.map + ext.len : 0;
+		iblock = next_iblock;
+		if (iblock == 0)
+			break;
+	}
+
+	*nr_ret = nr;
+	return ret;
+}
+
+/*
+ * Faults in offline regions wait for staging like reads do instead of
+ * failing in readpage.  The inode lock is held across the fault so the
+ * blocks can't be released again before they're read.  Waiting is
+ * killable because kernel faults can't return to deliver signals.
+ */
+static int scoutfs_data_fault(struct vm_area_struct *vma,
+			      struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vma->vm_file);
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_lock *lock = NULL;
+	struct scoutfs_data_wait dw;
+	bool wait = false;
+	int ret;
+
+retry:
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, SCOUTFS_LKF_REFRESH_INODE,
+				 inode, &lock);
+	if (ret)
+		return VM_FAULT_SIGBUS;
+
+	ret = scoutfs_data_wait_check(inode,
+				      (loff_t)vmf->pgoff << PAGE_CACHE_SHIFT,
+				      PAGE_CACHE_SIZE, lock, &dw);
+	if (ret == 0) {
+		ret = filemap_fault(vma, vmf);
+	} else if (ret > 0) {
+		wait = true;
+	} else {
+		ret = ret == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+	}
+	scoutfs_unlock(sb, lock, DLM_LOCK_PR);
+
+	if (wait) {
+		wait = false;
+		scoutfs_inc_counter(sb, data_fault_wait);
+		if (data_wait(sb, &dw, TASK_KILLABLE) == 0)
+			goto retry;
+		ret = VM_FAULT_SIGBUS;
+	}
 
 	return ret;
 }
 
+static const struct vm_operations_struct scoutfs_file_vm_ops = {
+	.fault		= scoutfs_data_fault,
+	.page_mkwrite	= scoutfs_page_mkwrite,
+	.remap_pages	= generic_file_remap_pages,
+};
+
+static int scoutfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &scoutfs_file_vm_ops;
+	return 0;
+}
+
 const struct address_space_operations scoutfs_file_aops = {
 	.readpage		= scoutfs_readpage,
 	.readpages		= scoutfs_readpages,
@@ -1254,6 +5523,8 @@ const struct address_space_operations scoutfs_file_aops = {
 	.writepages		= scoutfs_writepages,
 	.write_begin		= scoutfs_write_begin,
 	.write_end		= scoutfs_write_end,
+	.invalidatepage		= scoutfs_invalidatepage,
+	.releasepage		= scoutfs_releasepage,
 };
 
 const struct file_operations scoutfs_file_fops = {
@@ -1261,12 +5532,29 @@ const struct file_operations scoutfs_file_fops = {
 	.write		= do_sync_write,
 	.aio_read	= scoutfs_file_aio_read,
 	.aio_write	= scoutfs_file_aio_write,
+	.mmap		= scoutfs_file_mmap,
 	.unlocked_ioctl	= scoutfs_ioctl,
 	.fsync		= scoutfs_file_fsync,
 	.llseek		= scoutfs_file_llseek,
 	.fallocate	= scoutfs_fallocate,
+	.release	= scoutfs_file_release,
 };
 
+/*
+ * The server is low on free space.  Return all the free extents that
+ * aren't reserved for delayed allocation and only ask for small grants
+ * for a while.
+ */
+void scoutfs_data_return_unused(struct super_block *sb)
+{
+	DECLARE_DATA_INFO(sb, datinf);
+
+	ACCESS_ONCE(datinf->pressure_until) = jiffies +
+					    SERVER_PRESSURE_INTERVAL;
+	scoutfs_inc_counter(sb, data_return_unused);
+	queue_work(datinf->workq, &datinf->return_work);
+}
+
 /*
  * Return extents to the server if we're over the high water mark.  Each
  * work call sends one batch of extents so that the work can be easily
@@ -1281,6 +5569,7 @@ static void scoutfs_data_return_server_extents_worker(struct work_struct *work)
 	struct scoutfs_net_extent_list *nexl;
 	struct scoutfs_extent ext;
 	u64 nr = 0;
+	u64 high;
 	u64 free;
 	int bytes;
 	int ret;
@@ -1302,9 +5591,9 @@ static void scoutfs_data_return_server_extents_worker(struct work_struct *work)
 	down_write(&datinf->alloc_rwsem);
 
 	free = atomic64_read(&datinf->node_free_blocks);
+	high = free_high_water(datinf);
 
-	while (nr < SCOUTFS_NET_EXTENT_LIST_MAX_NR &&
-	       free > NODE_FREE_HIGH_WATER_BLOCKS) {
+	while (nr < SCOUTFS_NET_EXTENT_LIST_MAX_NR && free > high) {
 
 		scoutfs_extent_init(&ext, SCOUTFS_FREE_EXTENT_BLOCKS_TYPE,
 				    sbi->node_id, 0, 1, 0, 0);
@@ -1319,7 +5608,7 @@ static void scoutfs_data_return_server_extents_worker(struct work_struct *work)
 		trace_scoutfs_data_return_server_extent(sb, &ext);
 
 		ext.type = SCOUTFS_FREE_EXTENT_BLKNO_TYPE;
-		ext.len = min(ext.len, free - NODE_FREE_HIGH_WATER_BLOCKS);
+		ext.len = min(ext.len, free - high);
 
 		ret = scoutfs_extent_remove(sb, data_extent_io, &ext,
 					    sbi->node_id_lock);
@@ -1352,7 +5641,7 @@ out:
 
 	/* keep returning if we're still over the water mark */
 	if (ret == 0 && (atomic64_read(&datinf->node_free_blocks) >
-			 NODE_FREE_HIGH_WATER_BLOCKS))
+			 free_high_water(datinf)))
 		queue_work(datinf->workq, &datinf->return_work);
 }
 
@@ -1360,6 +5649,8 @@ int scoutfs_data_setup(struct super_block *sb)
 {
 	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
 	struct data_info *datinf;
+	struct data_pool *pool;
+	int i;
 
 	datinf = kzalloc(sizeof(struct data_info), GFP_KERNEL);
 	if (!datinf)
@@ -1368,11 +5659,42 @@ int scoutfs_data_setup(struct super_block *sb)
 	datinf->sb = sb;
 	init_rwsem(&datinf->alloc_rwsem);
 	atomic64_set(&datinf->node_free_blocks, 0);
+	atomic64_set(&datinf->fallocate_blocks, 0);
+	atomic64_set(&datinf->delayed_blocks, 0);
+	atomic64_set(&datinf->pool_blocks, 0);
+	atomic64_set(&datinf->alloc_since_grant, 0);
+	datinf->grant_jiffies = jiffies;
+	datinf->grant_blocks = SERVER_ALLOC_BLOCKS;
+	datinf->pressure_until = jiffies;
+	spin_lock_init(&datinf->wait_lock);
+	INIT_LIST_HEAD(&datinf->wait_reqs);
+	INIT_LIST_HEAD(&datinf->waiters);
+	init_waitqueue_head(&datinf->waiting_waitq);
 	INIT_WORK(&datinf->return_work,
 		  scoutfs_data_return_server_extents_worker);
+	atomic64_set(&datinf->release_id, 0);
+	INIT_WORK(&datinf->release_work, scoutfs_data_shared_release_worker);
+
+	spin_lock_init(&datinf->dir_goal_lock);
+
+	datinf->pools = kcalloc(ALLOC_STREAM_NR, sizeof(struct data_pool),
+				GFP_KERNEL);
+	if (!datinf->pools) {
+		kfree(datinf);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < ALLOC_STREAM_NR; i++) {
+		pool = &datinf->pools[i];
+		mutex_init(&pool->mutex);
+		pool->ino = 0;
+		pool->start = 0;
+		pool->len = 0;
+	}
 
 	datinf->workq = alloc_workqueue("scoutfs_data", WQ_UNBOUND, 1);
 	if (!datinf->workq) {
+		kfree(datinf->pools);
 		kfree(datinf);
 		return -ENOMEM;
 	}
@@ -1389,10 +5711,17 @@ void scoutfs_data_destroy(struct super_block *sb)
 	if (datinf) {
 		if (datinf->workq) {
 			cancel_work_sync(&datinf->return_work);
+			cancel_work_sync(&datinf->release_work);
 			destroy_workqueue(datinf->workq);
 			datinf->workq = NULL;
 		}
 
+		/* the final commit drained the pools */
+		WARN_ON_ONCE(atomic64_read(&datinf->pool_blocks));
+		/* readers hold open files */
+		WARN_ON_ONCE(!list_empty(&datinf->wait_reqs));
+		kfree(datinf->pools);
+
 		sbi->data_info = NULL;
 		kfree(datinf);
 	}
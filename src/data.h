@@ -1,15 +1,97 @@
 #ifndef _SCOUTFS_FILERW_H_
 #define _SCOUTFS_FILERW_H_
 
+#include <linux/wait.h>
+
+struct scoutfs_ioctl_data_waiting_entry;
+struct scoutfs_ioctl_extent;
+struct scoutfs_ioctl_inode_attrs;
+struct kstat;
+
+/* a reader waiting for offline blocks to be staged */
+struct scoutfs_data_wait {
+	struct list_head head;
+	wait_queue_head_t waitq;
+	bool woken;
+	u64 ino;
+	u64 start;
+	u64 last;
+};
+
+/*
+ * The data locks that cover a page cache user's block.  Writers can
+ * hold them across all the pages of a write.  Writers also record the
+ * inode lock they hold and, if it's only PR, the file deltas lock that
+ * covers the delta they write and the blocks they've brought online
+ * since they last wrote it.
+ */
+struct scoutfs_data_locks {
+	struct scoutfs_lock *file;
+	struct scoutfs_lock *region;
+	u64 region_nr;
+	int mode;
+	struct scoutfs_lock *inode;
+	struct scoutfs_lock *deltas;
+	s64 online;
+};
+
 extern const struct address_space_operations scoutfs_file_aops;
 extern const struct file_operations scoutfs_file_fops;
 
 int scoutfs_data_truncate_items(struct super_block *sb, struct inode *inode,
 				u64 ino, u64 iblock, u64 last, bool offline,
-				struct scoutfs_lock *lock);
+				bool background, struct scoutfs_lock *lock);
+int scoutfs_data_convert_inline(struct inode *inode, struct scoutfs_lock *lock);
+int scoutfs_data_truncate_inline(struct inode *inode, u64 old_size,
+				 struct scoutfs_lock *lock);
+int scoutfs_data_drop_inline(struct super_block *sb, u64 ino, u64 size,
+			     struct scoutfs_lock *lock);
+int scoutfs_data_clone(struct inode *src, struct inode *dst, u64 src_iblock,
+		       u64 dst_iblock, u64 count,
+		       struct scoutfs_lock *src_lock,
+		       struct scoutfs_lock *dst_lock,
+		       struct scoutfs_lock *shared_lock);
+void scoutfs_data_apply_shared_releases(struct super_block *sb);
+int scoutfs_data_count_extents(struct inode *inode, u64 *nr_ret,
+			       struct scoutfs_lock *lock);
 int scoutfs_data_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 			u64 start, u64 len);
+loff_t scoutfs_data_seek(struct inode *inode, loff_t offset, int whence,
+			 struct scoutfs_lock *lock);
+int scoutfs_data_get_extents(struct inode *inode, u64 iblock,
+			     struct scoutfs_ioctl_extent *exts,
+			     unsigned int nr, struct scoutfs_lock *lock);
+int scoutfs_data_fold_file_deltas(struct inode *inode,
+				  struct scoutfs_lock *lock);
+int scoutfs_data_add_file_deltas(struct inode *inode,
+				 struct scoutfs_lock *lock, struct kstat *stat);
+int scoutfs_data_add_attrs_file_deltas(struct super_block *sb, u64 ino,
+				       struct scoutfs_ioctl_inode_attrs *attrs);
+int scoutfs_data_grow_size_deltas(struct inode *inode,
+				  struct scoutfs_lock *lock);
+int scoutfs_data_delete_file_deltas(struct super_block *sb, u64 ino,
+				    u64 *extents_end);
 long scoutfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
+int scoutfs_data_drain_pools(struct super_block *sb);
+void scoutfs_data_return_unused(struct super_block *sb);
+int scoutfs_data_prealloc_offline(struct inode *inode, u64 iblock, u64 last,
+				  struct scoutfs_lock *lock);
+int scoutfs_data_unprealloc_offline(struct inode *inode, u64 iblock,
+				    u64 last, struct scoutfs_lock *lock);
+int scoutfs_data_start_writeback(struct inode *inode, loff_t start,
+				 loff_t end);
+void scoutfs_data_unlock_write(struct super_block *sb,
+			       struct scoutfs_data_locks *dl);
+void scoutfs_data_stride_readahead(struct file *file, loff_t pos, size_t len);
+int scoutfs_data_wait_check(struct inode *inode, loff_t pos, size_t len,
+			    struct scoutfs_lock *lock,
+			    struct scoutfs_data_wait *dw);
+int scoutfs_data_wait(struct inode *inode, struct scoutfs_data_wait *dw);
+void scoutfs_data_wake_waiters(struct super_block *sb, u64 ino, u64 start,
+			       u64 last);
+int scoutfs_data_waiting(struct super_block *sb, u64 ino, u64 iblock,
+			 struct scoutfs_ioctl_data_waiting_entry *dwe,
+			 unsigned int nr, bool block);
 
 int scoutfs_data_setup(struct super_block *sb);
 void scoutfs_data_destroy(struct super_block *sb);
@@ -60,6 +60,18 @@
  * so that any item use can reference all the items for a given entry.
  * This is important for deleting all the items given a dentry that was
  * populated by lookup.
+ *
+ * The name hash and readdir items are stored in their own zone so that
+ * they can be locked independently of the dir's inode lock.  They're
+ * locked in groups of name hashes and of readdir positions.  Creates
+ * only read the dir inode, lock the hash group of their name, take a
+ * readdir position from a range reserved for the mount, and record
+ * their changes to the dir's attributes in a per-mount delta item.
+ * Mounts creating entries in the same dir then only contend when their
+ * names land in the same hash group.  A mount that already holds the
+ * dir inode lock exclusively updates the dir inode directly.  Removing
+ * entries still locks the dir inode exclusively and first merges the
+ * deltas into the inode.
  */
 
 static unsigned int mode_to_type(umode_t mode)
@@ -195,7 +207,8 @@ static void init_dirent_key(struct scoutfs_key *key, u8 type, u64 ino,
 			    u64 major, u64 minor)
 {
 	*key = (struct scoutfs_key) {
-		.sk_zone = SCOUTFS_FS_ZONE,
+		.sk_zone = type == SCOUTFS_LINK_BACKREF_TYPE ?
+			   SCOUTFS_FS_ZONE : SCOUTFS_DIRENT_ZONE,
 		.skd_ino = cpu_to_le64(ino),
 		.sk_type = type,
 		.skd_major = cpu_to_le64(major),
@@ -295,6 +308,7 @@ static int scoutfs_d_revalidate(struct dentry *dentry, unsigned int flags)
 	bool is_covered = false;
 	struct inode *dir;
 	u64 dentry_ino;
+	u64 hash;
 	int ret;
 
 	/* don't think this happens but we can find out */
@@ -334,15 +348,15 @@ static int scoutfs_d_revalidate(struct dentry *dentry, unsigned int flags)
 		goto out;
 	}
 	dir = parent->d_inode;
+	hash = dirent_name_hash(dentry->d_name.name, dentry->d_name.len);
 
-	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, 0, dir, &lock);
+	ret = scoutfs_lock_dirent_hash(sb, DLM_LOCK_PR, 0, scoutfs_ino(dir),
+				       hash, &lock);
 	if (ret)
 		goto out;
 
 	ret = lookup_dirent(sb, scoutfs_ino(dir),
-			    dentry->d_name.name, dentry->d_name.len,
-			    dirent_name_hash(dentry->d_name.name,
-					     dentry->d_name.len),
+			    dentry->d_name.name, dentry->d_name.len, hash,
 			    &dent, lock);
 	if (ret == -ENOENT) {
 		dent.ino = 0;
@@ -377,21 +391,19 @@ out:
 }
 
 /*
- * Because of rename, locks are ordered by inode number.  To hold the
- * dir lock while calling iget, we might have to already hold a lesser
- * inode's lock while telling iget whether or not to lock.  Instead of
- * adding all those moving pieces we drop the dir lock before calling
- * iget.  We don't reuse inode numbers so we don't have to worry about
- * the target of the link changing.  We will only follow the entry as it
- * existed before or after whatever modification is happening under the
- * dir lock and that can already legally race before or after our
- * lookup.
+ * Lookup only locks the group of name hash items that contains the
+ * name.  Entry locks are acquired after inode locks so we drop the hash
+ * lock before calling iget.  We don't reuse inode numbers so we don't
+ * have to worry about the target of the link changing.  We will only
+ * follow the entry as it existed before or after whatever modification
+ * is happening under the hash lock and that can already legally race
+ * before or after our lookup.
  */
 static struct dentry *scoutfs_lookup(struct inode *dir, struct dentry *dentry,
 				     unsigned int flags)
 {
 	struct super_block *sb = dir->i_sb;
-	struct scoutfs_lock *dir_lock = NULL;
+	struct scoutfs_lock *hash_lock = NULL;
 	struct scoutfs_dirent dent;
 	struct inode *inode;
 	u64 ino = 0;
@@ -409,21 +421,22 @@ static struct dentry *scoutfs_lookup(struct inode *dir, struct dentry *dentry,
 	if (ret)
 		goto out;
 
-	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, 0, dir, &dir_lock);
+	ret = scoutfs_lock_dirent_hash(sb, DLM_LOCK_PR, 0, scoutfs_ino(dir),
+				       hash, &hash_lock);
 	if (ret)
 		goto out;
 
 	ret = lookup_dirent(sb, scoutfs_ino(dir), dentry->d_name.name,
-			    dentry->d_name.len, hash, &dent, dir_lock);
+			    dentry->d_name.len, hash, &dent, hash_lock);
 	if (ret == -ENOENT) {
 		ino = 0;
 		ret = 0;
 	} else if (ret == 0) {
 		ino = le64_to_cpu(dent.ino);
 		update_dentry_info(sb, dentry, le64_to_cpu(dent.hash),
-				   le64_to_cpu(dent.pos), dir_lock);
+				   le64_to_cpu(dent.pos), hash_lock);
 	}
-	scoutfs_unlock(sb, dir_lock, DLM_LOCK_PR);
+	scoutfs_unlock(sb, hash_lock, DLM_LOCK_PR);
 
 out:
 	if (ret < 0)
@@ -462,8 +475,11 @@ static int dir_emit_dots(struct file *file, void *dirent, filldir_t filldir)
  * readdir simply iterates over the dirent items for the dir inode and
  * uses their offset as the readdir position.
  *
- * It will need to be careful not to read past the region of the dirent
- * hash offset keys that it has access to.
+ * The readdir items are locked in groups of positions.  We walk the
+ * groups up to the dir's next position, which is past all the
+ * positions that have been used or reserved by mounts.  Groups can be
+ * sparse or empty when mounts didn't use all of their reserved
+ * positions.
  */
 static int scoutfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 {
@@ -473,8 +489,11 @@ static int scoutfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 	struct scoutfs_key key;
 	struct scoutfs_key last_key;
 	struct scoutfs_lock *dir_lock;
+	struct scoutfs_lock *pos_lock = NULL;
 	struct kvec val;
 	int name_len;
+	u64 next_pos;
+	u64 last_pos = 0;
 	u64 pos;
 	int ret;
 
@@ -482,29 +501,44 @@ static int scoutfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 		return 0;
 
 	dent = alloc_dirent(SCOUTFS_NAME_LEN);
-	if (!dent) {
-		ret = -ENOMEM;
+	if (!dent)
+		return -ENOMEM;
+
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, SCOUTFS_LKF_REFRESH_INODE,
+				 inode, &dir_lock);
+	if (ret)
 		goto out;
-	}
+	next_pos = SCOUTFS_I(inode)->next_readdir_pos;
+	scoutfs_unlock(sb, dir_lock, DLM_LOCK_PR);
 
-	init_dirent_key(&last_key, SCOUTFS_READDIR_TYPE, scoutfs_ino(inode),
-			SCOUTFS_DIRENT_LAST_POS, 0);
 	kvec_init(&val, dent, dirent_bytes(SCOUTFS_NAME_LEN));
 
-	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, 0, inode, &dir_lock);
-	if (ret)
-		goto out;
+	while ((u64)file->f_pos < next_pos) {
+		if (!pos_lock) {
+			ret = scoutfs_lock_readdir_pos(sb, DLM_LOCK_PR, 0,
+						       scoutfs_ino(inode),
+						       file->f_pos, &pos_lock);
+			if (ret)
+				break;
+			last_pos = le64_to_cpu(pos_lock->end.skd_major);
+			init_dirent_key(&last_key, SCOUTFS_READDIR_TYPE,
+					scoutfs_ino(inode), last_pos, 0);
+		}
 
-	for (;;) {
 		init_dirent_key(&key, SCOUTFS_READDIR_TYPE, scoutfs_ino(inode),
 				file->f_pos, 0);
 
-		ret = scoutfs_item_next(sb, &key, &last_key, &val, dir_lock);
-		if (ret < 0) {
-			if (ret == -ENOENT)
-				ret = 0;
-			break;
+		ret = scoutfs_item_next(sb, &key, &last_key, &val, pos_lock);
+		if (ret == -ENOENT) {
+			/* on to the next group */
+			scoutfs_unlock(sb, pos_lock, DLM_LOCK_PR);
+			pos_lock = NULL;
+			file->f_pos = last_pos + 1;
+			ret = 0;
+			continue;
 		}
+		if (ret < 0)
+			break;
 
 		name_len = ret - sizeof(struct scoutfs_dirent);
 		if (name_len < 1 || name_len > SCOUTFS_NAME_LEN) {
@@ -529,12 +563,49 @@ static int scoutfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 	}
 
 out:
-	scoutfs_unlock(sb, dir_lock, DLM_LOCK_PR);
+	scoutfs_unlock(sb, pos_lock, DLM_LOCK_PR);
 
 	kfree(dent);
 	return ret;
 }
 
+/*
+ * The locks that cover the items of an entry in a dir: the group of
+ * name hashes, the group of readdir positions, and the dir's deltas for
+ * creates.  They're acquired after the inode locks and before holding a
+ * transaction.  Creates that found the dir inode lock already granted
+ * in EX also hold an EX user on it.
+ */
+struct entry_locks {
+	struct scoutfs_lock *dir_ex;
+	struct scoutfs_lock *delta;
+	struct scoutfs_lock *hash;
+	struct scoutfs_lock *pos;
+};
+
+static int lock_entry(struct super_block *sb, u64 dir_ino, u64 hash, u64 pos,
+		      bool delta, struct entry_locks *el)
+{
+	return (delta ? scoutfs_lock_dir_deltas(sb, DLM_LOCK_CW, 0, dir_ino,
+						&el->delta) : 0) ?:
+	       scoutfs_lock_dirent_hash(sb, DLM_LOCK_EX, 0, dir_ino, hash,
+					&el->hash) ?:
+	       scoutfs_lock_readdir_pos(sb, DLM_LOCK_EX, 0, dir_ino, pos,
+					&el->pos);
+}
+
+static void unlock_entry(struct super_block *sb, struct entry_locks *el)
+{
+	scoutfs_unlock(sb, el->dir_ex, DLM_LOCK_EX);
+	scoutfs_unlock(sb, el->delta, DLM_LOCK_CW);
+	scoutfs_unlock(sb, el->hash, DLM_LOCK_EX);
+	scoutfs_unlock(sb, el->pos, DLM_LOCK_EX);
+	el->dir_ex = NULL;
+	el->delta = NULL;
+	el->hash = NULL;
+	el->pos = NULL;
+}
+
 /*
  * Add all the items for the named link to the inode in the dir.  Only
  * items are modified.  The caller is responsible for locking, entering
@@ -544,7 +615,7 @@ out:
  */
 static int add_entry_items(struct super_block *sb, u64 dir_ino, u64 hash,
 			   u64 pos, const char *name, unsigned name_len,
-			   u64 ino, umode_t mode, struct scoutfs_lock *dir_lock,
+			   u64 ino, umode_t mode, struct entry_locks *el,
 			   struct scoutfs_lock *inode_lock)
 {
 	struct scoutfs_key rdir_key;
@@ -574,12 +645,12 @@ static int add_entry_items(struct super_block *sb, u64 dir_ino, u64 hash,
 	init_dirent_key(&lb_key, SCOUTFS_LINK_BACKREF_TYPE, ino, dir_ino, pos);
 	kvec_init(&val, dent, dirent_bytes(name_len));
 
-	ret = scoutfs_item_create(sb, &ent_key, &val, dir_lock);
+	ret = scoutfs_item_create(sb, &ent_key, &val, el->hash);
 	if (ret)
 		goto out;
 	del_ent = true;
 
-	ret = scoutfs_item_create(sb, &rdir_key, &val, dir_lock);
+	ret = scoutfs_item_create(sb, &rdir_key, &val, el->pos);
 	if (ret)
 		goto out;
 	del_rdir = true;
@@ -606,13 +677,14 @@ out:
  * If this returns an error then nothing will have changed.
  */
 static int del_entry_items(struct super_block *sb, u64 dir_ino, u64 hash,
-			   u64 pos, u64 ino, struct scoutfs_lock *dir_lock,
+			   u64 pos, u64 ino, struct entry_locks *el,
 			   struct scoutfs_lock *inode_lock)
 {
 	struct scoutfs_key rdir_key;
 	struct scoutfs_key ent_key;
 	struct scoutfs_key lb_key;
-	LIST_HEAD(dir_saved);
+	LIST_HEAD(hash_saved);
+	LIST_HEAD(pos_saved);
 	LIST_HEAD(inode_saved);
 	int ret;
 
@@ -620,20 +692,561 @@ static int del_entry_items(struct super_block *sb, u64 dir_ino, u64 hash,
 	init_dirent_key(&rdir_key, SCOUTFS_READDIR_TYPE, dir_ino, pos, 0);
 	init_dirent_key(&lb_key, SCOUTFS_LINK_BACKREF_TYPE, ino, dir_ino, pos);
 
-	ret = scoutfs_item_delete_save(sb, &ent_key, &dir_saved, dir_lock) ?:
-	      scoutfs_item_delete_save(sb, &rdir_key, &dir_saved, dir_lock) ?:
+	ret = scoutfs_item_delete_save(sb, &ent_key, &hash_saved, el->hash) ?:
+	      scoutfs_item_delete_save(sb, &rdir_key, &pos_saved, el->pos) ?:
 	      scoutfs_item_delete_save(sb, &lb_key, &inode_saved, inode_lock);
 	if (ret < 0) {
-		scoutfs_item_restore(sb, &dir_saved, dir_lock);
+		scoutfs_item_restore(sb, &hash_saved, el->hash);
+		scoutfs_item_restore(sb, &pos_saved, el->pos);
 		scoutfs_item_restore(sb, &inode_saved, inode_lock);
 	} else {
-		scoutfs_item_free_batch(sb, &dir_saved);
+		scoutfs_item_free_batch(sb, &hash_saved);
+		scoutfs_item_free_batch(sb, &pos_saved);
 		scoutfs_item_free_batch(sb, &inode_saved);
 	}
 
 	return ret;
 }
 
+/* the sum of a dir's delta items */
+struct dir_deltas {
+	s64 size;
+	s64 nlink;
+	struct timespec mtime;
+};
+
+/*
+ * Add up to nr of a dir's delta items to the caller's sums, deleting
+ * each item as it's added if asked.  Returns the number of items that
+ * were added or -errno.  The sums include the items that were deleted
+ * before an error was returned.
+ */
+static int read_dir_deltas(struct super_block *sb, u64 dir_ino,
+			   unsigned int nr, bool delete,
+			   struct dir_deltas *dd, struct scoutfs_lock *lock)
+{
+	struct scoutfs_dir_delta delta;
+	struct scoutfs_key last_key;
+	struct scoutfs_key key;
+	struct timespec ts;
+	struct kvec val;
+	unsigned int i;
+	int ret = 0;
+
+	init_dirent_key(&key, SCOUTFS_DIR_DELTA_TYPE, dir_ino, 0, 0);
+	init_dirent_key(&last_key, SCOUTFS_DIR_DELTA_TYPE, dir_ino, U64_MAX,
+			U64_MAX);
+	kvec_init(&val, &delta, sizeof(delta));
+
+	for (i = 0; i < nr; i++) {
+		ret = scoutfs_item_next(sb, &key, &last_key, &val, lock);
+		if (ret < 0) {
+			if (ret == -ENOENT)
+				ret = 0;
+			break;
+		}
+
+		if (ret != sizeof(delta)) {
+			scoutfs_corruption(sb, SC_DIR_DELTA_VAL_SIZE,
+					   corrupt_dir_delta_val_size,
+					   "dir_ino %llu key "SK_FMT" len %d",
+					   dir_ino, SK_ARG(&key), ret);
+			ret = -EIO;
+			break;
+		}
+
+		if (delete) {
+			ret = scoutfs_item_delete(sb, &key, lock);
+			if (ret)
+				break;
+		}
+
+		dd->size += (s64)le64_to_cpu(delta.size);
+		dd->nlink += (s64)le64_to_cpu(delta.nlink);
+		ts.tv_sec = le64_to_cpu(delta.mtime_sec);
+		ts.tv_nsec = le32_to_cpu(delta.mtime_nsec);
+		if (timespec_compare(&ts, &dd->mtime) > 0)
+			dd->mtime = ts;
+
+		scoutfs_key_inc(&key);
+	}
+
+	return ret < 0 ? ret : i;
+}
+
+/*
+ * Creates record their changes to the dir's attributes in an item for
+ * the mount and transaction instead of updating the dir inode item,
+ * which would need an exclusive dir inode lock.  The item is written
+ * blindly under a CW lock so creating mounts don't contend with each
+ * other.  We keep our totals for the current transaction in the inode.
+ * Committing the item advances the trans seq which starts a new item.
+ *
+ * The caller holds the dir's i_mutex and a transaction.
+ */
+static int add_dir_delta(struct inode *dir, s64 size, s64 nlink,
+			 struct timespec *ts, struct scoutfs_lock *lock)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(dir);
+	struct super_block *sb = dir->i_sb;
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	struct scoutfs_dir_delta delta;
+	struct scoutfs_key key;
+	struct kvec val;
+	int ret;
+
+	si->dir_deltas_none_gen = 0;
+
+	if (si->dir_delta_seq != sbi->trans_seq) {
+		si->dir_delta_seq = sbi->trans_seq;
+		si->dir_delta_size = 0;
+		si->dir_delta_nlink = 0;
+	}
+
+	delta.size = cpu_to_le64(si->dir_delta_size + size);
+	delta.nlink = cpu_to_le64(si->dir_delta_nlink + nlink);
+	delta.mtime_sec = cpu_to_le64(ts->tv_sec);
+	delta.mtime_nsec = cpu_to_le32(ts->tv_nsec);
+
+	init_dirent_key(&key, SCOUTFS_DIR_DELTA_TYPE, scoutfs_ino(dir),
+			sbi->trans_seq, sbi->node_id);
+	kvec_init(&val, &delta, sizeof(delta));
+
+	ret = scoutfs_item_create_force(sb, &key, &val, lock);
+	if (ret == 0) {
+		si->dir_delta_size += size;
+		si->dir_delta_nlink += nlink;
+		scoutfs_inc_counter(sb, dir_delta_write);
+	}
+
+	return ret;
+}
+
+#define FOLD_DIR_DELTAS_BATCH 64
+
+/*
+ * Merge all of a dir's delta items into its inode.  This has to be done
+ * before anything that depends on the dir's attributes, like removing
+ * entries or testing that a dir is empty.  The caller holds the dir's
+ * inode lock in EX so creates can't add deltas while we're working.
+ * Each batch of items is deleted and applied to the inode in its own
+ * transaction.  Once they're all folded getattr can skip reading deltas
+ * until our EX lock is lost.
+ */
+static int fold_dir_deltas(struct inode *dir, struct scoutfs_lock *dir_lock)
+{
+	struct super_block *sb = dir->i_sb;
+	struct scoutfs_lock *delta_lock = NULL;
+	struct dir_deltas dd = {0,};
+	LIST_HEAD(ind_locks);
+	int ret;
+
+	ret = scoutfs_lock_dir_deltas(sb, DLM_LOCK_EX, 0, scoutfs_ino(dir),
+				      &delta_lock);
+	if (ret)
+		return ret;
+
+	/* our pending delta was written as our CW lock was converted */
+	SCOUTFS_I(dir)->dir_delta_seq = 0;
+
+	/* most of the time there's nothing to do */
+	ret = read_dir_deltas(sb, scoutfs_ino(dir), 1, false, &dd,
+			      delta_lock);
+
+	while (ret > 0) {
+		memset(&dd, 0, sizeof(dd));
+
+		ret = scoutfs_inode_index_lock_hold(dir, &ind_locks, false,
+				SIC_FOLD_DIR_DELTAS(FOLD_DIR_DELTAS_BATCH));
+		if (ret == 0) {
+			ret = scoutfs_dirty_inode_item(dir, dir_lock);
+			if (ret == 0) {
+				ret = read_dir_deltas(sb, scoutfs_ino(dir),
+						      FOLD_DIR_DELTAS_BATCH,
+						      true, &dd, delta_lock);
+
+				i_size_write(dir, i_size_read(dir) + dd.size);
+				set_nlink(dir, dir->i_nlink + dd.nlink);
+				if (timespec_compare(&dd.mtime,
+						     &dir->i_mtime) > 0)
+					dir->i_mtime = dd.mtime;
+				if (timespec_compare(&dd.mtime,
+						     &dir->i_ctime) > 0)
+					dir->i_ctime = dd.mtime;
+				scoutfs_update_inode_item(dir, dir_lock,
+							  &ind_locks);
+			}
+			scoutfs_release_trans(sb);
+		}
+		scoutfs_inode_index_unlock(sb, &ind_locks);
+
+		if (ret > 0)
+			scoutfs_add_counter(sb, dir_delta_fold, ret);
+		if (ret < FOLD_DIR_DELTAS_BATCH)
+			break;
+	}
+
+	scoutfs_unlock(sb, delta_lock, DLM_LOCK_EX);
+
+	if (ret >= 0)
+		SCOUTFS_I(dir)->dir_deltas_none_gen = dir_lock->write_gen;
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Sum all of a dir's pending delta items, returning the number of items.
+ * The caller holds the dir's inode lock.
+ */
+static int sum_dir_deltas(struct super_block *sb, u64 dir_ino,
+			  struct dir_deltas *dd)
+{
+	struct scoutfs_lock *delta_lock = NULL;
+	int ret;
+
+	ret = scoutfs_lock_dir_deltas(sb, DLM_LOCK_PR, 0, dir_ino,
+				      &delta_lock);
+	if (ret)
+		return ret;
+
+	ret = read_dir_deltas(sb, dir_ino, UINT_MAX, false, dd, delta_lock);
+
+	scoutfs_unlock(sb, delta_lock, DLM_LOCK_PR);
+
+	return ret;
+}
+
+/*
+ * Add a dir's pending deltas to its attributes for getattr.  The
+ * caller holds the dir's inode lock.
+ *
+ * Reading deltas takes a PR lock that would revoke the CW locks of
+ * mounts creating in the dir.  Other mounts can't create deltas while
+ * we hold the dir lock in EX and our creates update the inode directly,
+ * so we only read deltas once per EX grant and skip the delta lock
+ * until the EX lock is lost or we write a delta ourselves.
+ */
+int scoutfs_dir_add_deltas(struct inode *dir, struct scoutfs_lock *dir_lock,
+			   struct kstat *stat)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(dir);
+	struct super_block *sb = dir->i_sb;
+	struct dir_deltas dd = {0,};
+	bool ex;
+	int ret;
+
+	ex = scoutfs_lock_try_add_user(sb, dir_lock, DLM_LOCK_EX);
+	if (ex && si->dir_deltas_none_gen == dir_lock->write_gen) {
+		scoutfs_inc_counter(sb, dir_delta_skip);
+		ret = 0;
+		goto out;
+	}
+
+	ret = sum_dir_deltas(sb, scoutfs_ino(dir), &dd);
+	if (ret < 0)
+		goto out;
+
+	if (ret == 0 && ex)
+		si->dir_deltas_none_gen = dir_lock->write_gen;
+
+	stat->size += dd.size;
+	stat->nlink += dd.nlink;
+	if (timespec_compare(&dd.mtime, &stat->mtime) > 0)
+		stat->mtime = dd.mtime;
+	if (timespec_compare(&dd.mtime, &stat->ctime) > 0)
+		stat->ctime = dd.mtime;
+	ret = 0;
+out:
+	if (ex)
+		scoutfs_unlock(sb, dir_lock, DLM_LOCK_EX);
+	return ret;
+}
+
+/*
+ * Add a dir's pending deltas to the attributes returned by the bulk
+ * ioctls.  The caller holds the dir's inode lock.
+ */
+int scoutfs_dir_add_attrs_deltas(struct super_block *sb, u64 dir_ino,
+				 struct scoutfs_ioctl_inode_attrs *attrs)
+{
+	struct dir_deltas dd = {0,};
+	struct timespec ts;
+	int ret;
+
+	ret = sum_dir_deltas(sb, dir_ino, &dd);
+	if (ret < 0)
+		return ret;
+
+	attrs->size += dd.size;
+	attrs->nlink += dd.nlink;
+
+	ts.tv_sec = attrs->mtime_sec;
+	ts.tv_nsec = attrs->mtime_nsec;
+	if (timespec_compare(&dd.mtime, &ts) > 0) {
+		attrs->mtime_sec = dd.mtime.tv_sec;
+		attrs->mtime_nsec = dd.mtime.tv_nsec;
+	}
+
+	ts.tv_sec = attrs->ctime_sec;
+	ts.tv_nsec = attrs->ctime_nsec;
+	if (timespec_compare(&dd.mtime, &ts) > 0) {
+		attrs->ctime_sec = dd.mtime.tv_sec;
+		attrs->ctime_nsec = dd.mtime.tv_nsec;
+	}
+
+	return 0;
+}
+
+#define READDIR_PLUS_BATCH 32
+
+struct readdir_plus_batch {
+	u64 inos[READDIR_PLUS_BATCH];
+	struct scoutfs_ioctl_inode_attrs attrs[READDIR_PLUS_BATCH];
+	struct {
+		u64 pos;
+		u16 entry_bytes;
+		u8 name_len;
+		char name[SCOUTFS_NAME_LEN];
+	} ents[READDIR_PLUS_BATCH];
+};
+
+static unsigned int readdir_plus_bytes(unsigned int name_len)
+{
+	return ALIGN(offsetof(struct scoutfs_ioctl_readdir_plus_entry,
+			      name[name_len]), 8);
+}
+
+/*
+ * Read a batch of entries starting at *pos under one readdir pos lock.
+ * The batch stops at the end of the lock's group, before next_pos, or
+ * when the next entry won't fit in the caller's remaining bytes.
+ * Returns the number of entries read and sets *pos past the last
+ * position that was searched.
+ */
+static int read_readdir_plus_ents(struct super_block *sb, u64 dir_ino,
+				  u64 *pos, u64 next_pos,
+				  struct readdir_plus_batch *rpb,
+				  unsigned int *bytes, bool *full,
+				  struct scoutfs_dirent *dent)
+{
+	struct scoutfs_lock *lock = NULL;
+	struct scoutfs_key last_key;
+	struct scoutfs_key key;
+	struct kvec val;
+	unsigned int eb;
+	u64 last_pos;
+	int name_len;
+	int ret;
+	int i;
+
+	ret = scoutfs_lock_readdir_pos(sb, DLM_LOCK_PR, 0, dir_ino, *pos,
+				       &lock);
+	if (ret)
+		return ret;
+
+	last_pos = min(next_pos - 1, le64_to_cpu(lock->end.skd_major));
+	init_dirent_key(&last_key, SCOUTFS_READDIR_TYPE, dir_ino, last_pos, 0);
+	kvec_init(&val, dent, dirent_bytes(SCOUTFS_NAME_LEN));
+
+	for (i = 0; i < READDIR_PLUS_BATCH; i++) {
+		init_dirent_key(&key, SCOUTFS_READDIR_TYPE, dir_ino, *pos, 0);
+
+		ret = scoutfs_item_next(sb, &key, &last_key, &val, lock);
+		if (ret == -ENOENT) {
+			*pos = last_pos + 1;
+			ret = 0;
+			break;
+		}
+		if (ret < 0)
+			break;
+
+		name_len = ret - sizeof(struct scoutfs_dirent);
+		if (name_len < 1 || name_len > SCOUTFS_NAME_LEN) {
+			scoutfs_corruption(sb, SC_DIRENT_READDIR_NAME_LEN,
+					   corrupt_dirent_readdir_name_len,
+					   "dir_ino %llu pos %llu key "SK_FMT" len %d",
+					   dir_ino, *pos, SK_ARG(&key), name_len);
+			ret = -EIO;
+			break;
+		}
+
+		eb = readdir_plus_bytes(name_len);
+		if (eb > *bytes) {
+			*full = true;
+			ret = 0;
+			break;
+		}
+		*bytes -= eb;
+
+		rpb->inos[i] = le64_to_cpu(dent->ino);
+		rpb->ents[i].pos = le64_to_cpu(key.skd_major);
+		rpb->ents[i].entry_bytes = eb;
+		rpb->ents[i].name_len = name_len;
+		memcpy(rpb->ents[i].name, dent->name, name_len);
+
+		*pos = rpb->ents[i].pos + 1;
+	}
+
+	scoutfs_unlock(sb, lock, DLM_LOCK_PR);
+
+	return ret < 0 ? ret : i;
+}
+
+/*
+ * Copy a dir's entries and the attributes of their inodes to the
+ * caller's buffer.  See the comment above struct
+ * scoutfs_ioctl_readdir_plus for the semantics.
+ *
+ * Entries are read in batches.  The readdir pos lock is dropped before
+ * the batch's inode locks are acquired because inode locks are ordered
+ * before dirent locks.  Nothing is locked while the batch is copied to
+ * the caller.
+ */
+int scoutfs_dir_readdir_plus(struct inode *dir,
+			     struct scoutfs_ioctl_readdir_plus *rdp)
+{
+	struct super_block *sb = dir->i_sb;
+	struct scoutfs_ioctl_readdir_plus_entry __user *uent;
+	struct readdir_plus_batch *rpb = NULL;
+	struct scoutfs_dirent *dent = NULL;
+	struct scoutfs_lock *dir_lock;
+	unsigned int bytes;
+	bool full = false;
+	u64 next_pos;
+	u64 pos;
+	int total = 0;
+	int ret;
+	int nr;
+	int i;
+
+	if (rdp->buf_bytes < readdir_plus_bytes(SCOUTFS_NAME_LEN))
+		return -EINVAL;
+
+	rpb = kmalloc(sizeof(struct readdir_plus_batch), GFP_NOFS);
+	dent = alloc_dirent(SCOUTFS_NAME_LEN);
+	if (!rpb || !dent) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, SCOUTFS_LKF_REFRESH_INODE,
+				 dir, &dir_lock);
+	if (ret)
+		goto out;
+	next_pos = SCOUTFS_I(dir)->next_readdir_pos;
+	scoutfs_unlock(sb, dir_lock, DLM_LOCK_PR);
+
+	uent = (void __user *)(unsigned long)rdp->buf_ptr;
+	bytes = rdp->buf_bytes;
+	pos = rdp->pos;
+
+	while (pos < next_pos && !full) {
+		nr = read_readdir_plus_ents(sb, scoutfs_ino(dir), &pos,
+					    next_pos, rpb, &bytes, &full,
+					    dent);
+		if (nr <= 0) {
+			ret = nr;
+			if (ret < 0)
+				break;
+			continue;
+		}
+
+		ret = scoutfs_inode_read_attrs(sb, rpb->inos, rpb->attrs, nr);
+		if (ret)
+			break;
+
+		scoutfs_add_counter(sb, dir_readdir_plus_ents, nr);
+
+		for (i = 0; i < nr; i++) {
+			/* skip entries whose inodes were removed */
+			if (rpb->attrs[i].mode == 0) {
+				bytes += rpb->ents[i].entry_bytes;
+				continue;
+			}
+
+			if (put_user(rpb->inos[i], &uent->ino) ||
+			    put_user(rpb->ents[i].pos, &uent->pos) ||
+			    copy_to_user(&uent->attrs, &rpb->attrs[i],
+					 sizeof(rpb->attrs[i])) ||
+			    put_user(rpb->ents[i].entry_bytes,
+				     &uent->entry_bytes) ||
+			    put_user(rpb->ents[i].name_len, &uent->name_len) ||
+			    copy_to_user(uent->name, rpb->ents[i].name,
+					 rpb->ents[i].name_len)) {
+				ret = -EFAULT;
+				goto out;
+			}
+
+			uent = (void __user *)uent + rpb->ents[i].entry_bytes;
+			total++;
+		}
+	}
+
+out:
+	kfree(dent);
+	kfree(rpb);
+
+	return ret ?: total;
+}
+
+/*
+ * Creates use readdir positions from a range that's reserved for the
+ * mount so that they don't need an exclusive dir inode lock to advance
+ * the dir's next position.  Once the range is used up we reserve a new
+ * range by advancing the dir's next position past it.  Ranges are
+ * aligned to the readdir pos lock groups so each mount's creates lock
+ * their own group.  We also take the opportunity to merge the dir's
+ * deltas while we have the dir locked.
+ *
+ * The caller's dir i_mutex serializes use of the reserved range.  The
+ * caller advances the range once they've used its next position.
+ */
+static int reserve_readdir_pos(struct inode *dir)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(dir);
+	struct super_block *sb = dir->i_sb;
+	struct scoutfs_lock *dir_lock = NULL;
+	LIST_HEAD(ind_locks);
+	u64 start;
+	int ret;
+
+	if (si->readdir_pos_next < si->readdir_pos_end)
+		return 0;
+
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_EX, SCOUTFS_LKF_REFRESH_INODE,
+				 dir, &dir_lock);
+	if (ret)
+		return ret;
+
+	ret = fold_dir_deltas(dir, dir_lock);
+	if (ret)
+		goto unlock;
+
+	ret = scoutfs_inode_index_lock_hold(dir, &ind_locks, false,
+					    SIC_DIRTY_INODE());
+	if (ret)
+		goto unlock;
+
+	ret = scoutfs_dirty_inode_item(dir, dir_lock);
+	if (ret == 0) {
+		start = round_up(si->next_readdir_pos,
+				 SCOUTFS_LOCK_READDIR_POS_NR);
+		si->next_readdir_pos = start + SCOUTFS_LOCK_READDIR_POS_NR;
+		scoutfs_update_inode_item(dir, dir_lock, &ind_locks);
+
+		si->readdir_pos_next = start;
+		si->readdir_pos_end = start + SCOUTFS_LOCK_READDIR_POS_NR;
+		scoutfs_inc_counter(sb, dir_readdir_pos_reserve);
+	}
+
+	scoutfs_release_trans(sb);
+unlock:
+	scoutfs_inode_index_unlock(sb, &ind_locks);
+	scoutfs_unlock(sb, dir_lock, DLM_LOCK_EX);
+
+	return ret;
+}
+
 /*
  * Inode creation needs to hold dir and inode locks which can be greater
  * or less than each other.  It seems easiest to keep the dual locking
@@ -642,12 +1255,21 @@ static int del_entry_items(struct super_block *sb, u64 dir_ino, u64 hash,
  * so we roll our own comparion between the two instead of pushing
  * complexity down the locking paths that acquire existing inodes in
  * order.
+ *
+ * We only need to read the dir so its inode lock is acquired in PR.  If
+ * we already have it in EX, which is always the case without other
+ * mounts creating in the dir, we update the dir inode as usual.
+ * Otherwise the entry gets a position from our reserved range and the
+ * dir changes are recorded in our delta item.  A range is only reserved
+ * once a create needs it, which has to drop our locks to lock the dir
+ * in EX.
  */
 static struct inode *lock_hold_create(struct inode *dir, struct dentry *dentry,
-				      umode_t mode, dev_t rdev,
+				      umode_t mode, dev_t rdev, u64 hash,
 				      const struct scoutfs_item_count cnt,
 				      struct scoutfs_lock **dir_lock,
 				      struct scoutfs_lock **inode_lock,
+				      struct entry_locks *el, u64 *pos,
 				      struct list_head *ind_locks)
 {
 	struct super_block *sb = dir->i_sb;
@@ -664,13 +1286,14 @@ static struct inode *lock_hold_create(struct inode *dir, struct dentry *dentry,
 	if (ret)
 		return ERR_PTR(ret);
 
+relock:
 	if (ino < scoutfs_ino(dir)) {
 		ret = scoutfs_lock_ino(sb, DLM_LOCK_EX, 0, ino, inode_lock) ?:
-		      scoutfs_lock_inode(sb, DLM_LOCK_EX,
+		      scoutfs_lock_inode(sb, DLM_LOCK_PR,
 				         SCOUTFS_LKF_REFRESH_INODE, dir,
 					 dir_lock);
 	} else {
-		ret = scoutfs_lock_inode(sb, DLM_LOCK_EX,
+		ret = scoutfs_lock_inode(sb, DLM_LOCK_PR,
 				         SCOUTFS_LKF_REFRESH_INODE, dir,
 					 dir_lock) ?:
 		      scoutfs_lock_ino(sb, DLM_LOCK_EX, 0, ino, inode_lock);
@@ -678,9 +1301,33 @@ static struct inode *lock_hold_create(struct inode *dir, struct dentry *dentry,
 	if (ret)
 		goto out_unlock;
 
+	if (scoutfs_lock_try_add_user(sb, *dir_lock, DLM_LOCK_EX)) {
+		el->dir_ex = *dir_lock;
+		*pos = SCOUTFS_I(dir)->next_readdir_pos;
+	} else if (SCOUTFS_I(dir)->readdir_pos_next >=
+		   SCOUTFS_I(dir)->readdir_pos_end) {
+		scoutfs_unlock(sb, *dir_lock, DLM_LOCK_PR);
+		scoutfs_unlock(sb, *inode_lock, DLM_LOCK_EX);
+		*dir_lock = NULL;
+		*inode_lock = NULL;
+
+		ret = reserve_readdir_pos(dir);
+		if (ret)
+			goto out_unlock;
+		goto relock;
+	} else {
+		scoutfs_inc_counter(sb, dir_create_delta);
+		*pos = SCOUTFS_I(dir)->readdir_pos_next;
+	}
+
+	ret = lock_entry(sb, scoutfs_ino(dir), hash, *pos, !el->dir_ex, el);
+	if (ret)
+		goto out_unlock;
+
 retry:
 	ret = scoutfs_inode_index_start(sb, &ind_seq) ?:
-	      scoutfs_inode_index_prepare(sb, ind_locks, dir, true) ?:
+	      (el->dir_ex == NULL ? 0 :
+	       scoutfs_inode_index_prepare(sb, ind_locks, dir, true)) ?:
 	      scoutfs_inode_index_prepare_ino(sb, ind_locks, ino, mode) ?:
 	      scoutfs_inode_index_try_lock_hold(sb, ind_locks, ind_seq, cnt);
 	if (ret > 0)
@@ -694,14 +1341,16 @@ retry:
 		goto out;
 	}
 
-	ret = scoutfs_dirty_inode_item(dir, *dir_lock);
+	if (el->dir_ex)
+		ret = scoutfs_dirty_inode_item(dir, *dir_lock);
 out:
 	if (ret)
 		scoutfs_release_trans(sb);
 out_unlock:
 	if (ret) {
 		scoutfs_inode_index_unlock(sb, ind_locks);
-		scoutfs_unlock(sb, *dir_lock, DLM_LOCK_EX);
+		unlock_entry(sb, el);
+		scoutfs_unlock(sb, *dir_lock, DLM_LOCK_PR);
 		scoutfs_unlock(sb, *inode_lock, DLM_LOCK_EX);
 		*dir_lock = NULL;
 		*inode_lock = NULL;
@@ -712,6 +1361,51 @@ out_unlock:
 	return inode;
 }
 
+/*
+ * Add the items for a new entry and update the dir, either directly or
+ * by recording the changes in our delta item.  The dir's vfs inode
+ * isn't modified when we record a delta, getattr adds the deltas to
+ * the dir inode's attributes.
+ */
+static int create_entry(struct super_block *sb, struct inode *dir,
+			struct dentry *dentry, struct inode *inode, u64 hash,
+			u64 pos, struct timespec *ts, struct entry_locks *el,
+			struct scoutfs_lock *inode_lock,
+			struct list_head *ind_locks)
+{
+	s64 nlink = S_ISDIR(inode->i_mode) ? 1 : 0;
+	int ret;
+
+	ret = add_entry_items(sb, scoutfs_ino(dir), hash, pos,
+			      dentry->d_name.name, dentry->d_name.len,
+			      scoutfs_ino(inode), inode->i_mode, el,
+			      inode_lock);
+	if (ret)
+		return ret;
+
+	if (el->dir_ex) {
+		SCOUTFS_I(dir)->next_readdir_pos++;
+		i_size_write(dir, i_size_read(dir) + dentry->d_name.len);
+		dir->i_mtime = dir->i_ctime = *ts;
+		if (nlink)
+			inc_nlink(dir);
+		scoutfs_update_inode_item(dir, el->dir_ex, ind_locks);
+	} else {
+		ret = add_dir_delta(dir, dentry->d_name.len, nlink, ts,
+				    el->delta);
+		if (ret) {
+			del_entry_items(sb, scoutfs_ino(dir), hash, pos,
+					scoutfs_ino(inode), el, inode_lock);
+			return ret;
+		}
+		SCOUTFS_I(dir)->readdir_pos_next++;
+	}
+
+	update_dentry_info(sb, dentry, hash, pos, el->hash);
+
+	return 0;
+}
+
 static int scoutfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 		       dev_t rdev)
 {
@@ -719,6 +1413,8 @@ static int scoutfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 	struct inode *inode = NULL;
 	struct scoutfs_lock *dir_lock = NULL;
 	struct scoutfs_lock *inode_lock = NULL;
+	struct entry_locks el = {NULL,};
+	struct timespec ts = CURRENT_TIME;
 	LIST_HEAD(ind_locks);
 	u64 hash;
 	u64 pos;
@@ -728,34 +1424,23 @@ static int scoutfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 		return -ENAMETOOLONG;
 
 	hash = dirent_name_hash(dentry->d_name.name, dentry->d_name.len);
-	inode = lock_hold_create(dir, dentry, mode, rdev,
+	inode = lock_hold_create(dir, dentry, mode, rdev, hash,
 				 SIC_MKNOD(dentry->d_name.len),
-				 &dir_lock, &inode_lock, &ind_locks);
+				 &dir_lock, &inode_lock, &el, &pos, &ind_locks);
 	if (IS_ERR(inode))
 		return PTR_ERR(inode);
 
-	pos = SCOUTFS_I(dir)->next_readdir_pos++;
-
-	ret = add_entry_items(sb, scoutfs_ino(dir), hash, pos,
-			      dentry->d_name.name, dentry->d_name.len,
-			      scoutfs_ino(inode), inode->i_mode, dir_lock,
-			      inode_lock);
+	ret = create_entry(sb, dir, dentry, inode, hash, pos, &ts, &el,
+			   inode_lock, &ind_locks);
 	if (ret)
 		goto out;
 
-	update_dentry_info(sb, dentry, hash, pos, dir_lock);
-
-	i_size_write(dir, i_size_read(dir) + dentry->d_name.len);
-	dir->i_mtime = dir->i_ctime = CURRENT_TIME;
-	inode->i_mtime = inode->i_atime = inode->i_ctime = dir->i_mtime;
+	inode->i_mtime = inode->i_atime = inode->i_ctime = ts;
 
-	if (S_ISDIR(mode)) {
+	if (S_ISDIR(mode))
 		inc_nlink(inode);
-		inc_nlink(dir);
-	}
 
 	scoutfs_update_inode_item(inode, inode_lock, &ind_locks);
-	scoutfs_update_inode_item(dir, dir_lock, &ind_locks);
 	scoutfs_inode_index_unlock(sb, &ind_locks);
 
 	insert_inode_hash(inode);
@@ -763,7 +1448,8 @@ static int scoutfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 out:
 	scoutfs_release_trans(sb);
 	scoutfs_inode_index_unlock(sb, &ind_locks);
-	scoutfs_unlock(sb, dir_lock, DLM_LOCK_EX);
+	unlock_entry(sb, &el);
+	scoutfs_unlock(sb, dir_lock, DLM_LOCK_PR);
 	scoutfs_unlock(sb, inode_lock, DLM_LOCK_EX);
 
 	/* XXX delete the inode item here */
@@ -791,6 +1477,7 @@ static int scoutfs_link(struct dentry *old_dentry,
 	struct super_block *sb = dir->i_sb;
 	struct scoutfs_lock *dir_lock;
 	struct scoutfs_lock *inode_lock = NULL;
+	struct entry_locks el = {NULL,};
 	LIST_HEAD(ind_locks);
 	u64 dir_size;
 	u64 ind_seq;
@@ -819,6 +1506,11 @@ static int scoutfs_link(struct dentry *old_dentry,
 		goto out_unlock;
 
 	dir_size = i_size_read(dir) + dentry->d_name.len;
+	pos = SCOUTFS_I(dir)->next_readdir_pos++;
+
+	ret = lock_entry(sb, scoutfs_ino(dir), hash, pos, false, &el);
+	if (ret)
+		goto out_unlock;
 retry:
 	ret = scoutfs_inode_index_start(sb, &ind_seq) ?:
 	      scoutfs_inode_index_prepare(sb, &ind_locks, dir, false) ?:
@@ -834,15 +1526,13 @@ retry:
 	if (ret)
 		goto out;
 
-	pos = SCOUTFS_I(dir)->next_readdir_pos++;
-
 	ret = add_entry_items(sb, scoutfs_ino(dir), hash, pos,
 			      dentry->d_name.name, dentry->d_name.len,
-			      scoutfs_ino(inode), inode->i_mode, dir_lock,
+			      scoutfs_ino(inode), inode->i_mode, &el,
 			      inode_lock);
 	if (ret)
 		goto out;
-	update_dentry_info(sb, dentry, hash, pos, dir_lock);
+	update_dentry_info(sb, dentry, hash, pos, el.hash);
 
 	i_size_write(dir, dir_size);
 	dir->i_mtime = dir->i_ctime = CURRENT_TIME;
@@ -858,6 +1548,7 @@ out:
 	scoutfs_release_trans(sb);
 out_unlock:
 	scoutfs_inode_index_unlock(sb, &ind_locks);
+	unlock_entry(sb, &el);
 	scoutfs_unlock(sb, dir_lock, DLM_LOCK_EX);
 	scoutfs_unlock(sb, inode_lock, DLM_LOCK_EX);
 	return ret;
@@ -877,6 +1568,9 @@ static bool should_orphan(struct inode *inode)
 /*
  * Unlink removes the entry from its item and removes the item if ours
  * was the only remaining entry.
+ *
+ * The dir's attributes, and a dir target's size, have to include the
+ * pending deltas from creates before we can test or decrease them.
  */
 static int scoutfs_unlink(struct inode *dir, struct dentry *dentry)
 {
@@ -885,6 +1579,7 @@ static int scoutfs_unlink(struct inode *dir, struct dentry *dentry)
 	struct timespec ts = current_kernel_time();
 	struct scoutfs_lock *inode_lock = NULL;
 	struct scoutfs_lock *dir_lock = NULL;
+	struct entry_locks el = {NULL,};
 	LIST_HEAD(ind_locks);
 	u64 ind_seq;
 	int ret = 0;
@@ -895,11 +1590,21 @@ static int scoutfs_unlink(struct inode *dir, struct dentry *dentry)
 	if (ret)
 		return ret;
 
+	ret = fold_dir_deltas(dir, dir_lock) ?:
+	      (S_ISDIR(inode->i_mode) ? fold_dir_deltas(inode, inode_lock) : 0);
+	if (ret)
+		goto unlock;
+
 	if (S_ISDIR(inode->i_mode) && i_size_read(inode)) {
 		ret = -ENOTEMPTY;
 		goto unlock;
 	}
 
+	ret = lock_entry(sb, scoutfs_ino(dir), dentry_info_hash(dentry),
+			 dentry_info_pos(dentry), false, &el);
+	if (ret)
+		goto unlock;
+
 retry:
 	ret = scoutfs_inode_index_start(sb, &ind_seq) ?:
 	      scoutfs_inode_index_prepare(sb, &ind_locks, dir, false) ?:
@@ -913,7 +1618,7 @@ retry:
 
 	ret = del_entry_items(sb, scoutfs_ino(dir), dentry_info_hash(dentry),
 			      dentry_info_pos(dentry), scoutfs_ino(inode),
-			      dir_lock, inode_lock);
+			      &el, inode_lock);
 	if (ret)
 		goto out;
 
@@ -946,6 +1651,7 @@ out:
 	scoutfs_release_trans(sb);
 unlock:
 	scoutfs_inode_index_unlock(sb, &ind_locks);
+	unlock_entry(sb, &el);
 	scoutfs_unlock(sb, dir_lock, DLM_LOCK_EX);
 	scoutfs_unlock(sb, inode_lock, DLM_LOCK_EX);
 
@@ -1018,16 +1724,20 @@ static int symlink_item_ops(struct super_block *sb, int op, u64 ino,
 }
 
 /*
- * Full a buffer with the null terminated symlink, point nd at it, and
- * return it so put_link can free it once the vfs is done.
+ * Point nd at the null terminated symlink target.  Targets never change
+ * once they're created so the first follow reads the items into a
+ * buffer that's cached in the inode until it's freed.  Following the
+ * link again doesn't search items or allocate.  We still acquire the
+ * inode lock so that links deleted by other nodes return errors.
  *
- * We chose to pay the runtime cost of per-call allocation and copy
- * overhead instead of wiring up symlinks to the page cache, storing
- * each small link in a full page, and later having to reclaim them.
+ * We chose to cache exactly sized targets instead of wiring up symlinks
+ * to the page cache, storing each small link in a full page, and later
+ * having to reclaim them.
  */
 static void *scoutfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 {
 	struct inode *inode = dentry->d_inode;
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
 	struct super_block *sb = inode->i_sb;
 	struct scoutfs_lock *inode_lock = NULL;
 	char *path = NULL;
@@ -1039,6 +1749,12 @@ static void *scoutfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	if (ret)
 		return ERR_PTR(ret);
 
+	path = ACCESS_ONCE(si->symlink_target);
+	if (path) {
+		scoutfs_inc_counter(sb, symlink_cache_hit);
+		goto out;
+	}
+
 	size = i_size_read(inode);
 
 	if (size == 0 || size > SCOUTFS_SYMLINK_MAX_SIZE) {
@@ -1080,28 +1796,29 @@ static void *scoutfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 		ret = -EIO;
 	}
 
+	/* racing followers read the same target, first to cache it wins */
+	if (ret == 0) {
+		scoutfs_inc_counter(sb, symlink_cache_miss);
+		if (cmpxchg(&si->symlink_target, NULL, path) != NULL) {
+			kfree(path);
+			path = si->symlink_target;
+		}
+	}
+
 out:
+	scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
 	if (ret < 0) {
 		kfree(path);
-		path = ERR_PTR(ret);
-	} else {
-		nd_set_link(nd, path);
+		return ERR_PTR(ret);
 	}
-	scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
-	return path;
-}
 
-static void scoutfs_put_link(struct dentry *dentry, struct nameidata *nd,
-			     void *cookie)
-{
-	if (!IS_ERR_OR_NULL(cookie))
-		kfree(cookie);
+	nd_set_link(nd, path);
+	return NULL;
 }
 
 const struct inode_operations scoutfs_symlink_iops = {
 	.readlink       = generic_readlink,
 	.follow_link    = scoutfs_follow_link,
-	.put_link       = scoutfs_put_link,
 	.getattr	= scoutfs_getattr,
 	.setattr	= scoutfs_setattr,
 	.setxattr	= scoutfs_setxattr,
@@ -1122,6 +1839,8 @@ static int scoutfs_symlink(struct inode *dir, struct dentry *dentry,
 	struct inode *inode = NULL;
 	struct scoutfs_lock *dir_lock = NULL;
 	struct scoutfs_lock *inode_lock = NULL;
+	struct entry_locks el = {NULL,};
+	struct timespec ts = CURRENT_TIME;
 	LIST_HEAD(ind_locks);
 	u64 hash;
 	u64 pos;
@@ -1138,9 +1857,9 @@ static int scoutfs_symlink(struct inode *dir, struct dentry *dentry,
 	if (ret)
 		return ret;
 
-	inode = lock_hold_create(dir, dentry, S_IFLNK|S_IRWXUGO, 0,
+	inode = lock_hold_create(dir, dentry, S_IFLNK|S_IRWXUGO, 0, hash,
 				 SIC_SYMLINK(dentry->d_name.len, name_len),
-				 &dir_lock, &inode_lock, &ind_locks);
+				 &dir_lock, &inode_lock, &el, &pos, &ind_locks);
 	if (IS_ERR(inode))
 		return PTR_ERR(inode);
 
@@ -1149,25 +1868,19 @@ static int scoutfs_symlink(struct inode *dir, struct dentry *dentry,
 	if (ret)
 		goto out;
 
-	pos = SCOUTFS_I(dir)->next_readdir_pos++;
-
-	ret = add_entry_items(sb, scoutfs_ino(dir), hash, pos,
-			      dentry->d_name.name, dentry->d_name.len,
-			      scoutfs_ino(inode), inode->i_mode, dir_lock,
-			      inode_lock);
+	ret = create_entry(sb, dir, dentry, inode, hash, pos, &ts, &el,
+			   inode_lock, &ind_locks);
 	if (ret)
 		goto out;
 
-	update_dentry_info(sb, dentry, hash, pos, dir_lock);
-
-	i_size_write(dir, i_size_read(dir) + dentry->d_name.len);
-	dir->i_mtime = dir->i_ctime = CURRENT_TIME;
-
-	inode->i_ctime = dir->i_mtime;
+	inode->i_ctime = ts;
 	i_size_write(inode, name_len);
 
+	/* save a first follow_link from reading the items, fine if it fails */
+	SCOUTFS_I(inode)->symlink_target = kmemdup(symname, name_len,
+						   GFP_NOFS);
+
 	scoutfs_update_inode_item(inode, inode_lock, &ind_locks);
-	scoutfs_update_inode_item(dir, dir_lock, &ind_locks);
 
 	insert_inode_hash(inode);
 	/* XXX need to set i_op/fop before here for sec callbacks */
@@ -1184,7 +1897,8 @@ out:
 
 	scoutfs_release_trans(sb);
 	scoutfs_inode_index_unlock(sb, &ind_locks);
-	scoutfs_unlock(sb, dir_lock, DLM_LOCK_EX);
+	unlock_entry(sb, &el);
+	scoutfs_unlock(sb, dir_lock, DLM_LOCK_PR);
 	scoutfs_unlock(sb, inode_lock, DLM_LOCK_EX);
 
 	return ret;
@@ -1488,6 +2202,10 @@ static int verify_entry(struct super_block *sb, u64 dir_ino, const char *name,
  * properties that can be different in a given group.  This prevents us
  * from using parent/child locking orders as two groups can have both
  * parent and child relationships to each other.
+ *
+ * The entry locks for the old entry, the new entry, and the existing
+ * target's readdir pos are acquired after the inode locks.  The target
+ * shares the new entry's name hash lock.
  */
 static int scoutfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 			  struct inode *new_dir, struct dentry *new_dentry)
@@ -1500,6 +2218,9 @@ static int scoutfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	struct scoutfs_lock *new_dir_lock = NULL;
 	struct scoutfs_lock *old_inode_lock = NULL;
 	struct scoutfs_lock *new_inode_lock = NULL;
+	struct entry_locks old_el = {NULL,};
+	struct entry_locks new_el = {NULL,};
+	struct entry_locks tgt_el = {NULL,};
 	struct timespec now;
 	bool ins_new = false;
 	bool del_new = false;
@@ -1547,20 +2268,45 @@ static int scoutfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	if (ret)
 		goto out_unlock;
 
+	/* include pending create deltas in the attributes we'll change */
+	ret = fold_dir_deltas(old_dir, old_dir_lock) ?:
+	      (new_dir == old_dir ? 0 :
+	       fold_dir_deltas(new_dir, new_dir_lock)) ?:
+	      ((new_inode && S_ISDIR(new_inode->i_mode)) ?
+	       fold_dir_deltas(new_inode, new_inode_lock) : 0);
+	if (ret)
+		goto out_unlock;
+
 	/* test dir i_size now that it's refreshed */
 	if (new_inode && S_ISDIR(new_inode->i_mode) && i_size_read(new_inode)) {
 		ret = -ENOTEMPTY;
 		goto out_unlock;
 	}
 
+	/* get a pos for the new entry */
+	new_pos = SCOUTFS_I(new_dir)->next_readdir_pos++;
+
+	ret = lock_entry(sb, scoutfs_ino(old_dir), old_hash,
+			 dentry_info_pos(old_dentry), false, &old_el) ?:
+	      lock_entry(sb, scoutfs_ino(new_dir), new_hash, new_pos, false,
+			 &new_el) ?:
+	      (new_inode == NULL ? 0 :
+	       scoutfs_lock_readdir_pos(sb, DLM_LOCK_EX, 0,
+					scoutfs_ino(new_dir),
+					dentry_info_pos(new_dentry),
+					&tgt_el.pos));
+	if (ret)
+		goto out_unlock;
+	tgt_el.hash = new_el.hash;
+
 	/* make sure that the entries assumed by the argument still exist */
 	ret = verify_entry(sb, scoutfs_ino(old_dir), old_dentry->d_name.name,
 			   old_dentry->d_name.len, old_hash,
-			   scoutfs_ino(old_inode), old_dir_lock) ?:
+			   scoutfs_ino(old_inode), old_el.hash) ?:
 	      verify_entry(sb, scoutfs_ino(new_dir), new_dentry->d_name.name,
 			   new_dentry->d_name.len, new_hash,
 			   new_inode ? scoutfs_ino(new_inode) : 0,
-			   new_dir_lock);
+			   new_el.hash);
 	if (ret)
 		goto out_unlock;
 
@@ -1580,9 +2326,6 @@ retry:
 	if (ret)
 		goto out_unlock;
 
-	/* get a pos for the new entry */
-	new_pos = SCOUTFS_I(new_dir)->next_readdir_pos++;
-
 	/* dirty the inodes so that updating doesn't fail */
 	ret = scoutfs_dirty_inode_item(old_dir, old_dir_lock) ?:
 	      scoutfs_dirty_inode_item(old_inode, old_inode_lock) ?:
@@ -1599,7 +2342,7 @@ retry:
 				      dentry_info_hash(new_dentry),
 				      dentry_info_pos(new_dentry),
 				      scoutfs_ino(new_inode),
-				      new_dir_lock, new_inode_lock);
+				      &tgt_el, new_inode_lock);
 		if (ret)
 			goto out;
 		ins_new = true;
@@ -1609,7 +2352,7 @@ retry:
 	ret = add_entry_items(sb, scoutfs_ino(new_dir), new_hash, new_pos,
 			      new_dentry->d_name.name, new_dentry->d_name.len,
 			      scoutfs_ino(old_inode), old_inode->i_mode,
-			      new_dir_lock, old_inode_lock);
+			      &new_el, old_inode_lock);
 	if (ret)
 		goto out;
 	del_new = true;
@@ -1619,7 +2362,7 @@ retry:
 			      dentry_info_hash(old_dentry),
 			      dentry_info_pos(old_dentry),
 			      scoutfs_ino(old_inode),
-			      old_dir_lock, old_inode_lock);
+			      &old_el, old_inode_lock);
 	if (ret)
 		goto out;
 	ins_old = true;
@@ -1633,7 +2376,7 @@ retry:
 	/* won't fail from here on out, update all the vfs structs */
 
 	/* the caller will use d_move to move the old_dentry into place */
-	update_dentry_info(sb, old_dentry, new_hash, new_pos, new_dir_lock);
+	update_dentry_info(sb, old_dentry, new_hash, new_pos, new_el.hash);
 
        i_size_write(old_dir, i_size_read(old_dir) - old_dentry->d_name.len);
        if (!new_inode)
@@ -1697,14 +2440,14 @@ out:
 					      old_dentry->d_name.len,
 					      scoutfs_ino(old_inode),
 					      old_inode->i_mode,
-					      old_dir_lock,
+					      &old_el,
 					      old_inode_lock);
 
 		if (del_new && err == 0)
 			err = del_entry_items(sb, scoutfs_ino(new_dir),
 					      new_hash, new_pos,
 					      scoutfs_ino(old_inode),
-					      new_dir_lock, old_inode_lock);
+					      &new_el, old_inode_lock);
 
 		if (ins_new && err == 0)
 			err = add_entry_items(sb, scoutfs_ino(new_dir),
@@ -1714,7 +2457,7 @@ out:
 					      new_dentry->d_name.len,
 					      scoutfs_ino(new_inode),
 					      new_inode->i_mode,
-					      new_dir_lock,
+					      &tgt_el,
 					      new_inode_lock);
 		/* XXX freak out: panic, go read only, etc */
 		BUG_ON(err);
@@ -1724,6 +2467,9 @@ out:
 
 out_unlock:
 	scoutfs_inode_index_unlock(sb, &ind_locks);
+	unlock_entry(sb, &old_el);
+	unlock_entry(sb, &new_el);
+	scoutfs_unlock(sb, tgt_el.pos, DLM_LOCK_EX);
 	scoutfs_unlock(sb, old_inode_lock, DLM_LOCK_EX);
 	scoutfs_unlock(sb, new_inode_lock, DLM_LOCK_EX);
 	scoutfs_unlock(sb, old_dir_lock, DLM_LOCK_EX);
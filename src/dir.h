@@ -3,6 +3,7 @@
 
 #include "format.h"
 #include "lock.h"
+#include "ioctl.h"
 
 extern const struct file_operations scoutfs_dir_fops;
 extern const struct inode_operations scoutfs_dir_iops;
@@ -29,6 +30,13 @@ int scoutfs_dir_add_next_linkref(struct super_block *sb, u64 ino,
 int scoutfs_symlink_drop(struct super_block *sb, u64 ino,
 			 struct scoutfs_lock *lock, u64 i_size);
 
+int scoutfs_dir_add_deltas(struct inode *dir, struct scoutfs_lock *dir_lock,
+			   struct kstat *stat);
+int scoutfs_dir_add_attrs_deltas(struct super_block *sb, u64 dir_ino,
+				 struct scoutfs_ioctl_inode_attrs *attrs);
+int scoutfs_dir_readdir_plus(struct inode *dir,
+			     struct scoutfs_ioctl_readdir_plus *rdp);
+
 int scoutfs_dir_init(void);
 void scoutfs_dir_exit(void);
 
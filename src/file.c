@@ -29,30 +29,97 @@
 #include "inode.h"
 #include "per_task.h"
 
+/*
+ * Writers on other mounts that hold the inode lock in PR record their
+ * sizes in file deltas instead of in the inode item.  Reads past our
+ * i_size and SEEK_END first grow i_size to include the deltas.
+ */
+static int grow_size_deltas(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_lock *lock = NULL;
+	int ret;
+
+	mutex_lock(&inode->i_mutex);
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, SCOUTFS_LKF_REFRESH_INODE,
+				 inode, &lock);
+	if (ret == 0) {
+		ret = scoutfs_data_grow_size_deltas(inode, lock);
+		scoutfs_unlock(sb, lock, DLM_LOCK_PR);
+	}
+	mutex_unlock(&inode->i_mutex);
+
+	return ret;
+}
+
 /* TODO: Direct I/O, AIO */
 ssize_t scoutfs_file_aio_read(struct kiocb *iocb, const struct iovec *iov,
 			      unsigned long nr_segs, loff_t pos)
 {
 	struct file *file = iocb->ki_filp;
 	struct inode *inode = file_inode(file);
-	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
 	struct super_block *sb = inode->i_sb;
 	struct scoutfs_lock *inode_lock = NULL;
-	SCOUTFS_DECLARE_PER_TASK_ENTRY(pt_ent);
+	struct scoutfs_data_wait dw;
+	bool wait = false;
+	ssize_t read = 0;
 	int ret;
 
+	if (pos + iov_length(iov, nr_segs) > i_size_read(inode)) {
+		ret = grow_size_deltas(inode);
+		if (ret)
+			goto out;
+	}
+
+retry:
 	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, SCOUTFS_LKF_REFRESH_INODE,
 				 inode, &inode_lock);
+	if (ret)
+		goto out;
+
+	/* wait for staging instead of failing reads of offline blocks */
+	ret = scoutfs_data_wait_check(inode, pos, iov_length(iov, nr_segs),
+				      inode_lock, &dw);
 	if (ret == 0) {
-		scoutfs_per_task_add(&si->pt_data_lock, &pt_ent, inode_lock);
 		ret = generic_file_aio_read(iocb, iov, nr_segs, pos);
-		scoutfs_per_task_del(&si->pt_data_lock, &pt_ent);
-		scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
+		if (ret > 0)
+			read = ret;
+	} else if (ret > 0) {
+		wait = true;
 	}
+	scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
 
+	/* only reads that returned data advance stride detection */
+	if (read > 0)
+		scoutfs_data_stride_readahead(file, pos, read);
+
+	if (wait) {
+		wait = false;
+		ret = scoutfs_data_wait(inode, &dw);
+		if (ret == 0)
+			goto retry;
+	}
+out:
 	return ret;
 }
 
+/*
+ * Writers only need the inode lock in PR when they write blocks into
+ * regions, which they lock in EX, and record their changes to the inode
+ * in file deltas.  Writes that need the current inode use EX: inline
+ * data, finishing a truncate, appending at the current size, and
+ * removing suid bits which calls setattr.
+ */
+static bool write_needs_ex(struct file *file, struct inode *inode)
+{
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+
+	return (si->flags & (SCOUTFS_INO_FLAG_INLINE_DATA |
+			     SCOUTFS_INO_FLAG_TRUNCATE)) ||
+	       (file->f_flags & O_APPEND) ||
+	       should_remove_suid(file->f_path.dentry);
+}
+
 ssize_t scoutfs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			       unsigned long nr_segs, loff_t pos)
 {
@@ -61,30 +128,56 @@ ssize_t scoutfs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
 	struct super_block *sb = inode->i_sb;
 	struct scoutfs_lock *inode_lock = NULL;
-	SCOUTFS_DECLARE_PER_TASK_ENTRY(pt_ent);
+	struct scoutfs_data_locks dl = { NULL, };
+	SCOUTFS_DECLARE_PER_TASK_ENTRY(dl_ent);
+	int mode = DLM_LOCK_PR;
 	int ret;
 
 	if (iocb->ki_left == 0) /* Does this even happen? */
 		return 0;
 
 	mutex_lock(&inode->i_mutex);
-	ret = scoutfs_lock_inode(sb, DLM_LOCK_EX, SCOUTFS_LKF_REFRESH_INODE,
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, SCOUTFS_LKF_REFRESH_INODE,
 				 inode, &inode_lock);
 	if (ret)
 		goto out;
 
-	ret = scoutfs_complete_truncate(inode, inode_lock);
+	/* use EX if we have it, there's no contention to avoid */
+	if (scoutfs_lock_try_add_user(sb, inode_lock, DLM_LOCK_EX)) {
+		scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
+		mode = DLM_LOCK_EX;
+	} else if (write_needs_ex(file, inode)) {
+		scoutfs_unlock(sb, inode_lock, DLM_LOCK_PR);
+		inode_lock = NULL;
+		mode = DLM_LOCK_EX;
+		ret = scoutfs_lock_inode(sb, DLM_LOCK_EX,
+					 SCOUTFS_LKF_REFRESH_INODE, inode,
+					 &inode_lock);
+		if (ret)
+			goto out;
+	}
+
+	if (mode == DLM_LOCK_EX)
+		ret = scoutfs_data_fold_file_deltas(inode, inode_lock) ?:
+		      scoutfs_complete_truncate(inode, inode_lock);
+	else
+		ret = scoutfs_lock_file_deltas(sb, DLM_LOCK_CW, 0,
+					       scoutfs_ino(inode), &dl.deltas);
 	if (ret)
 		goto out;
 
-	scoutfs_per_task_add(&si->pt_data_lock, &pt_ent, inode_lock);
+	/* write_begin acquires data locks that we hold across pages */
+	dl.inode = inode_lock;
+	scoutfs_per_task_add(&si->pt_write_locks, &dl_ent, &dl);
 
 	/* XXX: remove SUID bit */
 
 	ret = __generic_file_aio_write(iocb, iov, nr_segs, &iocb->ki_pos);
 out:
-	scoutfs_per_task_del(&si->pt_data_lock, &pt_ent);
-	scoutfs_unlock(sb, inode_lock, DLM_LOCK_EX);
+	scoutfs_per_task_del(&si->pt_write_locks, &dl_ent);
+	scoutfs_data_unlock_write(sb, &dl);
+	scoutfs_unlock(sb, dl.deltas, DLM_LOCK_CW);
+	scoutfs_unlock(sb, inode_lock, mode);
 	mutex_unlock(&inode->i_mutex);
 
 	if (ret > 0 || ret == -EIOCBQUEUED) {
@@ -98,6 +191,33 @@ out:
 	return ret;
 }
 
+/*
+ * Writers that held the inode lock in PR left deltas that only getattr
+ * and the attribute ioctls see.  Closing a file that we wrote folds
+ * them into the inode item so that its indexes catch up.
+ */
+int scoutfs_file_release(struct inode *inode, struct file *file)
+{
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_lock *lock = NULL;
+	int ret;
+
+	if (!(file->f_mode & FMODE_WRITE) ||
+	    !SCOUTFS_I(inode)->file_deltas_written)
+		return 0;
+
+	mutex_lock(&inode->i_mutex);
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_EX, SCOUTFS_LKF_REFRESH_INODE,
+				 inode, &lock);
+	if (ret == 0) {
+		ret = scoutfs_data_fold_file_deltas(inode, lock);
+		scoutfs_unlock(sb, lock, DLM_LOCK_EX);
+	}
+	mutex_unlock(&inode->i_mutex);
+
+	return ret;
+}
+
 int scoutfs_permission(struct inode *inode, int mask)
 {
 	struct super_block *sb = inode->i_sb;
@@ -119,6 +239,46 @@ int scoutfs_permission(struct inode *inode, int mask)
 	return ret;
 }
 
+/*
+ * SEEK_DATA and SEEK_HOLE search the file extent items.  Dirty pages
+ * are written first so that their delayed blocks are allocated.
+ */
+static loff_t seek_data_hole(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_lock *lock = NULL;
+	loff_t ret;
+
+	ret = filemap_write_and_wait(inode->i_mapping) ?:
+	      grow_size_deltas(inode);
+	if (ret)
+		return ret;
+
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, SCOUTFS_LKF_REFRESH_INODE,
+				 inode, &lock);
+	if (ret)
+		return ret;
+
+	offset = scoutfs_data_seek(inode, offset, whence, lock);
+
+	scoutfs_unlock(sb, lock, DLM_LOCK_PR);
+
+	if (offset < 0)
+		return offset;
+	if (offset > inode->i_sb->s_maxbytes)
+		return -EINVAL;
+
+	spin_lock(&file->f_lock);
+	if (offset != file->f_pos) {
+		file->f_pos = offset;
+		file->f_version = 0;
+	}
+	spin_unlock(&file->f_lock);
+
+	return offset;
+}
+
 loff_t scoutfs_file_llseek(struct file *file, loff_t offset, int whence)
 {
 	struct inode *inode = file->f_mapping->host;
@@ -127,18 +287,17 @@ loff_t scoutfs_file_llseek(struct file *file, loff_t offset, int whence)
 	int ret = 0;
 
 	switch (whence) {
-	case SEEK_END:
 	case SEEK_DATA:
 	case SEEK_HOLE:
+		return seek_data_hole(file, offset, whence);
+	case SEEK_END:
 		/*
-		 * These require a lock and inode refresh as they
-		 * reference i_size.
-		 *
-		 * XXX: SEEK_DATA/SEEK_HOLE can search our extent
-		 * items instead of relying on generic_file_llseek()
-		 * trickery.
+		 * This requires a lock and inode refresh as it
+		 * references i_size, which writers on other mounts
+		 * could have grown in their deltas.
 		 */
-		ret = scoutfs_lock_inode(sb, DLM_LOCK_PR,
+		ret = grow_size_deltas(inode) ?:
+		      scoutfs_lock_inode(sb, DLM_LOCK_PR,
 					 SCOUTFS_LKF_REFRESH_INODE, inode,
 					 &lock);
 	case SEEK_SET:
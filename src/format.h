@@ -108,6 +108,22 @@ struct scoutfs_key {
 #define skfe_ino	_sk_first
 #define skfe_last	_sk_second
 
+/* file attribute delta */
+#define skfd_ino	_sk_first
+#define skfd_seq	_sk_second
+#define skfd_node_id	_sk_third
+
+/* inline file data */
+#define skid_ino	_sk_first
+#define skid_nr		_sk_second
+
+/* shared extent reference count */
+#define skse_last	_sk_first
+
+/* node pending shared extent release */
+#define sksr_node_id	_sk_first
+#define sksr_id		_sk_second
+
 /*
  * The btree still uses memcmp() to compare keys.  We should fix that
  * before too long.
@@ -293,29 +309,54 @@ struct scoutfs_segment_block {
 #define SCOUTFS_INODE_INDEX_ZONE		1
 #define SCOUTFS_NODE_ZONE			2
 #define SCOUTFS_FS_ZONE				3
-#define SCOUTFS_MAX_ZONE			4 /* power of 2 is efficient */
+#define SCOUTFS_SHARED_EXTENT_ZONE		4
+#define SCOUTFS_DIRENT_ZONE			5
+#define SCOUTFS_FILE_DATA_ZONE			6
+#define SCOUTFS_MAX_ZONE			8 /* power of 2 is efficient */
 
 /* inode index zone */
 #define SCOUTFS_INODE_INDEX_META_SEQ_TYPE	1
 #define SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE	2
-#define SCOUTFS_INODE_INDEX_NR			3 /* don't forget to update */
+#define SCOUTFS_INODE_INDEX_SIZE_TYPE		3
+#define SCOUTFS_INODE_INDEX_MTIME_TYPE		4
+#define SCOUTFS_INODE_INDEX_ATIME_TYPE		5
+#define SCOUTFS_INODE_INDEX_ONLINE_BLOCKS_TYPE	6
+#define SCOUTFS_INODE_INDEX_OFFLINE_BLOCKS_TYPE	7
+#define SCOUTFS_INODE_INDEX_UID_TYPE		8
+#define SCOUTFS_INODE_INDEX_GID_TYPE		9
+#define SCOUTFS_INODE_INDEX_XATTR_TYPE		10
+#define SCOUTFS_INODE_INDEX_NR			11 /* don't forget to update */
+
+/* time index majors are seconds in buckets of about 18 hours */
+#define SCOUTFS_INODE_INDEX_TIME_BUCKET_SHIFT	16
 
 /* node zone (also used in server alloc btree) */
 #define SCOUTFS_FREE_EXTENT_BLKNO_TYPE		1
 #define SCOUTFS_FREE_EXTENT_BLOCKS_TYPE		2
+#define SCOUTFS_SHARED_RELEASE_TYPE		3
 
 /* fs zone */
 #define SCOUTFS_INODE_TYPE			1
 #define SCOUTFS_XATTR_TYPE			2
-#define SCOUTFS_DIRENT_TYPE			3
-#define SCOUTFS_READDIR_TYPE			4
 #define SCOUTFS_LINK_BACKREF_TYPE		5
 #define SCOUTFS_SYMLINK_TYPE			6
-#define SCOUTFS_FILE_EXTENT_TYPE		7
 #define SCOUTFS_ORPHAN_TYPE			8
+#define SCOUTFS_INLINE_DATA_TYPE		9
 
 #define SCOUTFS_MAX_TYPE			16 /* power of 2 is efficient */
 
+/* shared extent zone */
+#define SCOUTFS_SHARED_EXTENT_TYPE		1
+
+/* dirent zone */
+#define SCOUTFS_DIRENT_TYPE			3
+#define SCOUTFS_READDIR_TYPE			4
+#define SCOUTFS_DIR_DELTA_TYPE			5
+
+/* file data zone, extent type differs from free extent types */
+#define SCOUTFS_FILE_EXTENT_TYPE		7
+#define SCOUTFS_FILE_DELTA_TYPE			8
+
 /*
  * File extents have more data than easily fits in the key so we move
  * the non-indexed fields into the value.
@@ -328,6 +369,31 @@ struct scoutfs_file_extent {
 
 #define SEF_OFFLINE	0x1
 #define SEF_UNWRITTEN	0x2
+#define SEF_SHARED	0x4
+
+/*
+ * Cloning files shares their allocated blocks.  File extents that
+ * reference shared blocks have the shared flag set and the number of
+ * file extents referencing each block is stored in reference count
+ * items in the shared extent zone.  Blocks without a reference count
+ * item are only referenced by one file extent.  The items are indexed
+ * by their final block, like file extents.
+ */
+struct scoutfs_shared_extent {
+	__le64 len;
+	__le64 refs;
+} __packed;
+
+/*
+ * Nodes can't modify the shared reference counts while they're writing
+ * or truncating so they record the blocks whose references they've
+ * dropped in their node zone.  The releases are applied in the
+ * background.
+ */
+struct scoutfs_shared_release {
+	__le64 blkno;
+	__le64 len;
+} __packed;
 
 /*
  * The first xattr part item has a header that describes the xattr.  The
@@ -401,6 +467,10 @@ struct scoutfs_timespec {
  * @offline_blocks: The number of fixed 4k blocks that could be made
  * online by staging.
  *
+ * @extents_end: One past the last logical block that file extent items
+ * might map.  Operations on all of a file's extents only visit the data
+ * lock regions before it.
+ *
  * XXX
  *	- otime?
  *	- compat flags?
@@ -415,6 +485,7 @@ struct scoutfs_inode {
 	__le64 data_version;
 	__le64 online_blocks;
 	__le64 offline_blocks;
+	__le64 extents_end;
 	__le64 next_readdir_pos;
 	__le64 next_xattr_id;
 	__le32 nlink;
@@ -429,12 +500,19 @@ struct scoutfs_inode {
 } __packed;
 
 #define SCOUTFS_INO_FLAG_TRUNCATE 0x1
+#define SCOUTFS_INO_FLAG_INLINE_DATA 0x2
 
 #define SCOUTFS_ROOT_INO 1
 
 /* like the block size, a reasonable min PATH_MAX across platforms */
 #define SCOUTFS_SYMLINK_MAX_SIZE 4096
 
+/*
+ * New regular files store their data in items instead of allocating
+ * blocks.  Writes past this size move the data into a file block.
+ */
+#define SCOUTFS_INLINE_DATA_MAX_SIZE 1024
+
 /*
  * Dirents are stored in multiple places to isolate contention when
  * performing different operations: hashed by name for creation and
@@ -461,6 +539,34 @@ struct scoutfs_dirent {
 /* getdents returns next pos with an entry, no entry at (f_pos)~0 */
 #define SCOUTFS_DIRENT_LAST_POS (U64_MAX - 1)
 
+/*
+ * Creates don't update the dir inode item.  They record their changes
+ * to the dir's attributes in a delta item per mount and transaction
+ * which are merged into the inode item by later exclusive dir users.
+ * The size and nlink fields are signed.
+ */
+struct scoutfs_dir_delta {
+	__le64 size;
+	__le64 nlink;
+	__le64 mtime_sec;
+	__le32 mtime_nsec;
+} __packed;
+
+/*
+ * Writers that only hold a file's inode lock in PR record their changes
+ * to the file's attributes in a delta item per mount and transaction,
+ * like dir deltas.  Sizes and extents_end are the greatest seen, the
+ * data_version field counts increments, and online_blocks is signed.
+ */
+struct scoutfs_file_delta {
+	__le64 size;
+	__le64 extents_end;
+	__le64 data_version;
+	__le64 online_blocks;
+	__le64 mtime_sec;
+	__le32 mtime_nsec;
+} __packed;
+
 enum {
 	SCOUTFS_DT_FIFO = 0,
 	SCOUTFS_DT_CHR,
@@ -481,6 +587,15 @@ enum {
 	DIV_ROUND_UP(sizeof(struct scoutfs_xattr) + name_len + val_len, \
 		     SCOUTFS_XATTR_MAX_PART_SIZE);
 
+/*
+ * xattrs in the index namespace also have an item in the inode index
+ * zone.  Their values are limited so that the whole xattr is always
+ * stored in a single item.
+ */
+#define SCOUTFS_XATTR_INDEX_PREFIX	"scoutfs.index."
+#define SCOUTFS_XATTR_INDEX_PREFIX_LEN	(sizeof(SCOUTFS_XATTR_INDEX_PREFIX) - 1)
+#define SCOUTFS_XATTR_INDEX_MAX_VAL_LEN	128
+
 #define SCOUTFS_MAX_VAL_SIZE	SCOUTFS_XATTR_MAX_PART_SIZE
 
 /*
@@ -488,6 +603,7 @@ enum {
  */
 #define SCOUTFS_LOCK_SCOPE_GLOBAL 1
 #define SCOUTFS_LOCK_SCOPE_FS_ITEMS 2
+#define SCOUTFS_LOCK_SCOPE_FILE_DATA 3
 
 #define SCOUTFS_LOCK_TYPE_GLOBAL_RENAME 1
 #define SCOUTFS_LOCK_TYPE_GLOBAL_SERVER 2
@@ -505,6 +621,22 @@ struct scoutfs_lock_name {
 
 #define SCOUTFS_LOCK_SEQ_GROUP_MASK	((1ULL << 10) - 1)
 
+/*
+ * Cached file data is covered by a lock on the whole file and by locks
+ * on aligned regions of file blocks.  The whole file lock uses a region
+ * number that can't be reached by a block offset.  Region locks also
+ * cover the file extent items in their region, which never cross a
+ * region boundary.
+ */
+#define SCOUTFS_LOCK_DATA_REGION_SHIFT	11
+#define SCOUTFS_LOCK_DATA_REGION_NR	(1ULL << SCOUTFS_LOCK_DATA_REGION_SHIFT)
+#define SCOUTFS_LOCK_DATA_FILE		U64_MAX
+
+/* dirent items are locked in groups of name hashes and readdir positions */
+#define SCOUTFS_LOCK_DIRENT_HASH_SHIFT	56
+#define SCOUTFS_LOCK_READDIR_POS_SHIFT	16
+#define SCOUTFS_LOCK_READDIR_POS_NR	(1ULL << SCOUTFS_LOCK_READDIR_POS_SHIFT)
+
 /*
  * messages over the wire.
  */
@@ -550,6 +682,7 @@ enum {
 	SCOUTFS_NET_CMD_GET_MANIFEST_ROOT,
 	SCOUTFS_NET_CMD_STATFS,
 	SCOUTFS_NET_CMD_COMPACT,
+	SCOUTFS_NET_CMD_RETURN_EXTENTS,
 	SCOUTFS_NET_CMD_UNKNOWN,
 };
 
@@ -611,6 +744,15 @@ struct scoutfs_net_extent {
 	__le64 len;
 } __packed;
 
+/*
+ * Clients ask for an extent of at most blocks.  The server tries to
+ * allocate from the hint so that each node's grants are contiguous.
+ */
+struct scoutfs_net_extent_alloc {
+	__le64 blocks;
+	__le64 hint;
+} __packed;
+
 struct scoutfs_net_extent_list {
 	__le64 nr;
 	struct {
@@ -700,6 +842,10 @@ enum {
 	SC_DATA_EXTENT_ALLOC_CLEANUP,
 	SC_SERVER_EXTENT_CLEANUP,
 	SC_DATA_EXTENT_FALLOCATE_CLEANUP,
+	SC_DATA_EXTENT_CLONE_CLEANUP,
+	SC_INLINE_DATA_MISSING_ITEM,
+	SC_DIR_DELTA_VAL_SIZE,
+	SC_FILE_DELTA_VAL_SIZE,
 	SC_NR_SOURCES,
 };
 
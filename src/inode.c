@@ -19,6 +19,9 @@
 #include <linux/pagemap.h>
 #include <linux/sched.h>
 #include <linux/list_sort.h>
+#include <linux/workqueue.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
 
 #include "format.h"
 #include "super.h"
@@ -34,6 +37,8 @@
 #include "item.h"
 #include "client.h"
 #include "cmp.h"
+#include "counters.h"
+#include "ioctl.h"
 
 /*
  * XXX
@@ -47,9 +52,60 @@
  *  - describe data locking size problems
  */
 
+/*
+ * Freeing the extents of very large files can take a long time.  Deleting
+ * inodes and truncating files with at least this many blocks is handed
+ * off to a background worker so that unlink and truncate return
+ * immediately.  The orphan item and truncate flag let the work be
+ * finished later if we don't get to it.
+ */
+#define BACKGROUND_FREE_BLOCKS (256ULL * 1024 * 1024 >> SCOUTFS_BLOCK_SHIFT)
+
 struct inode_sb_info {
+	struct super_block *sb;
 	spinlock_t writeback_lock;
 	struct rb_root writeback_inodes;
+
+	struct workqueue_struct *writeback_workq;
+
+	spinlock_t bg_lock;
+	struct list_head bg_list;
+	struct workqueue_struct *bg_workq;
+	struct work_struct bg_work;
+	bool bg_queued;
+	bool bg_stopped;
+};
+
+/*
+ * Commit starts writeback of dirty inodes in batches that are written
+ * by a pool of workers.  Each worker plugs the writes of its batch.
+ */
+#define WRITEBACK_BATCH_INODES 32
+#define WRITEBACK_WORKERS 8
+
+struct writeback_walk {
+	atomic_t pending;
+	struct completion done;
+	int ret;
+};
+
+struct writeback_batch {
+	struct list_head head;
+	struct work_struct work;
+	struct super_block *sb;
+	struct writeback_walk *walk;
+	unsigned int nr;
+	struct inode *inodes[WRITEBACK_BATCH_INODES];
+};
+
+/*
+ * A deletion only records the ino, the vfs inode is long gone.  A
+ * truncation holds a reference to its inode until it's done.
+ */
+struct background_entry {
+	struct list_head head;
+	u64 ino;
+	struct inode *inode;
 };
 
 #define DECLARE_INODE_SB_INFO(sb, name) \
@@ -70,9 +126,23 @@ static void scoutfs_inode_ctor(void *obj)
 	seqcount_init(&ci->seqcount);
 	ci->staging = false;
 	scoutfs_per_task_init(&ci->pt_data_lock);
+	scoutfs_per_task_init(&ci->pt_write_locks);
 	init_rwsem(&ci->xattr_rwsem);
 	RB_CLEAR_NODE(&ci->writeback_node);
+	spin_lock_init(&ci->delayed_blocks_lock);
+	ci->delayed_blocks = 0;
+	ci->delayed_next = 0;
+	INIT_LIST_HEAD(&ci->delayed_pins);
+	mutex_init(&ci->extent_mutex);
+	spin_lock_init(&ci->ext_cache_lock);
+	scoutfs_lock_init_coverage(&ci->ext_cache_cov);
+	ci->ext_cache_gen = 0;
+	ci->ext_cache_region = 0;
+	ci->ext_cache_nr = 0;
+	ci->ext_cache_next = 0;
+	spin_lock_init(&ci->read_stride_lock);
 	spin_lock_init(&ci->ino_alloc.lock);
+	ci->symlink_target = NULL;
 
 	inode_init_once(&ci->inode);
 }
@@ -91,9 +161,12 @@ struct inode *scoutfs_alloc_inode(struct super_block *sb)
 static void scoutfs_i_callback(struct rcu_head *head)
 {
 	struct inode *inode = container_of(head, struct inode, i_rcu);
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
 
 	trace_scoutfs_i_callback(inode);
-	kmem_cache_free(scoutfs_inode_cachep, SCOUTFS_I(inode));
+	kfree(si->symlink_target);
+	si->symlink_target = NULL;
+	kmem_cache_free(scoutfs_inode_cachep, si);
 }
 
 static void insert_writeback_inode(struct inode_sb_info *inf,
@@ -133,11 +206,15 @@ static void remove_writeback_inode(struct inode_sb_info *inf,
 void scoutfs_destroy_inode(struct inode *inode)
 {
 	DECLARE_INODE_SB_INFO(inode->i_sb, inf);
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
 
 	spin_lock(&inf->writeback_lock);
-	remove_writeback_inode(inf, SCOUTFS_I(inode));
+	remove_writeback_inode(inf, si);
 	spin_unlock(&inf->writeback_lock);
 
+	scoutfs_lock_del_coverage(inode->i_sb, &si->ext_cache_cov);
+	si->ext_cache_nr = 0;
+
 	call_rcu(&inode->i_rcu, scoutfs_i_callback);
 }
 
@@ -189,6 +266,35 @@ static void set_inode_ops(struct inode *inode)
 	mapping_set_gfp_mask(inode->i_mapping, GFP_USER);
 }
 
+static u64 index_time_bucket(u64 sec)
+{
+	return sec >> SCOUTFS_INODE_INDEX_TIME_BUCKET_SHIFT;
+}
+
+/*
+ * Get the values of all the indexed fields in an inode item.
+ */
+static void get_index_majors(struct scoutfs_inode *sinode, u64 *majors)
+{
+	majors[0] = 0;
+	majors[SCOUTFS_INODE_INDEX_META_SEQ_TYPE] =
+		le64_to_cpu(sinode->meta_seq);
+	majors[SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE] =
+		le64_to_cpu(sinode->data_seq);
+	majors[SCOUTFS_INODE_INDEX_SIZE_TYPE] = le64_to_cpu(sinode->size);
+	majors[SCOUTFS_INODE_INDEX_MTIME_TYPE] =
+		index_time_bucket(le64_to_cpu(sinode->mtime.sec));
+	majors[SCOUTFS_INODE_INDEX_ATIME_TYPE] =
+		index_time_bucket(le64_to_cpu(sinode->atime.sec));
+	majors[SCOUTFS_INODE_INDEX_ONLINE_BLOCKS_TYPE] =
+		le64_to_cpu(sinode->online_blocks);
+	majors[SCOUTFS_INODE_INDEX_OFFLINE_BLOCKS_TYPE] =
+		le64_to_cpu(sinode->offline_blocks);
+	majors[SCOUTFS_INODE_INDEX_UID_TYPE] = le32_to_cpu(sinode->uid);
+	majors[SCOUTFS_INODE_INDEX_GID_TYPE] = le32_to_cpu(sinode->gid);
+	majors[SCOUTFS_INODE_INDEX_XATTR_TYPE] = 0;
+}
+
 /*
  * The caller has ensured that the fields in the incoming scoutfs inode
  * reflect both the inode item and the inode index items.  This happens
@@ -201,14 +307,10 @@ static void set_item_info(struct scoutfs_inode_info *si,
 {
 	BUG_ON(!mutex_is_locked(&si->item_mutex));
 
-	memset(si->item_majors, 0, sizeof(si->item_majors));
 	memset(si->item_minors, 0, sizeof(si->item_minors));
 
 	si->have_item = true;
-	si->item_majors[SCOUTFS_INODE_INDEX_META_SEQ_TYPE] =
-		le64_to_cpu(sinode->meta_seq);
-	si->item_majors[SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE] =
-		le64_to_cpu(sinode->data_seq);
+	get_index_majors(sinode, si->item_majors);
 }
 
 static void load_inode(struct inode *inode, struct scoutfs_inode *cinode)
@@ -233,6 +335,7 @@ static void load_inode(struct inode *inode, struct scoutfs_inode *cinode)
 	ci->data_version = le64_to_cpu(cinode->data_version);
 	ci->online_blocks = le64_to_cpu(cinode->online_blocks);
 	ci->offline_blocks = le64_to_cpu(cinode->offline_blocks);
+	ci->extents_end = le64_to_cpu(cinode->extents_end);
 	ci->next_readdir_pos = le64_to_cpu(cinode->next_readdir_pos);
 	ci->next_xattr_id = le64_to_cpu(cinode->next_xattr_id);
 	ci->flags = le32_to_cpu(cinode->flags);
@@ -256,6 +359,132 @@ static void init_inode_key(struct scoutfs_key *key, u64 ino)
 	};
 }
 
+/*
+ * Read an inode's item without an inode struct for callers that want
+ * the attributes of many inodes without instantiating them.  The
+ * caller's lock covers the inode.
+ */
+int scoutfs_inode_lookup_item(struct super_block *sb, u64 ino,
+			      struct scoutfs_inode *sinode,
+			      struct scoutfs_lock *lock)
+{
+	struct scoutfs_key key;
+	struct kvec val;
+
+	init_inode_key(&key, ino);
+	kvec_init(&val, sinode, sizeof(struct scoutfs_inode));
+
+	return scoutfs_item_lookup_exact(sb, &key, &val, lock);
+}
+
+static void set_ioctl_attrs(struct scoutfs_ioctl_inode_attrs *attrs,
+			    struct scoutfs_inode *sinode)
+{
+	attrs->size = le64_to_cpu(sinode->size);
+	attrs->meta_seq = le64_to_cpu(sinode->meta_seq);
+	attrs->data_seq = le64_to_cpu(sinode->data_seq);
+	attrs->data_version = le64_to_cpu(sinode->data_version);
+	attrs->online_blocks = le64_to_cpu(sinode->online_blocks);
+	attrs->offline_blocks = le64_to_cpu(sinode->offline_blocks);
+	attrs->atime_sec = le64_to_cpu(sinode->atime.sec);
+	attrs->atime_nsec = le32_to_cpu(sinode->atime.nsec);
+	attrs->mtime_sec = le64_to_cpu(sinode->mtime.sec);
+	attrs->mtime_nsec = le32_to_cpu(sinode->mtime.nsec);
+	attrs->ctime_sec = le64_to_cpu(sinode->ctime.sec);
+	attrs->ctime_nsec = le32_to_cpu(sinode->ctime.nsec);
+	attrs->nlink = le32_to_cpu(sinode->nlink);
+	attrs->uid = le32_to_cpu(sinode->uid);
+	attrs->gid = le32_to_cpu(sinode->gid);
+	attrs->mode = le32_to_cpu(sinode->mode);
+	attrs->rdev = le32_to_cpu(sinode->rdev);
+}
+
+static inline u64 ino_lock_group(u64 ino)
+{
+	return ino & ~(u64)SCOUTFS_LOCK_INODE_GROUP_MASK;
+}
+
+/*
+ * Read the attributes of many inodes for the bulk ioctls without
+ * instantiating vfs inodes.  Inode locks cover groups of inode numbers
+ * so we acquire each group's lock once and read the items of all the
+ * inodes in the group under it.  The first lookup populates the item
+ * cache with the group's items from one read of the segments that
+ * intersect the lock's range so the rest are cache hits.  The inode
+ * numbers don't need to be sorted but the caller's batch should be
+ * small because we search it for each group.
+ *
+ * Inodes that don't exist have their attrs mode set to 0.  Dirs and
+ * files have their pending deltas added, as getattr does.
+ */
+int scoutfs_inode_read_attrs(struct super_block *sb, u64 *inos,
+			     struct scoutfs_ioctl_inode_attrs *attrs,
+			     unsigned int nr)
+{
+	struct scoutfs_lock *lock = NULL;
+	struct scoutfs_inode sinode;
+	u64 group;
+	int ret = 0;
+	int i;
+	int j;
+
+	for (i = 0; i < nr; i++) {
+		group = ino_lock_group(inos[i]);
+
+		/* skip groups that earlier inodes already read */
+		for (j = 0; j < i; j++) {
+			if (ino_lock_group(inos[j]) == group)
+				break;
+		}
+		if (j < i)
+			continue;
+
+		ret = scoutfs_lock_ino(sb, DLM_LOCK_PR, 0, group, &lock);
+		if (ret)
+			break;
+
+		for (j = i; j < nr; j++) {
+			if (ino_lock_group(inos[j]) != group)
+				continue;
+
+			ret = scoutfs_inode_lookup_item(sb, inos[j], &sinode,
+							lock);
+			if (ret == -ENOENT) {
+				memset(&attrs[j], 0, sizeof(attrs[j]));
+				ret = 0;
+				continue;
+			}
+			if (ret)
+				break;
+
+			set_ioctl_attrs(&attrs[j], &sinode);
+			if (S_ISDIR(attrs[j].mode)) {
+				ret = scoutfs_dir_add_attrs_deltas(sb, inos[j],
+								   &attrs[j]);
+				if (ret)
+					break;
+			} else if (S_ISREG(attrs[j].mode)) {
+				ret = scoutfs_data_add_attrs_file_deltas(sb,
+								inos[j],
+								&attrs[j]);
+				if (ret)
+					break;
+			}
+		}
+
+		scoutfs_unlock(sb, lock, DLM_LOCK_PR);
+		if (ret)
+			break;
+
+		scoutfs_inc_counter(sb, inode_read_attrs_group);
+	}
+
+	if (ret == 0)
+		scoutfs_add_counter(sb, inode_read_attrs, nr);
+
+	return ret;
+}
+
 /*
  * Refresh the vfs inode fields if the lock indicates that the current
  * contents could be stale.
@@ -297,6 +526,10 @@ int scoutfs_inode_refresh(struct inode *inode, struct scoutfs_lock *lock,
 		ret = scoutfs_item_lookup_exact(sb, &key, &val, lock);
 		if (ret == 0) {
 			load_inode(inode, &sinode);
+			/* our writers' sizes could still be in deltas */
+			if (S_ISREG(inode->i_mode) &&
+			    si->file_delta_isize > i_size_read(inode))
+				i_size_write(inode, si->file_delta_isize);
 			atomic64_set(&si->last_refreshed, refresh_gen);
 		}
 	} else {
@@ -319,6 +552,14 @@ int scoutfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
 				 inode, &lock);
 	if (ret == 0) {
 		generic_fillattr(inode, stat);
+		/* don't let tools think inline data is a sparse hole */
+		if ((SCOUTFS_I(inode)->flags & SCOUTFS_INO_FLAG_INLINE_DATA) &&
+		    stat->size)
+			stat->blocks = SCOUTFS_BLOCK_SECTORS;
+		if (S_ISDIR(inode->i_mode))
+			ret = scoutfs_dir_add_deltas(inode, lock, stat);
+		else if (S_ISREG(inode->i_mode))
+			ret = scoutfs_data_add_file_deltas(inode, lock, stat);
 		scoutfs_unlock(sb, lock, DLM_LOCK_PR);
 	}
 	return ret;
@@ -330,23 +571,32 @@ static int set_inode_size(struct inode *inode, struct scoutfs_lock *lock,
 	struct scoutfs_inode_info *ci = SCOUTFS_I(inode);
 	struct super_block *sb = inode->i_sb;
 	LIST_HEAD(ind_locks);
+	u64 old_size;
 	int ret;
 
 	if (!S_ISREG(inode->i_mode))
 		return 0;
 
 	ret = scoutfs_inode_index_lock_hold(inode, &ind_locks, true,
-					    SIC_DIRTY_INODE());
+					    SIC_SET_SIZE());
 	if (ret)
 		return ret;
 
+	old_size = i_size_read(inode);
 	truncate_setsize(inode, new_size);
+	ret = scoutfs_data_truncate_inline(inode, old_size, lock);
+	if (ret) {
+		i_size_write(inode, old_size);
+		goto out;
+	}
+
 	inode->i_ctime = inode->i_mtime = CURRENT_TIME;
 	if (truncate)
 		ci->flags |= SCOUTFS_INO_FLAG_TRUNCATE;
 	scoutfs_inode_set_data_seq(inode);
 	scoutfs_update_inode_item(inode, lock, &ind_locks);
 
+out:
 	scoutfs_release_trans(sb);
 	scoutfs_inode_index_unlock(sb, &ind_locks);
 
@@ -374,7 +624,8 @@ static int clear_truncate_flag(struct inode *inode, struct scoutfs_lock *lock)
 	return ret;
 }
 
-int scoutfs_complete_truncate(struct inode *inode, struct scoutfs_lock *lock)
+static int complete_truncate(struct inode *inode, struct scoutfs_lock *lock,
+			     bool background)
 {
 	struct scoutfs_inode_info *ci = SCOUTFS_I(inode);
 	u64 start;
@@ -388,20 +639,97 @@ int scoutfs_complete_truncate(struct inode *inode, struct scoutfs_lock *lock)
 	start = (i_size_read(inode) + SCOUTFS_BLOCK_SIZE - 1) >> SCOUTFS_BLOCK_SHIFT;
 	ret = scoutfs_data_truncate_items(inode->i_sb, inode,
 					  scoutfs_ino(inode), start, ~0ULL,
-					  false, lock);
+					  false, background, lock);
 	err = clear_truncate_flag(inode, lock);
 
 	return ret ? ret : err;
 }
 
+int scoutfs_complete_truncate(struct inode *inode, struct scoutfs_lock *lock)
+{
+	return complete_truncate(inode, lock, false);
+}
+
+/*
+ * Queue background freeing of either a deleted inode's items or the
+ * extents past the size of a truncated inode.  Returns false if the
+ * caller has to do the work itself.
+ */
+static bool queue_background(struct super_block *sb, u64 ino,
+			     struct inode *inode)
+{
+	DECLARE_INODE_SB_INFO(sb, inf);
+	struct background_entry *ent;
+	bool queued = false;
+
+	ent = kmalloc(sizeof(struct background_entry), GFP_NOFS);
+	if (!ent)
+		return false;
+
+	if (inode && !igrab(inode)) {
+		kfree(ent);
+		return false;
+	}
+
+	ent->ino = ino;
+	ent->inode = inode;
+
+	spin_lock(&inf->bg_lock);
+	if (!inf->bg_stopped) {
+		list_add_tail(&ent->head, &inf->bg_list);
+		queue_work(inf->bg_workq, &inf->bg_work);
+		inf->bg_queued = true;
+		queued = true;
+	}
+	spin_unlock(&inf->bg_lock);
+
+	if (!queued) {
+		if (inode)
+			iput(inode);
+		kfree(ent);
+	}
+
+	return queued;
+}
+
+/*
+ * Only large truncations are worth handing off.  We don't know how many
+ * blocks are past the new size so we use the shrinking size and the
+ * inode's total block count as estimates.
+ */
+static bool truncate_in_background(struct inode *inode, u64 old_size)
+{
+	u64 new_size = i_size_read(inode);
+	s64 on;
+	s64 off;
+
+	if (old_size <= new_size ||
+	    ((old_size - new_size) >> SCOUTFS_BLOCK_SHIFT) <
+	     BACKGROUND_FREE_BLOCKS)
+		return false;
+
+	scoutfs_inode_get_onoff(inode, &on, &off);
+	if (on + off < BACKGROUND_FREE_BLOCKS)
+		return false;
+
+	if (!queue_background(inode->i_sb, scoutfs_ino(inode), inode))
+		return false;
+
+	scoutfs_inc_counter(inode->i_sb, inode_truncate_background);
+	return true;
+}
+
 int scoutfs_setattr(struct dentry *dentry, struct iattr *attr)
 {
 	struct inode *inode = dentry->d_inode;
 	struct super_block *sb = inode->i_sb;
+	struct scoutfs_lock *data_lock = NULL;
 	struct scoutfs_lock *lock = NULL;
 	LIST_HEAD(ind_locks);
 	bool truncate = false;
 	u64 attr_size;
+	u64 old_size;
+	u64 seq;
 	int ret;
 
 	trace_scoutfs_setattr(dentry, attr);
@@ -415,10 +743,21 @@ int scoutfs_setattr(struct dentry *dentry, struct iattr *attr)
 	if (ret)
 		goto out;
 
+	/* sizes and times from writers' deltas would override ours */
+	ret = scoutfs_data_fold_file_deltas(inode, lock);
+	if (ret)
+		goto out;
+
 	attr_size = (attr->ia_valid & ATTR_SIZE) ? attr->ia_size :
 		i_size_read(inode);
 
 	if (S_ISREG(inode->i_mode) && attr->ia_valid & ATTR_SIZE) {
+		/* other nodes can't cache pages across the size change */
+		ret = scoutfs_lock_data_file(sb, DLM_LOCK_EX, 0, inode,
+					     &data_lock);
+		if (ret)
+			goto out;
+
 		/*
 		 * Complete any truncates that may have failed while
 		 * in progress
@@ -428,21 +767,33 @@ int scoutfs_setattr(struct dentry *dentry, struct iattr *attr)
 			goto out;
 
 		/* truncating to current size truncates extents past size */
-		truncate = i_size_read(inode) >= attr_size;
+		old_size = i_size_read(inode);
+		truncate = old_size >= attr_size;
 
 		ret = set_inode_size(inode, lock, attr_size, truncate);
 		if (ret)
 			goto out;
 
-		if (truncate) {
+		/* writers finish the truncate if they get there first */
+		if (truncate && !truncate_in_background(inode, old_size)) {
 			ret = scoutfs_complete_truncate(inode, lock);
 			if (ret)
 				goto out;
 		}
 	}
 
-	ret = scoutfs_inode_index_lock_hold(inode, &ind_locks, false,
-					    SIC_DIRTY_INODE());
+	/* explicit times can move to any time index bucket */
+	do {
+		ret = scoutfs_inode_index_start(sb, &seq) ?:
+		      scoutfs_inode_index_prepare(sb, &ind_locks, inode,
+						  false);
+		if (ret == 0 && (attr->ia_valid & (ATTR_ATIME | ATTR_MTIME)))
+			ret = scoutfs_inode_index_prepare_times(&ind_locks,
+								inode);
+		if (ret == 0)
+			ret = scoutfs_inode_index_try_lock_hold(sb, &ind_locks,
+						seq, SIC_DIRTY_INODE());
+	} while (ret > 0);
 	if (ret)
 		goto out;
 
@@ -452,6 +803,7 @@ int scoutfs_setattr(struct dentry *dentry, struct iattr *attr)
 	scoutfs_release_trans(sb);
 	scoutfs_inode_index_unlock(sb, &ind_locks);
 out:
+	scoutfs_unlock(sb, data_lock, DLM_LOCK_EX);
 	scoutfs_unlock(sb, lock, DLM_LOCK_EX);
 	return ret;
 }
@@ -490,17 +842,22 @@ void scoutfs_inode_set_data_seq(struct inode *inode)
 	set_trans_seq(inode, &si->data_seq);
 }
 
-void scoutfs_inode_inc_data_version(struct inode *inode)
+void scoutfs_inode_add_data_version(struct inode *inode, u64 nr)
 {
 	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
 
 	preempt_disable();
 	write_seqcount_begin(&si->seqcount);
-	si->data_version++;
+	si->data_version += nr;
 	write_seqcount_end(&si->seqcount);
 	preempt_enable();
 }
 
+void scoutfs_inode_inc_data_version(struct inode *inode)
+{
+	scoutfs_inode_add_data_version(inode, 1);
+}
+
 void scoutfs_inode_add_onoff(struct inode *inode, s64 on, s64 off)
 {
 	struct scoutfs_inode_info *si;
@@ -629,6 +986,18 @@ struct inode *scoutfs_iget(struct super_block *sb, u64 ino)
 		atomic64_set(&si->last_refreshed, 0);
 		si->ino_alloc.ino = 0;
 		si->ino_alloc.nr = 0;
+		si->alloc_dir_ino = 0;
+		si->read_stride_pos = 0;
+		si->read_stride = 0;
+		si->read_stride_hits = 0;
+		si->readdir_pos_next = 0;
+		si->readdir_pos_end = 0;
+		si->dir_delta_seq = 0;
+		si->dir_deltas_none_gen = 0;
+		si->file_delta_seq = 0;
+		si->file_deltas_none_gen = 0;
+		si->file_delta_isize = 0;
+		si->file_deltas_written = false;
 
 		ret = scoutfs_inode_refresh(inode, lock, 0);
 		if (ret) {
@@ -671,6 +1040,7 @@ static void store_inode(struct scoutfs_inode *cinode, struct inode *inode)
 	cinode->data_version = cpu_to_le64(scoutfs_inode_data_version(inode));
 	cinode->online_blocks = cpu_to_le64(online_blocks);
 	cinode->offline_blocks = cpu_to_le64(offline_blocks);
+	cinode->extents_end = cpu_to_le64(ci->extents_end);
 	cinode->next_readdir_pos = cpu_to_le64(ci->next_readdir_pos);
 	cinode->next_xattr_id = cpu_to_le64(ci->next_xattr_id);
 	cinode->flags = cpu_to_le32(ci->flags);
@@ -742,9 +1112,19 @@ static bool inode_has_index(umode_t mode, u8 type)
 {
 	switch(type) {
 		case SCOUTFS_INODE_INDEX_META_SEQ_TYPE:
+		case SCOUTFS_INODE_INDEX_MTIME_TYPE:
+		case SCOUTFS_INODE_INDEX_ATIME_TYPE:
+		case SCOUTFS_INODE_INDEX_UID_TYPE:
+		case SCOUTFS_INODE_INDEX_GID_TYPE:
 			return true;
 		case SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE:
+		case SCOUTFS_INODE_INDEX_SIZE_TYPE:
+		case SCOUTFS_INODE_INDEX_ONLINE_BLOCKS_TYPE:
+		case SCOUTFS_INODE_INDEX_OFFLINE_BLOCKS_TYPE:
 			return S_ISREG(mode);
+		case SCOUTFS_INODE_INDEX_XATTR_TYPE:
+			/* maintained as indexed xattrs are set */
+			return false;
 		default:
 			return WARN_ON_ONCE(false);
 	}
@@ -865,25 +1245,19 @@ static int update_indices(struct super_block *sb,
 			  struct scoutfs_inode *sinode,
 			  struct list_head *lock_list)
 {
-	struct index_update {
-		u8 type;
-		u64 major;
-		u32 minor;
-	} *upd, upds[] = {
-		{ SCOUTFS_INODE_INDEX_META_SEQ_TYPE,
-			le64_to_cpu(sinode->meta_seq), 0 },
-		{ SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE,
-			le64_to_cpu(sinode->data_seq), 0 },
-	};
-	int ret;
-	int i;
+	u64 majors[SCOUTFS_INODE_INDEX_NR];
+	int ret = 0;
+	u8 type;
 
-	for (i = 0, upd = upds; i < ARRAY_SIZE(upds); i++, upd++) {
-		if (!inode_has_index(mode, upd->type))
+	get_index_majors(sinode, majors);
+
+	for (type = SCOUTFS_INODE_INDEX_META_SEQ_TYPE;
+	     type < SCOUTFS_INODE_INDEX_NR; type++) {
+		if (!inode_has_index(mode, type))
 			continue;
 
-		ret = update_index_items(sb, si, ino, upd->type, upd->major,
-					 upd->minor, lock_list);
+		ret = update_index_items(sb, si, ino, type, majors[type], 0,
+					 lock_list);
 		if (ret)
 			break;
 	}
@@ -1012,6 +1386,28 @@ static u64 upd_data_seq(struct scoutfs_sb_info *sbi,
 	return si->item_majors[SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE];
 }
 
+/*
+ * Updates only move times forward to the current time or to times that
+ * other mounts set, so a time index can only change if the item's
+ * bucket isn't the current bucket.  Updates near the end of the
+ * current bucket could cross into the next so they always lock.
+ * setattr can set any time and adds the time index locks itself.
+ */
+#define INDEX_TIME_SLACK_SECS (60 * 60)
+static bool time_index_may_change(struct scoutfs_inode_info *si, u8 type)
+{
+	u64 now = get_seconds();
+
+	if (type != SCOUTFS_INODE_INDEX_MTIME_TYPE &&
+	    type != SCOUTFS_INODE_INDEX_ATIME_TYPE)
+		return true;
+
+	return !si || !si->have_item ||
+	       si->item_majors[type] != index_time_bucket(now) ||
+	       index_time_bucket(now) !=
+			index_time_bucket(now + INDEX_TIME_SLACK_SECS);
+}
+
 /*
  * Prepare locks that will cover the inode index items that will be
  * modified when this inode's item is updated during the upcoming
@@ -1022,6 +1418,10 @@ static u64 upd_data_seq(struct scoutfs_sb_info *sbi,
  * to the current seq.  This will usually be a nop in a running
  * transaction.  The caller tells us what the size will be and whether
  * data_seq will also be set to the current transaction.
+ *
+ * The other indexes are covered by a single lock per index type so we
+ * don't have to predict their values, we add their locks unless we know
+ * that a time index can't change.
  */
 static int prepare_indices(struct super_block *sb, struct list_head *list,
 			   struct scoutfs_inode_info *si, u64 ino,
@@ -1037,7 +1437,8 @@ static int prepare_indices(struct super_block *sb, struct list_head *list,
 		{ SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE,
 			upd_data_seq(sbi, si, set_data_seq), 0},
 	};
-	int ret;
+	int ret = 0;
+	u8 type;
 	int i;
 
 	for (i = 0, upd = upds; i < ARRAY_SIZE(upds); i++, upd++) {
@@ -1046,6 +1447,17 @@ static int prepare_indices(struct super_block *sb, struct list_head *list,
 
 		ret = prepare_index_items(si, list, ino, mode,
 					  upd->type, upd->major, upd->minor);
+		if (ret)
+			return ret;
+	}
+
+	for (type = SCOUTFS_INODE_INDEX_SIZE_TYPE;
+	     type < SCOUTFS_INODE_INDEX_NR; type++) {
+		if (!inode_has_index(mode, type) ||
+		    !time_index_may_change(si, type))
+			continue;
+
+		ret = add_index_lock(list, ino, type, 0, 0);
 		if (ret)
 			break;
 	}
@@ -1062,6 +1474,21 @@ int scoutfs_inode_index_prepare(struct super_block *sb, struct list_head *list,
 			       inode->i_mode, set_data_seq);
 }
 
+/*
+ * The caller is going to set times that we can't predict so we always
+ * lock the time indexes.
+ */
+int scoutfs_inode_index_prepare_times(struct list_head *list,
+				      struct inode *inode)
+{
+	const u64 ino = scoutfs_ino(inode);
+
+	return add_index_lock(list, ino, SCOUTFS_INODE_INDEX_MTIME_TYPE,
+			      0, 0) ?:
+	       add_index_lock(list, ino, SCOUTFS_INODE_INDEX_ATIME_TYPE,
+			      0, 0);
+}
+
 /*
  * This is used to initially create the index items for a newly created
  * inode.  We don't have a populated vfs inode yet.  The existing
@@ -1084,25 +1511,18 @@ static int prepare_index_deletion(struct super_block *sb,
 				  struct list_head *list, u64 ino,
 				  umode_t mode, struct scoutfs_inode *sinode)
 {
-	struct index_item {
-		u8 type;
-		u64 major;
-		u32 minor;
-	} *ind, inds[] = {
-		{ SCOUTFS_INODE_INDEX_META_SEQ_TYPE,
-			le64_to_cpu(sinode->meta_seq), 0 },
-		{ SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE,
-			le64_to_cpu(sinode->data_seq), 0 },
-	};
-	int ret;
-	int i;
+	u64 majors[SCOUTFS_INODE_INDEX_NR];
+	int ret = 0;
+	u8 type;
+
+	get_index_majors(sinode, majors);
 
-	for (i = 0, ind = inds; i < ARRAY_SIZE(inds); i++, ind++) {
-		if (!inode_has_index(mode, ind->type))
+	for (type = SCOUTFS_INODE_INDEX_META_SEQ_TYPE;
+	     type < SCOUTFS_INODE_INDEX_NR; type++) {
+		if (!inode_has_index(mode, type))
 			continue;
 
-		ret = add_index_lock(list, ino, ind->type,  ind->major,
-				     ind->minor);
+		ret = add_index_lock(list, ino, type, majors[type], 0);
 		if (ret)
 			break;
 	}
@@ -1110,6 +1530,37 @@ static int prepare_index_deletion(struct super_block *sb,
 	return ret;
 }
 
+/*
+ * Indexed xattrs have index items whose major is the hash of their
+ * name and value.  xattr.c prepares their locks along with the inode's
+ * index locks and then creates or deletes the items in the
+ * transaction.
+ */
+int scoutfs_inode_index_prepare_xattr(struct super_block *sb,
+				      struct list_head *list, u64 ino,
+				      u64 major)
+{
+	return add_index_lock(list, ino, SCOUTFS_INODE_INDEX_XATTR_TYPE,
+			      major, 0);
+}
+
+int scoutfs_inode_index_xattr(struct super_block *sb, struct list_head *list,
+			      u64 ino, u64 major, bool create)
+{
+	struct scoutfs_lock *lock;
+	struct scoutfs_key key;
+
+	scoutfs_inode_init_index_key(&key, SCOUTFS_INODE_INDEX_XATTR_TYPE,
+				     major, 0, ino);
+	lock = find_index_lock(list, SCOUTFS_INODE_INDEX_XATTR_TYPE, major, 0,
+			       ino);
+
+	if (create)
+		return scoutfs_item_create_force(sb, &key, NULL, lock);
+	else
+		return scoutfs_item_delete_force(sb, &key, lock);
+}
+
 /*
  * Sample the transaction sequence before we start checking it to see if
  * indexed meta seq and data seq items will change.
@@ -1225,13 +1676,22 @@ static int remove_index_items(struct super_block *sb, u64 ino,
 			      struct list_head *ind_locks)
 {
 	umode_t mode = le32_to_cpu(sinode->mode);
-	int ret;
+	u64 majors[SCOUTFS_INODE_INDEX_NR];
+	int ret = 0;
+	u8 type;
+
+	get_index_majors(sinode, majors);
+
+	for (type = SCOUTFS_INODE_INDEX_META_SEQ_TYPE;
+	     type < SCOUTFS_INODE_INDEX_NR; type++) {
+		if (!inode_has_index(mode, type))
+			continue;
+
+		ret = remove_index(sb, ino, type, majors[type], 0, ind_locks);
+		if (ret)
+			break;
+	}
 
-	ret = remove_index(sb, ino, SCOUTFS_INODE_INDEX_META_SEQ_TYPE,
-			   le64_to_cpu(sinode->meta_seq), 0, ind_locks);
-	if (ret == 0 && S_ISREG(mode))
-		ret = remove_index(sb, ino, SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE,
-				   le64_to_cpu(sinode->data_seq), 0, ind_locks);
 	return ret;
 }
 
@@ -1325,13 +1785,27 @@ struct inode *scoutfs_new_inode(struct super_block *sb, struct inode *dir,
 	ci->data_version = 0;
 	ci->online_blocks = 0;
 	ci->offline_blocks = 0;
+	ci->extents_end = 0;
 	ci->next_readdir_pos = SCOUTFS_DIRENT_FIRST_POS;
 	ci->next_xattr_id = 0;
 	ci->have_item = false;
 	atomic64_set(&ci->last_refreshed, lock->refresh_gen);
-	ci->flags = 0;
+	/* regular files store data in items until they grow */
+	ci->flags = S_ISREG(mode) ? SCOUTFS_INO_FLAG_INLINE_DATA : 0;
 	ci->ino_alloc.ino = 0;
 	ci->ino_alloc.nr = 0;
+	ci->alloc_dir_ino = dir ? scoutfs_ino(dir) : 0;
+	ci->read_stride_pos = 0;
+	ci->read_stride = 0;
+	ci->read_stride_hits = 0;
+	ci->readdir_pos_next = 0;
+	ci->readdir_pos_end = 0;
+	ci->dir_delta_seq = 0;
+	ci->dir_deltas_none_gen = 0;
+	ci->file_delta_seq = 0;
+	ci->file_deltas_none_gen = 0;
+	ci->file_delta_isize = 0;
+	ci->file_deltas_written = false;
 
 	scoutfs_inode_set_meta_seq(inode);
 	scoutfs_inode_set_data_seq(inode);
@@ -1390,7 +1864,8 @@ static int remove_orphan_item(struct super_block *sb, u64 ino)
  * triggering attempts to finish previous partial deletion until all
  * deletion is complete and the orphan item is removed.
  */
-static int delete_inode_items(struct super_block *sb, u64 ino)
+static int delete_inode_items(struct super_block *sb, u64 ino,
+			      bool background)
 {
 	struct scoutfs_lock *lock = NULL;
 	struct scoutfs_inode sinode;
@@ -1399,6 +1874,7 @@ static int delete_inode_items(struct super_block *sb, u64 ino)
 	bool release = false;
 	struct kvec val;
 	umode_t mode;
+	u64 extents_end;
 	u64 ind_seq;
 	u64 size;
 	int ret;
@@ -1430,8 +1906,16 @@ static int delete_inode_items(struct super_block *sb, u64 ino)
 
 	/* remove data items in their own transactions */
 	if (S_ISREG(mode)) {
-		ret = scoutfs_data_truncate_items(sb, NULL, ino, 0, ~0ULL,
-						  false, lock);
+		ret = scoutfs_data_delete_file_deltas(sb, ino, &extents_end);
+		if (ret)
+			goto out;
+
+		extents_end = max(extents_end, le64_to_cpu(sinode.extents_end));
+		if (extents_end)
+			ret = scoutfs_data_truncate_items(sb, NULL, ino, 0,
+							  extents_end - 1,
+							  false, background,
+							  lock);
 		if (ret)
 			goto out;
 	}
@@ -1463,6 +1947,13 @@ retry:
 			goto out;
 	}
 
+	if (S_ISREG(mode) &&
+	    (le32_to_cpu(sinode.flags) & SCOUTFS_INO_FLAG_INLINE_DATA)) {
+		ret = scoutfs_data_drop_inline(sb, ino, size, lock);
+		if (ret)
+			goto out;
+	}
+
 	ret = scoutfs_item_delete(sb, &key, lock);
 	if (ret)
 		goto out;
@@ -1476,6 +1967,29 @@ out:
 	return ret;
 }
 
+/*
+ * Large regular files are deleted in the background.  Their orphan item
+ * keeps them from being lost if we don't finish.
+ */
+static bool delete_in_background(struct inode *inode)
+{
+	s64 on;
+	s64 off;
+
+	if (!S_ISREG(inode->i_mode))
+		return false;
+
+	scoutfs_inode_get_onoff(inode, &on, &off);
+	if (on + off < BACKGROUND_FREE_BLOCKS)
+		return false;
+
+	if (!queue_background(inode->i_sb, scoutfs_ino(inode), NULL))
+		return false;
+
+	scoutfs_inc_counter(inode->i_sb, inode_delete_background);
+	return true;
+}
+
 /*
  * iput_final has already written out the dirty pages to the inode
  * before we get here.  We're left with a clean inode that we have to
@@ -1492,8 +2006,8 @@ void scoutfs_evict_inode(struct inode *inode)
 
 	truncate_inode_pages_final(&inode->i_data);
 
-	if (inode->i_nlink == 0)
-		delete_inode_items(inode->i_sb, scoutfs_ino(inode));
+	if (inode->i_nlink == 0 && !delete_in_background(inode))
+		delete_inode_items(inode->i_sb, scoutfs_ino(inode), false);
 clear:
 	clear_inode(inode);
 }
@@ -1538,7 +2052,7 @@ int scoutfs_scan_orphans(struct super_block *sb)
 		if (ret < 0)
 			goto out;
 
-		ret = delete_inode_items(sb, le64_to_cpu(key.sko_ino));
+		ret = delete_inode_items(sb, le64_to_cpu(key.sko_ino), false);
 		if (ret && ret != -ENOENT && !err)
 			err = ret;
 
@@ -1554,6 +2068,80 @@ out:
 	return err ? err : ret;
 }
 
+/*
+ * Finish the truncation of a large file.  We lock the inode like
+ * setattr so that a racing writer or truncate that completes the
+ * truncation first leaves us nothing to do.
+ */
+static int background_truncate(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_lock *lock = NULL;
+	int ret;
+
+	mutex_lock(&inode->i_mutex);
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_EX, SCOUTFS_LKF_REFRESH_INODE,
+				 inode, &lock);
+	if (ret == 0) {
+		ret = complete_truncate(inode, lock, true);
+		scoutfs_unlock(sb, lock, DLM_LOCK_EX);
+	}
+	mutex_unlock(&inode->i_mutex);
+
+	return ret;
+}
+
+/*
+ * Process the queued background deletions and truncations in order.
+ * Errors leave the orphan item or truncate flag behind so the work is
+ * retried by the next orphan scan or access to the inode.
+ */
+static void scoutfs_inode_bg_worker(struct work_struct *work)
+{
+	struct inode_sb_info *inf = container_of(work, struct inode_sb_info,
+						 bg_work);
+	struct super_block *sb = inf->sb;
+	struct background_entry *ent;
+	int ret;
+
+	for (;;) {
+		spin_lock(&inf->bg_lock);
+		ent = list_first_entry_or_null(&inf->bg_list,
+					       struct background_entry, head);
+		if (ent)
+			list_del_init(&ent->head);
+		spin_unlock(&inf->bg_lock);
+		if (!ent)
+			break;
+
+		if (ent->inode) {
+			ret = background_truncate(ent->inode);
+			iput(ent->inode);
+		} else {
+			ret = delete_inode_items(sb, ent->ino, true);
+		}
+		if (ret < 0)
+			scoutfs_err(sb, "background %s of inode %llu failed: %d",
+				    ent->inode ? "truncate" : "delete",
+				    ent->ino, ret);
+		kfree(ent);
+	}
+}
+
+/*
+ * Wait for all the queued background work to finish.  This is called
+ * before unmount evicts inodes because truncations hold inode
+ * references.  Final deletions during unmount can still queue work.
+ */
+void scoutfs_inode_flush_background(struct super_block *sb)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	struct inode_sb_info *inf = sbi ? sbi->inode_sb_info : NULL;
+
+	if (inf && inf->bg_workq)
+		flush_workqueue(inf->bg_workq);
+}
+
 int scoutfs_orphan_inode(struct inode *inode)
 {
 	struct super_block *sb = inode->i_sb;
@@ -1587,6 +2175,148 @@ void scoutfs_inode_queue_writeback(struct inode *inode)
 	spin_unlock(&inf->writeback_lock);
 }
 
+static void write_batch(struct writeback_batch *batch)
+{
+	struct super_block *sb = batch->sb;
+	struct blk_plug plug;
+	struct inode *inode;
+	int ret;
+	int i;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < batch->nr; i++) {
+		inode = batch->inodes[i];
+		ret = filemap_fdatawrite(inode->i_mapping);
+		trace_scoutfs_inode_walk_writeback(sb, scoutfs_ino(inode),
+						   true, ret);
+		if (ret)
+			cmpxchg(&batch->walk->ret, 0, ret);
+	}
+	blk_finish_plug(&plug);
+}
+
+/*
+ * Workers allocate delayed blocks and modify extent items while the
+ * committing task excludes holders so they're marked as writing for
+ * the commit.
+ */
+static void scoutfs_inode_writeback_worker(struct work_struct *work)
+{
+	struct writeback_batch *batch = container_of(work,
+						     struct writeback_batch,
+						     work);
+	struct writeback_walk *walk = batch->walk;
+
+	scoutfs_trans_begin_commit_writeback(batch->sb);
+	write_batch(batch);
+	scoutfs_trans_end_commit_writeback(batch->sb);
+
+	if (atomic_dec_and_test(&walk->pending))
+		complete(&walk->done);
+}
+
+/* return the first writeback inode node at or after the given ino */
+static struct rb_node *first_writeback_node(struct inode_sb_info *inf,
+					    u64 ino)
+{
+	struct rb_node *node = inf->writeback_inodes.rb_node;
+	struct rb_node *ret = NULL;
+	struct scoutfs_inode_info *si;
+
+	while (node) {
+		si = container_of(node, struct scoutfs_inode_info,
+				  writeback_node);
+		if (ino <= si->ino) {
+			ret = node;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	return ret;
+}
+
+static void put_batch_inodes(struct writeback_batch *batch)
+{
+	int i;
+
+	for (i = 0; i < batch->nr; i++)
+		iput(batch->inodes[i]);
+	batch->nr = 0;
+}
+
+/*
+ * Start writeback of all the dirty inodes.  The walk hands batches of
+ * referenced inodes to the workers and waits for them to finish
+ * starting writes.  It doesn't wait for the writes to complete so the
+ * commit can write its segment while the data writes are in flight.
+ * If we can't allocate a batch we write it ourselves.
+ */
+static int start_writeback(struct super_block *sb)
+{
+	DECLARE_INODE_SB_INFO(sb, inf);
+	struct writeback_batch *batch;
+	struct writeback_batch *tmp;
+	struct writeback_batch stack_batch;
+	struct writeback_walk walk;
+	struct scoutfs_inode_info *si;
+	struct rb_node *node;
+	struct inode *inode;
+	LIST_HEAD(batches);
+	u64 ino = 0;
+
+	atomic_set(&walk.pending, 1);
+	init_completion(&walk.done);
+	walk.ret = 0;
+
+	do {
+		batch = kmalloc(sizeof(struct writeback_batch), GFP_NOFS);
+		if (!batch)
+			batch = &stack_batch;
+		batch->sb = sb;
+		batch->walk = &walk;
+		batch->nr = 0;
+
+		spin_lock(&inf->writeback_lock);
+		node = first_writeback_node(inf, ino);
+		while (node && batch->nr < WRITEBACK_BATCH_INODES) {
+			si = container_of(node, struct scoutfs_inode_info,
+					  writeback_node);
+			node = rb_next(node);
+			ino = si->ino + 1;
+			inode = igrab(&si->inode);
+			if (inode)
+				batch->inodes[batch->nr++] = inode;
+		}
+		spin_unlock(&inf->writeback_lock);
+
+		if (batch == &stack_batch) {
+			write_batch(batch);
+			put_batch_inodes(batch);
+		} else if (batch->nr == 0) {
+			kfree(batch);
+		} else {
+			list_add_tail(&batch->head, &batches);
+			atomic_inc(&walk.pending);
+			INIT_WORK(&batch->work, scoutfs_inode_writeback_worker);
+			queue_work(inf->writeback_workq, &batch->work);
+			scoutfs_inc_counter(sb, inode_writeback_batch);
+		}
+	} while (node);
+
+	if (!atomic_dec_and_test(&walk.pending))
+		wait_for_completion(&walk.done);
+
+	list_for_each_entry_safe(batch, tmp, &batches, head) {
+		list_del_init(&batch->head);
+		put_batch_inodes(batch);
+		kfree(batch);
+	}
+
+	return walk.ret;
+}
+
 /*
  * Walk our dirty inodes in ino order and either start dirty page
  * writeback or wait for writeback to complete.
@@ -1607,7 +2337,10 @@ int scoutfs_inode_walk_writeback(struct super_block *sb, bool write)
 	struct rb_node *node;
 	struct inode *inode;
 	struct inode *defer_iput = NULL;
-	int ret;
+	int ret = 0;
+
+	if (write)
+		return start_writeback(sb);
 
 	spin_lock(&inf->writeback_lock);
 
@@ -1627,10 +2360,7 @@ int scoutfs_inode_walk_writeback(struct super_block *sb, bool write)
 			defer_iput = NULL;
 		}
 
-		if (write)
-			ret = filemap_fdatawrite(inode->i_mapping);
-		else
-			ret = filemap_fdatawait(inode->i_mapping);
+		ret = filemap_fdatawait(inode->i_mapping);
 		trace_scoutfs_inode_walk_writeback(sb, scoutfs_ino(inode),
 						   write, ret);
 		if (ret) {
@@ -1645,8 +2375,7 @@ int scoutfs_inode_walk_writeback(struct super_block *sb, bool write)
 		else
 			node = rb_next(&si->writeback_node);
 
-		if (!write)
-			remove_writeback_inode(inf, si);
+		remove_writeback_inode(inf, si);
 
 		/* avoid iput->destroy lock deadlock */
 		defer_iput = inode;
@@ -1668,19 +2397,64 @@ int scoutfs_inode_setup(struct super_block *sb)
 	if (!inf)
 		return -ENOMEM;
 
+	inf->sb = sb;
 	spin_lock_init(&inf->writeback_lock);
 	inf->writeback_inodes = RB_ROOT;
+	spin_lock_init(&inf->bg_lock);
+	INIT_LIST_HEAD(&inf->bg_list);
+	INIT_WORK(&inf->bg_work, scoutfs_inode_bg_worker);
+
+	inf->writeback_workq = alloc_workqueue("scoutfs_writeback",
+					       WQ_UNBOUND | WQ_MEM_RECLAIM,
+					       WRITEBACK_WORKERS);
+	if (!inf->writeback_workq) {
+		kfree(inf);
+		return -ENOMEM;
+	}
+
+	inf->bg_workq = alloc_workqueue("scoutfs_inode_bg", WQ_UNBOUND, 1);
+	if (!inf->bg_workq) {
+		destroy_workqueue(inf->writeback_workq);
+		kfree(inf);
+		return -ENOMEM;
+	}
 
 	sbi->inode_sb_info = inf;
 
 	return 0;
 }
 
+/*
+ * Stop queueing background work, finish what was queued by final
+ * deletions during unmount, and commit it before the transaction is
+ * shut down.  Any later deletions are performed synchronously.
+ */
+void scoutfs_inode_stop_background(struct super_block *sb)
+{
+	DECLARE_INODE_SB_INFO(sb, inf);
+
+	if (inf && inf->bg_workq) {
+		spin_lock(&inf->bg_lock);
+		inf->bg_stopped = true;
+		spin_unlock(&inf->bg_lock);
+		flush_workqueue(inf->bg_workq);
+		destroy_workqueue(inf->bg_workq);
+		inf->bg_workq = NULL;
+		if (inf->bg_queued)
+			scoutfs_trans_sync(sb, 1);
+	}
+}
+
 void scoutfs_inode_destroy(struct super_block *sb)
 {
 	struct inode_sb_info *inf = SCOUTFS_SB(sb)->inode_sb_info;
 
-	kfree(inf);
+	if (inf) {
+		WARN_ON_ONCE(!list_empty(&inf->bg_list));
+		if (inf->writeback_workq)
+			destroy_workqueue(inf->writeback_workq);
+		kfree(inf);
+	}
 }
 
 void scoutfs_inode_exit(void)
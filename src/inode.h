@@ -6,8 +6,10 @@
 #include "per_task.h"
 #include "count.h"
 #include "format.h"
+#include "extents.h"
 
 struct scoutfs_lock;
+struct scoutfs_ioctl_inode_attrs;
 
 struct scoutfs_inode_allocator {
 	spinlock_t lock;
@@ -15,6 +17,14 @@ struct scoutfs_inode_allocator {
 	u64 nr;
 };
 
+#define SCOUTFS_EXTENT_CACHE_NR 4
+
+/* the result of a file extent search, see data.c */
+struct scoutfs_extent_cache {
+	u64 from;
+	struct scoutfs_extent ext;
+};
+
 struct scoutfs_inode_info {
 	/* read or initialized for each inode instance */
 	u64 ino;
@@ -25,6 +35,7 @@ struct scoutfs_inode_info {
 	u64 data_version;
 	u64 online_blocks;
 	u64 offline_blocks;
+	u64 extents_end;
 	u32 flags;
 
 	/*
@@ -43,13 +54,58 @@ struct scoutfs_inode_info {
 
 	/* reset for every new inode instance */
 	struct scoutfs_inode_allocator ino_alloc;
+	u64 alloc_dir_ino;		/* dir created in, for data locality */
+	u64 readdir_pos_next;		/* creates' reserved positions */
+	u64 readdir_pos_end;
+	u64 dir_delta_seq;		/* our delta item, see dir.c */
+	s64 dir_delta_size;
+	s64 dir_delta_nlink;
+	struct timespec dir_delta_mtime;
+	u64 dir_deltas_none_gen;	/* lock write_gen seen without deltas */
+	u64 file_delta_seq;		/* our delta item, see data.c */
+	u64 file_delta_size;
+	u64 file_delta_extents_end;
+	u64 file_delta_data_version;
+	s64 file_delta_online;
+	u64 file_deltas_none_gen;
+	u64 file_delta_isize;		/* size grown by local deltas */
+	bool file_deltas_written;	/* local deltas need to be folded */
 
 	/* initialized once for slab object */
 	seqcount_t seqcount;
 	bool staging;			/* holder of i_mutex is staging */
 	struct scoutfs_per_task pt_data_lock;
+	struct scoutfs_per_task pt_write_locks;
 	struct rw_semaphore xattr_rwsem;
 	struct rb_node writeback_node;
+
+	/* dirty delayed allocation blocks pin their regions' locks */
+	spinlock_t delayed_blocks_lock;
+	u64 delayed_blocks;
+	u64 delayed_next;
+	struct list_head delayed_pins;
+
+	/* serializes modification of the inode's file extent items */
+	struct mutex extent_mutex;
+
+	/* recent file extent searches, dropped with lock coverage */
+	spinlock_t ext_cache_lock;
+	struct scoutfs_lock_coverage ext_cache_cov;
+	u64 ext_cache_gen;
+	u64 ext_cache_region;
+	unsigned int ext_cache_nr;
+	unsigned int ext_cache_next;
+	struct scoutfs_extent_cache ext_cache[SCOUTFS_EXTENT_CACHE_NR];
+
+	/* strided read detection, updated by concurrent readers */
+	spinlock_t read_stride_lock;
+	u64 read_stride_pos;
+	u64 read_stride;
+	unsigned int read_stride_hits;
+
+	/* symlink targets never change, cached until the inode is freed */
+	char *symlink_target;
+
 	struct inode inode;
 };
 
@@ -80,9 +136,16 @@ int scoutfs_inode_index_prepare(struct super_block *sb, struct list_head *list,
 int scoutfs_inode_index_prepare_ino(struct super_block *sb,
 				    struct list_head *list, u64 ino,
 				    umode_t mode);
+int scoutfs_inode_index_prepare_times(struct list_head *list,
+				      struct inode *inode);
 int scoutfs_inode_index_try_lock_hold(struct super_block *sb,
 				      struct list_head *list, u64 seq,
 				      const struct scoutfs_item_count cnt);
+int scoutfs_inode_index_prepare_xattr(struct super_block *sb,
+				      struct list_head *list, u64 ino,
+				      u64 major);
+int scoutfs_inode_index_xattr(struct super_block *sb, struct list_head *list,
+			      u64 ino, u64 major, bool create);
 int scoutfs_inode_index_lock_hold(struct inode *inode, struct list_head *list,
 				  bool set_data_seq,
 				  const struct scoutfs_item_count cnt);
@@ -99,6 +162,7 @@ struct inode *scoutfs_new_inode(struct super_block *sb, struct inode *dir,
 
 void scoutfs_inode_set_meta_seq(struct inode *inode);
 void scoutfs_inode_set_data_seq(struct inode *inode);
+void scoutfs_inode_add_data_version(struct inode *inode, u64 nr);
 void scoutfs_inode_inc_data_version(struct inode *inode);
 void scoutfs_inode_add_onoff(struct inode *inode, s64 on, s64 off);
 u64 scoutfs_inode_meta_seq(struct inode *inode);
@@ -107,6 +171,12 @@ u64 scoutfs_inode_data_version(struct inode *inode);
 void scoutfs_inode_get_onoff(struct inode *inode, s64 *on, s64 *off);
 int scoutfs_complete_truncate(struct inode *inode, struct scoutfs_lock *lock);
 
+int scoutfs_inode_lookup_item(struct super_block *sb, u64 ino,
+			      struct scoutfs_inode *sinode,
+			      struct scoutfs_lock *lock);
+int scoutfs_inode_read_attrs(struct super_block *sb, u64 *inos,
+			     struct scoutfs_ioctl_inode_attrs *attrs,
+			     unsigned int nr);
 int scoutfs_inode_refresh(struct inode *inode, struct scoutfs_lock *lock,
 			  int flags);
 int scoutfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
@@ -114,6 +184,8 @@ int scoutfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
 int scoutfs_setattr(struct dentry *dentry, struct iattr *attr);
 
 int scoutfs_scan_orphans(struct super_block *sb);
+void scoutfs_inode_flush_background(struct super_block *sb);
+void scoutfs_inode_stop_background(struct super_block *sb);
 
 void scoutfs_inode_queue_writeback(struct inode *inode);
 int scoutfs_inode_walk_writeback(struct super_block *sb, bool write);
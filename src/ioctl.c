@@ -20,6 +20,9 @@
 #include <linux/mm.h>
 #include <linux/sched.h>
 #include <linux/aio.h>
+#include <linux/pagemap.h>
+#include <linux/file.h>
+#include <linux/writeback.h>
 
 #include "format.h"
 #include "key.h"
@@ -32,8 +35,18 @@
 #include "client.h"
 #include "lock.h"
 #include "manifest.h"
+#include "trans.h"
+#include "xattr.h"
 #include "scoutfs_trace.h"
 
+#define WALK_INODES_BATCH 32
+
+struct walk_inodes_batch {
+	struct scoutfs_ioctl_walk_inodes_entry ents[WALK_INODES_BATCH];
+	u64 inos[WALK_INODES_BATCH];
+	struct scoutfs_ioctl_inode_attrs attrs[WALK_INODES_BATCH];
+};
+
 /*
  * We make inode index items coherent by locking fixed size regions of
  * the key space.  But the inode index item key space is vast and can
@@ -43,38 +56,148 @@
  * relatively cheap because reading is going to check the segments
  * anyway.
  *
- * This is copying to userspace while holding a DLM lock.  This is safe
- * because faulting can convert the lock to a higher level while we hold
- * the lower level.  DLM locks don't block tasks in a node, they match
- * and the tasks fall back to local locking.  In this case the spin
- * locks around the item cache.
+ * This fills a batch of entries starting at the key and advances the
+ * key past them.  The index lock is dropped before returning so that
+ * callers can acquire inode locks, which are ordered before index
+ * locks, to read the batch's inodes.  Returns the number of entries
+ * found and sets done once the walk has passed the last key.
  */
-static long scoutfs_ioc_walk_inodes(struct file *file, unsigned long arg)
+static int walk_index_batch(struct super_block *sb, struct scoutfs_key *key,
+			    struct scoutfs_key *last_key,
+			    struct scoutfs_ioctl_walk_inodes_entry *ents,
+			    unsigned int nr, bool *done)
+{
+	struct scoutfs_lock *lock = NULL;
+	struct scoutfs_key next_key;
+	unsigned int found = 0;
+	int ret;
+
+	ret = scoutfs_lock_inode_index(sb, DLM_LOCK_PR, key->sk_type,
+				       le64_to_cpu(key->skii_major),
+				       le64_to_cpu(key->skii_ino), &lock);
+	if (ret < 0)
+		return ret;
+
+	while (found < nr) {
+
+		ret = scoutfs_item_next(sb, key, last_key, NULL, lock);
+		if (ret < 0 && ret != -ENOENT)
+			break;
+
+		if (ret == -ENOENT) {
+
+			/* done if lock covers last iteration key */
+			if (scoutfs_key_compare(last_key, &lock->end) <= 0) {
+				*done = true;
+				ret = 0;
+				break;
+			}
+
+			/* continue iterating after locked empty region */
+			*key = lock->end;
+			scoutfs_key_inc(key);
+
+			scoutfs_unlock(sb, lock, DLM_LOCK_PR);
+			lock = NULL;
+
+			/*
+			 * XXX This will miss dirty items.  We'd need to
+			 * force writeouts of dirty items in our
+			 * zone|type and get the manifest root for that.
+			 * It'd mean adding a lock to the inode index
+			 * items which isn't quite there yet.
+			 */
+			ret = scoutfs_manifest_next_key(sb, key, &next_key);
+			if (ret < 0 && ret != -ENOENT)
+				break;
+
+			if (ret == -ENOENT ||
+			    scoutfs_key_compare(&next_key, last_key) > 0) {
+				*done = true;
+				ret = 0;
+				break;
+			}
+
+			*key = next_key;
+
+			ret = scoutfs_lock_inode_index(sb, DLM_LOCK_PR,
+						key->sk_type,
+						le64_to_cpu(key->skii_major),
+						le64_to_cpu(key->skii_ino),
+						&lock);
+			if (ret < 0)
+				break;
+
+			continue;
+		}
+
+		ents[found].major = le64_to_cpu(key->skii_major);
+		ents[found].minor = 0;
+		ents[found].ino = le64_to_cpu(key->skii_ino);
+		found++;
+
+		scoutfs_key_inc(key);
+	}
+
+	scoutfs_unlock(sb, lock, DLM_LOCK_PR);
+
+	return found ?: ret;
+}
+
+/*
+ * Walk an inode index, copying entries to the caller in batches.  With
+ * attrs each entry is followed by the attributes of its inode which are
+ * read for each batch with one lock per inode lock group.  The
+ * attributes can be newer than the index entry that found the inode.
+ */
+static long walk_inodes(struct file *file, unsigned long arg, bool attrs)
 {
 	struct super_block *sb = file_inode(file)->i_sb;
 	struct scoutfs_ioctl_walk_inodes __user *uwalk = (void __user *)arg;
+	struct scoutfs_ioctl_walk_inodes_attrs_entry __user *uaent;
+	struct scoutfs_ioctl_walk_inodes_entry __user *uent;
 	struct scoutfs_ioctl_walk_inodes walk;
-	struct scoutfs_ioctl_walk_inodes_entry ent;
-	struct scoutfs_key next_key;
+	struct walk_inodes_batch *wib = NULL;
+	static const u8 index_types[] = {
+		[SCOUTFS_IOC_WALK_INODES_META_SEQ] =
+			SCOUTFS_INODE_INDEX_META_SEQ_TYPE,
+		[SCOUTFS_IOC_WALK_INODES_DATA_SEQ] =
+			SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE,
+		[SCOUTFS_IOC_WALK_INODES_SIZE] =
+			SCOUTFS_INODE_INDEX_SIZE_TYPE,
+		[SCOUTFS_IOC_WALK_INODES_MTIME] =
+			SCOUTFS_INODE_INDEX_MTIME_TYPE,
+		[SCOUTFS_IOC_WALK_INODES_ATIME] =
+			SCOUTFS_INODE_INDEX_ATIME_TYPE,
+		[SCOUTFS_IOC_WALK_INODES_ONLINE_BLOCKS] =
+			SCOUTFS_INODE_INDEX_ONLINE_BLOCKS_TYPE,
+		[SCOUTFS_IOC_WALK_INODES_OFFLINE_BLOCKS] =
+			SCOUTFS_INODE_INDEX_OFFLINE_BLOCKS_TYPE,
+		[SCOUTFS_IOC_WALK_INODES_UID] =
+			SCOUTFS_INODE_INDEX_UID_TYPE,
+		[SCOUTFS_IOC_WALK_INODES_GID] =
+			SCOUTFS_INODE_INDEX_GID_TYPE,
+		[SCOUTFS_IOC_WALK_INODES_XATTR] =
+			SCOUTFS_INODE_INDEX_XATTR_TYPE,
+	};
 	struct scoutfs_key last_key;
 	struct scoutfs_key key;
-	struct scoutfs_lock *lock;
+	bool done = false;
 	u64 last_seq;
+	int found;
 	int ret = 0;
 	u32 nr = 0;
 	u8 type;
+	int i;
 
 	if (copy_from_user(&walk, uwalk, sizeof(walk)))
 		return -EFAULT;
 
 	trace_scoutfs_ioc_walk_inodes(sb, &walk);
 
-	if (walk.index == SCOUTFS_IOC_WALK_INODES_META_SEQ)
-		type = SCOUTFS_INODE_INDEX_META_SEQ_TYPE;
-	else if (walk.index == SCOUTFS_IOC_WALK_INODES_DATA_SEQ)
-		type = SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE;
-	else
+	if (walk.index >= ARRAY_SIZE(index_types))
 		return -EINVAL;
+	type = index_types[walk.index];
 
 	/* clamp results to the inodes in the farthest stable seq */
 	if (type == SCOUTFS_INODE_INDEX_META_SEQ_TYPE ||
@@ -99,80 +222,159 @@ static long scoutfs_ioc_walk_inodes(struct file *file, unsigned long arg)
 	/* cap nr to the max the ioctl can return to a compat task */
 	walk.nr_entries = min_t(u64, walk.nr_entries, INT_MAX);
 
-	ret = scoutfs_lock_inode_index(sb, DLM_LOCK_PR, type, walk.first.major,
-				       walk.first.ino, &lock);
-	if (ret < 0)
-		goto out;
+	wib = kmalloc(sizeof(struct walk_inodes_batch), GFP_KERNEL);
+	if (!wib)
+		return -ENOMEM;
 
-	for (nr = 0; nr < walk.nr_entries; ) {
+	uent = (void __user *)(unsigned long)walk.entries_ptr;
+	uaent = (void __user *)(unsigned long)walk.entries_ptr;
 
-		ret = scoutfs_item_next(sb, &key, &last_key, NULL, lock);
-		if (ret < 0 && ret != -ENOENT)
+	while (nr < walk.nr_entries && !done) {
+		found = walk_index_batch(sb, &key, &last_key, wib->ents,
+					 min_t(u32, walk.nr_entries - nr,
+					       WALK_INODES_BATCH), &done);
+		if (found <= 0) {
+			ret = found;
 			break;
+		}
 
-		if (ret == -ENOENT) {
-
-			/* done if lock covers last iteration key */
-			if (scoutfs_key_compare(&last_key, &lock->end) <= 0) {
-				ret = 0;
+		if (attrs) {
+			for (i = 0; i < found; i++)
+				wib->inos[i] = wib->ents[i].ino;
+			ret = scoutfs_inode_read_attrs(sb, wib->inos,
+						       wib->attrs, found);
+			if (ret)
 				break;
+		}
+
+		for (i = 0; i < found; i++) {
+			if (attrs) {
+				ret = (copy_to_user(uaent, &wib->ents[i],
+						    sizeof(wib->ents[i])) ||
+				       copy_to_user(&uaent->attrs,
+						    &wib->attrs[i],
+						    sizeof(wib->attrs[i]))) ?
+				      -EFAULT : 0;
+				uaent++;
+			} else {
+				ret = copy_to_user(uent, &wib->ents[i],
+						   sizeof(wib->ents[i])) ?
+				      -EFAULT : 0;
+				uent++;
 			}
+			if (ret)
+				goto out;
+			nr++;
+		}
+	}
 
-			/* continue iterating after locked empty region */
-			key = lock->end;
-			scoutfs_key_inc(&key);
+out:
+	kfree(wib);
 
-			scoutfs_unlock(sb, lock, DLM_LOCK_PR);
+	if (nr > 0)
+		ret = nr;
 
-			/*
-			 * XXX This will miss dirty items.  We'd need to
-			 * force writeouts of dirty items in our
-			 * zone|type and get the manifest root for that.
-			 * It'd mean adding a lock to the inode index
-			 * items which isn't quite there yet.
-			 */
-			ret = scoutfs_manifest_next_key(sb, &key, &next_key);
-			if (ret < 0 && ret != -ENOENT)
-				goto out;
+	return ret;
+}
 
-			if (ret == -ENOENT ||
-			    scoutfs_key_compare(&next_key, &last_key) > 0) {
-				ret = 0;
-				goto out;
-			}
+static long scoutfs_ioc_walk_inodes(struct file *file, unsigned long arg)
+{
+	return walk_inodes(file, arg, false);
+}
 
-			key = next_key;
+static long scoutfs_ioc_walk_inodes_attrs(struct file *file, unsigned long arg)
+{
+	return walk_inodes(file, arg, true);
+}
 
-			ret = scoutfs_lock_inode_index(sb, DLM_LOCK_PR,
-						key.sk_type,
-						le64_to_cpu(key.skii_major),
-						le64_to_cpu(key.skii_ino),
-						&lock);
-			if (ret < 0)
-				goto out;
+/*
+ * See the comment above the definition of struct
+ * scoutfs_ioctl_find_xattr_inodes.  This walks the inode index items
+ * with the major value of the name and value's hash.
+ */
+static long scoutfs_ioc_find_xattr_inodes(struct file *file,
+					  unsigned long arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct scoutfs_ioctl_find_xattr_inodes fxi;
+	struct walk_inodes_batch *wib = NULL;
+	struct scoutfs_key last_key;
+	struct scoutfs_key key;
+	u64 __user *uinos;
+	char *name = NULL;
+	bool done = false;
+	u64 major;
+	int found;
+	int ret = 0;
+	u32 nr = 0;
+	int i;
 
-			continue;
+	if (copy_from_user(&fxi, (void __user *)arg, sizeof(fxi)))
+		return -EFAULT;
+
+	if (fxi.name_bytes > SCOUTFS_XATTR_MAX_NAME_LEN ||
+	    fxi.value_bytes > SCOUTFS_XATTR_INDEX_MAX_VAL_LEN)
+		return -EINVAL;
+
+	/* the value is stored after the name */
+	name = kmalloc(fxi.name_bytes + fxi.value_bytes, GFP_KERNEL);
+	wib = kmalloc(sizeof(struct walk_inodes_batch), GFP_KERNEL);
+	if (!name || !wib) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_user(name, (void __user *)(unsigned long)fxi.name_ptr,
+			   fxi.name_bytes) ||
+	    copy_from_user(name + fxi.name_bytes,
+			   (void __user *)(unsigned long)fxi.value_ptr,
+			   fxi.value_bytes)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	if (!scoutfs_xattr_is_indexed(name, fxi.name_bytes)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	major = scoutfs_xattr_index_major(name, fxi.name_bytes,
+					  name + fxi.name_bytes,
+					  fxi.value_bytes);
+	scoutfs_inode_init_index_key(&key, SCOUTFS_INODE_INDEX_XATTR_TYPE,
+				     major, 0, fxi.first_ino);
+	scoutfs_inode_init_index_key(&last_key, SCOUTFS_INODE_INDEX_XATTR_TYPE,
+				     major, 0, U64_MAX);
+
+	/* cap nr to the max the ioctl can return to a compat task */
+	fxi.nr_inos = min_t(u32, fxi.nr_inos, INT_MAX);
+	uinos = (void __user *)(unsigned long)fxi.inos_ptr;
+
+	while (nr < fxi.nr_inos && !done) {
+		found = walk_index_batch(sb, &key, &last_key, wib->ents,
+					 min_t(u32, fxi.nr_inos - nr,
+					       WALK_INODES_BATCH), &done);
+		if (found <= 0) {
+			ret = found;
+			break;
 		}
 
-		ent.major = le64_to_cpu(key.skii_major);
-		ent.minor = 0;
-		ent.ino = le64_to_cpu(key.skii_ino);
+		for (i = 0; i < found; i++)
+			wib->inos[i] = wib->ents[i].ino;
 
-		if (copy_to_user((void __user *)walk.entries_ptr, &ent,
-				 sizeof(ent))) {
+		if (copy_to_user(uinos, wib->inos, found * sizeof(u64))) {
 			ret = -EFAULT;
 			break;
 		}
 
-		nr++;
-		walk.entries_ptr += sizeof(ent);
-
-		scoutfs_key_inc(&key);
+		uinos += found;
+		nr += found;
 	}
 
-	scoutfs_unlock(sb, lock, DLM_LOCK_PR);
-
 out:
+	kfree(wib);
+	kfree(name);
+
 	if (nr > 0)
 		ret = nr;
 
@@ -256,25 +458,16 @@ out:
 }
 
 /*
- * The caller has a version of the data available in the given byte
- * range in an external archive.  As long as the data version still
- * matches we free the blocks fully contained in the range and mark them
- * offline.  Attempts to use the blocks in the future will trigger
- * recall from the archive.
- *
- * If the file's online blocks drop to 0 then we also truncate any
- * blocks beyond i_size.  This honors the intent of fully releasing a file
- * without the user needing to know to release past i_size or truncate.
- *
- * XXX permissions?
- * XXX a lot of this could be generic file write prep
+ * Release blocks in an inode whose data_version matches.  The caller
+ * holds i_mutex and an EX lock that covers the inode and has checked
+ * that the release range is valid.  The whole file data lock drops
+ * other nodes' cached pages of the released blocks.
  */
-static long scoutfs_ioc_release(struct file *file, unsigned long arg)
+static int release_inode_blocks(struct super_block *sb, struct inode *inode,
+				u64 block, u64 count, u64 data_version,
+				struct scoutfs_lock *lock)
 {
-	struct inode *inode = file_inode(file);
-	struct super_block *sb = inode->i_sb;
-	struct scoutfs_ioctl_release args;
-	struct scoutfs_lock *lock = NULL;
+	struct scoutfs_lock *data_lock = NULL;
 	loff_t start;
 	loff_t end_inc;
 	u64 online;
@@ -282,54 +475,38 @@ static long scoutfs_ioc_release(struct file *file, unsigned long arg)
 	u64 isize;
 	int ret;
 
-	if (copy_from_user(&args, (void __user *)arg, sizeof(args)))
-		return -EFAULT;
-
-	trace_scoutfs_ioc_release(sb, &args);
-
-	if (args.count == 0)
-		return 0;
-	if ((args.block + args.count) < args.block)
+	if (!S_ISREG(inode->i_mode))
 		return -EINVAL;
 
-
-	ret = mnt_want_write_file(file);
+	/* writers' data_versions and extents could be in deltas */
+	ret = scoutfs_data_fold_file_deltas(inode, lock);
 	if (ret)
 		return ret;
 
-	mutex_lock(&inode->i_mutex);
+	if (scoutfs_inode_data_version(inode) != data_version)
+		return -ESTALE;
 
-	ret = scoutfs_lock_inode(sb, DLM_LOCK_EX, SCOUTFS_LKF_REFRESH_INODE,
-				 inode, &lock);
+	ret = scoutfs_lock_data_file(sb, DLM_LOCK_EX, 0, inode, &data_lock);
 	if (ret)
-		goto out;
-
-	if (!S_ISREG(inode->i_mode)) {
-		ret = -EINVAL;
-		goto out;
-	}
-
-	if (!(file->f_mode & FMODE_WRITE)) {
-		ret = -EINVAL;
-		goto out;
-	}
+		return ret;
 
-	if (scoutfs_inode_data_version(inode) != args.data_version) {
-		ret = -ESTALE;
-		goto out;
+	/* inline data is moved to a block that can be released */
+	if (block == 0) {
+		ret = scoutfs_data_convert_inline(inode, lock);
+		if (ret)
+			goto out;
 	}
 
 	inode_dio_wait(inode);
 
 	/* drop all clean and dirty cached blocks in the range */
-	start = args.block << SCOUTFS_BLOCK_SHIFT;
-	end_inc = ((args.block + args.count) << SCOUTFS_BLOCK_SHIFT) - 1;
+	start = block << SCOUTFS_BLOCK_SHIFT;
+	end_inc = ((block + count) << SCOUTFS_BLOCK_SHIFT) - 1;
 	truncate_inode_pages_range(&inode->i_data, start, end_inc);
 
 	ret = scoutfs_data_truncate_items(sb, inode, scoutfs_ino(inode),
-					  args.block,
-					  args.block + args.count - 1, true,
-					  lock);
+					  block, block + count - 1, true,
+					  false, lock);
 	if (ret == 0) {
 		scoutfs_inode_get_onoff(inode, &online, &offline);
 		isize = i_size_read(inode);
@@ -339,83 +516,47 @@ static long scoutfs_ioc_release(struct file *file, unsigned long arg)
 			ret = scoutfs_data_truncate_items(sb, inode,
 							  scoutfs_ino(inode),
 							  start, U64_MAX,
-							  false, lock);
+							  false, false, lock);
 		}
 	}
 
 out:
-	scoutfs_unlock(sb, lock, DLM_LOCK_EX);
-	mutex_unlock(&inode->i_mutex);
-	mnt_drop_write_file(file);
-
-	trace_scoutfs_ioc_release_ret(sb, ret);
+	scoutfs_unlock(sb, data_lock, DLM_LOCK_EX);
 	return ret;
 }
 
 /*
- * Write the archived contents of the file back if the data_version
- * still matches.
- *
- * This is a data plane operation only.  We don't want the write to
- * change any fields in the inode.  It only changes the file contents.
- *
- * Keep in mind that the staging writes can easily span transactions and
- * can crash partway through.  If we called the normal write path and
- * restored the inode afterwards the modified inode could be commited
- * partway through by a transaction and then left that way by a crash
- * before the write finishes and we restore the fields.  It also
- * wouldn't be great if the temporarily updated inode was visible to
- * paths that don't serialize with write.
- *
- * We're implementing the buffered write path down to the start of
- * generic_file_buffered_writes() without all the stuff that would
- * change the inode: file_remove_suid(), file_update_time().  The
- * easiest way to do that is to call generic_file_buffered_write().
- * We're careful to only allow staging writes inside i_size.
+ * The caller has a version of the data available in the given byte
+ * range in an external archive.  As long as the data version still
+ * matches we free the blocks fully contained in the range and mark them
+ * offline.  Attempts to use the blocks in the future will trigger
+ * recall from the archive.
  *
- * We set a  bool on the inode which tells our code to update the
- * offline extents and to not update the data_version counter.
+ * If the file's online blocks drop to 0 then we also truncate any
+ * blocks beyond i_size.  This honors the intent of fully releasing a file
+ * without the user needing to know to release past i_size or truncate.
  *
- * This doesn't support any fancy write modes or side-effects: aio,
- * direct, append, sync, breaking suid, sending rlimit signals.
+ * XXX permissions?
+ * XXX a lot of this could be generic file write prep
  */
-static long scoutfs_ioc_stage(struct file *file, unsigned long arg)
+static long scoutfs_ioc_release(struct file *file, unsigned long arg)
 {
 	struct inode *inode = file_inode(file);
 	struct super_block *sb = inode->i_sb;
-	struct address_space *mapping = inode->i_mapping;
-	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
-	SCOUTFS_DECLARE_PER_TASK_ENTRY(pt_ent);
-	struct scoutfs_ioctl_stage args;
+	struct scoutfs_ioctl_release args;
 	struct scoutfs_lock *lock = NULL;
-	struct kiocb kiocb;
-	struct iovec iov;
-	size_t written;
-	loff_t end_size;
-	loff_t isize;
-	loff_t pos;
 	int ret;
 
 	if (copy_from_user(&args, (void __user *)arg, sizeof(args)))
 		return -EFAULT;
 
-	end_size = args.offset + args.count;
-
-	/* verify arg constraints that aren't dependent on file */
-	if (args.count < 0 || (end_size < args.offset) ||
-	    args.offset & SCOUTFS_BLOCK_MASK)
-		return -EINVAL;
+	trace_scoutfs_ioc_release(sb, &args);
 
 	if (args.count == 0)
 		return 0;
+	if ((args.block + args.count) < args.block)
+		return -EINVAL;
 
-	/* the iocb is really only used for the file pointer :P */
-	init_sync_kiocb(&kiocb, file);
-	kiocb.ki_pos = args.offset;
-	kiocb.ki_left = args.count;
-	kiocb.ki_nbytes = args.count;
-	iov.iov_base = (void __user *)(unsigned long)args.buf_ptr;
-	iov.iov_len = args.count;
 
 	ret = mnt_want_write_file(file);
 	if (ret)
@@ -428,16 +569,233 @@ static long scoutfs_ioc_stage(struct file *file, unsigned long arg)
 	if (ret)
 		goto out;
 
-	scoutfs_per_task_add(&si->pt_data_lock, &pt_ent, lock);
-
-	isize = i_size_read(inode);
-
-	if (!S_ISREG(inode->i_mode) ||
-	    !(file->f_mode & FMODE_WRITE) ||
-	    (file->f_flags & (O_APPEND | O_DIRECT | O_DSYNC)) ||
-	    IS_SYNC(file->f_mapping->host) ||
-	    (end_size > isize) ||
-	    ((end_size & SCOUTFS_BLOCK_MASK) && (end_size != isize))) {
+	if (!S_ISREG(inode->i_mode)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (!(file->f_mode & FMODE_WRITE)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = release_inode_blocks(sb, inode, args.block, args.count,
+				   args.data_version, lock);
+out:
+	scoutfs_unlock(sb, lock, DLM_LOCK_EX);
+	mutex_unlock(&inode->i_mutex);
+	mnt_drop_write_file(file);
+
+	trace_scoutfs_ioc_release_ret(sb, ret);
+	return ret;
+}
+
+/*
+ * Release one entry of a vectored release.  The caller holds the EX
+ * lock for the entry's inode group.  We get the inode's i_mutex while
+ * holding the group lock, which is the reverse of the usual order, so
+ * we only try.  If it's contended we drop the group lock and reacquire
+ * it after the i_mutex.
+ */
+static int release_entry(struct super_block *sb,
+			 struct scoutfs_ioctl_release_entry *ent,
+			 struct scoutfs_lock **group_lock)
+{
+	struct inode *inode;
+	int ret;
+
+	if (ent->count == 0)
+		return 0;
+	if ((ent->block + ent->count) < ent->block)
+		return -EINVAL;
+
+	inode = scoutfs_iget(sb, ent->ino);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	if (!mutex_trylock(&inode->i_mutex)) {
+		scoutfs_unlock(sb, *group_lock, DLM_LOCK_EX);
+		*group_lock = NULL;
+		mutex_lock(&inode->i_mutex);
+		ret = scoutfs_lock_ino(sb, DLM_LOCK_EX, 0, ent->ino,
+				       group_lock);
+		if (ret)
+			goto out;
+	}
+
+	ret = scoutfs_inode_refresh(inode, *group_lock, 0) ?:
+	      release_inode_blocks(sb, inode, ent->block, ent->count,
+				   ent->data_version, *group_lock);
+out:
+	mutex_unlock(&inode->i_mutex);
+	iput(inode);
+	return ret;
+}
+
+/*
+ * Release blocks in many files with one call.  Consecutive entries
+ * whose inodes are covered by the same lock share one acquisition of
+ * the lock so callers should sort their entries by inode number.
+ *
+ * This releases by inode number so it's restricted to CAP_SYS_ADMIN
+ * instead of checking that the caller could open each file for
+ * writing.
+ */
+static long scoutfs_ioc_release_vec(struct file *file, unsigned long arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct scoutfs_ioctl_release_entry __user *uents;
+	struct scoutfs_ioctl_release_vec args;
+	struct scoutfs_ioctl_release_entry ent;
+	struct scoutfs_lock *group_lock = NULL;
+	u64 group = 0;
+	u32 released = 0;
+	u32 i;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&args, (void __user *)arg, sizeof(args)))
+		return -EFAULT;
+
+	uents = (void __user *)(unsigned long)args.entries_ptr;
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < args.nr_entries; i++) {
+		if (copy_from_user(&ent, &uents[i], sizeof(ent))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (group_lock &&
+		    group != (ent.ino & ~(u64)SCOUTFS_LOCK_INODE_GROUP_MASK)) {
+			scoutfs_unlock(sb, group_lock, DLM_LOCK_EX);
+			group_lock = NULL;
+		}
+
+		if (!group_lock) {
+			group = ent.ino & ~(u64)SCOUTFS_LOCK_INODE_GROUP_MASK;
+			ret = scoutfs_lock_ino(sb, DLM_LOCK_EX, 0, ent.ino,
+					       &group_lock);
+		}
+
+		if (ret == 0)
+			ret = release_entry(sb, &ent, &group_lock);
+
+		ent.result = ret;
+		if (put_user(ent.result, &uents[i].result)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (ret == 0)
+			released++;
+		ret = 0;
+
+		if (fatal_signal_pending(current))
+			break;
+	}
+
+	scoutfs_unlock(sb, group_lock, DLM_LOCK_EX);
+	mnt_drop_write_file(file);
+
+	return ret ?: released;
+}
+
+/*
+ * Write the archived contents of the file back if the data_version
+ * still matches.
+ *
+ * This is a data plane operation only.  We don't want the write to
+ * change any fields in the inode.  It only changes the file contents.
+ *
+ * Keep in mind that the staging writes can easily span transactions and
+ * can crash partway through.  If we called the normal write path and
+ * restored the inode afterwards the modified inode could be commited
+ * partway through by a transaction and then left that way by a crash
+ * before the write finishes and we restore the fields.  It also
+ * wouldn't be great if the temporarily updated inode was visible to
+ * paths that don't serialize with write.
+ *
+ * We're implementing the buffered write path down to the start of
+ * generic_file_buffered_writes() without all the stuff that would
+ * change the inode: file_remove_suid(), file_update_time().  The
+ * easiest way to do that is to call generic_file_buffered_write().
+ * We're careful to only allow staging writes inside i_size.
+ *
+ * We set a  bool on the inode which tells our code to update the
+ * offline extents and to not update the data_version counter.
+ *
+ * This doesn't support any fancy write modes or side-effects: aio,
+ * direct, append, sync, breaking suid, sending rlimit signals.
+ */
+static long scoutfs_ioc_stage(struct file *file, unsigned long arg)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct address_space *mapping = inode->i_mapping;
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	SCOUTFS_DECLARE_PER_TASK_ENTRY(dl_ent);
+	struct scoutfs_data_locks dl = { NULL, };
+	struct scoutfs_ioctl_stage args;
+	struct scoutfs_lock *lock = NULL;
+	struct kiocb kiocb;
+	struct iovec iov;
+	size_t written;
+	loff_t end_size;
+	loff_t isize;
+	loff_t pos;
+	int ret;
+
+	if (copy_from_user(&args, (void __user *)arg, sizeof(args)))
+		return -EFAULT;
+
+	end_size = args.offset + args.count;
+
+	/* verify arg constraints that aren't dependent on file */
+	if (args.count < 0 || (end_size < args.offset) ||
+	    args.offset & SCOUTFS_BLOCK_MASK)
+		return -EINVAL;
+
+	if (args.count == 0)
+		return 0;
+
+	/* the iocb is really only used for the file pointer :P */
+	init_sync_kiocb(&kiocb, file);
+	kiocb.ki_pos = args.offset;
+	kiocb.ki_left = args.count;
+	kiocb.ki_nbytes = args.count;
+	iov.iov_base = (void __user *)(unsigned long)args.buf_ptr;
+	iov.iov_len = args.count;
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+
+	mutex_lock(&inode->i_mutex);
+
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_EX, SCOUTFS_LKF_REFRESH_INODE,
+				 inode, &lock) ?:
+	      scoutfs_data_fold_file_deltas(inode, lock);
+	if (ret)
+		goto out;
+
+	/* write_begin acquires data locks that we hold across pages */
+	dl.inode = lock;
+	scoutfs_per_task_add(&si->pt_write_locks, &dl_ent, &dl);
+
+	isize = i_size_read(inode);
+
+	if (!S_ISREG(inode->i_mode) ||
+	    !(file->f_mode & FMODE_WRITE) ||
+	    (file->f_flags & (O_APPEND | O_DIRECT | O_DSYNC)) ||
+	    IS_SYNC(file->f_mapping->host) ||
+	    (end_size > isize) ||
+	    ((end_size & SCOUTFS_BLOCK_MASK) && (end_size != isize))) {
 		ret = -EINVAL;
 		goto out;
 	}
@@ -462,8 +820,15 @@ static long scoutfs_ioc_stage(struct file *file, unsigned long arg)
 
 	si->staging = false;
 	current->backing_dev_info = NULL;
+
+	if (written)
+		scoutfs_data_wake_waiters(sb, scoutfs_ino(inode),
+				args.offset >> SCOUTFS_BLOCK_SHIFT,
+				(args.offset + written - 1) >>
+					SCOUTFS_BLOCK_SHIFT);
 out:
-	scoutfs_per_task_del(&si->pt_data_lock, &pt_ent);
+	scoutfs_per_task_del(&si->pt_write_locks, &dl_ent);
+	scoutfs_data_unlock_write(sb, &dl);
 	scoutfs_unlock(sb, lock, DLM_LOCK_EX);
 	mutex_unlock(&inode->i_mutex);
 	mnt_drop_write_file(file);
@@ -471,25 +836,463 @@ out:
 	return ret;
 }
 
+/*
+ * Write a buffer into the page cache with the staging write path.  The
+ * caller has set up staging on the inode.  Returns the number of bytes
+ * written or -errno if nothing was written.
+ */
+static ssize_t stage_write(struct file *file, loff_t pos,
+			   const struct iovec *iov, size_t count)
+{
+	struct kiocb kiocb;
+	ssize_t written = 0;
+	ssize_t ret;
+
+	init_sync_kiocb(&kiocb, file);
+	kiocb.ki_pos = pos;
+	kiocb.ki_left = count;
+	kiocb.ki_nbytes = count;
+
+	do {
+		/* returns the total including the written we pass in */
+		ret = generic_file_buffered_write(&kiocb, iov, 1, pos, &pos,
+						  count, written);
+		BUG_ON(ret == -EIOCBQUEUED);
+		if (ret <= written)
+			break;
+		written = ret;
+	} while (written < count);
+
+	return written ?: ret;
+}
+
+/*
+ * Stage a range from the source file's page cache.  Each source page is
+ * read into the page cache and copied directly into our pages between
+ * our write_begin and write_end, like the buffered write path does with
+ * user buffers.
+ */
+static ssize_t stage_from_file(struct file *file, struct file *src,
+			       loff_t pos, loff_t src_pos, size_t count)
+{
+	struct address_space *src_mapping = src->f_mapping;
+	struct address_space *mapping = file->f_mapping;
+	const struct address_space_operations *a_ops = mapping->a_ops;
+	struct page *src_page;
+	struct page *page;
+	void *fsdata;
+	void *dst_addr;
+	void *src_addr;
+	size_t written = 0;
+	size_t src_off;
+	size_t off;
+	size_t len;
+	ssize_t ret = 0;
+
+	while (written < count) {
+		src_off = src_pos & ~PAGE_CACHE_MASK;
+		off = pos & ~PAGE_CACHE_MASK;
+		len = min3(PAGE_CACHE_SIZE - src_off, PAGE_CACHE_SIZE - off,
+			   count - written);
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		src_page = read_mapping_page(src_mapping,
+					     src_pos >> PAGE_CACHE_SHIFT, src);
+		if (IS_ERR(src_page)) {
+			ret = PTR_ERR(src_page);
+			break;
+		}
+
+		ret = a_ops->write_begin(file, mapping, pos, len, 0, &page,
+					 &fsdata);
+		if (ret == 0) {
+			dst_addr = kmap_atomic(page);
+			src_addr = kmap_atomic(src_page);
+			memcpy(dst_addr + off, src_addr + src_off, len);
+			kunmap_atomic(src_addr);
+			kunmap_atomic(dst_addr);
+			flush_dcache_page(page);
+
+			ret = a_ops->write_end(file, mapping, pos, len, len,
+					       page, fsdata);
+		}
+		page_cache_release(src_page);
+
+		if (ret <= 0)
+			break;
+
+		pos += ret;
+		src_pos += ret;
+		written += ret;
+		balance_dirty_pages_ratelimited(mapping);
+		if (ret < len)
+			break;
+	}
+
+	return written ?: ret;
+}
+
+static int check_stage_range(struct inode *inode, struct file *src,
+			     struct scoutfs_ioctl_stage_range *sr)
+{
+	loff_t isize = i_size_read(inode);
+	loff_t end_size = sr->offset + sr->count;
+
+	if (sr->count == 0 || end_size < sr->offset ||
+	    (sr->offset & SCOUTFS_BLOCK_MASK) || end_size > isize ||
+	    ((end_size & SCOUTFS_BLOCK_MASK) && end_size != isize))
+		return -EINVAL;
+
+	if (src && (sr->src + sr->count < sr->src ||
+		    sr->src + sr->count > i_size_read(file_inode(src))))
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Stage a vector of ranges in one call.  The lock and data_version
+ * check are done once and all the ranges are checked.  Then each
+ * range's offline blocks are preallocated just before it's written and
+ * its writeback started.  Preallocated blocks that a failed range
+ * didn't write are freed so they're not stranded in the file.  See the
+ * _stage ioctl for how staging writes avoid changing the inode.
+ */
+static long scoutfs_ioc_stage_vec(struct file *file, unsigned long arg)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct address_space *mapping = inode->i_mapping;
+	struct scoutfs_inode_info *si = SCOUTFS_I(inode);
+	SCOUTFS_DECLARE_PER_TASK_ENTRY(dl_ent);
+	struct scoutfs_data_locks dl = { NULL, };
+	struct scoutfs_ioctl_stage_range __user *uranges;
+	struct scoutfs_ioctl_stage_range *ranges = NULL;
+	struct scoutfs_ioctl_stage_range *sr;
+	struct scoutfs_ioctl_stage_vec args;
+	struct scoutfs_lock *lock = NULL;
+	struct file *src = NULL;
+	struct inode *src_inode;
+	struct iovec iov;
+	ssize_t written;
+	loff_t end;
+	u32 staged = 0;
+	u32 i;
+	int err;
+	int ret;
+
+	if (copy_from_user(&args, (void __user *)arg, sizeof(args)))
+		return -EFAULT;
+
+	if (args.flags & SCOUTFS_IOC_STAGE_VEC_UNKNOWN)
+		return -EINVAL;
+
+	if (args.nr_ranges == 0)
+		return 0;
+
+	if (args.nr_ranges > SCOUTFS_IOC_STAGE_VEC_MAX_RANGES)
+		return -EINVAL;
+
+	/*
+	 * The ranges are copied once so that all the passes see the
+	 * ranges that were checked.
+	 */
+	uranges = (void __user *)(unsigned long)args.ranges_ptr;
+	ranges = kmalloc(args.nr_ranges * sizeof(ranges[0]), GFP_KERNEL);
+	if (!ranges)
+		return -ENOMEM;
+
+	if (copy_from_user(ranges, uranges,
+			   args.nr_ranges * sizeof(ranges[0]))) {
+		ret = -EFAULT;
+		goto out_ranges;
+	}
+
+	if (args.src_fd >= 0) {
+		src = fget(args.src_fd);
+		if (!src) {
+			ret = -EBADF;
+			goto out_ranges;
+		}
+
+		src_inode = file_inode(src);
+		if (!(src->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			goto out_src;
+		}
+		if (!S_ISREG(src_inode->i_mode) ||
+		    src_inode->i_sb->s_magic == SCOUTFS_SUPER_MAGIC ||
+		    !src->f_mapping->a_ops->readpage) {
+			ret = -EINVAL;
+			goto out_src;
+		}
+	}
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		goto out_src;
+
+	mutex_lock(&inode->i_mutex);
+
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_EX, SCOUTFS_LKF_REFRESH_INODE,
+				 inode, &lock) ?:
+	      scoutfs_data_fold_file_deltas(inode, lock);
+	if (ret)
+		goto out;
+
+	/* write_begin acquires data locks that we hold across pages */
+	dl.inode = lock;
+	scoutfs_per_task_add(&si->pt_write_locks, &dl_ent, &dl);
+
+	if (!S_ISREG(inode->i_mode) ||
+	    !(file->f_mode & FMODE_WRITE) ||
+	    (file->f_flags & (O_APPEND | O_DIRECT | O_DSYNC)) ||
+	    IS_SYNC(file->f_mapping->host)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (scoutfs_inode_data_version(inode) != args.data_version) {
+		ret = -ESTALE;
+		goto out;
+	}
+
+	/* check all the ranges before staging any */
+	for (i = 0; i < args.nr_ranges; i++) {
+		ret = check_stage_range(inode, src, &ranges[i]);
+		if (ret)
+			goto out;
+	}
+
+	si->staging = true;
+	current->backing_dev_info = mapping->backing_dev_info;
+
+	for (i = 0; i < args.nr_ranges; i++) {
+		sr = &ranges[i];
+		end = sr->offset + sr->count - 1;
+
+		/* allocate large extents for the range's offline blocks */
+		ret = scoutfs_data_prealloc_offline(inode,
+					sr->offset >> SCOUTFS_BLOCK_SHIFT,
+					end >> SCOUTFS_BLOCK_SHIFT, lock);
+		if (ret) {
+			written = 0;
+		} else if (src) {
+			written = stage_from_file(file, src, sr->offset,
+						  sr->src, sr->count);
+		} else {
+			iov.iov_base = (void __user *)(unsigned long)sr->src;
+			iov.iov_len = sr->count;
+			written = stage_write(file, sr->offset, &iov,
+					      sr->count);
+		}
+
+		/* each range locks the regions that it writes */
+		scoutfs_data_unlock_write(sb, &dl);
+
+		if (written > 0) {
+			end = sr->offset + written - 1;
+			scoutfs_data_wake_waiters(sb, scoutfs_ino(inode),
+					sr->offset >> SCOUTFS_BLOCK_SHIFT,
+					end >> SCOUTFS_BLOCK_SHIFT);
+			if (args.flags & SCOUTFS_IOC_STAGE_VEC_SYNC)
+				ret = filemap_write_and_wait_range(mapping,
+							sr->offset, end);
+			else
+				ret = scoutfs_data_start_writeback(inode,
+							sr->offset, end);
+		} else {
+			ret = ret ?: written ?: -EIO;
+		}
+
+		/* free preallocated blocks that weren't staged */
+		if (written < (ssize_t)sr->count) {
+			err = scoutfs_data_unprealloc_offline(inode,
+				DIV_ROUND_UP(sr->offset + max_t(ssize_t, written, 0),
+					     SCOUTFS_BLOCK_SIZE),
+				(sr->offset + sr->count - 1) >>
+					SCOUTFS_BLOCK_SHIFT, lock);
+			if (err && !ret)
+				ret = err;
+		}
+
+		sr->result = ret ?: written;
+		if (put_user(sr->result, &uranges[i].result)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (ret || written < sr->count)
+			break;
+		staged++;
+	}
+
+	si->staging = false;
+	current->backing_dev_info = NULL;
+
+	/* errors in ranges are reported in their results */
+	if (ret != -EFAULT)
+		ret = staged;
+out:
+	scoutfs_per_task_del(&si->pt_write_locks, &dl_ent);
+	scoutfs_data_unlock_write(sb, &dl);
+	scoutfs_unlock(sb, lock, DLM_LOCK_EX);
+	mutex_unlock(&inode->i_mutex);
+	mnt_drop_write_file(file);
+out_src:
+	if (src)
+		fput(src);
+out_ranges:
+	kfree(ranges);
+
+	return ret;
+}
+
 static long scoutfs_ioc_stat_more(struct file *file, unsigned long arg)
 {
 	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_ioctl_inode_attrs attrs;
 	struct scoutfs_ioctl_stat_more stm;
+	struct scoutfs_lock *lock = NULL;
+	u64 gbs;
+	int ret;
 
 	if (get_user(stm.valid_bytes, (__u64 __user *)arg))
 		return -EFAULT;
 
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, SCOUTFS_LKF_REFRESH_INODE,
+				 inode, &lock);
+	if (ret)
+		return ret;
+
 	stm.valid_bytes = min_t(u64, stm.valid_bytes,
 				sizeof(struct scoutfs_ioctl_stat_more));
 	stm.meta_seq = scoutfs_inode_meta_seq(inode);
 	stm.data_seq = scoutfs_inode_data_seq(inode);
 	stm.data_version = scoutfs_inode_data_version(inode);
 	scoutfs_inode_get_onoff(inode, &stm.online_blocks, &stm.offline_blocks);
+	stm.data_extents = 0;
+	stm.data_extents_per_gb = 0;
+
+	/* writers that hold the inode lock in PR count in file deltas */
+	if (S_ISREG(inode->i_mode)) {
+		memset(&attrs, 0, sizeof(attrs));
+		ret = scoutfs_data_add_attrs_file_deltas(sb, scoutfs_ino(inode),
+							 &attrs);
+		if (ret)
+			goto out;
+		stm.data_version += attrs.data_version;
+		stm.online_blocks += attrs.online_blocks;
+	}
+
+	/* only read all the extents if the caller wants the counts */
+	if (stm.valid_bytes > offsetof(struct scoutfs_ioctl_stat_more,
+				       data_extents)) {
+		ret = scoutfs_data_count_extents(inode, &stm.data_extents,
+						 lock);
+		if (ret)
+			goto out;
+
+		gbs = DIV_ROUND_UP_ULL(stm.online_blocks,
+				       1ULL << (30 - SCOUTFS_BLOCK_SHIFT));
+		if (gbs)
+			stm.data_extents_per_gb = div64_u64(stm.data_extents +
+							    gbs - 1, gbs);
+	}
+out:
+	scoutfs_unlock(sb, lock, DLM_LOCK_PR);
+
+	if (ret == 0 &&
+	    copy_to_user((void __user *)arg, &stm, stm.valid_bytes))
+		ret = -EFAULT;
 
-	if (copy_to_user((void __user *)arg, &stm, stm.valid_bytes))
+	return ret;
+}
+
+/*
+ * See the comment above the definition of struct
+ * scoutfs_ioctl_readdir_plus.  Like stat, reading the attributes of a
+ * directory's entries requires search permission in the directory.
+ */
+static long scoutfs_ioc_readdir_plus(struct file *file, unsigned long arg)
+{
+	struct inode *inode = file_inode(file);
+	struct scoutfs_ioctl_readdir_plus rdp;
+	int ret;
+
+	if (copy_from_user(&rdp, (void __user *)arg, sizeof(rdp)))
 		return -EFAULT;
 
-	return 0;
+	if (!S_ISDIR(inode->i_mode))
+		return -ENOTDIR;
+
+	ret = inode_permission(inode, MAY_READ | MAY_EXEC);
+	if (ret)
+		return ret;
+
+	return scoutfs_dir_readdir_plus(inode, &rdp);
+}
+
+/*
+ * See the comment above the definition of struct
+ * scoutfs_ioctl_stat_bulk.  The caller's inode numbers are read in
+ * batches so that inodes in the same lock group in a batch share one
+ * lock acquisition.  Like open by handle, this needs
+ * CAP_DAC_READ_SEARCH because it bypasses path permission checks.
+ */
+static long scoutfs_ioc_stat_bulk(struct file *file, unsigned long arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct scoutfs_ioctl_inode_attrs __user *uattrs;
+	struct scoutfs_ioctl_inode_attrs *attrs = NULL;
+	struct scoutfs_ioctl_stat_bulk stb;
+	u64 __user *uinos;
+	u64 inos[64];
+	unsigned int nr;
+	int ret = 0;
+
+	if (!capable(CAP_DAC_READ_SEARCH))
+		return -EPERM;
+
+	if (copy_from_user(&stb, (void __user *)arg, sizeof(stb)))
+		return -EFAULT;
+
+	attrs = kmalloc(ARRAY_SIZE(inos) * sizeof(attrs[0]), GFP_KERNEL);
+	if (!attrs)
+		return -ENOMEM;
+
+	uinos = (void __user *)(unsigned long)stb.inos_ptr;
+	uattrs = (void __user *)(unsigned long)stb.attrs_ptr;
+
+	while (stb.nr) {
+		nr = min_t(u32, stb.nr, ARRAY_SIZE(inos));
+
+		if (copy_from_user(inos, uinos, nr * sizeof(inos[0]))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = scoutfs_inode_read_attrs(sb, inos, attrs, nr);
+		if (ret)
+			break;
+
+		if (copy_to_user(uattrs, attrs, nr * sizeof(attrs[0]))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		uinos += nr;
+		uattrs += nr;
+		stb.nr -= nr;
+	}
+
+	kfree(attrs);
+	return ret;
 }
 
 static long scoutfs_ioc_item_cache_keys(struct file *file, unsigned long arg)
@@ -540,11 +1343,312 @@ static long scoutfs_ioc_item_cache_keys(struct file *file, unsigned long arg)
 	return ret ?: total;
 }
 
+/*
+ * Copy the current staging requests to the caller.  See the comment
+ * above the definition of struct scoutfs_ioctl_data_waiting.
+ */
+static long scoutfs_ioc_data_waiting(struct file *file, unsigned long arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct scoutfs_ioctl_data_waiting_entry __user *udwe;
+	struct scoutfs_ioctl_data_waiting_entry dwe[16];
+	struct scoutfs_ioctl_data_waiting idw;
+	bool block;
+	int total;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&idw, (void __user *)arg, sizeof(idw)))
+		return -EFAULT;
+
+	if (idw.flags & SCOUTFS_IOC_DATA_WAITING_FLAGS_UNKNOWN)
+		return -EINVAL;
+
+	udwe = (void __user *)(unsigned long)idw.ents_ptr;
+	block = !!(idw.flags & SCOUTFS_IOC_DATA_WAITING_FLAGS_BLOCK);
+	total = 0;
+	ret = 0;
+	while (idw.ents_nr) {
+		ret = scoutfs_data_waiting(sb, idw.after_ino,
+					   idw.after_iblock, dwe,
+					   min_t(size_t, idw.ents_nr,
+						 ARRAY_SIZE(dwe)),
+					   block && total == 0);
+		if (ret <= 0)
+			break;
+
+		if (copy_to_user(udwe, dwe, ret * sizeof(dwe[0]))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		idw.after_ino = dwe[ret - 1].ino;
+		idw.after_iblock = dwe[ret - 1].iblock + 1;
+		if (idw.after_iblock == 0)
+			idw.after_ino++;
+
+		udwe += ret;
+		idw.ents_nr -= ret;
+		total += ret;
+		ret = 0;
+	}
+
+	return ret ?: total;
+}
+
+/*
+ * See the comment above the definition of struct
+ * scoutfs_ioctl_get_extents.  Copying to userspace while holding the
+ * lock is safe as in walk_inodes.
+ */
+static long scoutfs_ioc_get_extents(struct file *file, unsigned long arg)
+{
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct scoutfs_ioctl_extent __user *uexts;
+	struct scoutfs_ioctl_get_extents ige;
+	struct scoutfs_ioctl_extent exts[32];
+	struct scoutfs_lock *lock = NULL;
+	int total;
+	int ret;
+
+	if (copy_from_user(&ige, (void __user *)arg, sizeof(ige)))
+		return -EFAULT;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+
+	uexts = (void __user *)(unsigned long)ige.exts_ptr;
+
+	ret = scoutfs_lock_inode(sb, DLM_LOCK_PR, 0, inode, &lock);
+	if (ret)
+		return ret;
+
+	total = 0;
+	while (ige.exts_nr) {
+		ret = scoutfs_data_get_extents(inode, ige.block, exts,
+					       min_t(size_t, ige.exts_nr,
+						     ARRAY_SIZE(exts)), lock);
+		if (ret <= 0)
+			break;
+
+		if (copy_to_user(uexts, exts, ret * sizeof(exts[0]))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ige.block = exts[ret - 1].logical + exts[ret - 1].blocks;
+
+		uexts += ret;
+		ige.exts_nr -= ret;
+		total += ret;
+		ret = 0;
+	}
+
+	scoutfs_unlock(sb, lock, DLM_LOCK_PR);
+
+	return ret ?: total;
+}
+
+/*
+ * Clone a range of blocks from a source file into the destination file
+ * by sharing the source's blocks.
+ *
+ * Both inodes' i_mutex and cluster locks are held while cached pages in
+ * both ranges are written and dropped.  This ensures that the clone
+ * sees all the writes to the source and that neither file has cached
+ * pages that refer to blocks whose sharing changes.  The shared extent
+ * lock is acquired after the inode locks, as in all its users.
+ */
+static long clone_range(struct file *file, struct file *src_file,
+			u64 src_off, u64 len, u64 dst_off)
+{
+	struct inode *dst = file_inode(file);
+	struct inode *src = file_inode(src_file);
+	struct super_block *sb = dst->i_sb;
+	struct scoutfs_lock *shared_lock = NULL;
+	struct scoutfs_lock *data_lock = NULL;
+	struct scoutfs_lock *dst_lock = NULL;
+	struct scoutfs_lock *src_lock = NULL;
+	LIST_HEAD(ind_locks);
+	u64 src_size;
+	u64 count;
+	u64 end;
+	int ret;
+
+	if (src->i_sb != sb)
+		return -EXDEV;
+	if (src == dst)
+		return -EINVAL;
+	if (!S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode))
+		return -EINVAL;
+	if (!(src_file->f_mode & FMODE_READ) || !(file->f_mode & FMODE_WRITE) ||
+	    (file->f_flags & O_APPEND))
+		return -EBADF;
+	if ((src_off | dst_off) & SCOUTFS_BLOCK_MASK)
+		return -EINVAL;
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+
+	if (src < dst) {
+		mutex_lock(&src->i_mutex);
+		mutex_lock_nested(&dst->i_mutex, I_MUTEX_CHILD);
+	} else {
+		mutex_lock(&dst->i_mutex);
+		mutex_lock_nested(&src->i_mutex, I_MUTEX_CHILD);
+	}
+
+	ret = scoutfs_lock_inodes(sb, DLM_LOCK_EX, SCOUTFS_LKF_REFRESH_INODE,
+				  src, &src_lock, dst, &dst_lock, NULL, NULL,
+				  NULL, NULL) ?:
+	      scoutfs_data_fold_file_deltas(src, src_lock) ?:
+	      scoutfs_data_fold_file_deltas(dst, dst_lock) ?:
+	      scoutfs_lock_data_file(sb, DLM_LOCK_EX, 0, dst, &data_lock);
+	if (ret)
+		goto out;
+
+	/*
+	 * The length can only end in a partial block at the source eof.
+	 * The whole final block is shared so the cloned range must then
+	 * also extend to or past the dest eof, otherwise dest bytes
+	 * after the range in that block would be overwritten.
+	 */
+	src_size = i_size_read(src);
+	if (len == 0 && src_off < src_size)
+		len = src_size - src_off;
+	if (len == 0) {
+		ret = 0;
+		goto out;
+	}
+	end = src_off + len;
+	if (end < src_off || end > src_size ||
+	    dst_off + len < dst_off ||
+	    ((end & SCOUTFS_BLOCK_MASK) &&
+	     (end != src_size || dst_off + len < i_size_read(dst)))) {
+		ret = -EINVAL;
+		goto out;
+	}
+	count = (len + SCOUTFS_BLOCK_SIZE - 1) >> SCOUTFS_BLOCK_SHIFT;
+
+	/* blocks can only be shared once inline data is moved into them */
+	ret = scoutfs_complete_truncate(dst, dst_lock) ?:
+	      scoutfs_data_convert_inline(src, src_lock) ?:
+	      scoutfs_data_convert_inline(dst, dst_lock);
+	if (ret)
+		goto out;
+
+	inode_dio_wait(src);
+	inode_dio_wait(dst);
+
+	ret = filemap_write_and_wait_range(src->i_mapping, src_off,
+					   src_off + len - 1) ?:
+	      filemap_write_and_wait_range(dst->i_mapping, dst_off,
+					   dst_off + len - 1);
+	if (ret)
+		goto out;
+
+	/* cached pages in either range would refer to stale mappings */
+	unmap_mapping_range(src->i_mapping, src_off, len, 1);
+	truncate_inode_pages_range(src->i_mapping, src_off,
+				   src_off + len - 1);
+	unmap_mapping_range(dst->i_mapping, dst_off, len, 1);
+	truncate_inode_pages_range(dst->i_mapping, dst_off,
+				   dst_off + (count << SCOUTFS_BLOCK_SHIFT) - 1);
+
+	ret = scoutfs_data_truncate_items(sb, dst, scoutfs_ino(dst),
+					  dst_off >> SCOUTFS_BLOCK_SHIFT,
+					  (dst_off >> SCOUTFS_BLOCK_SHIFT) +
+					  count - 1, false, false, dst_lock);
+	if (ret)
+		goto out;
+
+	ret = scoutfs_lock_shared_extents(sb, DLM_LOCK_EX, 0, &shared_lock);
+	if (ret)
+		goto out;
+
+	ret = scoutfs_data_clone(src, dst, src_off >> SCOUTFS_BLOCK_SHIFT,
+				 dst_off >> SCOUTFS_BLOCK_SHIFT, count,
+				 src_lock, dst_lock, shared_lock);
+	if (ret)
+		goto out;
+
+	ret = scoutfs_inode_index_lock_hold(dst, &ind_locks, true,
+					    SIC_DIRTY_INODE());
+	if (ret)
+		goto out;
+
+	ret = scoutfs_dirty_inode_item(dst, dst_lock);
+	if (ret == 0) {
+		if (dst_off + len > i_size_read(dst))
+			i_size_write(dst, dst_off + len);
+		dst->i_mtime = dst->i_ctime = CURRENT_TIME;
+		scoutfs_inode_set_data_seq(dst);
+		scoutfs_inode_inc_data_version(dst);
+		scoutfs_update_inode_item(dst, dst_lock, &ind_locks);
+	}
+	scoutfs_release_trans(sb);
+	scoutfs_inode_index_unlock(sb, &ind_locks);
+out:
+	scoutfs_unlock(sb, shared_lock, DLM_LOCK_EX);
+	scoutfs_unlock(sb, data_lock, DLM_LOCK_EX);
+	scoutfs_unlock(sb, dst_lock, DLM_LOCK_EX);
+	scoutfs_unlock(sb, src_lock, DLM_LOCK_EX);
+	mutex_unlock(&src->i_mutex);
+	mutex_unlock(&dst->i_mutex);
+	mnt_drop_write_file(file);
+
+	return ret;
+}
+
+static long scoutfs_ioc_clone_range(struct file *file, unsigned long arg)
+{
+	struct scoutfs_ioctl_clone_range args;
+	struct file *src_file;
+	long ret;
+
+	if (copy_from_user(&args, (void __user *)arg, sizeof(args)))
+		return -EFAULT;
+
+	if (args.src_fd < 0 || args.src_fd > INT_MAX)
+		return -EBADF;
+
+	src_file = fget(args.src_fd);
+	if (!src_file)
+		return -EBADF;
+
+	ret = clone_range(file, src_file, args.src_offset, args.src_length,
+			  args.dest_offset);
+	fput(src_file);
+	return ret;
+}
+
+#ifdef FICLONE
+static long scoutfs_ioc_clone_file(struct file *file, unsigned long arg)
+{
+	struct file *src_file;
+	long ret;
+
+	src_file = fget(arg);
+	if (!src_file)
+		return -EBADF;
+
+	ret = clone_range(file, src_file, 0, 0, 0);
+	fput(src_file);
+	return ret;
+}
+#endif
+
 long scoutfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	switch (cmd) {
 	case SCOUTFS_IOC_WALK_INODES:
 		return scoutfs_ioc_walk_inodes(file, arg);
+	case SCOUTFS_IOC_WALK_INODES_ATTRS:
+		return scoutfs_ioc_walk_inodes_attrs(file, arg);
 	case SCOUTFS_IOC_INO_PATH:
 		return scoutfs_ioc_ino_path(file, arg);
 	case SCOUTFS_IOC_RELEASE:
@@ -555,6 +1659,31 @@ long scoutfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return scoutfs_ioc_stat_more(file, arg);
 	case SCOUTFS_IOC_ITEM_CACHE_KEYS:
 		return scoutfs_ioc_item_cache_keys(file, arg);
+	case SCOUTFS_IOC_STAGE_VEC:
+		return scoutfs_ioc_stage_vec(file, arg);
+	case SCOUTFS_IOC_RELEASE_VEC:
+		return scoutfs_ioc_release_vec(file, arg);
+	case SCOUTFS_IOC_DATA_WAITING:
+		return scoutfs_ioc_data_waiting(file, arg);
+	case SCOUTFS_IOC_GET_EXTENTS:
+		return scoutfs_ioc_get_extents(file, arg);
+	case SCOUTFS_IOC_CLONE_RANGE:
+		return scoutfs_ioc_clone_range(file, arg);
+	case SCOUTFS_IOC_READDIR_PLUS:
+		return scoutfs_ioc_readdir_plus(file, arg);
+	case SCOUTFS_IOC_STAT_BULK:
+		return scoutfs_ioc_stat_bulk(file, arg);
+	case SCOUTFS_IOC_FIND_XATTR_INODES:
+		return scoutfs_ioc_find_xattr_inodes(file, arg);
+#ifdef FICLONERANGE
+	/* struct file_clone_range matches our clone_range args */
+	case FICLONERANGE:
+		return scoutfs_ioc_clone_range(file, arg);
+#endif
+#ifdef FICLONE
+	case FICLONE:
+		return scoutfs_ioc_clone_file(file, arg);
+#endif
 	}
 
 	return -ENOTTY;
@@ -40,6 +40,21 @@ struct scoutfs_ioctl_walk_inodes_entry {
  *
  * If first is greater than last then the walk will return 0 entries.
  *
+ * The size, online and offline block indexes only contain regular
+ * files.  The mtime and atime index majors are coarse buckets of
+ * seconds, the seconds shifted right by 16.  An inode's entry only moves
+ * when its time moves to a new bucket.  Directories' entries in the
+ * mtime index are only updated as creates' dir deltas are folded into
+ * the dir inode.  Reads don't update the inode so atime is only indexed
+ * as other changes to the inode are written.
+ *
+ * Walking the size, time, block count, uid, or gid index is expensive
+ * in a cluster.  Each of these indexes is covered by a single lock that
+ * every mount's inode updates hold.  A walk revokes those locks, which
+ * makes every mount commit its transaction, and updates on all mounts
+ * wait for the walk to release its lock.  Updates only hold the time
+ * index locks when they could move an inode to a new bucket.
+ *
  * XXX invalidate before reading.
  */
 struct scoutfs_ioctl_walk_inodes {
@@ -53,6 +68,14 @@ struct scoutfs_ioctl_walk_inodes {
 enum {
 	SCOUTFS_IOC_WALK_INODES_META_SEQ = 0,
 	SCOUTFS_IOC_WALK_INODES_DATA_SEQ,
+	SCOUTFS_IOC_WALK_INODES_SIZE,
+	SCOUTFS_IOC_WALK_INODES_MTIME,
+	SCOUTFS_IOC_WALK_INODES_ATIME,
+	SCOUTFS_IOC_WALK_INODES_ONLINE_BLOCKS,
+	SCOUTFS_IOC_WALK_INODES_OFFLINE_BLOCKS,
+	SCOUTFS_IOC_WALK_INODES_UID,
+	SCOUTFS_IOC_WALK_INODES_GID,
+	SCOUTFS_IOC_WALK_INODES_XATTR,
 	SCOUTFS_IOC_WALK_INODES_UNKNOWN,
 };
 
@@ -195,6 +218,13 @@ struct scoutfs_ioctl_stage {
  * kernel set on return.
  *
  * New fields are only added to the end of the struct.
+ *
+ * @data_extents is the number of physically contiguous runs of blocks
+ * that store the file's data and @data_extents_per_gb divides it by
+ * the file's online data rounded up to whole GBs.  They're a measure of
+ * the file's fragmentation.  They're only counted if the caller's
+ * valid_bytes includes them because that requires reading all of the
+ * file's extents.
  */
 struct scoutfs_ioctl_stat_more {
 	__u64 valid_bytes;
@@ -203,6 +233,8 @@ struct scoutfs_ioctl_stat_more {
 	__u64 data_version;
 	__u64 online_blocks;
 	__u64 offline_blocks;
+	__u64 data_extents;
+	__u64 data_extents_per_gb;
 } __packed;
 
 #define SCOUTFS_IOC_STAT_MORE _IOW(SCOUTFS_IOCTL_MAGIC, 7, \
@@ -229,4 +261,304 @@ enum {
 #define SCOUTFS_IOC_ITEM_CACHE_KEYS _IOW(SCOUTFS_IOCTL_MAGIC, 8, \
 					 struct scoutfs_ioctl_item_cache_keys)
 
+/*
+ * Stage many ranges of a file with one call.  This is the staging
+ * interface for bulk recall: the lock, data_version check, and
+ * allocation are done once for all the ranges.
+ *
+ * The file's offline blocks in all the ranges are first allocated as
+ * large unwritten extents.  Then each range is written from either the
+ * user buffer at @src or, if @src_fd isn't negative, from the byte
+ * offset @src in the source file.  Source files are read through their
+ * page cache without copying through user space.  The source file
+ * can't be in a scoutfs file system.
+ *
+ * Writeback of each range is started as it's staged and the call
+ * returns without waiting for it unless _SYNC is set.
+ *
+ * Each range has the same constraints as _STAGE: it must start on a
+ * block boundary and end on a block boundary or at i_size.  All the
+ * ranges are checked before any are staged.  A call can stage at most
+ * _MAX_RANGES ranges.
+ *
+ * Each range's result is set to the number of bytes staged or a
+ * negative errno.  The call returns the number of ranges that were
+ * fully staged.  Staging stops at the first range that fails.
+ */
+struct scoutfs_ioctl_stage_range {
+	__u64 offset;
+	__u64 count;
+	__u64 src;
+	__s64 result;
+} __packed;
+
+struct scoutfs_ioctl_stage_vec {
+	__u64 data_version;
+	__u64 ranges_ptr;
+	__u32 nr_ranges;
+	__s32 src_fd;
+	__u64 flags;
+} __packed;
+
+#define SCOUTFS_IOC_STAGE_VEC_SYNC	(1ULL << 0)
+#define SCOUTFS_IOC_STAGE_VEC_UNKNOWN	(~0ULL << 1)
+
+#define SCOUTFS_IOC_STAGE_VEC_MAX_RANGES 256
+
+#define SCOUTFS_IOC_STAGE_VEC _IOW(SCOUTFS_IOCTL_MAGIC, 9, \
+				   struct scoutfs_ioctl_stage_vec)
+
+/*
+ * Release blocks in many files with one call.  Each entry has the same
+ * semantics as _RELEASE but identifies its file by inode number.
+ * Entries are processed in order and entries with nearby inode numbers
+ * share cluster locks so callers should sort them by inode number.
+ *
+ * Each entry's result is set to 0 or a negative errno.  The call
+ * returns the number of entries that were released.  Failed entries
+ * don't stop the following entries from being released.
+ *
+ * This requires CAP_SYS_ADMIN and can be called on any file in the
+ * file system.
+ */
+struct scoutfs_ioctl_release_entry {
+	__u64 ino;
+	__u64 data_version;
+	__u64 block;
+	__u64 count;
+	__s64 result;
+} __packed;
+
+struct scoutfs_ioctl_release_vec {
+	__u64 entries_ptr;
+	__u32 nr_entries;
+} __packed;
+
+#define SCOUTFS_IOC_RELEASE_VEC _IOW(SCOUTFS_IOCTL_MAGIC, 10, \
+				     struct scoutfs_ioctl_release_vec)
+
+/*
+ * Reads of offline blocks wait for the blocks to be staged.  This lists
+ * the ranges of offline blocks that readers are waiting for so that an
+ * archive agent knows what to stage.  Readers of overlapping or
+ * adjacent ranges in a file share one entry.
+ *
+ * Entries are returned in order of inode number and block, starting
+ * with the first at or after @after_ino and @after_iblock.  Callers
+ * iterate by setting the cursor past the last entry they received.
+ * With _BLOCK set the call waits for an entry if there are none.
+ *
+ * Returns the number of entries filled.  Entries only describe the
+ * waiters on this node.
+ */
+struct scoutfs_ioctl_data_waiting_entry {
+	__u64 ino;
+	__u64 iblock;
+	__u64 count;
+	__u32 nr_waiters;
+} __packed;
+
+struct scoutfs_ioctl_data_waiting {
+	__u64 after_ino;
+	__u64 after_iblock;
+	__u64 ents_ptr;
+	__u16 ents_nr;
+	__u8 flags;
+} __packed;
+
+#define SCOUTFS_IOC_DATA_WAITING_FLAGS_BLOCK	(1 << 0)
+#define SCOUTFS_IOC_DATA_WAITING_FLAGS_UNKNOWN	(0xff << 1)
+
+#define SCOUTFS_IOC_DATA_WAITING _IOW(SCOUTFS_IOCTL_MAGIC, 11, \
+				      struct scoutfs_ioctl_data_waiting)
+
+/*
+ * Copy many of a file's extents to the caller in one call.  Extents
+ * are returned in logical order starting with the first extent that
+ * ends after @block.  All units are 4KB blocks.  Sparse regions don't
+ * have extents.  Offline extents have a physical block of 0 unless
+ * they've been allocated for staging.
+ *
+ * Callers iterate by setting @block to the end of the last extent they
+ * received.  Returns the number of extents copied, 0 when there are no
+ * more extents.
+ */
+struct scoutfs_ioctl_extent {
+	__u64 logical;
+	__u64 physical;
+	__u64 blocks;
+	__u8 flags;
+} __packed;
+
+#define SCOUTFS_IOC_EXTENT_OFFLINE	(1 << 0)
+#define SCOUTFS_IOC_EXTENT_UNWRITTEN	(1 << 1)
+#define SCOUTFS_IOC_EXTENT_SHARED	(1 << 2)
+
+struct scoutfs_ioctl_get_extents {
+	__u64 block;
+	__u64 exts_ptr;
+	__u32 exts_nr;
+} __packed;
+
+#define SCOUTFS_IOC_GET_EXTENTS _IOW(SCOUTFS_IOCTL_MAGIC, 12, \
+				     struct scoutfs_ioctl_get_extents)
+
+/*
+ * Clone a range of a source file into the file the ioctl is called on
+ * by sharing the source's blocks instead of copying them.  Shared
+ * blocks are copied as they're written in either file.  The source is
+ * given by @src_fd and must be a regular file in the same scoutfs
+ * mount.
+ *
+ * Offsets and the length must be 4KB block aligned.  A length of 0
+ * clones to the end of the source file and a length that reaches the
+ * end of the source file may end in a partial block, but only if the
+ * cloned range also reaches the end of the destination file.
+ * Existing data in the destination range is replaced and the
+ * destination grows to cover the end of the cloned range.
+ */
+struct scoutfs_ioctl_clone_range {
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 src_length;
+	__u64 dest_offset;
+} __packed;
+
+#define SCOUTFS_IOC_CLONE_RANGE _IOW(SCOUTFS_IOCTL_MAGIC, 13, \
+				     struct scoutfs_ioctl_clone_range)
+
+/*
+ * The attributes of an inode returned by the bulk ioctls.  They include
+ * the fields that stat returns along with the fields from stat_more.
+ * Inodes that don't exist are returned with a @mode of 0.
+ */
+struct scoutfs_ioctl_inode_attrs {
+	__u64 size;
+	__u64 meta_seq;
+	__u64 data_seq;
+	__u64 data_version;
+	__u64 online_blocks;
+	__u64 offline_blocks;
+	__u64 atime_sec;
+	__u64 mtime_sec;
+	__u64 ctime_sec;
+	__u32 atime_nsec;
+	__u32 mtime_nsec;
+	__u32 ctime_nsec;
+	__u32 nlink;
+	__u32 uid;
+	__u32 gid;
+	__u32 mode;
+	__u32 rdev;
+} __packed;
+
+/*
+ * Read a directory's entries along with the attributes of the inodes
+ * they reference.  This saves callers from having to stat each entry
+ * after reading it with readdir.  The ioctl is called on the directory.
+ *
+ * Entries are returned in order of their readdir position starting with
+ * the first at or after @pos.  Callers iterate by setting @pos past the
+ * last entry they received.  Returns the number of entries copied, 0
+ * when there are no more entries.
+ *
+ * Each entry in the buffer is followed by its name, which isn't null
+ * terminated, and padding to an 8 byte boundary.  @entry_bytes gives
+ * the offset of the next entry.  The buffer must be large enough to
+ * hold an entry with a 255 byte name.
+ *
+ * The attributes are those of the inode at the time it was read, it
+ * can have been modified or the entry removed by the time the call
+ * returns.  Entries whose inodes are removed while the call is reading
+ * them aren't returned.
+ */
+struct scoutfs_ioctl_readdir_plus_entry {
+	__u64 ino;
+	__u64 pos;
+	struct scoutfs_ioctl_inode_attrs attrs;
+	__u16 entry_bytes;
+	__u8 name_len;
+	__u8 name[0];
+} __packed;
+
+struct scoutfs_ioctl_readdir_plus {
+	__u64 pos;
+	__u64 buf_ptr;
+	__u32 buf_bytes;
+} __packed;
+
+#define SCOUTFS_IOC_READDIR_PLUS _IOW(SCOUTFS_IOCTL_MAGIC, 14, \
+				      struct scoutfs_ioctl_readdir_plus)
+
+/*
+ * Get the attributes of many inodes by their inode numbers.  The
+ * attributes of the inode at @inos_ptr[i] are stored in
+ * @attrs_ptr[i].  Inodes that don't exist have a mode of 0.  Returns 0
+ * once all @nr attributes have been copied.
+ *
+ * The attributes are read under the cluster locks that cover groups of
+ * inode numbers so callers get the best performance by passing inode
+ * numbers that are near each other, as returned by walk_inodes.
+ */
+struct scoutfs_ioctl_stat_bulk {
+	__u64 inos_ptr;
+	__u64 attrs_ptr;
+	__u32 nr;
+} __packed;
+
+#define SCOUTFS_IOC_STAT_BULK _IOW(SCOUTFS_IOCTL_MAGIC, 15, \
+				   struct scoutfs_ioctl_stat_bulk)
+
+/*
+ * Walk an inode index like _WALK_INODES but return the attributes of
+ * each entry's inode along with the entry.  @entries_ptr points to an
+ * array of struct scoutfs_ioctl_walk_inodes_attrs_entry.
+ *
+ * The attributes are read after the index entries so they can be newer
+ * than the index entry that found the inode.  Inodes that were removed
+ * after their entry was read have a mode of 0.
+ */
+struct scoutfs_ioctl_walk_inodes_attrs_entry {
+	__u64 major;
+	__u32 minor;
+	__u64 ino;
+	struct scoutfs_ioctl_inode_attrs attrs;
+} __packed;
+
+#define SCOUTFS_IOC_WALK_INODES_ATTRS _IOW(SCOUTFS_IOCTL_MAGIC, 16, \
+					   struct scoutfs_ioctl_walk_inodes)
+
+/*
+ * Find the inodes that have an indexed xattr with the given name and
+ * value.  Indexed xattrs have names that start with "scoutfs.index."
+ * and values of at most 128 bytes.  @name_ptr points to the full name,
+ * including the prefix, and neither the name nor value are null
+ * terminated.
+ *
+ * Inode numbers are copied to the array at @inos_ptr in sorted order
+ * starting with @first_ino.  Callers iterate by setting @first_ino past
+ * the last inode number they received.  Returns the number of inode
+ * numbers copied, 0 when there are no more.
+ *
+ * The index is searched by the hash of the name and value so inodes
+ * can be returned whose xattrs don't match.  Callers check the xattrs
+ * of the returned inodes.
+ *
+ * The index items can also be walked with _WALK_INODES_XATTR.  Their
+ * major values are the crc32c, seeded with ~0, of the full name in the
+ * high 32 bits and of the value in the low 32 bits.
+ */
+struct scoutfs_ioctl_find_xattr_inodes {
+	__u64 name_ptr;
+	__u64 value_ptr;
+	__u64 first_ino;
+	__u64 inos_ptr;
+	__u32 nr_inos;
+	__u16 name_bytes;
+	__u16 value_bytes;
+} __packed;
+
+#define SCOUTFS_IOC_FIND_XATTR_INODES _IOW(SCOUTFS_IOCTL_MAGIC, 17, \
+					   struct scoutfs_ioctl_find_xattr_inodes)
+
 #endif
@@ -88,20 +88,10 @@ struct lock_info {
 static void scoutfs_lock_work(struct work_struct *work);
 static void scoutfs_lock_grace_work(struct work_struct *work);
 
-/*
- * invalidate cached data associated with an inode whose lock is going
- * away.
- */
-static void invalidate_inode(struct super_block *sb, u64 ino)
+/* only PR and EX modes read items to populate the cache. */
+static bool lock_mode_can_read(int mode)
 {
-	struct inode *inode;
-
-	inode = scoutfs_ilookup(sb, ino);
-	if (inode) {
-		if (S_ISREG(inode->i_mode))
-			truncate_inode_pages(inode->i_mapping, 0);
-		iput(inode);
-	}
+	return mode == DLM_LOCK_PR || mode == DLM_LOCK_EX;
 }
 
 /*
@@ -115,7 +105,6 @@ static int lock_invalidate(struct super_block *sb, struct scoutfs_lock *lock,
 	struct scoutfs_key *end = &lock->end;
 	struct scoutfs_lock_coverage *cov;
 	struct scoutfs_lock_coverage *tmp;
-	u64 ino, last;
 	int ret;
 
 	/* any transition from a mode allowed to dirty items has to write */
@@ -148,15 +137,6 @@ retry:
 		}
 		spin_unlock(&lock->cov_list_lock);
 
-		if (lock->name.zone == SCOUTFS_FS_ZONE) {
-			ino = le64_to_cpu(lock->name.first);
-			last = ino + SCOUTFS_LOCK_INODE_GROUP_NR - 1;
-			while (ino <= last) {
-				invalidate_inode(sb, ino);
-				ino++;
-			}
-		}
-
 		ret = scoutfs_item_invalidate(sb, start, end);
 		if (ret > 0) {
 			scoutfs_add_counter(sb, lock_invalidate_clean_item,
@@ -168,6 +148,65 @@ retry:
 	return ret;
 }
 
+/*
+ * Invalidate the page cache covered by a data lock.  Pages dirtied
+ * under the lock have to be written before another node can read their
+ * blocks.  Their allocations and extent items are written by the
+ * transaction so we commit rather than only writing the pages.  Only
+ * the pages in the lock's region are dropped if we can no longer read,
+ * the whole file lock drops all the file's pages.  The size that local
+ * writers grew the file to under the whole file lock is forgotten with
+ * the pages, readers will sum the file's deltas again.
+ */
+static int lock_invalidate_data(struct super_block *sb,
+				struct scoutfs_lock *lock, int prev, int mode)
+{
+	u64 ino = le64_to_cpu(lock->name.first);
+	u64 region = le64_to_cpu(lock->name.second);
+	struct address_space *mapping;
+	struct inode *inode;
+	loff_t start;
+	loff_t end;
+	int ret = 0;
+
+	inode = scoutfs_ilookup(sb, ino);
+	if (!inode)
+		return 0;
+	mapping = inode->i_mapping;
+
+	if (region == SCOUTFS_LOCK_DATA_FILE) {
+		start = 0;
+		end = LLONG_MAX;
+	} else {
+		start = (region << SCOUTFS_LOCK_DATA_REGION_SHIFT) <<
+			SCOUTFS_BLOCK_SHIFT;
+		end = start + (SCOUTFS_LOCK_DATA_REGION_NR <<
+			       SCOUTFS_BLOCK_SHIFT) - 1;
+	}
+
+	if ((prev == DLM_LOCK_EX || !lock_mode_can_read(mode)) &&
+	    (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY) ||
+	     mapping_tagged(mapping, PAGECACHE_TAG_WRITEBACK))) {
+		scoutfs_inc_counter(sb, lock_write_dirty_data);
+		ret = scoutfs_trans_sync(sb, 1);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (lock_mode_can_read(prev) && !lock_mode_can_read(mode) &&
+	    mapping->nrpages) {
+		scoutfs_inc_counter(sb, lock_invalidate_data_pages);
+		truncate_inode_pages_range(mapping, start, end);
+	}
+
+	if (region == SCOUTFS_LOCK_DATA_FILE &&
+	    lock_mode_can_read(prev) && !lock_mode_can_read(mode))
+		SCOUTFS_I(inode)->file_delta_isize = 0;
+out:
+	iput(inode);
+	return ret;
+}
+
 static void lock_free(struct lock_info *linfo, struct scoutfs_lock *lock)
 {
 	struct super_block *sb = lock->sb;
@@ -231,6 +270,7 @@ static struct scoutfs_lock *lock_alloc(struct super_block *sb,
 	lock->bast_mode = DLM_LOCK_IV;
 	lock->work_prev_mode = DLM_LOCK_IV;
 	lock->work_mode = DLM_LOCK_IV;
+	atomic_set(&lock->delayed_pins, 0);
 
 	scoutfs_tseq_add(&linfo->tseq_tree, &lock->tseq_entry);
 	trace_scoutfs_lock_alloc(sb, lock);
@@ -250,12 +290,6 @@ static void lock_dec_count(unsigned int *counts, int mode)
 	counts[mode]--;
 }
 
-/* only PR and EX modes read items to populate the cache. */
-static bool lock_mode_can_read(int mode)
-{
-	return mode == DLM_LOCK_PR || mode == DLM_LOCK_EX;
-}
-
 /*
  * Returns true if a given user mode can be satisfied by a lock with the
  * given granted mode.  This is directional.  A PR user is satisfied by
@@ -547,6 +581,12 @@ static void scoutfs_lock_ast(void *arg)
 			lock->refresh_gen =
 				atomic64_inc_return(&linfo->next_refresh_gen);
 		}
+		/* no other mount can write while write_gen is unchanged */
+		if (lock->work_mode == DLM_LOCK_EX &&
+		    lock->work_prev_mode != DLM_LOCK_EX) {
+			lock->write_gen =
+				atomic64_inc_return(&linfo->next_refresh_gen);
+		}
 		lock->granted_mode = lock->work_mode;
 
 	} else if (status == -DLM_EUNLOCK) {
@@ -625,6 +665,7 @@ static void scoutfs_lock_bast(void *arg, int blocked_mode)
 	struct scoutfs_lock *lock = arg;
 	struct super_block *sb = lock->sb;
 	DECLARE_LOCK_INFO(sb, linfo);
+	bool commit;
 	int bast_mode;
 
 	scoutfs_inc_counter(sb, lock_bast);
@@ -642,10 +683,16 @@ static void scoutfs_lock_bast(void *arg, int blocked_mode)
 	    lock_mode_valid_and_greater(lock->bast_mode, bast_mode))
 		lock->bast_mode = bast_mode;
 
+	/* delayed allocation holds EX users until a commit writes it */
+	commit = atomic_read(&lock->delayed_pins) > 0;
+
 	trace_scoutfs_lock_bast(sb, lock);
 	lock_process(linfo, lock);
 
 	spin_unlock(&linfo->lock);
+
+	if (commit)
+		scoutfs_trans_sync(sb, 0);
 }
 
 /*
@@ -678,6 +725,11 @@ static void scoutfs_lock_work(struct work_struct *work)
 
 	spin_unlock(&linfo->lock);
 
+	/* region locks write and drop pages before their extent items */
+	if (lock->name.scope == SCOUTFS_LOCK_SCOPE_FILE_DATA) {
+		ret = lock_invalidate_data(sb, lock, prev, mode);
+		BUG_ON(ret);
+	}
 	if (!RB_EMPTY_NODE(&lock->range_node)) {
 		ret = lock_invalidate(sb, lock, prev, mode);
 		BUG_ON(ret);
@@ -1042,7 +1094,17 @@ int scoutfs_lock_global(struct super_block *sb, int mode, int flags, int type,
  * contention and hold times by locking a small number of items.
  *
  * The seq indexes have natural batching and limits on the number of
- * keys per major value.
+ * keys per major value.  Indexed xattrs' hashes are grouped the same
+ * way.
+ *
+ * The new values of the other indexes can't be predicted before the
+ * transaction that changes them so each index type is covered by a
+ * single lock.  Writers only ever hold CW which doesn't conflict
+ * between mounts.  A walk's PR revokes the CW locks on every mount,
+ * forcing them to commit, and blocks all their inode updates until the
+ * walk unlocks.  Walks of these indexes are meant to be occasional
+ * policy scans.  The time indexes are bucketed so updates only hold
+ * their locks when an inode's time could move to a new bucket.
  *
  * This can also be used to find items that are covered by the same lock
  * because their starting keys are the same.
@@ -1054,8 +1116,14 @@ void scoutfs_lock_get_index_item_range(u8 type, u64 major, u64 ino,
 	u64 start_major = major & ~SCOUTFS_LOCK_SEQ_GROUP_MASK;
 	u64 end_major = major | SCOUTFS_LOCK_SEQ_GROUP_MASK;
 
-	BUG_ON(type != SCOUTFS_INODE_INDEX_META_SEQ_TYPE &&
-	       type != SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE);
+	BUG_ON(type == 0 || type >= SCOUTFS_INODE_INDEX_NR);
+
+	if (type != SCOUTFS_INODE_INDEX_META_SEQ_TYPE &&
+	    type != SCOUTFS_INODE_INDEX_DATA_SEQ_TYPE &&
+	    type != SCOUTFS_INODE_INDEX_XATTR_TYPE) {
+		start_major = 0;
+		end_major = U64_MAX;
+	}
 
 	if (start)
 		scoutfs_inode_init_index_key(start, type, start_major, 0, 0);
@@ -1129,6 +1197,199 @@ int scoutfs_lock_node_id(struct super_block *sb, int mode, int flags,
 	return lock_name_keys(sb, mode, flags, &name, &start, &end, lock);
 }
 
+/*
+ * The shared extent lock covers all the reference count items for
+ * blocks that are shared by cloned files.  It's only acquired by
+ * cloning and by applying nodes' pending releases, which are both
+ * batched, so a single lock for the whole zone is good enough for now.
+ */
+int scoutfs_lock_shared_extents(struct super_block *sb, int mode, int flags,
+				struct scoutfs_lock **lock)
+{
+	struct scoutfs_lock_name name;
+	struct scoutfs_key start;
+	struct scoutfs_key end;
+
+	name.scope = SCOUTFS_LOCK_SCOPE_FS_ITEMS;
+	name.zone = SCOUTFS_SHARED_EXTENT_ZONE;
+	name.type = 0;
+	name.first = 0;
+	name.second = 0;
+
+	scoutfs_key_set_zeros(&start);
+	start.sk_zone = SCOUTFS_SHARED_EXTENT_ZONE;
+	scoutfs_key_set_ones(&end);
+	end.sk_zone = SCOUTFS_SHARED_EXTENT_ZONE;
+
+	return lock_name_keys(sb, mode, flags, &name, &start, &end, lock);
+}
+
+static int lock_data(struct super_block *sb, int mode, int flags, u64 ino,
+		     u64 region, struct scoutfs_lock **lock)
+{
+	struct scoutfs_lock_name name;
+	struct scoutfs_key start;
+	struct scoutfs_key end;
+	u64 first;
+
+	name.scope = SCOUTFS_LOCK_SCOPE_FILE_DATA;
+	name.zone = SCOUTFS_FILE_DATA_ZONE;
+	name.type = SCOUTFS_FILE_EXTENT_TYPE;
+	name.first = cpu_to_le64(ino);
+	name.second = cpu_to_le64(region);
+
+	if (region == SCOUTFS_LOCK_DATA_FILE)
+		return lock_name_keys(sb, mode, flags, &name, NULL, NULL,
+				      lock);
+
+	first = region << SCOUTFS_LOCK_DATA_REGION_SHIFT;
+
+	scoutfs_key_set_zeros(&start);
+	start.sk_zone = SCOUTFS_FILE_DATA_ZONE;
+	start.skfe_ino = cpu_to_le64(ino);
+	start.sk_type = SCOUTFS_FILE_EXTENT_TYPE;
+	start.skfe_last = cpu_to_le64(first);
+
+	end = start;
+	end.skfe_last = cpu_to_le64(first + SCOUTFS_LOCK_DATA_REGION_NR - 1);
+
+	return lock_name_keys(sb, mode, flags, &name, &start, &end, lock);
+}
+
+/*
+ * The data locks protect a file's cached pages.  Region locks also
+ * cover the file extent items in their region, extents never cross
+ * region boundaries.  The rest of the file's items are protected by
+ * its inode lock.  They're acquired after the inode lock and the file
+ * delta lock and before holding a transaction.
+ *
+ * Page cache readers and writers use the whole file lock in PR and
+ * then a region lock in the mode they need.  Writers only need the
+ * inode lock in PR, they record their changes to the inode in delta
+ * items.  Operations that change file contents without going through
+ * the page cache, like truncate, use the whole file lock in EX which
+ * invalidates all the file's pages on other nodes, and then lock each
+ * region whose extents they modify.
+ */
+int scoutfs_lock_data_file(struct super_block *sb, int mode, int flags,
+			   struct inode *inode, struct scoutfs_lock **lock)
+{
+	return lock_data(sb, mode, flags, scoutfs_ino(inode),
+			 SCOUTFS_LOCK_DATA_FILE, lock);
+}
+
+int scoutfs_lock_data_region(struct super_block *sb, int mode, int flags,
+			     u64 ino, u64 iblock, struct scoutfs_lock **lock)
+{
+	return lock_data(sb, mode, flags, ino,
+			 iblock >> SCOUTFS_LOCK_DATA_REGION_SHIFT, lock);
+}
+
+/*
+ * Writers that only hold a file's inode lock in PR record their
+ * changes to its size and block counts in delta items which are
+ * covered by this lock.  Writers hold it in CW, it's used in PR to sum
+ * the deltas and EX to fold them into the inode.
+ */
+int scoutfs_lock_file_deltas(struct super_block *sb, int mode, int flags,
+			     u64 ino, struct scoutfs_lock **lock)
+{
+	struct scoutfs_lock_name name;
+	struct scoutfs_key start;
+	struct scoutfs_key end;
+
+	name.scope = SCOUTFS_LOCK_SCOPE_FS_ITEMS;
+	name.zone = SCOUTFS_FILE_DATA_ZONE;
+	name.type = SCOUTFS_FILE_DELTA_TYPE;
+	name.first = cpu_to_le64(ino);
+	name.second = 0;
+
+	start = (struct scoutfs_key) {
+		.sk_zone = SCOUTFS_FILE_DATA_ZONE,
+		.skfd_ino = cpu_to_le64(ino),
+		.sk_type = SCOUTFS_FILE_DELTA_TYPE,
+	};
+
+	end = start;
+	end.skfd_seq = cpu_to_le64(U64_MAX);
+	end.skfd_node_id = cpu_to_le64(U64_MAX);
+
+	return lock_name_keys(sb, mode, flags, &name, &start, &end, lock);
+}
+
+static int lock_dirent_keys(struct super_block *sb, int mode, int flags,
+			    u64 dir_ino, u8 type, u64 group, u64 first,
+			    u64 last, struct scoutfs_lock **lock)
+{
+	struct scoutfs_lock_name name;
+	struct scoutfs_key start;
+	struct scoutfs_key end;
+
+	name.scope = SCOUTFS_LOCK_SCOPE_FS_ITEMS;
+	name.zone = SCOUTFS_DIRENT_ZONE;
+	name.type = type;
+	name.first = cpu_to_le64(dir_ino);
+	name.second = cpu_to_le64(group);
+
+	start = (struct scoutfs_key) {
+		.sk_zone = SCOUTFS_DIRENT_ZONE,
+		.skd_ino = cpu_to_le64(dir_ino),
+		.sk_type = type,
+		.skd_major = cpu_to_le64(first),
+		.skd_minor = 0,
+	};
+
+	end = (struct scoutfs_key) {
+		.sk_zone = SCOUTFS_DIRENT_ZONE,
+		.skd_ino = cpu_to_le64(dir_ino),
+		.sk_type = type,
+		.skd_major = cpu_to_le64(last),
+		.skd_minor = cpu_to_le64(U64_MAX),
+	};
+
+	return lock_name_keys(sb, mode, flags, &name, &start, &end, lock);
+}
+
+/*
+ * A directory's entry items aren't covered by its inode lock.  The name
+ * hash items are locked in groups of hash values and the readdir items
+ * in groups of positions so that mounts creating entries in the same
+ * directory don't all contend on one lock.  The dir's pending attribute
+ * delta items are covered by their own lock that creates hold in CW.
+ *
+ * These are acquired after inode locks in the order deltas, hash,
+ * then pos.
+ */
+int scoutfs_lock_dirent_hash(struct super_block *sb, int mode, int flags,
+			     u64 dir_ino, u64 hash, struct scoutfs_lock **lock)
+{
+	u64 group = hash >> SCOUTFS_LOCK_DIRENT_HASH_SHIFT;
+	u64 first = group << SCOUTFS_LOCK_DIRENT_HASH_SHIFT;
+
+	return lock_dirent_keys(sb, mode, flags, dir_ino, SCOUTFS_DIRENT_TYPE,
+				group, first, first |
+				((1ULL << SCOUTFS_LOCK_DIRENT_HASH_SHIFT) - 1),
+				lock);
+}
+
+int scoutfs_lock_readdir_pos(struct super_block *sb, int mode, int flags,
+			     u64 dir_ino, u64 pos, struct scoutfs_lock **lock)
+{
+	u64 group = pos >> SCOUTFS_LOCK_READDIR_POS_SHIFT;
+	u64 first = group << SCOUTFS_LOCK_READDIR_POS_SHIFT;
+
+	return lock_dirent_keys(sb, mode, flags, dir_ino, SCOUTFS_READDIR_TYPE,
+				group, first,
+				first + SCOUTFS_LOCK_READDIR_POS_NR - 1, lock);
+}
+
+int scoutfs_lock_dir_deltas(struct super_block *sb, int mode, int flags,
+			    u64 dir_ino, struct scoutfs_lock **lock)
+{
+	return lock_dirent_keys(sb, mode, flags, dir_ino,
+				SCOUTFS_DIR_DELTA_TYPE, 0, 0, U64_MAX, lock);
+}
+
 /*
  * As we unlock we start a grace period.  If a bast arrives before the
  * grace period we'll wait for another full grace period we downconvert
@@ -1158,6 +1419,46 @@ void scoutfs_unlock(struct super_block *sb, struct scoutfs_lock *lock, int mode)
 	spin_unlock(&linfo->lock);
 }
 
+/*
+ * Add another user to a lock that the caller already holds in a mode
+ * that satisfies the given mode.  This lets callers keep the lock from
+ * being down converted past the life of their own use.  The added user
+ * is dropped with a matching call to _unlock.
+ */
+void scoutfs_lock_add_user(struct super_block *sb, struct scoutfs_lock *lock,
+			   int mode)
+{
+	DECLARE_LOCK_INFO(sb, linfo);
+
+	spin_lock(&linfo->lock);
+	BUG_ON(!lock_modes_match(lock->granted_mode, mode));
+	lock_inc_count(lock->users, mode);
+	lock_process(linfo, lock);
+	spin_unlock(&linfo->lock);
+}
+
+/*
+ * Add a user in the given mode if the lock is already granted in a mode
+ * that satisfies it and isn't transitioning or being asked to down
+ * convert.  This never waits or changes the lock's mode.  Returns true
+ * if the user was added, it's dropped with a matching call to _unlock.
+ */
+bool scoutfs_lock_try_add_user(struct super_block *sb,
+			       struct scoutfs_lock *lock, int mode)
+{
+	DECLARE_LOCK_INFO(sb, linfo);
+	bool added;
+
+	spin_lock(&linfo->lock);
+	added = lock_modes_match(lock->granted_mode, mode) &&
+		lock->work_mode < 0 && lock->bast_mode < 0;
+	if (added)
+		lock_inc_count(lock->users, mode);
+	spin_unlock(&linfo->lock);
+
+	return added;
+}
+
 void scoutfs_lock_init_coverage(struct scoutfs_lock_coverage *cov)
 {
 	spin_lock_init(&cov->cov_lock);
@@ -11,8 +11,8 @@
 #define SCOUTFS_LOCK_NR_MODES (DLM_LOCK_EX + 1)
 
 /*
- * A few fields (start, end, refresh_gen, granted_mode) are referenced
- * by code outside lock.c.
+ * A few fields (start, end, refresh_gen, write_gen, delayed_pins,
+ * granted_mode) are referenced by code outside lock.c.
  */
 struct scoutfs_lock {
 	struct super_block *sb;
@@ -23,6 +23,8 @@ struct scoutfs_lock {
 	struct rb_node range_node;
 	unsigned int debug_locks_id;
 	u64 refresh_gen;
+	u64 write_gen;
+	atomic_t delayed_pins;		/* region pinned by delayed blocks */
 	struct list_head lru_head;
 	wait_queue_head_t waitq;
 	struct work_struct work;
@@ -70,8 +72,26 @@ int scoutfs_lock_global(struct super_block *sb, int mode, int flags, int type,
 			struct scoutfs_lock **lock);
 int scoutfs_lock_node_id(struct super_block *sb, int mode, int flags,
 			 u64 node_id, struct scoutfs_lock **lock);
+int scoutfs_lock_shared_extents(struct super_block *sb, int mode, int flags,
+				struct scoutfs_lock **lock);
+int scoutfs_lock_data_file(struct super_block *sb, int mode, int flags,
+			   struct inode *inode, struct scoutfs_lock **lock);
+int scoutfs_lock_data_region(struct super_block *sb, int mode, int flags,
+			     u64 ino, u64 iblock, struct scoutfs_lock **lock);
+int scoutfs_lock_file_deltas(struct super_block *sb, int mode, int flags,
+			     u64 ino, struct scoutfs_lock **lock);
+int scoutfs_lock_dirent_hash(struct super_block *sb, int mode, int flags,
+			     u64 dir_ino, u64 hash, struct scoutfs_lock **lock);
+int scoutfs_lock_readdir_pos(struct super_block *sb, int mode, int flags,
+			     u64 dir_ino, u64 pos, struct scoutfs_lock **lock);
+int scoutfs_lock_dir_deltas(struct super_block *sb, int mode, int flags,
+			    u64 dir_ino, struct scoutfs_lock **lock);
 void scoutfs_unlock(struct super_block *sb, struct scoutfs_lock *lock,
 		    int level);
+void scoutfs_lock_add_user(struct super_block *sb, struct scoutfs_lock *lock,
+			   int mode);
+bool scoutfs_lock_try_add_user(struct super_block *sb,
+			       struct scoutfs_lock *lock, int mode);
 void scoutfs_unlock_flags(struct super_block *sb, struct scoutfs_lock *lock,
 			  int level, int flags);
 
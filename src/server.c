@@ -86,6 +86,10 @@ struct server_info {
 	unsigned long nr_compacts;
 	struct list_head compacts;
 	struct work_struct compact_work;
+
+	/* ask clients to return free extents when we're low */
+	struct work_struct clawback_work;
+	unsigned long clawback_next;
 };
 
 #define DECLARE_SERVER_INFO(sb, name) \
@@ -230,16 +234,48 @@ static int server_extent_io(struct super_block *sb, int op,
 }
 
 /*
- * Allocate an extent of the given length in the first smallest free
- * extent that contains it.  We allocate in multiples of segment blocks
- * and expose that to callers today.
+ * Try to allocate the full length from the free extent that contains
+ * the caller's hint or from the next free extent after it.  Clients
+ * hint with the end of their previous grant so that a node's grants
+ * are contiguous and near each other.  Hinted grants start on a segment
+ * boundary, like the grants they follow, so that partially freed
+ * extents don't leave the node's grants misaligned.  Returns -ENOENT if
+ * there wasn't enough free space after the aligned start.
+ */
+static int next_hinted_extent(struct super_block *sb, u64 blocks, u64 hint,
+			      struct scoutfs_extent *ext)
+{
+	u64 start;
+	int ret;
+
+	scoutfs_extent_init(ext, SCOUTFS_FREE_EXTENT_BLKNO_TYPE, 0,
+			    hint, 1, 0, 0);
+	ret = scoutfs_extent_next(sb, server_extent_io, ext, NULL);
+	if (ret)
+		return ret;
+
+	start = round_up(max(ext->start, hint), SCOUTFS_SEGMENT_BLOCKS);
+	if (start >= ext->start + ext->len ||
+	    ext->start + ext->len - start < blocks)
+		return -ENOENT;
+
+	ext->len -= start - ext->start;
+	ext->start = start;
+	return 0;
+}
+
+/*
+ * Allocate an extent of the given length.  We first try to allocate
+ * after the client's hint and then fall back to the first smallest
+ * free extent that contains it.  We allocate in multiples of segment
+ * blocks and expose that to callers today.
  *
  * This doesn't have the cursor that segment allocation does.  It's
  * possible that a recently freed segment can merge to form a larger
  * free extent that can be very quickly allocated to a node.  The hope is
  * that doesn't happen very often.
  */
-static int alloc_extent(struct super_block *sb, u64 blocks,
+static int alloc_extent(struct super_block *sb, u64 blocks, u64 hint,
 			u64 *start, u64 *len)
 {
 	struct server_info *server = SCOUTFS_SB(sb)->server_info;
@@ -256,6 +292,16 @@ static int alloc_extent(struct super_block *sb, u64 blocks,
 		goto out;
 	}
 
+	if (hint) {
+		ret = next_hinted_extent(sb, blocks, hint, &ext);
+		if (ret == 0) {
+			scoutfs_inc_counter(sb, server_extent_alloc_hinted);
+			goto found;
+		}
+		if (ret != -ENOENT)
+			goto out;
+	}
+
 	scoutfs_extent_init(&ext, SCOUTFS_FREE_EXTENT_BLOCKS_TYPE, 0,
 			    0, blocks, 0, 0);
 	ret = scoutfs_extent_next(sb, server_extent_io, &ext, NULL);
@@ -267,6 +313,7 @@ static int alloc_extent(struct super_block *sb, u64 blocks,
 		goto out;
 	}
 
+found:
 	trace_scoutfs_server_alloc_extent_next(sb, &ext);
 
 	ext.type = SCOUTFS_FREE_EXTENT_BLKNO_TYPE;
@@ -691,6 +738,33 @@ out:
 	return scoutfs_net_response(sb, conn, cmd, id, ret, &ial, sizeof(ial));
 }
 
+/*
+ * Once free space falls below this fraction of the device we ask
+ * clients to return the free extents they've been granted but aren't
+ * using.  We only ask every so often.
+ */
+#define CLAWBACK_FREE_DIVISOR 16
+#define CLAWBACK_INTERVAL (10 * HZ)
+
+static void maybe_queue_clawback(struct super_block *sb)
+{
+	struct scoutfs_super_block *super = &SCOUTFS_SB(sb)->super;
+	DECLARE_SERVER_INFO(sb, server);
+	bool queue = false;
+
+	spin_lock(&server->lock);
+	if (le64_to_cpu(super->free_blocks) <
+	    le64_to_cpu(super->total_blocks) / CLAWBACK_FREE_DIVISOR &&
+	    time_after_eq(jiffies, server->clawback_next)) {
+		server->clawback_next = jiffies + CLAWBACK_INTERVAL;
+		queue = true;
+	}
+	spin_unlock(&server->lock);
+
+	if (queue)
+		queue_work(server->wq, &server->clawback_work);
+}
+
 /*
  * Give the client an extent allocation of len blocks.  We leave the
  * details to the extent allocator.
@@ -700,27 +774,28 @@ static int server_alloc_extent(struct super_block *sb,
 			       u8 cmd, u64 id, void *arg, u16 arg_len)
 {
 	DECLARE_SERVER_INFO(sb, server);
+	struct scoutfs_net_extent_alloc *nea = arg;
 	struct commit_waiter cw;
 	struct scoutfs_net_extent nex = {0,};
-	__le64 leblocks;
 	u64 start;
 	u64 len;
 	int ret;
 
-	if (arg_len != sizeof(leblocks)) {
+	if (arg_len != sizeof(struct scoutfs_net_extent_alloc)) {
 		ret = -EINVAL;
 		goto out;
 	}
 
-	memcpy(&leblocks, arg, arg_len);
-
 	down_read(&server->commit_rwsem);
-	ret = alloc_extent(sb, le64_to_cpu(leblocks), &start, &len);
+	ret = alloc_extent(sb, le64_to_cpu(nea->blocks),
+			   le64_to_cpu(nea->hint), &start, &len);
 	if (ret == 0)
 		queue_commit_work(server, &cw);
 	up_read(&server->commit_rwsem);
 	if (ret == 0)
 		ret = wait_for_commit(&cw);
+	if (ret == 0 || ret == -ENOSPC)
+		maybe_queue_clawback(sb);
 	if (ret)
 		goto out;
 
@@ -1686,6 +1761,50 @@ out:
 	trace_scoutfs_server_compact_work_exit(sb, 0, ret);
 }
 
+/*
+ * Ask all the connected clients to return their unused free extents.
+ * Clients reply immediately and send the extents back with the usual
+ * free extent requests.  Clients can disconnect as we send, we don't
+ * care if they don't receive the request.
+ */
+static void scoutfs_server_clawback_worker(struct work_struct *work)
+{
+	struct server_info *server = container_of(work, struct server_info,
+						  clawback_work);
+	struct super_block *sb = server->sb;
+	struct server_client_info *sci;
+	unsigned long nr;
+	unsigned long i;
+	u64 *node_ids;
+
+	spin_lock(&server->lock);
+	nr = server->nr_clients;
+	spin_unlock(&server->lock);
+
+	node_ids = kcalloc(nr, sizeof(u64), GFP_NOFS);
+	if (!node_ids)
+		return;
+
+	i = 0;
+	spin_lock(&server->lock);
+	list_for_each_entry(sci, &server->clients, head) {
+		if (i == nr)
+			break;
+		node_ids[i++] = sci->node_id;
+	}
+	spin_unlock(&server->lock);
+	nr = i;
+
+	for (i = 0; i < nr; i++) {
+		scoutfs_inc_counter(sb, server_extent_clawback);
+		scoutfs_net_submit_request_node(sb, server->conn, node_ids[i],
+						SCOUTFS_NET_CMD_RETURN_EXTENTS,
+						NULL, 0, NULL, NULL, NULL);
+	}
+
+	kfree(node_ids);
+}
+
 /*
  * This relies on the caller having read the current super and advanced
  * its seq so that it's dirty.  This will go away when we communicate
@@ -1849,6 +1968,7 @@ shutdown:
 	scoutfs_net_shutdown(sb, conn);
 	/* drain compact work queued by responses */
 	cancel_work_sync(&server->compact_work);
+	cancel_work_sync(&server->clawback_work);
 	/* wait for commit queued by request processing */
 	flush_work(&server->commit_work);
 	server->conn = NULL;
@@ -1902,6 +2022,7 @@ int scoutfs_server_setup(struct super_block *sb)
 	server->compacts_per_client = 2;
 	INIT_LIST_HEAD(&server->compacts);
 	INIT_WORK(&server->compact_work, scoutfs_server_compact_worker);
+	INIT_WORK(&server->clawback_work, scoutfs_server_clawback_worker);
 
 	server->wq = alloc_workqueue("scoutfs_server",
 				     WQ_UNBOUND | WQ_NON_REENTRANT, 0);
@@ -119,6 +119,8 @@ static void scoutfs_put_super(struct super_block *sb)
 
 	trace_scoutfs_put_super(sb);
 
+	scoutfs_inode_stop_background(sb);
+
 	sbi->shutdown = true;
 
 	scoutfs_data_destroy(sb);
@@ -355,6 +357,7 @@ static int scoutfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto out;
 
 	scoutfs_trans_restart_sync_deadline(sb);
+	scoutfs_data_apply_shared_releases(sb);
 //	scoutfs_scan_orphans(sb);
 	ret = 0;
 out:
@@ -372,12 +375,15 @@ static struct dentry *scoutfs_mount(struct file_system_type *fs_type, int flags,
 }
 
 /*
- * kill_block_super eventually calls ->put_super if s_root is set
+ * kill_block_super eventually calls ->put_super if s_root is set.
+ * Background truncation holds inode references so it has to finish
+ * before the vfs evicts inodes.
  */
 static void scoutfs_kill_sb(struct super_block *sb)
 {
 	trace_scoutfs_kill_sb(sb);
 
+	scoutfs_inode_flush_background(sb);
 	kill_block_super(sb);
 }
 
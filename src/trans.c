@@ -54,6 +54,29 @@
 /* sync dirty data at least this often */
 #define TRANS_SYNC_DELAY (HZ * 10)
 
+/*
+ * Each thread reserves space in the segment for their dirty items while
+ * they hold the transaction.  This is calculated before the first
+ * transaction hold is acquired.  It includes all the potential nested
+ * item manipulation that could happen with the transaction held.
+ * Including nested holds avoids having to deal with writing out partial
+ * transactions while a caller still holds the transaction.
+ */
+#define SCOUTFS_RESERVATION_MAGIC 0xd57cd13b
+struct scoutfs_reservation {
+	unsigned magic;
+	unsigned holders;
+	struct scoutfs_item_count reserved;
+	struct scoutfs_item_count actual;
+};
+
+/*
+ * Tasks that write dirty data on behalf of the commit point their
+ * journal_info at this reservation.  Like the committing task they can
+ * modify items while holders are excluded.
+ */
+#define SCOUTFS_COMMIT_RESERVATION_MAGIC 0x6a1f0c27
+
 /*
  * XXX move the rest of the super trans_ fields here.
  */
@@ -61,13 +84,45 @@ struct trans_info {
 	spinlock_t lock;
 	unsigned reserved_items;
 	unsigned reserved_vals;
+	unsigned delayed_items;
+	unsigned delayed_vals;
 	unsigned holders;
 	bool writing;
+	struct scoutfs_reservation commit_rsv;
 };
 
 #define DECLARE_TRANS_INFO(sb, name) \
 	struct trans_info *name = SCOUTFS_SB(sb)->trans_info
 
+/*
+ * Returns true if the calling task is committing the transaction or is
+ * writing dirty data for the commit.
+ */
+bool scoutfs_trans_committing(struct super_block *sb)
+{
+	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
+	DECLARE_TRANS_INFO(sb, tri);
+
+	return current == sbi->trans_task ||
+	       current->journal_info == &tri->commit_rsv;
+}
+
+void scoutfs_trans_begin_commit_writeback(struct super_block *sb)
+{
+	DECLARE_TRANS_INFO(sb, tri);
+
+	WARN_ON_ONCE(current->journal_info);
+	current->journal_info = &tri->commit_rsv;
+}
+
+void scoutfs_trans_end_commit_writeback(struct super_block *sb)
+{
+	DECLARE_TRANS_INFO(sb, tri);
+
+	WARN_ON_ONCE(current->journal_info != &tri->commit_rsv);
+	current->journal_info = NULL;
+}
+
 static bool drained_holders(struct trans_info *tri)
 {
 	bool drained;
@@ -132,6 +187,7 @@ void scoutfs_trans_write_func(struct work_struct *work)
 		 * on crashes between us and the server.
 		 */
 		ret = scoutfs_inode_walk_writeback(sb, true) ?:
+		      scoutfs_data_drain_pools(sb) ?:
 		      scoutfs_client_alloc_segno(sb, &segno) ?:
 		      scoutfs_seg_alloc(sb, segno, &seg) ?:
 		      scoutfs_item_dirty_seg(sb, seg) ?:
@@ -144,6 +200,12 @@ void scoutfs_trans_write_func(struct work_struct *work)
 		if (ret)
 			goto out;
 
+		/* writeback allocated all the delayed blocks */
+		spin_lock(&tri->lock);
+		tri->delayed_items = 0;
+		tri->delayed_vals = 0;
+		spin_unlock(&tri->lock);
+
 		scoutfs_inc_counter(sb, trans_level0_seg_writes);
 		scoutfs_add_counter(sb, trans_level0_seg_write_bytes,
 				    scoutfs_seg_total_bytes(seg));
@@ -264,22 +326,6 @@ void scoutfs_trans_restart_sync_deadline(struct super_block *sb)
 			 TRANS_SYNC_DELAY);
 }
 
-/*
- * Each thread reserves space in the segment for their dirty items while
- * they hold the transaction.  This is calculated before the first
- * transaction hold is acquired.  It includes all the potential nested
- * item manipulation that could happen with the transaction held.
- * Including nested holds avoids having to deal with writing out partial
- * transactions while a caller still holds the transaction.
- */
-#define SCOUTFS_RESERVATION_MAGIC 0xd57cd13b
-struct scoutfs_reservation {
-	unsigned magic;
-	unsigned holders;
-	struct scoutfs_item_count reserved;
-	struct scoutfs_item_count actual;
-};
-
 /*
  * Try to hold the transaction.  If a caller already holds the trans then
  * we piggy back on their hold.  We wait if the writer is trying to
@@ -314,8 +360,8 @@ static bool acquired_hold(struct super_block *sb,
 		goto out;
 
 	/* see if we can reserve space for our item count */
-	items = tri->reserved_items + cnt->items;
-	vals = tri->reserved_vals + cnt->vals;
+	items = tri->reserved_items + tri->delayed_items + cnt->items;
+	vals = tri->reserved_vals + tri->delayed_vals + cnt->vals;
 	fits = scoutfs_item_dirty_fits_single(sb, items, vals);
 	if (!fits) {
 		scoutfs_inc_counter(sb, trans_commit_full);
@@ -356,7 +402,7 @@ int scoutfs_hold_trans(struct super_block *sb,
 	    WARN_ON_ONCE(!scoutfs_seg_fits_single(cnt.items, cnt.vals)))
 		return -EINVAL;
 
-	if (current == sbi->trans_task)
+	if (scoutfs_trans_committing(sb))
 		return 0;
 
 	rsv = current->journal_info;
@@ -392,6 +438,23 @@ bool scoutfs_trans_held(void)
 	return rsv && rsv->magic == SCOUTFS_RESERVATION_MAGIC;
 }
 
+/*
+ * Returns true if other tasks are holding the transaction or it's being
+ * written.  Background work that isn't holding the transaction can use
+ * this to get out of the way of foreground writers.
+ */
+bool scoutfs_trans_contended(struct super_block *sb)
+{
+	DECLARE_TRANS_INFO(sb, tri);
+	bool contended;
+
+	spin_lock(&tri->lock);
+	contended = tri->holders > 0 || tri->writing;
+	spin_unlock(&tri->lock);
+
+	return contended;
+}
+
 /*
  * Record a transaction holder's individual contribution to the dirty
  * items in the current transaction.  We're making sure that the
@@ -405,10 +468,9 @@ bool scoutfs_trans_held(void)
 void scoutfs_trans_track_item(struct super_block *sb, signed items,
 			      signed vals)
 {
-	struct scoutfs_sb_info *sbi = SCOUTFS_SB(sb);
 	struct scoutfs_reservation *rsv = current->journal_info;
 
-	if (current == sbi->trans_task)
+	if (scoutfs_trans_committing(sb))
 		return;
 
 	BUG_ON(!rsv || rsv->magic != SCOUTFS_RESERVATION_MAGIC);
@@ -424,6 +486,25 @@ void scoutfs_trans_track_item(struct super_block *sb, signed items,
 	WARN_ON_ONCE(rsv->actual.vals > rsv->reserved.vals);
 }
 
+/*
+ * Delayed allocation dirties pages without creating the extent items
+ * that map them.  Those items are created as the pages are written,
+ * which can be during the commit long after the writer has released
+ * their hold.  Writers record the items that allocation could dirty
+ * here so that holders leave room for them in the transaction.  The
+ * estimate is cleared once a commit has written all the dirty data.
+ */
+void scoutfs_trans_add_delayed(struct super_block *sb,
+			       const struct scoutfs_item_count cnt)
+{
+	DECLARE_TRANS_INFO(sb, tri);
+
+	spin_lock(&tri->lock);
+	tri->delayed_items += cnt.items;
+	tri->delayed_vals += cnt.vals;
+	spin_unlock(&tri->lock);
+}
+
 /*
  * As we drop the last hold in the reservation we try and wake other
  * hold attempts that were waiting for space.  As we drop the last trans
@@ -437,7 +518,7 @@ void scoutfs_release_trans(struct super_block *sb)
 	DECLARE_TRANS_INFO(sb, tri);
 	bool wake = false;
 
-	if (current == sbi->trans_task)
+	if (scoutfs_trans_committing(sb))
 		return;
 
 	rsv = current->journal_info;
@@ -479,6 +560,7 @@ int scoutfs_setup_trans(struct super_block *sb)
 		return -ENOMEM;
 
 	spin_lock_init(&tri->lock);
+	tri->commit_rsv.magic = SCOUTFS_COMMIT_RESERVATION_MAGIC;
 
 	sbi->trans_write_workq = alloc_workqueue("scoutfs_trans",
 						 WQ_UNBOUND, 1);
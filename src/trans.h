@@ -12,9 +12,15 @@ void scoutfs_trans_restart_sync_deadline(struct super_block *sb);
 int scoutfs_hold_trans(struct super_block *sb,
 		       const struct scoutfs_item_count cnt);
 bool scoutfs_trans_held(void);
+bool scoutfs_trans_committing(struct super_block *sb);
+void scoutfs_trans_begin_commit_writeback(struct super_block *sb);
+void scoutfs_trans_end_commit_writeback(struct super_block *sb);
+bool scoutfs_trans_contended(struct super_block *sb);
 void scoutfs_release_trans(struct super_block *sb);
 void scoutfs_trans_track_item(struct super_block *sb, signed items,
 			      signed vals);
+void scoutfs_trans_add_delayed(struct super_block *sb,
+			       const struct scoutfs_item_count cnt);
 
 int scoutfs_setup_trans(struct super_block *sb);
 void scoutfs_shutdown_trans(struct super_block *sb);
@@ -40,6 +40,14 @@
  * items to make sure that we don't let readers race and see an
  * inconsistent mix of the items that make up xattrs.
  *
+ * xattrs in the scoutfs.index. namespace also have an item in the inode
+ * index zone whose major is the hash of their name in the high 32 bits
+ * and the hash of their value in the low 32 bits.  Walking the index
+ * finds inodes with a given name and value without scanning the
+ * namespace.  Hash collisions and failing to remove index items leave
+ * false positives in the index so callers check the xattrs of the
+ * inodes they find.  We never leave an xattr without its index item.
+ *
  * XXX
  *  - add acl support and call generic xattr->handlers for SYSTEM
  */
@@ -86,7 +94,24 @@ static int unknown_prefix(const char *name)
 	return strncmp(name, XATTR_USER_PREFIX, XATTR_USER_PREFIX_LEN) &&
 	       strncmp(name, XATTR_TRUSTED_PREFIX, XATTR_TRUSTED_PREFIX_LEN) &&
 	       strncmp(name, XATTR_SYSTEM_PREFIX, XATTR_SYSTEM_PREFIX_LEN) &&
-	       strncmp(name, XATTR_SECURITY_PREFIX, XATTR_SECURITY_PREFIX_LEN);
+	       strncmp(name, XATTR_SECURITY_PREFIX, XATTR_SECURITY_PREFIX_LEN) &&
+	       strncmp(name, SCOUTFS_XATTR_INDEX_PREFIX,
+		       SCOUTFS_XATTR_INDEX_PREFIX_LEN);
+}
+
+/* names aren't null terminated in items */
+bool scoutfs_xattr_is_indexed(const char *name, unsigned int name_len)
+{
+	return name_len > SCOUTFS_XATTR_INDEX_PREFIX_LEN &&
+	       !memcmp(name, SCOUTFS_XATTR_INDEX_PREFIX,
+		       SCOUTFS_XATTR_INDEX_PREFIX_LEN);
+}
+
+u64 scoutfs_xattr_index_major(const char *name, unsigned int name_len,
+			      const void *value, unsigned int val_len)
+{
+	return ((u64)xattr_name_hash(name, name_len) << 32) |
+	       crc32c(U32_MAX, value, val_len);
 }
 
 /*
@@ -359,6 +384,12 @@ static int scoutfs_xattr_set(struct dentry *dentry, const char *name,
 	LIST_HEAD(saved);
 	u8 found_parts;
 	unsigned int bytes;
+	unsigned int find_bytes;
+	bool indexed;
+	bool ins_ind = false;
+	bool del_ind = false;
+	u64 old_major = 0;
+	u64 new_major = 0;
 	u64 ind_seq;
 	u64 id;
 	int ret;
@@ -378,8 +409,15 @@ static int scoutfs_xattr_set(struct dentry *dentry, const char *name,
 	if (unknown_prefix(name))
 		return -EOPNOTSUPP;
 
+	indexed = scoutfs_xattr_is_indexed(name, name_len);
+	if (indexed && value && size > SCOUTFS_XATTR_INDEX_MAX_VAL_LEN)
+		return -E2BIG;
+
+	/* find the existing value of indexed xattrs to find its index item */
 	bytes = sizeof(struct scoutfs_xattr) + name_len + size;
-	xat = kmalloc(bytes, GFP_NOFS);
+	find_bytes = sizeof(struct scoutfs_xattr) + name_len +
+		     (indexed ? SCOUTFS_XATTR_INDEX_MAX_VAL_LEN : 0);
+	xat = kmalloc(max(bytes, find_bytes), GFP_NOFS);
 	if (!xat) {
 		ret = -ENOMEM;
 		goto out;
@@ -393,8 +431,7 @@ static int scoutfs_xattr_set(struct dentry *dentry, const char *name,
 	down_write(&si->xattr_rwsem);
 
 	/* find an existing xattr to delete */
-	ret = get_next_xattr(inode, &key, xat,
-			     sizeof(struct scoutfs_xattr) + name_len,
+	ret = get_next_xattr(inode, &key, xat, find_bytes,
 			     name, name_len, 0, 0, lck);
 	if (ret < 0 && ret != -ENOENT)
 		goto unlock;
@@ -417,6 +454,17 @@ static int scoutfs_xattr_set(struct dentry *dentry, const char *name,
 	/* found fields in key will also be used */
 	found_parts = ret >= 0 ? xattr_nr_parts(xat) : 0;
 
+	if (indexed && found_parts) {
+		/* XXX corruption, indexed values always fit */
+		if (ret < xattr_full_bytes(xat)) {
+			ret = -EIO;
+			goto unlock;
+		}
+		old_major = scoutfs_xattr_index_major(name, name_len,
+						&xat->name[xat->name_len],
+						le16_to_cpu(xat->val_len));
+	}
+
 	/* prepare our xattr */
 	if (value) {
 		id = si->next_xattr_id++;
@@ -424,15 +472,31 @@ static int scoutfs_xattr_set(struct dentry *dentry, const char *name,
 		xat->val_len = cpu_to_le16(size);
 		memcpy(xat->name, name, name_len);
 		memcpy(&xat->name[xat->name_len], value, size);
+		if (indexed)
+			new_major = scoutfs_xattr_index_major(name, name_len,
+							      value, size);
+	}
+
+	/* only touch the index if the name and value hash changes */
+	if (indexed) {
+		ins_ind = value && (!found_parts || new_major != old_major);
+		del_ind = found_parts && (!value || new_major != old_major);
 	}
 
 retry:
 	ret = scoutfs_inode_index_start(sb, &ind_seq) ?:
 	      scoutfs_inode_index_prepare(sb, &ind_locks, inode, false) ?:
+	      (ins_ind ? scoutfs_inode_index_prepare_xattr(sb, &ind_locks,
+						scoutfs_ino(inode),
+						new_major) : 0) ?:
+	      (del_ind ? scoutfs_inode_index_prepare_xattr(sb, &ind_locks,
+						scoutfs_ino(inode),
+						old_major) : 0) ?:
 	      scoutfs_inode_index_try_lock_hold(sb, &ind_locks, ind_seq,
 						SIC_XATTR_SET(found_parts,
 							      value != NULL,
-							      name_len, size));
+							      name_len, size,
+							      indexed));
 	if (ret > 0)
 		goto retry;
 	if (ret)
@@ -442,6 +506,15 @@ retry:
 	if (ret < 0)
 		goto release;
 
+	/* index the new value before the xattr can be seen */
+	if (ins_ind) {
+		ret = scoutfs_inode_index_xattr(sb, &ind_locks,
+						scoutfs_ino(inode), new_major,
+						true);
+		if (ret < 0)
+			goto release;
+	}
+
 	ret = 0;
 	if (found_parts)
 		ret = delete_xattr_items(inode, le64_to_cpu(key.skx_name_hash),
@@ -451,10 +524,20 @@ retry:
 		ret = create_xattr_items(inode, id, xat, bytes, lck);
 	if (ret < 0) {
 		scoutfs_item_restore(sb, &saved, lck);
+		/* failing to remove the new index item is a false positive */
+		if (ins_ind)
+			scoutfs_inode_index_xattr(sb, &ind_locks,
+						  scoutfs_ino(inode),
+						  new_major, false);
 		goto release;
 	}
 	scoutfs_item_free_batch(sb, &saved);
 
+	/* failing to remove the old index item is a false positive */
+	if (del_ind)
+		scoutfs_inode_index_xattr(sb, &ind_locks, scoutfs_ino(inode),
+					  old_major, false);
+
 	/* XXX do these want i_mutex or anything? */
 	inode_inc_iversion(inode);
 	inode->i_ctime = CURRENT_TIME;
@@ -553,9 +636,48 @@ out:
 	return ret;
 }
 
+/*
+ * Remove the index item of an indexed xattr whose inode is being
+ * deleted.  The index lock has to be acquired before holding the
+ * transaction so the caller can't be holding one.
+ */
+static int drop_index_item(struct super_block *sb, u64 ino,
+			   struct scoutfs_xattr *xat, int bytes)
+{
+	LIST_HEAD(ind_locks);
+	u64 major;
+	u64 seq;
+	int ret;
+
+	/* XXX corruption, indexed values always fit */
+	if (bytes < xattr_full_bytes(xat))
+		return -EIO;
+
+	major = scoutfs_xattr_index_major(xat->name, xat->name_len,
+					  &xat->name[xat->name_len],
+					  le16_to_cpu(xat->val_len));
+
+	do {
+		ret = scoutfs_inode_index_start(sb, &seq) ?:
+		      scoutfs_inode_index_prepare_xattr(sb, &ind_locks, ino,
+							major) ?:
+		      scoutfs_inode_index_try_lock_hold(sb, &ind_locks, seq,
+							SIC_EXACT(1, 0));
+	} while (ret > 0);
+	if (ret == 0) {
+		ret = scoutfs_inode_index_xattr(sb, &ind_locks, ino, major,
+						false);
+		scoutfs_release_trans(sb);
+	}
+	scoutfs_inode_index_unlock(sb, &ind_locks);
+
+	return ret;
+}
+
 /*
  * Delete all the xattr items associated with this inode.  The inode is
- * dead so we don't need the xattr rwsem.
+ * dead so we don't need the xattr rwsem.  Indexed xattrs have their
+ * index items deleted as their first item is found.
  *
  * XXX This isn't great because it reads in all the items so that it can
  * create deletion items for each.  It would be better to have the
@@ -565,23 +687,46 @@ out:
 int scoutfs_xattr_drop(struct super_block *sb, u64 ino,
 		       struct scoutfs_lock *lock)
 {
+	struct scoutfs_xattr *xat;
 	struct scoutfs_key last;
 	struct scoutfs_key key;
 	unsigned int items = 16;
 	bool holding = false;
+	struct kvec val;
 	int ret;
 
+	xat = kmalloc(SCOUTFS_XATTR_MAX_PART_SIZE, GFP_NOFS);
+	if (!xat)
+		return -ENOMEM;
+
 	init_xattr_key(&key, ino, 0, 0);
 	init_xattr_key(&last, ino, U32_MAX, U64_MAX);
+	kvec_init(&val, xat, SCOUTFS_XATTR_MAX_PART_SIZE);
 
 	for (;;) {
-		ret = scoutfs_item_next(sb, &key, &last, NULL, lock);
+		ret = scoutfs_item_next(sb, &key, &last, &val, lock);
 		if (ret < 0) {
 			if (ret == -ENOENT)
 				ret = 0;
 			break;
 		}
 
+		if (key.skx_part == 0 &&
+		    ret >= offsetof(struct scoutfs_xattr, name[0]) &&
+		    ret >= offsetof(struct scoutfs_xattr,
+				    name[xat->name_len]) &&
+		    scoutfs_xattr_is_indexed(xat->name, xat->name_len)) {
+			if (holding) {
+				scoutfs_release_trans(sb);
+				holding = false;
+				items = 16;
+			}
+
+			ret = drop_index_item(sb, ino, xat, ret);
+			if (ret)
+				break;
+		}
+
 		if (!holding) {
 			ret = scoutfs_hold_trans(sb, SIC_EXACT(items, 0));
 			if (ret)
@@ -605,5 +750,7 @@ int scoutfs_xattr_drop(struct super_block *sb, u64 ino,
 	if (holding)
 		scoutfs_release_trans(sb);
 
+	kfree(xat);
+
 	return ret;
 }
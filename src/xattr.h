@@ -11,4 +11,8 @@ ssize_t scoutfs_listxattr(struct dentry *dentry, char *buffer, size_t size);
 int scoutfs_xattr_drop(struct super_block *sb, u64 ino,
 		       struct scoutfs_lock *lock);
 
+bool scoutfs_xattr_is_indexed(const char *name, unsigned int name_len);
+u64 scoutfs_xattr_index_major(const char *name, unsigned int name_len,
+			      const void *value, unsigned int val_len);
+
 #endif